@@ -0,0 +1,78 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+namespace async {
+
+// Log-linear latency histogram in the style of HdrHistogram: values below
+// 128 are counted exactly, larger ones in 64 sub-buckets per power of two,
+// so any recorded value is reported within 1.6% of its true value. Fixed
+// size, no allocation on record(); per-thread instances are merged at the
+// end of a run.
+class LatencyHistogram {
+ public:
+  void record(std::uint64_t v) {
+    ++counts_[indexOf(v)];
+    ++count_;
+    sum_ += v;
+    max_ = std::max(max_, v);
+    min_ = std::min(min_, v);
+  }
+
+  void merge(const LatencyHistogram& other) {
+    for (std::size_t i = 0; i < kBuckets; ++i) counts_[i] += other.counts_[i];
+    count_ += other.count_;
+    sum_ += other.sum_;
+    max_ = std::max(max_, other.max_);
+    min_ = std::min(min_, other.min_);
+  }
+
+  std::uint64_t count() const { return count_; }
+  std::uint64_t max() const { return max_; }
+  std::uint64_t min() const { return count_ ? min_ : 0; }
+  double mean() const { return count_ ? static_cast<double>(sum_) / count_ : 0.0; }
+
+  // Smallest recorded value v such that a fraction q (0..1) of all values
+  // is <= v, reported as the upper edge of its bucket (capped at max()).
+  std::uint64_t percentile(double q) const {
+    if (count_ == 0) return 0;
+    std::uint64_t rank = static_cast<std::uint64_t>(q * static_cast<double>(count_) + 0.5);
+    rank = std::clamp<std::uint64_t>(rank, 1, count_);
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < kBuckets; ++i) {
+      seen += counts_[i];
+      if (seen >= rank) return std::min(upperEdge(i), max_);
+    }
+    return max_;
+  }
+
+ private:
+  static constexpr unsigned kSubBits = 6;
+  static constexpr std::uint64_t kSub = 1u << kSubBits;  // 64
+  static constexpr std::size_t kBuckets = (64 - kSubBits) * kSub + 2 * kSub;
+
+  // v < 128 maps to itself. Otherwise, with e = index of the top bit,
+  // the top 7 bits m (64..127) select the sub-bucket of group e - 6.
+  static std::size_t indexOf(std::uint64_t v) {
+    if (v < 2 * kSub) return static_cast<std::size_t>(v);
+    const unsigned shift = 63 - static_cast<unsigned>(__builtin_clzll(v)) - kSubBits;
+    return shift * kSub + static_cast<std::size_t>(v >> shift);
+  }
+
+  static std::uint64_t upperEdge(std::size_t i) {
+    if (i < 2 * kSub) return i;
+    const unsigned shift = static_cast<unsigned>(i / kSub) - 1;
+    const std::uint64_t m = kSub + i % kSub;
+    return ((m + 1) << shift) - 1;
+  }
+
+  std::array<std::uint64_t, kBuckets> counts_{};
+  std::uint64_t count_ = 0;
+  std::uint64_t sum_ = 0;
+  std::uint64_t max_ = 0;
+  std::uint64_t min_ = UINT64_MAX;
+};
+
+}  // namespace async
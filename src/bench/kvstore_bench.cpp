@@ -0,0 +1,137 @@
+// Scaling benchmark for the sharded KVStore: runs a get/set mix from 1 to
+// --max-threads threads against a single-shard store (one global lock) and
+// against sharded stores, and prints throughput per configuration.
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../storage/kvstore.h"
+
+namespace {
+
+struct Options {
+  std::size_t keys = 100000;
+  unsigned read_pct = 90;
+  unsigned duration_ms = 500;
+  unsigned max_threads = 32;
+  std::vector<std::size_t> shards = {1, 16, 64, 256};
+};
+
+// xorshift64*: cheap per-thread RNG so the generator is not the bottleneck.
+struct Rng {
+  uint64_t s;
+  explicit Rng(uint64_t seed) : s(seed * 0x9E3779B97F4A7C15ull + 1) {}
+  uint64_t next() {
+    s ^= s >> 12;
+    s ^= s << 25;
+    s ^= s >> 27;
+    return s * 0x2545F4914F6CDD1Dull;
+  }
+};
+
+std::vector<std::string> makeKeys(std::size_t n) {
+  std::vector<std::string> keys;
+  keys.reserve(n);
+  for (std::size_t i = 0; i < n; ++i) keys.push_back("key:" + std::to_string(i));
+  return keys;
+}
+
+double runOne(const Options& opts, const std::vector<std::string>& keys,
+              std::size_t nshards, unsigned nthreads) {
+  async::KVStore store(nshards);
+  for (const std::string& k : keys) store.set(k, "value");
+
+  std::atomic<bool> start{false};
+  std::atomic<bool> stop{false};
+  std::vector<uint64_t> ops(nthreads, 0);
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < nthreads; ++t) {
+    threads.emplace_back([&, t] {
+      Rng rng(t + 1);
+      std::string out;
+      uint64_t n = 0;
+      while (!start.load(std::memory_order_acquire)) {}
+      while (!stop.load(std::memory_order_relaxed)) {
+        // Check the stop flag every 256 ops to keep it off the hot path.
+        for (int i = 0; i < 256; ++i) {
+          const uint64_t r = rng.next();
+          const std::string& key = keys[r % keys.size()];
+          if ((r >> 32) % 100 < opts.read_pct) {
+            store.get(key, out);
+          } else {
+            store.set(key, "value");
+          }
+        }
+        n += 256;
+      }
+      ops[t] = n;
+    });
+  }
+
+  const auto t0 = std::chrono::steady_clock::now();
+  start.store(true, std::memory_order_release);
+  std::this_thread::sleep_for(std::chrono::milliseconds(opts.duration_ms));
+  stop.store(true, std::memory_order_relaxed);
+  for (std::thread& th : threads) th.join();
+  const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+  uint64_t total = 0;
+  for (uint64_t n : ops) total += n;
+  return static_cast<double>(total) / secs;
+}
+
+void printUsage(const char* prog) {
+  std::fprintf(stderr,
+               "Usage: %s [--keys N] [--read-pct P] [--duration-ms D] [--max-threads T]\n",
+               prog);
+}
+
+bool parseArgs(int argc, char** argv, Options& opts) {
+  for (int i = 1; i + 1 < argc; i += 2) {
+    const long v = std::strtol(argv[i + 1], nullptr, 10);
+    if (v <= 0) return false;
+    if (std::strcmp(argv[i], "--keys") == 0) {
+      opts.keys = static_cast<std::size_t>(v);
+    } else if (std::strcmp(argv[i], "--read-pct") == 0 && v <= 100) {
+      opts.read_pct = static_cast<unsigned>(v);
+    } else if (std::strcmp(argv[i], "--duration-ms") == 0) {
+      opts.duration_ms = static_cast<unsigned>(v);
+    } else if (std::strcmp(argv[i], "--max-threads") == 0) {
+      opts.max_threads = static_cast<unsigned>(v);
+    } else {
+      return false;
+    }
+  }
+  return argc % 2 == 1;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options opts;
+  if (!parseArgs(argc, argv, opts)) {
+    printUsage(argv[0]);
+    return 1;
+  }
+
+  const std::vector<std::string> keys = makeKeys(opts.keys);
+  std::printf("keys=%zu read=%u%% duration=%ums hw_threads=%u\n", opts.keys, opts.read_pct,
+              opts.duration_ms, std::thread::hardware_concurrency());
+  std::printf("%8s %8s %14s %10s\n", "threads", "shards", "ops/s", "speedup");
+
+  for (std::size_t nshards : opts.shards) {
+    double base = 0;
+    for (unsigned t = 1; t <= opts.max_threads; t *= 2) {
+      const double rate = runOne(opts, keys, nshards, t);
+      if (t == 1) base = rate;
+      std::printf("%8u %8zu %14.0f %9.2fx\n", t, nshards, rate, rate / base);
+    }
+  }
+  return 0;
+}
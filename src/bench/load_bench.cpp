@@ -0,0 +1,423 @@
+// Load generator for a running server, in the spirit of redis-benchmark:
+// --threads threads share --connections connections, each keeping
+// --pipeline requests in flight, and issue a GET/SET mix over a key space
+// with uniform or Zipfian popularity. Reports throughput and latency
+// percentiles, as text or as JSON (--json) for tracking regressions.
+#include <poll.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "../client/client.h"
+#include "histogram.h"
+
+namespace {
+
+struct Options {
+  std::string host = "127.0.0.1";
+  std::uint16_t port = 1234;
+  unsigned threads = 1;
+  unsigned connections = 50;
+  unsigned pipeline = 1;
+  std::size_t keys = 100000;
+  std::size_t value_min = 64;
+  std::size_t value_max = 64;
+  unsigned read_pct = 90;
+  double zipf = 0;  // 0 = uniform
+  unsigned duration_ms = 5000;
+  std::uint64_t seed = 1;
+  bool prefill = true;
+  bool json = false;
+};
+
+// xorshift64*: cheap per-thread RNG so the generator is not the bottleneck.
+struct Rng {
+  std::uint64_t s;
+  explicit Rng(std::uint64_t seed) : s(seed * 0x9E3779B97F4A7C15ull + 1) {}
+  std::uint64_t next() {
+    s ^= s >> 12;
+    s ^= s << 25;
+    s ^= s >> 27;
+    return s * 0x2545F4914F6CDD1Dull;
+  }
+  // Uniform in [0, 1).
+  double unit() { return static_cast<double>(next() >> 11) * 0x1.0p-53; }
+};
+
+// Picks key indices. With s > 0, rank r is chosen with probability
+// proportional to 1 / r^s (s = 0.99 is the usual "hot keys" setting), by
+// binary search over a precomputed CDF. Ranks are mapped through a fixed
+// permutation so hot keys do not cluster in one part of the key space.
+class KeyChooser {
+ public:
+  KeyChooser(std::size_t n, double s, std::uint64_t seed) : n_(n) {
+    if (s <= 0) return;
+    cdf_.resize(n);
+    double sum = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+      sum += 1.0 / std::pow(static_cast<double>(i + 1), s);
+      cdf_[i] = sum;
+    }
+    for (double& c : cdf_) c /= sum;
+
+    perm_.resize(n);
+    for (std::size_t i = 0; i < n; ++i) perm_[i] = static_cast<std::uint32_t>(i);
+    Rng rng(seed);
+    for (std::size_t i = n - 1; i > 0; --i) std::swap(perm_[i], perm_[rng.next() % (i + 1)]);
+  }
+
+  std::size_t pick(Rng& rng) const {
+    if (cdf_.empty()) return rng.next() % n_;
+    const auto it = std::lower_bound(cdf_.begin(), cdf_.end(), rng.unit());
+    const std::size_t rank = std::min<std::size_t>(it - cdf_.begin(), n_ - 1);
+    return perm_[rank];
+  }
+
+ private:
+  std::size_t n_;
+  std::vector<double> cdf_;
+  std::vector<std::uint32_t> perm_;
+};
+
+// Shared, read-only description of the requests to generate.
+struct Workload {
+  const Options& opts;
+  KeyChooser chooser;
+  std::string value_bytes;  // value_max bytes; SETs send a prefix of it
+
+  explicit Workload(const Options& o)
+    : opts(o), chooser(o.keys, o.zipf, o.seed), value_bytes(o.value_max, 'x') {}
+
+  std::string_view key(std::size_t index, char (&buf)[32]) const {
+    const int n = std::snprintf(buf, sizeof(buf), "key:%zu", index);
+    return std::string_view(buf, static_cast<std::size_t>(n));
+  }
+
+  std::string_view value(Rng& rng) const {
+    const std::size_t span = opts.value_max - opts.value_min + 1;
+    return std::string_view(value_bytes.data(), opts.value_min + rng.next() % span);
+  }
+};
+
+struct OpStats {
+  async::LatencyHistogram latency;  // nanoseconds
+  std::uint64_t errors = 0;
+  std::uint64_t misses = 0;  // GET of a missing key
+
+  void merge(const OpStats& other) {
+    latency.merge(other.latency);
+    errors += other.errors;
+    misses += other.misses;
+  }
+};
+
+struct ThreadStats {
+  OpStats get;
+  OpStats set;
+};
+
+std::uint64_t nowNs() {
+  return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                        std::chrono::steady_clock::now().time_since_epoch())
+                                        .count());
+}
+
+struct Conn {
+  std::unique_ptr<async::AsyncClient> client;
+  ThreadStats* stats = nullptr;
+  unsigned inflight = 0;
+};
+
+void issue(const Workload& w, Conn& c, Rng& rng) {
+  char buf[32];
+  const std::string_view key = w.key(w.chooser.pick(rng), buf);
+  const bool is_get = rng.next() % 100 < w.opts.read_pct;
+  // Capture 16 bytes at most so std::function stores the callback inline
+  // instead of allocating per request; the op kind rides in the low bit.
+  Conn* conn = &c;
+  const std::uint64_t tag = nowNs() << 1 | (is_get ? 1 : 0);
+  auto done = [conn, tag](async::Reply&& reply) {
+    OpStats& op = (tag & 1) ? conn->stats->get : conn->stats->set;
+    op.latency.record(nowNs() - (tag >> 1));
+    if (reply.error()) ++op.errors;
+    if (reply.nil()) ++op.misses;
+    --conn->inflight;
+  };
+  if (is_get) {
+    c.client->send({"get", key}, done);
+  } else {
+    c.client->send({"set", key, w.value(rng)}, done);
+  }
+  ++c.inflight;
+}
+
+// Drives 'nconns' connections until 'stop' is set, then drains the
+// requests still in flight so every sent request is accounted for.
+void runWorker(const Workload& w, unsigned id, unsigned nconns, const std::atomic<bool>& stop,
+               ThreadStats& stats) {
+  std::vector<Conn> conns(nconns);
+  for (Conn& c : conns) {
+    c.client = std::make_unique<async::AsyncClient>(w.opts.host, w.opts.port);
+    c.stats = &stats;
+  }
+  std::vector<pollfd> pfds(nconns);
+  Rng rng(w.opts.seed + id + 1);
+
+  for (;;) {
+    const bool stopping = stop.load(std::memory_order_relaxed);
+    unsigned inflight = 0;
+    for (std::size_t i = 0; i < conns.size(); ++i) {
+      Conn& c = conns[i];
+      while (!stopping && c.inflight < w.opts.pipeline) issue(w, c, rng);
+      inflight += c.inflight;
+      pfds[i].fd = c.client->fd();
+      pfds[i].events = static_cast<short>(POLLIN | (c.client->wantsWrite() ? POLLOUT : 0));
+      pfds[i].revents = 0;
+    }
+    if (stopping && inflight == 0) break;
+
+    const int rv = ::poll(pfds.data(), pfds.size(), 100);
+    if (rv < 0 && errno != EINTR) throw std::runtime_error("poll() failed");
+    for (std::size_t i = 0; rv > 0 && i < conns.size(); ++i) {
+      async::AsyncClient& client = *conns[i].client;
+      const short ev = pfds[i].revents;
+      if ((ev & (POLLOUT | POLLERR | POLLHUP)) && client.wantsWrite()) client.handleWritable();
+      if (ev & (POLLIN | POLLERR | POLLHUP)) client.handleReadable();
+    }
+  }
+}
+
+// Writes every key once, in pipelined batches, so GETs hit.
+void prefill(const Workload& w) {
+  async::Client client(w.opts.host, w.opts.port);
+  async::Pipeline pipeline;
+  std::vector<async::Reply> replies;
+  Rng rng(w.opts.seed);
+  char buf[32];
+  for (std::size_t i = 0; i < w.opts.keys; ++i) {
+    pipeline.add({"set", w.key(i, buf), w.value(rng)});
+    if (pipeline.size() == 1000 || i + 1 == w.opts.keys) {
+      client.exec(pipeline, replies);
+      for (const async::Reply& r : replies) {
+        if (r.error()) throw std::runtime_error("prefill: SET failed");
+      }
+      pipeline.clear();
+    }
+  }
+}
+
+// ===================== Reporting =====================
+
+double toUs(std::uint64_t ns) { return static_cast<double>(ns) / 1000.0; }
+
+void printText(const char* name, const OpStats& op, double secs) {
+  const async::LatencyHistogram& h = op.latency;
+  if (h.count() == 0) return;
+  std::printf("%-5s %10llu req %12.0f req/s  errors %llu  misses %llu\n", name,
+              static_cast<unsigned long long>(h.count()), h.count() / secs,
+              static_cast<unsigned long long>(op.errors),
+              static_cast<unsigned long long>(op.misses));
+  std::printf("      latency us: mean %.1f  p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+              h.mean() / 1000.0, toUs(h.percentile(0.50)), toUs(h.percentile(0.99)),
+              toUs(h.percentile(0.999)), toUs(h.max()));
+}
+
+void printJsonOp(const char* name, const OpStats& op, double secs, bool last) {
+  const async::LatencyHistogram& h = op.latency;
+  std::printf(
+      "  \"%s\": {\"requests\": %llu, \"rps\": %.1f, \"errors\": %llu, \"misses\": %llu, "
+      "\"latency_us\": {\"mean\": %.2f, \"min\": %.2f, \"p50\": %.2f, \"p90\": %.2f, "
+      "\"p99\": %.2f, \"p99_9\": %.2f, \"max\": %.2f}}%s\n",
+      name, static_cast<unsigned long long>(h.count()), h.count() / secs,
+      static_cast<unsigned long long>(op.errors), static_cast<unsigned long long>(op.misses),
+      h.mean() / 1000.0, toUs(h.min()), toUs(h.percentile(0.50)), toUs(h.percentile(0.90)),
+      toUs(h.percentile(0.99)), toUs(h.percentile(0.999)), toUs(h.max()), last ? "" : ",");
+}
+
+void printJson(const Options& o, const ThreadStats& s, const OpStats& all, double secs) {
+  std::printf("{\n");
+  std::printf(
+      "  \"config\": {\"threads\": %u, \"connections\": %u, \"pipeline\": %u, \"keys\": %zu, "
+      "\"value_min\": %zu, \"value_max\": %zu, \"read_pct\": %u, \"zipf\": %.3f, "
+      "\"duration_ms\": %u, \"seed\": %llu},\n",
+      o.threads, o.connections, o.pipeline, o.keys, o.value_min, o.value_max, o.read_pct, o.zipf,
+      o.duration_ms, static_cast<unsigned long long>(o.seed));
+  std::printf("  \"seconds\": %.3f,\n", secs);
+  printJsonOp("total", all, secs, false);
+  printJsonOp("get", s.get, secs, false);
+  printJsonOp("set", s.set, secs, true);
+  std::printf("}\n");
+}
+
+// ===================== Arguments =====================
+
+void printUsage(const char* prog) {
+  std::fprintf(stderr,
+               "Usage: %s [--host H] [--port P] [--threads T] [--connections C]\n"
+               "          [--pipeline D] [--keys N] [--value-size BYTES|MIN-MAX]\n"
+               "          [--read-pct P] [--zipf S] [--duration-ms MS] [--seed N]\n"
+               "          [--no-prefill] [--json]\n",
+               prog);
+}
+
+bool parseUnsigned(const char* s, unsigned long long min, unsigned long long max,
+                   unsigned long long& out) {
+  char* end = nullptr;
+  errno = 0;
+  const unsigned long long v = std::strtoull(s, &end, 10);
+  if (errno != 0 || end == s || *end != '\0' || v < min || v > max) return false;
+  out = v;
+  return true;
+}
+
+bool parseValueSize(const char* s, Options& opts) {
+  const char* dash = std::strchr(s, '-');
+  unsigned long long lo = 0, hi = 0;
+  const unsigned long long limit = k_max_msg / 2;
+  if (!dash) {
+    if (!parseUnsigned(s, 0, limit, lo)) return false;
+    hi = lo;
+  } else {
+    const std::string first(s, dash);
+    if (!parseUnsigned(first.c_str(), 0, limit, lo) || !parseUnsigned(dash + 1, lo, limit, hi)) {
+      return false;
+    }
+  }
+  opts.value_min = static_cast<std::size_t>(lo);
+  opts.value_max = static_cast<std::size_t>(hi);
+  return true;
+}
+
+bool parseArgs(int argc, char** argv, Options& opts) {
+  for (int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    if (std::strcmp(arg, "--json") == 0) {
+      opts.json = true;
+      continue;
+    }
+    if (std::strcmp(arg, "--no-prefill") == 0) {
+      opts.prefill = false;
+      continue;
+    }
+    if (i + 1 >= argc) return false;
+    const char* val = argv[++i];
+    unsigned long long v = 0;
+    if (std::strcmp(arg, "--host") == 0) {
+      opts.host = val;
+    } else if (std::strcmp(arg, "--port") == 0) {
+      if (!parseUnsigned(val, 1, 65535, v)) return false;
+      opts.port = static_cast<std::uint16_t>(v);
+    } else if (std::strcmp(arg, "--threads") == 0) {
+      if (!parseUnsigned(val, 1, 1024, v)) return false;
+      opts.threads = static_cast<unsigned>(v);
+    } else if (std::strcmp(arg, "--connections") == 0) {
+      if (!parseUnsigned(val, 1, 100000, v)) return false;
+      opts.connections = static_cast<unsigned>(v);
+    } else if (std::strcmp(arg, "--pipeline") == 0) {
+      if (!parseUnsigned(val, 1, 100000, v)) return false;
+      opts.pipeline = static_cast<unsigned>(v);
+    } else if (std::strcmp(arg, "--keys") == 0) {
+      if (!parseUnsigned(val, 1, UINT32_MAX, v)) return false;
+      opts.keys = static_cast<std::size_t>(v);
+    } else if (std::strcmp(arg, "--value-size") == 0) {
+      if (!parseValueSize(val, opts)) return false;
+    } else if (std::strcmp(arg, "--read-pct") == 0) {
+      if (!parseUnsigned(val, 0, 100, v)) return false;
+      opts.read_pct = static_cast<unsigned>(v);
+    } else if (std::strcmp(arg, "--zipf") == 0) {
+      char* end = nullptr;
+      opts.zipf = std::strtod(val, &end);
+      if (end == val || *end != '\0' || opts.zipf < 0 || opts.zipf > 10) return false;
+    } else if (std::strcmp(arg, "--duration-ms") == 0) {
+      if (!parseUnsigned(val, 1, UINT32_MAX, v)) return false;
+      opts.duration_ms = static_cast<unsigned>(v);
+    } else if (std::strcmp(arg, "--seed") == 0) {
+      if (!parseUnsigned(val, 0, UINT64_MAX, v)) return false;
+      opts.seed = v;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options opts;
+  if (!parseArgs(argc, argv, opts)) {
+    printUsage(argv[0]);
+    return 1;
+  }
+  opts.threads = std::min(opts.threads, opts.connections);
+
+  try {
+    const Workload workload(opts);
+    if (opts.prefill && opts.read_pct > 0) prefill(workload);
+
+    std::atomic<bool> stop{false};
+    std::vector<ThreadStats> stats(opts.threads);
+    std::vector<std::thread> threads;
+    std::mutex error_mu;
+    std::string error;
+    const auto t0 = std::chrono::steady_clock::now();
+    for (unsigned t = 0; t < opts.threads; ++t) {
+      // Spread connections as evenly as possible over the threads.
+      const unsigned nconns = opts.connections / opts.threads + (t < opts.connections % opts.threads);
+      threads.emplace_back([&, t, nconns] {
+        try {
+          runWorker(workload, t, nconns, stop, stats[t]);
+        } catch (const std::exception& e) {
+          std::lock_guard<std::mutex> lock(error_mu);
+          if (error.empty()) error = e.what();
+          stop.store(true, std::memory_order_relaxed);
+        }
+      });
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(opts.duration_ms));
+    stop.store(true, std::memory_order_relaxed);
+    for (std::thread& th : threads) th.join();
+    const double secs =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    if (!error.empty()) throw std::runtime_error(error);
+
+    ThreadStats total;
+    for (const ThreadStats& s : stats) {
+      total.get.merge(s.get);
+      total.set.merge(s.set);
+    }
+    OpStats all = total.get;
+    all.merge(total.set);
+
+    if (opts.json) {
+      printJson(opts, total, all, secs);
+    } else {
+      std::printf("%s:%u threads=%u connections=%u pipeline=%u keys=%zu value=%zu-%zu "
+                  "read=%u%% zipf=%.2f, %.2fs\n",
+                  opts.host.c_str(), opts.port, opts.threads, opts.connections, opts.pipeline,
+                  opts.keys, opts.value_min, opts.value_max, opts.read_pct, opts.zipf, secs);
+      printText("total", all, secs);
+      printText("get", total.get, secs);
+      printText("set", total.set, secs);
+    }
+  } catch (const std::exception& e) {
+    std::fprintf(stderr, "load_bench: %s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
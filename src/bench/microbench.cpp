@@ -0,0 +1,418 @@
+// In-process microbenchmarks for the request path and the store: request
+// parsing, I/O buffers, response encoding and KVStore get/set/del at
+// several key counts. Reports ns/op plus heap allocations and bytes
+// allocated per op, counted by replacing the global operator new. Runs on
+// one thread with no network, so changes to the data structures can be
+// compared without I/O noise.
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "../multithreading/asyncio.h"
+#include "../multithreading/buffer.h"
+#include "../storage/kvstore.h"
+
+// ===================== Allocation counting =====================
+
+namespace {
+// Single-threaded benchmarks, so plain counters suffice.
+std::uint64_t g_allocs = 0;
+std::uint64_t g_alloc_bytes = 0;
+}  // namespace
+
+void* operator new(std::size_t n) {
+  ++g_allocs;
+  g_alloc_bytes += n;
+  if (void* p = std::malloc(n ? n : 1)) return p;
+  throw std::bad_alloc();
+}
+void* operator new[](std::size_t n) { return ::operator new(n); }
+// Out of line, so that GCC does not see free() paired with operator new at
+// inlined call sites (-Wmismatched-new-delete).
+__attribute__((noinline)) void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { ::operator delete(p); }
+void operator delete(void* p, std::size_t) noexcept { ::operator delete(p); }
+void operator delete[](void* p, std::size_t) noexcept { ::operator delete(p); }
+
+namespace {
+
+// ===================== Harness =====================
+
+struct Options {
+  unsigned min_time_ms = 200;
+  std::vector<std::size_t> sizes = {1000, 1000000};
+  const char* filter = nullptr;
+};
+
+Options g_opts;
+
+// Keeps the compiler from discarding a computed value.
+template <typename T>
+void doNotOptimize(const T& v) {
+  asm volatile("" : : "r,m"(v) : "memory");
+}
+
+bool selected(const std::string& name) {
+  return !g_opts.filter || name.find(g_opts.filter) != std::string::npos;
+}
+
+// Runs fn(iters) with growing iteration counts until one run takes at least
+// min_time_ms / 10, then once more for the full time, and reports that run.
+// fn performs 'iters' operations and must leave its state reusable.
+
+template <typename Fn>
+void bench(const std::string& name, Fn&& fn) {
+  if (!selected(name)) return;
+  using Clock = std::chrono::steady_clock;
+  const double target_ns = g_opts.min_time_ms * 1e6;
+
+  std::uint64_t iters = 1;
+  double ns = 0;
+  for (;;) {
+    const auto t0 = Clock::now();
+    fn(iters);
+    ns = std::chrono::duration<double, std::nano>(Clock::now() - t0).count();
+    if (ns >= target_ns / 10 || iters >= (1ull << 40)) break;
+    iters *= ns > 0 && ns < target_ns / 100 ? 10 : 2;
+  }
+  iters = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(iters * (target_ns / ns)));
+
+  const std::uint64_t allocs0 = g_allocs;
+  const std::uint64_t bytes0 = g_alloc_bytes;
+  const auto t0 = Clock::now();
+  fn(iters);
+  ns = std::chrono::duration<double, std::nano>(Clock::now() - t0).count();
+  const double n = static_cast<double>(iters);
+  std::printf("%-36s %12llu %10.1f %10.3f %10.1f\n", name.c_str(),
+              static_cast<unsigned long long>(iters), ns / n, (g_allocs - allocs0) / n,
+              (g_alloc_bytes - bytes0) / n);
+  std::fflush(stdout);
+}
+
+// xorshift64*: cheap RNG so the generator is not the bottleneck.
+struct Rng {
+  std::uint64_t s;
+  explicit Rng(std::uint64_t seed) : s(seed * 0x9E3779B97F4A7C15ull + 1) {}
+  std::uint64_t next() {
+    s ^= s >> 12;
+    s ^= s << 25;
+    s ^= s >> 27;
+    return s * 0x2545F4914F6CDD1Dull;
+  }
+};
+
+// Formats key i as "key:" plus 12 digits into buf. Far cheaper than
+// snprintf, and no key list has to be held in memory at 50M keys.
+std::string_view makeKey(std::uint64_t i, char (&buf)[16]) {
+  std::memcpy(buf, "key:", 4);
+  for (int d = 15; d >= 4; --d) {
+    buf[d] = static_cast<char>('0' + i % 10);
+    i /= 10;
+  }
+  return std::string_view(buf, 16);
+}
+
+void putU32(std::string& s, std::uint32_t v) { s.append(reinterpret_cast<const char*>(&v), 4); }
+
+// Framed request [len][nstr]{[len][bytes]}.
+std::string frame(const std::vector<std::string_view>& args) {
+  std::string payload;
+  putU32(payload, static_cast<std::uint32_t>(args.size()));
+  for (std::string_view a : args) {
+    putU32(payload, static_cast<std::uint32_t>(a.size()));
+    payload.append(a);
+  }
+  std::string out;
+  putU32(out, static_cast<std::uint32_t>(payload.size()));
+  return out + payload;
+}
+
+// ===================== Parser =====================
+
+void benchParser() {
+  std::vector<std::string_view> out;
+  const std::string get = frame({"get", "key:000000000042"});
+  std::vector<std::string_view> many = {"mset"};
+  for (int i = 0; i < 16; ++i) many.push_back("field-value");
+  const std::string set16 = frame(many);
+
+  for (const auto& [name, req] : {std::pair<const char*, const std::string*>{"parse/get", &get},
+                                  {"parse/16_args", &set16}}) {
+    const auto* payload = reinterpret_cast<const std::uint8_t*>(req->data()) + 4;
+    const std::size_t size = req->size() - 4;
+    bench(name, [&](std::uint64_t iters) {
+      for (std::uint64_t i = 0; i < iters; ++i) {
+        async::Connection::parseRequest(payload, size, out);
+        doNotOptimize(out.data());
+      }
+    });
+  }
+}
+
+// ===================== Buffers =====================
+
+void benchBuffers() {
+  async::BufferPool pool;
+  const std::uint8_t chunk[64] = {};
+
+  // A request-sized append drained right away: the block goes back to the
+  // pool each time, as for a connection that keeps up.
+  bench("buffer/append_consume_64", [&](std::uint64_t iters) {
+    async::Buffer buf(pool);
+    for (std::uint64_t i = 0; i < iters; ++i) {
+      buf.append(chunk, sizeof(chunk));
+      buf.consume(sizeof(chunk));
+    }
+  });
+
+  // Pipelined input: 64 appends, then the batch is consumed piecewise.
+  bench("buffer/append_64x64_consume", [&](std::uint64_t iters) {
+    async::Buffer buf(pool);
+    for (std::uint64_t i = 0; i < iters; ++i) {
+      buf.append(chunk, sizeof(chunk));
+      if (i % 64 == 63) {
+        while (!buf.empty()) buf.consume(sizeof(chunk));
+      }
+    }
+  });
+
+  bench("buffer/prepare_commit_16k", [&](std::uint64_t iters) {
+    async::Buffer buf(pool);
+    for (std::uint64_t i = 0; i < iters; ++i) {
+      std::uint8_t* p = buf.prepare(async::BufferPool::kBlockSize);
+      doNotOptimize(p);
+      buf.commit(async::BufferPool::kBlockSize);
+      buf.consume(async::BufferPool::kBlockSize);
+    }
+  });
+
+  auto shared = async::makeSharedValue(std::string(64 * 1024, 'v'));
+  bench("outqueue/append_gather_consume", [&](std::uint64_t iters) {
+    async::OutputQueue out(pool);
+    iovec iov[64];
+    for (std::uint64_t i = 0; i < iters; ++i) {
+      out.append(chunk, 8);
+      if (i % 16 == 0) out.appendShared(shared);
+      if (i % 64 == 63) {
+        while (!out.empty()) {
+          const int n = out.gather(iov, 64);
+          std::size_t bytes = 0;
+          for (int k = 0; k < n; ++k) bytes += iov[k].iov_len;
+          out.consume(bytes);
+        }
+      }
+    }
+  });
+}
+
+// ===================== Responses and requests =====================
+
+// Connection with no socket: output is "sent" by consuming it.
+struct FakeConnection {
+  async::LoopContext loop{0};
+  std::unique_ptr<async::Connection> conn;
+
+  FakeConnection() {
+    loop.max_request_bytes = k_max_msg;
+    conn = std::make_unique<async::Connection>(-1, loop);
+  }
+
+  void drain(async::KVStore& store) {
+    conn->beginSend();
+    conn->finishSend(conn->output().size(), store);
+  }
+};
+
+void benchResponses() {
+  async::KVStore store;
+  FakeConnection fc;
+  const std::string small(16, 'v');
+  const std::string medium(1024, 'v');
+  auto shared = async::makeSharedValue(std::string(64 * 1024, 'v'));
+
+  // Responses are encoded in batches of 64 before being "sent", as for a
+  // pipelined client.
+  const std::pair<const char*, const std::string*> sizes[] = {
+      {"response/append_16", &small}, {"response/append_1k", &medium}};
+  for (const auto& [name, value] : sizes) {
+    bench(name, [&](std::uint64_t iters) {
+      for (std::uint64_t i = 0; i < iters; ++i) {
+        fc.conn->appendResponse(0, *value);
+        if (i % 64 == 63) fc.drain(store);
+      }
+      fc.drain(store);
+    });
+  }
+  bench("response/append_shared_64k", [&](std::uint64_t iters) {
+    for (std::uint64_t i = 0; i < iters; ++i) {
+      fc.conn->appendSharedResponse(0, shared);
+      if (i % 64 == 63) fc.drain(store);
+    }
+    fc.drain(store);
+  });
+
+  // Whole request path without the socket: framing, parsing, command
+  // lookup, execution and response encoding.
+  store.set("key:000000000042", small);
+  const std::string get = frame({"get", "key:000000000042"});
+  const std::string set = frame({"set", "key:000000000042", small});
+  for (const auto& [name, req] :
+       {std::pair<const char*, const std::string*>{"request/get", &get}, {"request/set", &set}}) {
+    std::string batch;
+    for (int i = 0; i < 64; ++i) batch += *req;
+    bench(name, [&](std::uint64_t iters) {
+      for (std::uint64_t i = 0; i < iters; i += 64) {
+        fc.conn->onReceived(reinterpret_cast<const std::uint8_t*>(batch.data()), batch.size(),
+                            store);
+        fc.drain(store);
+      }
+    });
+  }
+}
+
+// ===================== KVStore =====================
+
+void benchStore(std::size_t nkeys) {
+  const std::string suffix = "/" + std::to_string(nkeys);
+  static const char* const kNames[] = {"kvstore/get_hit",       "kvstore/view_hit",
+                                       "kvstore/view_many_64",  "kvstore/get_miss",
+                                       "kvstore/set_overwrite", "kvstore/del_reinsert"};
+  bool any = false;
+  for (const char* name : kNames) any = any || selected(name + suffix);
+  if (!any) return;  // skip filling the store
+
+  async::KVStore store;
+  const std::string value(16, 'v');
+  char buf[16];
+  for (std::size_t i = 0; i < nkeys; ++i) store.set(makeKey(i, buf), value);
+  Rng rng(42);
+
+  bench("kvstore/get_hit" + suffix, [&](std::uint64_t iters) {
+    std::string out;
+    for (std::uint64_t i = 0; i < iters; ++i) {
+      store.get(makeKey(rng.next() % nkeys, buf), out);
+      doNotOptimize(out.data());
+    }
+  });
+  bench("kvstore/view_hit" + suffix, [&](std::uint64_t iters) {
+    std::size_t total = 0;
+    for (std::uint64_t i = 0; i < iters; ++i) {
+      store.view(makeKey(rng.next() % nkeys, buf), [&](std::string_view v) { total += v.size(); });
+    }
+    doNotOptimize(total);
+  });
+  // One op is a batch of 64 random keys, as MGET does it.
+  bench("kvstore/view_many_64" + suffix, [&](std::uint64_t iters) {
+    constexpr std::size_t kBatch = 64;
+    char bufs[kBatch][16];
+    std::string_view keys[kBatch];
+    std::size_t total = 0;
+    for (std::uint64_t i = 0; i < iters; ++i) {
+      for (std::size_t k = 0; k < kBatch; ++k) keys[k] = makeKey(rng.next() % nkeys, bufs[k]);
+      store.viewMany(keys, kBatch,
+                     [&](std::size_t, const std::string_view* v, const async::SharedValue*) {
+                       if (v) total += v->size();
+                     });
+    }
+    doNotOptimize(total);
+  });
+  bench("kvstore/get_miss" + suffix, [&](std::uint64_t iters) {
+    std::string out;
+    for (std::uint64_t i = 0; i < iters; ++i) {
+      store.get(makeKey(nkeys + rng.next() % nkeys, buf), out);
+    }
+  });
+  bench("kvstore/set_overwrite" + suffix, [&](std::uint64_t iters) {
+    for (std::uint64_t i = 0; i < iters; ++i) store.set(makeKey(rng.next() % nkeys, buf), value);
+  });
+  // A delete alone would empty the store during calibration; every op is a
+  // delete of an existing key followed by its re-insert.
+  bench("kvstore/del_reinsert" + suffix, [&](std::uint64_t iters) {
+    for (std::uint64_t i = 0; i < iters; ++i) {
+      const std::string_view key = makeKey(rng.next() % nkeys, buf);
+      store.del(key);
+      store.set(key, value);
+    }
+  });
+}
+
+// Inserting into a fresh store, including table growth and rehashing.
+void benchInsert() {
+  bench("kvstore/insert_fresh", [&](std::uint64_t iters) {
+    async::KVStore store;
+    const std::string value(16, 'v');
+    char buf[16];
+    for (std::uint64_t i = 0; i < iters; ++i) store.set(makeKey(i, buf), value);
+  });
+}
+
+// ===================== Arguments =====================
+
+void printUsage(const char* prog) {
+  std::fprintf(stderr,
+               "Usage: %s [--min-time-ms MS] [--sizes N,N,...] [--filter SUBSTRING]\n"
+               "  --sizes  key counts for the kvstore benchmarks (default 1000,1000000;\n"
+               "           about 150 bytes per key, so 50000000 needs ~7 GB)\n",
+               prog);
+}
+
+bool parseSizes(const char* s, std::vector<std::size_t>& out) {
+  out.clear();
+  while (*s) {
+    char* end = nullptr;
+    const unsigned long long v = std::strtoull(s, &end, 10);
+    if (end == s || v == 0) return false;
+    out.push_back(static_cast<std::size_t>(v));
+    if (*end == ',') {
+      ++end;
+    } else if (*end != '\0') {
+      return false;
+    }
+    s = end;
+  }
+  return !out.empty();
+}
+
+bool parseArgs(int argc, char** argv, Options& opts) {
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (std::strcmp(argv[i], "--min-time-ms") == 0) {
+      const long v = std::strtol(argv[i + 1], nullptr, 10);
+      if (v <= 0) return false;
+      opts.min_time_ms = static_cast<unsigned>(v);
+    } else if (std::strcmp(argv[i], "--sizes") == 0) {
+      if (!parseSizes(argv[i + 1], opts.sizes)) return false;
+    } else if (std::strcmp(argv[i], "--filter") == 0) {
+      opts.filter = argv[i + 1];
+    } else {
+      return false;
+    }
+  }
+  return argc % 2 == 1;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (!parseArgs(argc, argv, g_opts)) {
+    printUsage(argv[0]);
+    return 1;
+  }
+
+  std::printf("%-36s %12s %10s %10s %10s\n", "benchmark", "iterations", "ns/op", "allocs/op",
+              "bytes/op");
+  benchParser();
+  benchBuffers();
+  benchResponses();
+  benchInsert();
+  for (std::size_t n : g_opts.sizes) benchStore(n);
+  return 0;
+}
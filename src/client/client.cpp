@@ -0,0 +1,473 @@
+#include "client.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "../utils/hashslot.h"
+
+namespace async {
+
+namespace {
+// Bytes requested from the kernel per read().
+constexpr std::size_t kReadChunk = 64 * 1024;
+
+void putU32(char* p, std::uint32_t v) { std::memcpy(p, &v, 4); }
+
+std::runtime_error sysError(const char* what) {
+  return std::runtime_error(std::string(what) + ": " + std::strerror(errno));
+}
+
+// Connects blocking socket fd, waiting at most timeout_ms, and applies the
+// same timeout to its reads and writes.
+bool connectWithin(int fd, const sockaddr* addr, socklen_t len, int timeout_ms) {
+  const int flags = ::fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) return false;
+  if (::connect(fd, addr, len) != 0) {
+    if (errno != EINPROGRESS) return false;
+    pollfd pfd{fd, POLLOUT, 0};
+    int rv = 0;
+    do {
+      rv = ::poll(&pfd, 1, timeout_ms);
+    } while (rv < 0 && errno == EINTR);
+    if (rv == 0) errno = ETIMEDOUT;
+    if (rv <= 0) return false;
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    if (::getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0) return false;
+    if (err != 0) {
+      errno = err;
+      return false;
+    }
+  }
+  if (::fcntl(fd, F_SETFL, flags) < 0) return false;
+  timeval tv{};
+  tv.tv_sec = static_cast<time_t>(timeout_ms / 1000);
+  tv.tv_usec = static_cast<suseconds_t>(timeout_ms % 1000 * 1000);
+  return ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0 &&
+         ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == 0;
+}
+
+// Resolves host:port and returns a connected (or connecting, when
+// 'nonblocking') TCP socket; see Client for 'timeout_ms'.
+int connectTo(const std::string& host, std::uint16_t port, bool nonblocking, int timeout_ms = 0) {
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* res = nullptr;
+  const std::string service = std::to_string(port);
+  if (::getaddrinfo(host.c_str(), service.c_str(), &hints, &res) != 0 || !res) {
+    throw std::runtime_error("cannot resolve " + host);
+  }
+  std::unique_ptr<addrinfo, decltype(&::freeaddrinfo)> guard(res, ::freeaddrinfo);
+
+  int fd = ::socket(res->ai_family, res->ai_socktype | (nonblocking ? SOCK_NONBLOCK : 0), 0);
+  if (fd < 0) throw sysError("socket()");
+  // Requests are written whole; don't let Nagle hold back the last one.
+  int one = 1;
+  ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  const bool connected =
+      timeout_ms > 0 ? connectWithin(fd, res->ai_addr, res->ai_addrlen, timeout_ms)
+                     : ::connect(fd, res->ai_addr, res->ai_addrlen) == 0 ||
+                           (nonblocking && errno == EINPROGRESS);
+  if (!connected) {
+    const std::runtime_error err = sysError("connect()");
+    ::close(fd);
+    throw err;
+  }
+  return fd;
+}
+}  // namespace
+
+// ===================== Encoding =====================
+
+void encodeRequest(std::string& out, const std::string_view* args, std::size_t n) {
+  std::size_t payload = 4;
+  for (std::size_t i = 0; i < n; ++i) payload += 4 + args[i].size();
+  if (payload > k_max_msg_limit) {
+    throw std::runtime_error("request too large");
+  }
+
+  const std::size_t start = out.size();
+  out.resize(start + 4 + payload);
+  char* p = &out[start];
+  putU32(p, static_cast<std::uint32_t>(payload));
+  putU32(p + 4, static_cast<std::uint32_t>(n));
+  p += 8;
+  for (std::size_t i = 0; i < n; ++i) {
+    putU32(p, static_cast<std::uint32_t>(args[i].size()));
+    if (!args[i].empty()) std::memcpy(p + 4, args[i].data(), args[i].size());
+    p += 4 + args[i].size();
+  }
+}
+
+void decodeArray(std::string_view data, std::vector<Reply>& out) {
+  const char* p = data.data();
+  const char* const end = p + data.size();
+  std::uint32_t count = 0;
+  if (end - p < 4) throw std::runtime_error("malformed array reply");
+  std::memcpy(&count, p, 4);
+  p += 4;
+  // Every element has at least its 8-byte header.
+  if (count > static_cast<std::size_t>(end - p) / 8) {
+    throw std::runtime_error("malformed array reply");
+  }
+  out.resize(count);
+  for (Reply& reply : out) {
+    std::uint32_t len = 0;
+    if (end - p < 8) throw std::runtime_error("malformed array reply");
+    std::memcpy(&reply.status, p, 4);
+    std::memcpy(&len, p + 4, 4);
+    p += 8;
+    if (len > static_cast<std::size_t>(end - p)) throw std::runtime_error("malformed array reply");
+    reply.data.assign(p, len);
+    p += len;
+  }
+  if (p != end) throw std::runtime_error("malformed array reply");
+}
+
+// ===================== ReplyReader =====================
+
+char* ReplyReader::prepare(std::size_t n) {
+  if (begin_ == end_) begin_ = end_ = 0;
+  if (buf_.size() - end_ < n) {
+    // Move the unread tail to the front before growing.
+    if (begin_ > 0) {
+      std::memmove(&buf_[0], &buf_[begin_], end_ - begin_);
+      end_ -= begin_;
+      begin_ = 0;
+    }
+    if (buf_.size() - end_ < n) buf_.resize(end_ + n);
+  }
+  return &buf_[end_];
+}
+
+bool ReplyReader::next(Reply& out) {
+  const std::size_t avail = end_ - begin_;
+  if (avail < 8) return false;
+  std::uint32_t len = 0;
+  std::memcpy(&len, &buf_[begin_], 4);
+  if (len < 4) throw std::runtime_error("malformed reply");
+  if (avail < 4u + len) {
+    // Make room for the rest of a large reply in one go.
+    prepare(4u + len - avail);
+    return false;
+  }
+  std::memcpy(&out.status, &buf_[begin_ + 4], 4);
+  out.data.assign(&buf_[begin_ + 8], len - 4);
+  begin_ += 4u + len;
+  return true;
+}
+
+// ===================== Client =====================
+
+Client::Client(const std::string& host, std::uint16_t port, int timeout_ms)
+  : fd_(connectTo(host, port, false, timeout_ms)) {}
+
+Client::~Client() {
+  if (fd_ >= 0) ::close(fd_);
+}
+
+Client::Client(Client&& other) noexcept
+  : fd_(std::exchange(other.fd_, -1)), request_(std::move(other.request_)),
+    args_(std::move(other.args_)), reader_(std::move(other.reader_)) {}
+
+Client& Client::operator=(Client&& other) noexcept {
+  if (this != &other) {
+    if (fd_ >= 0) ::close(fd_);
+    fd_ = std::exchange(other.fd_, -1);
+    request_ = std::move(other.request_);
+    args_ = std::move(other.args_);
+    reader_ = std::move(other.reader_);
+  }
+  return *this;
+}
+
+Reply Client::call(std::initializer_list<std::string_view> args) {
+  request_.clear();
+  encodeRequest(request_, args.begin(), args.size());
+  writeAll(request_);
+  Reply reply;
+  readReplies(1, &reply);
+  return reply;
+}
+
+Reply Client::call(const std::vector<std::string_view>& args) {
+  request_.clear();
+  encodeRequest(request_, args.data(), args.size());
+  writeAll(request_);
+  Reply reply;
+  readReplies(1, &reply);
+  return reply;
+}
+
+void Client::exec(const Pipeline& pipeline, std::vector<Reply>& replies) {
+  replies.resize(pipeline.size());
+  if (pipeline.empty()) return;
+  writeAll(pipeline.bytes());
+  readReplies(pipeline.size(), replies.data());
+}
+
+Reply Client::mget(const std::vector<std::string_view>& keys, std::vector<Reply>& values) {
+  args_.assign(1, "mget");
+  args_.insert(args_.end(), keys.begin(), keys.end());
+  Reply reply = call(args_);
+  values.clear();
+  if (reply.ok()) decodeArray(reply.data, values);
+  reply.data.clear();
+  return reply;
+}
+
+Reply Client::mset(const std::vector<std::pair<std::string_view, std::string_view>>& pairs) {
+  args_.assign(1, "mset");
+  for (const auto& [key, value] : pairs) {
+    args_.push_back(key);
+    args_.push_back(value);
+  }
+  return call(args_);
+}
+
+Reply Client::mdel(const std::vector<std::string_view>& keys) {
+  args_.assign(1, "mdel");
+  args_.insert(args_.end(), keys.begin(), keys.end());
+  return call(args_);
+}
+
+void Client::writeAll(const std::string& bytes) {
+  std::size_t off = 0;
+  while (off < bytes.size()) {
+    const ssize_t rv = ::send(fd_, bytes.data() + off, bytes.size() - off, MSG_NOSIGNAL);
+    if (rv < 0 && errno == EINTR) continue;
+    if (rv < 0) throw sysError("send()");
+    off += static_cast<std::size_t>(rv);
+  }
+}
+
+void Client::readReplies(std::size_t n, Reply* out) {
+  std::size_t done = 0;
+  while (done < n) {
+    if (reader_.next(out[done])) {
+      ++done;
+      continue;
+    }
+    const ssize_t rv = ::read(fd_, reader_.prepare(kReadChunk), kReadChunk);
+    if (rv < 0 && errno == EINTR) continue;
+    if (rv < 0) throw sysError("read()");
+    if (rv == 0) throw std::runtime_error("connection closed by server");
+    reader_.commit(static_cast<std::size_t>(rv));
+  }
+}
+
+// ===================== ClusterClient =====================
+
+ClusterClient::ClusterClient(const std::string& host, std::uint16_t port)
+  : slots_(kClusterSlots, kUnknown) {
+  last_ = nodeIndex(host + ":" + std::to_string(port));
+  refreshSlots();
+}
+
+Reply ClusterClient::call(std::initializer_list<std::string_view> args) {
+  return route(args.begin(), args.size());
+}
+
+Reply ClusterClient::call(const std::vector<std::string_view>& args) {
+  return route(args.data(), args.size());
+}
+
+void ClusterClient::refreshSlots() {
+  const Reply reply = connection(last_).call({"cluster", "slots"});
+  if (!reply.ok()) throw std::runtime_error("cluster slots failed");
+  std::vector<Reply> ranges;
+  decodeArray(reply.data, ranges);
+  std::fill(slots_.begin(), slots_.end(), kUnknown);
+  for (const Reply& range : ranges) {
+    // "<first> <last> <host>:<port>"
+    const std::size_t sp1 = range.data.find(' ');
+    const std::size_t sp2 = range.data.find(' ', sp1 + 1);
+    if (sp1 == std::string::npos || sp2 == std::string::npos) {
+      throw std::runtime_error("malformed cluster slots reply");
+    }
+    const unsigned long first = std::strtoul(range.data.c_str(), nullptr, 10);
+    const unsigned long last = std::strtoul(range.data.c_str() + sp1 + 1, nullptr, 10);
+    if (first > last || last >= kClusterSlots) {
+      throw std::runtime_error("malformed cluster slots reply");
+    }
+    const std::uint16_t node = nodeIndex(std::string_view(range.data).substr(sp2 + 1));
+    std::fill(slots_.begin() + first, slots_.begin() + last + 1, node);
+  }
+}
+
+std::string ClusterClient::nodeFor(std::uint16_t slot) const {
+  return slots_[slot] == kUnknown ? std::string() : nodes_[slots_[slot]];
+}
+
+Reply ClusterClient::route(const std::string_view* args, std::size_t n) {
+  std::uint16_t node = last_;
+  if (n > 1) {
+    const std::uint16_t owner = slots_[keyHashSlot(args[1])];
+    if (owner != kUnknown) node = owner;
+  }
+  bool asking = false;
+  for (int hop = 0;; ++hop) {
+    last_ = node;
+    Reply reply;
+    try {
+      if (asking) {
+        asking_.clear();
+        asking_.add({"asking"});
+        asking_.add(args, n);
+        connection(node).exec(asking_, replies_);
+        reply = std::move(replies_[1]);
+      } else {
+        args_.assign(args, args + n);
+        reply = connection(node).call(args_);
+      }
+    } catch (const std::runtime_error&) {
+      connections_[node].reset();
+      throw;
+    }
+    std::uint16_t slot = 0;
+    if ((!reply.moved() && !reply.ask()) || hop == kMaxRedirects ||
+        !parseRedirect(reply.data, slot, node)) {
+      return reply;
+    }
+    ++redirects_;
+    asking = reply.ask();
+    if (reply.moved()) {
+      slots_[slot] = node;
+      // Slots rarely move one at a time; learn the rest of the change too.
+      last_ = node;
+      refreshSlots();
+    }
+  }
+}
+
+std::uint16_t ClusterClient::nodeIndex(std::string_view address) {
+  for (std::size_t i = 0; i < nodes_.size(); ++i) {
+    if (nodes_[i] == address) return static_cast<std::uint16_t>(i);
+  }
+  if (nodes_.size() == kUnknown) throw std::runtime_error("too many cluster nodes");
+  nodes_.emplace_back(address);
+  connections_.emplace_back();
+  return static_cast<std::uint16_t>(nodes_.size() - 1);
+}
+
+Client& ClusterClient::connection(std::uint16_t node) {
+  std::unique_ptr<Client>& conn = connections_[node];
+  if (!conn) {
+    const std::string& address = nodes_[node];
+    const std::size_t colon = address.rfind(':');
+    const unsigned long port = std::strtoul(address.c_str() + colon + 1, nullptr, 10);
+    if (colon == std::string::npos || port == 0 || port > 65535) {
+      throw std::runtime_error("bad node address " + address);
+    }
+    conn = std::make_unique<Client>(address.substr(0, colon), static_cast<std::uint16_t>(port));
+  }
+  return *conn;
+}
+
+bool ClusterClient::parseRedirect(const std::string& data, std::uint16_t& slot,
+                                  std::uint16_t& node) {
+  const std::size_t sp = data.find(' ');
+  if (sp == std::string::npos || sp + 1 == data.size()) return false;
+  const unsigned long n = std::strtoul(data.c_str(), nullptr, 10);
+  if (n >= kClusterSlots) return false;
+  slot = static_cast<std::uint16_t>(n);
+  node = nodeIndex(std::string_view(data).substr(sp + 1));
+  return true;
+}
+
+// ===================== AsyncClient =====================
+
+AsyncClient::AsyncClient(const std::string& host, std::uint16_t port)
+  : fd_(connectTo(host, port, true)) {}
+
+AsyncClient::~AsyncClient() {
+  if (fd_ >= 0) ::close(fd_);
+}
+
+void AsyncClient::send(std::initializer_list<std::string_view> args, Callback done) {
+  encodeRequest(out_, args.begin(), args.size());
+  callbacks_.push_back(std::move(done));
+}
+
+std::future<Reply> AsyncClient::send(std::initializer_list<std::string_view> args) {
+  auto promise = std::make_shared<std::promise<Reply>>();
+  std::future<Reply> result = promise->get_future();
+  send(args, [promise](Reply&& reply) { promise->set_value(std::move(reply)); });
+  return result;
+}
+
+void AsyncClient::handleWritable() {
+  if (connecting_) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (::getsockopt(fd_, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+      callbacks_.clear();
+      errno = err;
+      throw sysError("connect()");
+    }
+    connecting_ = false;
+  }
+  while (sent_ < out_.size()) {
+    const ssize_t rv = ::send(fd_, out_.data() + sent_, out_.size() - sent_, MSG_NOSIGNAL);
+    if (rv < 0 && errno == EINTR) continue;
+    if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    if (rv < 0) {
+      callbacks_.clear();
+      throw sysError("send()");
+    }
+    sent_ += static_cast<std::size_t>(rv);
+  }
+  out_.clear();
+  sent_ = 0;
+}
+
+void AsyncClient::handleReadable() {
+  Reply reply;
+  for (;;) {
+    const ssize_t rv = ::read(fd_, reader_.prepare(kReadChunk), kReadChunk);
+    if (rv < 0 && errno == EINTR) continue;
+    if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    if (rv <= 0) {
+      callbacks_.clear();
+      if (rv == 0) throw std::runtime_error("connection closed by server");
+      throw sysError("read()");
+    }
+    reader_.commit(static_cast<std::size_t>(rv));
+    while (!callbacks_.empty() && reader_.next(reply)) {
+      // Pop first: the callback may queue further commands.
+      Callback done = std::move(callbacks_.front());
+      callbacks_.pop_front();
+      done(std::move(reply));
+    }
+  }
+}
+
+void AsyncClient::poll(int timeout_ms) {
+  pollfd pfd{};
+  pfd.fd = fd_;
+  pfd.events = static_cast<short>(POLLIN | (wantsWrite() ? POLLOUT : 0));
+  const int rv = ::poll(&pfd, 1, timeout_ms);
+  if (rv < 0 && errno == EINTR) return;
+  if (rv < 0) throw sysError("poll()");
+  if (pfd.revents & (POLLOUT | POLLERR | POLLHUP)) {
+    if (wantsWrite()) handleWritable();
+  }
+  if (pfd.revents & (POLLIN | POLLERR | POLLHUP)) handleReadable();
+}
+
+}  // namespace async
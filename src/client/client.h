@@ -0,0 +1,220 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "../utils/utils.h"
+
+namespace async {
+
+// One server response: [status: u32][data...].
+struct Reply {
+  std::uint32_t status = 0;
+  std::string data;
+
+  bool ok() const { return status == 0; }
+  bool nil() const { return status == ResponseStatus::RES_NX; }
+  bool error() const { return status == ResponseStatus::RES_ERR; }
+  // Cluster redirections; data is "<slot> <host>:<port>".
+  bool moved() const { return status == ResponseStatus::RES_MOVED; }
+  bool ask() const { return status == ResponseStatus::RES_ASK; }
+};
+
+// Splits the data of a multi-key reply (MGET), [count]{[status][len][bytes]},
+// into one Reply per key, reusing the strings already in 'out'. Throws
+// std::runtime_error if the data is malformed.
+void decodeArray(std::string_view data, std::vector<Reply>& out);
+
+// Appends one framed request, [len][nstr]{[len][bytes]}, to 'out'. Sizes are
+// computed up front, so encoding is a single pass with no temporaries.
+void encodeRequest(std::string& out, const std::string_view* args, std::size_t n);
+
+// Incremental reply decoder over a reusable receive buffer.
+class ReplyReader {
+ public:
+  // Space to read into; follow with commit().
+  char* prepare(std::size_t n);
+  void commit(std::size_t n) { end_ += n; }
+  // Pops the next complete reply. Returns false if more bytes are needed;
+  // throws std::runtime_error on a malformed frame.
+  bool next(Reply& out);
+
+ private:
+  std::string buf_;
+  std::size_t begin_ = 0;
+  std::size_t end_ = 0;
+};
+
+// A batch of commands sent with one write. Reusable: clear() keeps the
+// encode buffer, so steady-state batches do not allocate.
+class Pipeline {
+ public:
+  Pipeline& add(std::initializer_list<std::string_view> args) {
+    encodeRequest(buf_, args.begin(), args.size());
+    ++count_;
+    return *this;
+  }
+  Pipeline& add(const std::vector<std::string_view>& args) {
+    encodeRequest(buf_, args.data(), args.size());
+    ++count_;
+    return *this;
+  }
+  Pipeline& add(const std::string_view* args, std::size_t n) {
+    encodeRequest(buf_, args, n);
+    ++count_;
+    return *this;
+  }
+
+  std::size_t size() const { return count_; }
+  bool empty() const { return count_ == 0; }
+  void clear() {
+    buf_.clear();
+    count_ = 0;
+  }
+  const std::string& bytes() const { return buf_; }
+
+ private:
+  std::string buf_;
+  std::size_t count_ = 0;
+};
+
+// Blocking client over one TCP connection. Errors (connect, I/O, protocol)
+// are reported with std::runtime_error; the connection is unusable after.
+class Client {
+ public:
+  // With 'timeout_ms' > 0, connecting and then every read or write fail
+  // once they have waited that long; otherwise they wait indefinitely.
+  // Name resolution is not bounded.
+  Client(const std::string& host, std::uint16_t port, int timeout_ms = 0);
+  ~Client();
+  Client(Client&& other) noexcept;
+  Client& operator=(Client&& other) noexcept;
+  Client(const Client&) = delete;
+  Client& operator=(const Client&) = delete;
+
+  // One command, one round trip.
+  Reply call(std::initializer_list<std::string_view> args);
+  Reply call(const std::vector<std::string_view>& args);
+
+  // Sends every command of 'pipeline' in one write and reads the replies,
+  // in order, into 'replies' (resized; existing strings are reused).
+  void exec(const Pipeline& pipeline, std::vector<Reply>& replies);
+
+  // Multi-key commands, one round trip each. mget() fills 'values' with one
+  // reply per key (nil() if missing) and returns the status of the whole
+  // reply, whose data it consumes; 'values' is emptied on error.
+  Reply mget(const std::vector<std::string_view>& keys, std::vector<Reply>& values);
+  Reply mset(const std::vector<std::pair<std::string_view, std::string_view>>& pairs);
+  // The reply's data is the number of keys that existed, in decimal.
+  Reply mdel(const std::vector<std::string_view>& keys);
+
+  int fd() const { return fd_; }
+
+ private:
+  void writeAll(const std::string& bytes);
+  void readReplies(std::size_t n, Reply* out);
+
+  int fd_ = -1;
+  std::string request_;
+  std::vector<std::string_view> args_;  // scratch for multi-key commands
+  ReplyReader reader_;
+};
+
+// Blocking client of a cluster of servers in cluster mode. Each command goes
+// to the node serving the hash slot of its key, taken to be args[1]
+// (commands with no arguments go to the node last used), so commands with
+// several keys must keep them in one slot, e.g. with a {hash tag}. The slot
+// map is fetched with "cluster slots" on construction and after every
+// MOVED reply, whose slot is also updated right away; an ASK reply is
+// followed for that one command. MOVED and ASK are followed up to
+// kMaxRedirects times per command, after which the redirection itself is
+// returned. Connections to nodes are opened on first use and kept; errors
+// are reported as by Client, and drop the failed connection only.
+class ClusterClient {
+ public:
+  static constexpr int kMaxRedirects = 5;
+
+  // 'host':'port' is any node of the cluster.
+  ClusterClient(const std::string& host, std::uint16_t port);
+
+  Reply call(std::initializer_list<std::string_view> args);
+  Reply call(const std::vector<std::string_view>& args);
+
+  // Fetches the slot map again, from the node last used.
+  void refreshSlots();
+
+  // Node address ("host:port") serving 'slot' as far as known, or empty.
+  std::string nodeFor(std::uint16_t slot) const;
+  // MOVED and ASK replies followed so far.
+  std::uint64_t redirects() const { return redirects_; }
+
+ private:
+  static constexpr std::uint16_t kUnknown = 0xFFFF;
+
+  Reply route(const std::string_view* args, std::size_t n);
+  // Index of node 'address', added if new.
+  std::uint16_t nodeIndex(std::string_view address);
+  Client& connection(std::uint16_t node);
+  // Parses "<slot> <host>:<port>"; false if malformed.
+  bool parseRedirect(const std::string& data, std::uint16_t& slot, std::uint16_t& node);
+
+  std::vector<std::string> nodes_;
+  std::vector<std::unique_ptr<Client>> connections_;  // by node index, null until used
+  std::vector<std::uint16_t> slots_;                  // node index per slot
+  std::uint16_t last_ = 0;
+  std::uint64_t redirects_ = 0;
+  std::vector<std::string_view> args_;  // scratch
+  Pipeline asking_;
+  std::vector<Reply> replies_;
+};
+
+// Non-blocking client for use from an event loop. It never blocks: send()
+// only queues, and the owner drives I/O by watching fd() (readable always,
+// writable while wantsWrite()) and calling handleReadable/handleWritable,
+// or by calling poll() when it has no loop of its own. Replies complete in
+// request order, on the thread that drives I/O.
+class AsyncClient {
+ public:
+  using Callback = std::function<void(Reply&&)>;
+
+  // Starts a non-blocking connect; commands may be queued right away.
+  AsyncClient(const std::string& host, std::uint16_t port);
+  ~AsyncClient();
+  AsyncClient(const AsyncClient&) = delete;
+  AsyncClient& operator=(const AsyncClient&) = delete;
+
+  void send(std::initializer_list<std::string_view> args, Callback done);
+  std::future<Reply> send(std::initializer_list<std::string_view> args);
+
+  int fd() const { return fd_; }
+  bool wantsWrite() const { return connecting_ || sent_ < out_.size(); }
+  // Commands sent or queued whose reply has not arrived yet.
+  std::size_t pending() const { return callbacks_.size(); }
+
+  // Throw std::runtime_error if the connection failed; pending callbacks
+  // are then dropped (their futures report a broken promise).
+  void handleReadable();
+  void handleWritable();
+
+  // Waits up to timeout_ms for the socket and handles what is ready.
+  void poll(int timeout_ms);
+
+ private:
+  int fd_ = -1;
+  bool connecting_ = true;
+  std::string out_;
+  std::size_t sent_ = 0;
+  ReplyReader reader_;
+  std::deque<Callback> callbacks_;
+};
+
+}  // namespace async
@@ -0,0 +1,175 @@
+#include "cluster.h"
+
+#include "../commands/registry.h"
+#include "../storage/kvstore.h"
+
+namespace async {
+
+Cluster& Cluster::instance() {
+  static Cluster cluster;
+  return cluster;
+}
+
+Cluster::Cluster() {
+  for (std::atomic<std::uint32_t>& entry : slots_) {
+    entry.store(pack(kNoNode, kNoNode), std::memory_order_relaxed);
+  }
+}
+
+void Cluster::configure(const std::string& self) {
+  nodes_[0] = self;
+  enabled_ = true;
+}
+
+Cluster::Route Cluster::route(const Command& command, const std::vector<std::string_view>& args,
+                              const KVStore& store, bool asking, std::uint16_t& slot,
+                              std::string_view& node,
+                              std::shared_lock<std::shared_mutex>& guard) {
+  const CommandSpec& spec = command.spec;
+  if (spec.first_key == 0) return Route::Serve;
+  const int argc = static_cast<int>(args.size());
+  const int first = spec.first_key;
+  const int last = spec.last_key < 0 ? argc + spec.last_key : spec.last_key;
+  if (first > last || last >= argc) return Route::Serve;
+  slot = keyHashSlot(args[first]);
+  for (int i = first + spec.key_step; i <= last; i += spec.key_step) {
+    if (keyHashSlot(args[i]) != slot) return Route::CrossSlot;
+  }
+
+  const std::uint32_t entry = slots_[slot].load(std::memory_order_acquire);
+  const std::uint16_t owner = ownerOf(entry);
+  const std::uint16_t peer = peerOf(entry);
+  if (owner == 0) {
+    if (peer == kNoNode) return Route::Serve;
+    // Migrating: the keys not here any more are on 'peer'.
+    guard = std::shared_lock<std::shared_mutex>(migration_mu_);
+    int present = 0;
+    int keys = 0;
+    for (int i = first; i <= last; i += spec.key_step) {
+      ValueType type;
+      present += store.type(args[i], type) ? 1 : 0;
+      ++keys;
+    }
+    if (present == keys) return Route::Serve;
+    guard.unlock();
+    if (present != 0) return Route::TryAgain;
+    node = nodes_[peer];
+    return Route::Ask;
+  }
+  if (peer != kNoNode && asking) return Route::Serve;
+  if (owner == kNoNode) return Route::Unassigned;
+  node = nodes_[owner];
+  return Route::Moved;
+}
+
+std::uint16_t Cluster::nodeIndex(std::string_view node) {
+  const std::size_t colon = node.rfind(':');
+  if (colon == std::string_view::npos || colon == 0 || colon + 1 == node.size()) return kNoNode;
+  const std::size_t count = node_count_.load(std::memory_order_relaxed);
+  for (std::size_t i = 0; i < count; ++i) {
+    if (nodes_[i] == node) return static_cast<std::uint16_t>(i);
+  }
+  if (count == kMaxNodes) return kNoNode;
+  nodes_[count] = std::string(node);
+  node_count_.store(count + 1, std::memory_order_release);
+  return static_cast<std::uint16_t>(count);
+}
+
+bool Cluster::addSlots(const std::vector<std::uint16_t>& slots) {
+  std::lock_guard<std::mutex> lock(mu_);
+  for (std::uint16_t slot : slots) {
+    if (ownerOf(slots_[slot].load(std::memory_order_relaxed)) != kNoNode) return false;
+  }
+  for (std::uint16_t slot : slots) slots_[slot].store(pack(0, kNoNode), std::memory_order_release);
+  return true;
+}
+
+void Cluster::delSlots(const std::vector<std::uint16_t>& slots) {
+  std::lock_guard<std::mutex> lock(mu_);
+  for (std::uint16_t slot : slots) {
+    slots_[slot].store(pack(kNoNode, kNoNode), std::memory_order_release);
+  }
+}
+
+bool Cluster::assign(std::string_view node, const std::vector<SlotRange>& ranges) {
+  std::lock_guard<std::mutex> lock(mu_);
+  for (const SlotRange& range : ranges) {
+    if (range.first > range.last || range.last >= kClusterSlots) return false;
+  }
+  const std::uint16_t index = nodeIndex(node);
+  if (index == kNoNode) return false;
+  for (const SlotRange& range : ranges) {
+    for (std::size_t slot = range.first; slot <= range.last; ++slot) {
+      slots_[slot].store(pack(index, kNoNode), std::memory_order_release);
+    }
+  }
+  return true;
+}
+
+bool Cluster::setMigrating(std::uint16_t slot, std::string_view node) {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (ownerOf(slots_[slot].load(std::memory_order_relaxed)) != 0) return false;
+  const std::uint16_t index = nodeIndex(node);
+  if (index == kNoNode || index == 0) return false;
+  slots_[slot].store(pack(0, index), std::memory_order_release);
+  return true;
+}
+
+bool Cluster::setImporting(std::uint16_t slot, std::string_view node) {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (ownerOf(slots_[slot].load(std::memory_order_relaxed)) == 0) return false;
+  const std::uint16_t index = nodeIndex(node);
+  if (index == kNoNode || index == 0) return false;
+  // The source serves the slot until told otherwise.
+  slots_[slot].store(pack(index, index), std::memory_order_release);
+  return true;
+}
+
+void Cluster::setStable(std::uint16_t slot) {
+  std::lock_guard<std::mutex> lock(mu_);
+  const std::uint32_t entry = slots_[slot].load(std::memory_order_relaxed);
+  slots_[slot].store(pack(ownerOf(entry), kNoNode), std::memory_order_release);
+}
+
+std::vector<Cluster::SlotRange> Cluster::slotRanges() const {
+  std::vector<SlotRange> ranges;
+  std::uint16_t current = kNoNode;
+  for (std::size_t slot = 0; slot < kClusterSlots; ++slot) {
+    const std::uint16_t owner = ownerOf(slots_[slot].load(std::memory_order_acquire));
+    if (owner == current && owner != kNoNode) {
+      ranges.back().last = static_cast<std::uint16_t>(slot);
+      continue;
+    }
+    current = owner;
+    if (owner == kNoNode) continue;
+    ranges.push_back({static_cast<std::uint16_t>(slot), static_cast<std::uint16_t>(slot),
+                      nodes_[owner]});
+  }
+  return ranges;
+}
+
+void Cluster::noteRedirect(Route route) {
+  if (route == Route::Moved) moved_.fetch_add(1, std::memory_order_relaxed);
+  if (route == Route::Ask) asked_.fetch_add(1, std::memory_order_relaxed);
+}
+
+Cluster::Status Cluster::status() const {
+  Status s;
+  s.enabled = enabled_;
+  if (!enabled_) return s;
+  s.self = nodes_[0];
+  for (const std::atomic<std::uint32_t>& slot : slots_) {
+    const std::uint32_t entry = slot.load(std::memory_order_relaxed);
+    const std::uint16_t owner = ownerOf(entry);
+    const std::uint16_t peer = peerOf(entry);
+    if (owner != kNoNode) ++s.slots_assigned;
+    if (owner == 0) ++s.slots_served;
+    if (peer != kNoNode) ++(owner == 0 ? s.slots_migrating : s.slots_importing);
+  }
+  s.known_nodes = node_count_.load(std::memory_order_acquire);
+  s.moved = moved_.load(std::memory_order_relaxed);
+  s.asked = asked_.load(std::memory_order_relaxed);
+  return s;
+}
+
+}  // namespace async
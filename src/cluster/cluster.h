@@ -0,0 +1,154 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../utils/hashslot.h"
+
+namespace async {
+
+struct Command;
+class KVStore;
+
+// Cluster mode, after Redis Cluster: the keyspace is split into
+// kClusterSlots hash slots (keyHashSlot()), each served by one node, and a
+// command runs where the slot of its keys is served. Any other node answers
+// it with RES_MOVED and the owner's address, and clients keep a slot map so
+// that they rarely need to be redirected.
+//
+// There is no gossip: every node is told the whole slot map (CLUSTER
+// ASSIGN / ADDSLOTS / SETSLOT), and nodes are known by the "host:port"
+// clients reach them at. A slot moves between nodes online, as in Redis:
+//   1. the target: CLUSTER SETSLOT <slot> IMPORTING <source>
+//   2. the source: CLUSTER SETSLOT <slot> MIGRATING <target>
+//   3. the source: SCAN ... SLOT <slot> and MIGRATE of the keys found,
+//      until none is left
+//   4. every node: CLUSTER SETSLOT <slot> NODE <target>
+// Meanwhile the source serves the keys it still has and answers RES_ASK
+// for the others, and the target serves a command in the slot only right
+// after "asking". MIGRATE holds the locks of the keys it moves until the
+// target has them, so no write to a key is lost in between. Its timeout-ms
+// bounds each socket operation (the connect, every read and write), not
+// the whole command: over a slow link a MIGRATE of many keys can keep
+// their shards locked, stalling every event loop that touches them, for
+// several timeouts. Migrate a few keys per command.
+//
+// The slot table is read lock-free by every event loop; changes, rare and
+// made by administrators, are serialized by a mutex.
+class Cluster {
+ public:
+  // Node index of "none"; index 0 is this node.
+  static constexpr std::uint16_t kNoNode = 0xFFFF;
+  static constexpr std::size_t kMaxNodes = 1024;
+
+  // Where a command runs, by the slot of its keys.
+  enum class Route {
+    Serve,       // here
+    Moved,       // on the node serving the slot, from now on
+    Ask,         // its keys have moved to the slot's migration target
+    CrossSlot,   // its keys are in different slots: rejected
+    TryAgain,    // some of its keys have moved and some not yet: rejected
+    Unassigned,  // no node serves the slot: rejected
+  };
+
+  // Consecutive slots served by one node, for CLUSTER SLOTS.
+  struct SlotRange {
+    std::uint16_t first = 0;
+    std::uint16_t last = 0;
+    std::string node;
+  };
+
+  // For INFO.
+  struct Status {
+    bool enabled = false;
+    std::string self;
+    std::size_t slots_assigned = 0;
+    std::size_t slots_served = 0;  // by this node
+    std::size_t slots_migrating = 0;
+    std::size_t slots_importing = 0;
+    std::size_t known_nodes = 0;
+    std::uint64_t moved = 0;  // redirections sent
+    std::uint64_t asked = 0;
+  };
+
+  static Cluster& instance();
+
+  Cluster(const Cluster&) = delete;
+  Cluster& operator=(const Cluster&) = delete;
+
+  // Turns cluster mode on with this node reachable at 'self' ("host:port"),
+  // serving no slot yet. Call once, before event loops start.
+  void configure(const std::string& self);
+  bool enabled() const { return enabled_; }
+  const std::string& self() const { return nodes_[0]; }
+
+  // Decides where the command with arguments 'args' runs. For Moved and Ask
+  // 'slot' and 'node' tell where to; for Serve in a slot being migrated
+  // away, 'guard' is a shared hold on migrationLock() that must be kept
+  // while the command runs. 'asking': the client sent "asking" right before.
+  Route route(const Command& command, const std::vector<std::string_view>& args,
+              const KVStore& store, bool asking, std::uint16_t& slot, std::string_view& node,
+              std::shared_lock<std::shared_mutex>& guard);
+
+  // Slot table changes. Each checks all of its arguments first and changes
+  // nothing (returning false) if one is invalid.
+  // Unassigned slots become this node's.
+  bool addSlots(const std::vector<std::uint16_t>& slots);
+  // Slots served by no node from now on.
+  void delSlots(const std::vector<std::uint16_t>& slots);
+  // Slots [first, last] of each range are served by 'node', and any
+  // migration of them is over.
+  bool assign(std::string_view node, const std::vector<SlotRange>& ranges);
+  // This node's 'slot' is being moved to 'node'.
+  bool setMigrating(std::uint16_t slot, std::string_view node);
+  // 'slot', served by 'node', is being moved to this node.
+  bool setImporting(std::uint16_t slot, std::string_view node);
+  // Ends a migration of 'slot' without moving it.
+  void setStable(std::uint16_t slot);
+
+  std::vector<SlotRange> slotRanges() const;
+
+  // Held exclusively while MIGRATE moves keys, shared by commands running
+  // in slots this node is migrating away (see route()): a command sees its
+  // keys either all before or all after a move.
+  std::shared_mutex& migrationLock() { return migration_mu_; }
+
+  // Counts a redirection the caller sent.
+  void noteRedirect(Route route);
+
+  Status status() const;
+
+ private:
+  Cluster();
+
+  // Slot table entry: the owner's node index in the low 16 bits, the node
+  // a migration goes to (owner is this node) or comes from (owner is not)
+  // in the high 16.
+  static std::uint32_t pack(std::uint16_t owner, std::uint16_t peer) {
+    return owner | static_cast<std::uint32_t>(peer) << 16;
+  }
+  static std::uint16_t ownerOf(std::uint32_t entry) { return entry & 0xFFFF; }
+  static std::uint16_t peerOf(std::uint32_t entry) { return entry >> 16; }
+
+  // With mu_ held: the index of 'node', added if new; kNoNode if the table
+  // is full or the address malformed.
+  std::uint16_t nodeIndex(std::string_view node);
+
+  bool enabled_ = false;
+  std::mutex mu_;  // serializes changes
+  std::atomic<std::uint32_t> slots_[kClusterSlots];
+  // Append-only: nodes_[i] is written before node_count_ covers it.
+  std::string nodes_[kMaxNodes];
+  std::atomic<std::size_t> node_count_{1};
+  std::shared_mutex migration_mu_;
+  std::atomic<std::uint64_t> moved_{0};
+  std::atomic<std::uint64_t> asked_{0};
+};
+
+}  // namespace async
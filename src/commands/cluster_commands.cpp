@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "commands.h"
+#include "../client/client.h"
+#include "../cluster/cluster.h"
+#include "../multithreading/asyncio.h"
+#include "../persistence/aof.h"
+#include "../storage/kvstore.h"
+#include "../utils/hashslot.h"
+
+namespace async {
+
+namespace {
+
+bool parseSlot(std::string_view arg, std::uint16_t& out) {
+  std::int64_t n = 0;
+  if (!parseInt64(arg, n) || n < 0 || n >= static_cast<std::int64_t>(kClusterSlots)) return false;
+  out = static_cast<std::uint16_t>(n);
+  return true;
+}
+
+// Slots args[from..], or pairs of range bounds when 'ranges'.
+bool parseSlots(const std::vector<std::string_view>& args, std::size_t from, bool ranges,
+                std::vector<Cluster::SlotRange>& out) {
+  if (args.size() <= from || (ranges && (args.size() - from) % 2 != 0)) return false;
+  const std::size_t step = ranges ? 2 : 1;
+  for (std::size_t i = from; i < args.size(); i += step) {
+    Cluster::SlotRange range;
+    if (!parseSlot(args[i], range.first) || !parseSlot(args[i + step - 1], range.last) ||
+        range.first > range.last) {
+      return false;
+    }
+    out.push_back(range);
+  }
+  return true;
+}
+
+std::vector<std::uint16_t> expand(const std::vector<Cluster::SlotRange>& ranges) {
+  std::vector<std::uint16_t> slots;
+  for (const Cluster::SlotRange& range : ranges) {
+    for (std::size_t slot = range.first; slot <= range.last; ++slot) {
+      slots.push_back(static_cast<std::uint16_t>(slot));
+    }
+  }
+  return slots;
+}
+
+// cluster keyslot key: the key's hash slot, in decimal.
+// cluster slots: an array of "first last host:port", one per range of
+//   consecutive slots served by one node.
+// cluster addslots slot... / addslotsrange first last...: unassigned slots
+//   become this node's.
+// cluster delslots slot...: the slots are served by no node.
+// cluster assign host:port first last...: the ranges are served by that
+//   node (this one, if it is its address); how every node is told the map.
+// cluster setslot slot importing|migrating|node host:port, or
+//   setslot slot stable: steps of a slot migration (see Cluster).
+// Everything but keyslot errors unless cluster mode is on.
+void cmdCluster(CommandContext& ctx) {
+  const std::vector<std::string_view>& args = ctx.args;
+  const std::string_view sub = args[1];
+  if (equalsIgnoreCase(sub, "keyslot") && args.size() == 3) {
+    ctx.conn.appendResponse(0, std::to_string(keyHashSlot(args[2])));
+    return;
+  }
+  Cluster& cluster = Cluster::instance();
+  if (!cluster.enabled()) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  if (equalsIgnoreCase(sub, "slots") && args.size() == 2) {
+    ctx.conn.beginArrayResponse();
+    for (const Cluster::SlotRange& range : cluster.slotRanges()) {
+      ctx.conn.appendArrayElement(0, std::to_string(range.first) + " " +
+                                         std::to_string(range.last) + " " + range.node);
+    }
+    ctx.conn.endResponse();
+    return;
+  }
+  bool ok = false;
+  std::vector<Cluster::SlotRange> ranges;
+  if (equalsIgnoreCase(sub, "addslots")) {
+    ok = parseSlots(args, 2, false, ranges) && cluster.addSlots(expand(ranges));
+  } else if (equalsIgnoreCase(sub, "addslotsrange")) {
+    ok = parseSlots(args, 2, true, ranges) && cluster.addSlots(expand(ranges));
+  } else if (equalsIgnoreCase(sub, "delslots")) {
+    ok = parseSlots(args, 2, false, ranges);
+    if (ok) cluster.delSlots(expand(ranges));
+  } else if (equalsIgnoreCase(sub, "assign") && args.size() >= 5) {
+    ok = parseSlots(args, 3, true, ranges) && cluster.assign(args[2], ranges);
+  } else if (equalsIgnoreCase(sub, "setslot") && (args.size() == 4 || args.size() == 5)) {
+    std::uint16_t slot = 0;
+    const std::string_view action = args[3];
+    if (!parseSlot(args[2], slot)) {
+      ok = false;
+    } else if (args.size() == 4) {
+      ok = equalsIgnoreCase(action, "stable");
+      if (ok) cluster.setStable(slot);
+    } else if (equalsIgnoreCase(action, "migrating")) {
+      ok = cluster.setMigrating(slot, args[4]);
+    } else if (equalsIgnoreCase(action, "importing")) {
+      ok = cluster.setImporting(slot, args[4]);
+    } else if (equalsIgnoreCase(action, "node")) {
+      ok = cluster.assign(args[4], {{slot, slot, {}}});
+    }
+  }
+  ctx.conn.appendResponse(ok ? 0 : ResponseStatus::RES_ERR, {});
+}
+
+// asking: lets the next command run in a slot this node is importing.
+void cmdAsking(CommandContext& ctx) {
+  ctx.conn.setAsking();
+  ctx.conn.appendResponse(0, {});
+}
+
+// migrate host port timeout-ms key [key...]: moves the keys that exist to
+// the node at host:port, which must be importing their slot, and replies
+// with how many moved. The keys are sent as the commands that recreate
+// them, each after "asking", and deleted here once the target has them
+// all; until then their shards stay locked, and the event loop waits for
+// the target, up to timeout-ms for the connect and for each read or write
+// (not for the whole command). Errors, leaving the keys here, if the
+// target cannot be reached or rejects a command.
+void cmdMigrate(CommandContext& ctx) {
+  const std::vector<std::string_view>& args = ctx.args;
+  Cluster& cluster = Cluster::instance();
+  std::int64_t port = 0;
+  std::int64_t timeout_ms = 0;
+  if (!cluster.enabled() || !parseInt64(args[2], port) || port < 1 || port > 65535 ||
+      !parseInt64(args[3], timeout_ms) || timeout_ms < 1 || timeout_ms > INT_MAX) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  // This node would wait for itself with the keys locked.
+  if (std::string(args[1]) + ":" + std::string(args[2]) == cluster.self()) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  try {
+    Client target(std::string(args[1]), static_cast<std::uint16_t>(port),
+                  static_cast<int>(timeout_ms));
+
+    Pipeline batch;
+    std::vector<Reply> replies;
+    const std::function<void(const std::string_view*, std::size_t)> emit =
+        [&batch](const std::string_view* command, std::size_t argc) {
+          batch.add({"asking"});
+          batch.add(command, argc);
+        };
+    std::unique_lock<std::shared_mutex> lock(cluster.migrationLock());
+    const std::size_t moved = ctx.store.handOff(
+        &args[4], args.size() - 4,
+        [&emit](std::string_view key, std::string_view value, const Object* object,
+                std::int64_t expire_at) {
+          // Whatever an earlier, failed attempt left there goes first.
+          const std::string_view del[] = {"del", key};
+          emit(del, 2);
+          rewriteKey(key, value, object, expire_at, emit);
+        },
+        [&] {
+          target.exec(batch, replies);
+          return std::all_of(replies.begin(), replies.end(),
+                             [](const Reply& r) { return r.ok() || r.nil(); });
+        });
+    if (moved == 0 && !batch.empty()) {
+      ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+      return;
+    }
+    ctx.conn.appendResponse(0, std::to_string(moved));
+  } catch (const std::runtime_error&) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+  }
+}
+
+}  // namespace
+
+void registerClusterCommands(CommandRegistry& registry) {
+  registry.add({"cluster", cmdCluster, -2, CommandFlag::kAdmin, 0, 0, 0});
+  registry.add({"asking", cmdAsking, 1, 0, 0, 0, 0});
+  registry.add({"migrate", cmdMigrate, -5, CommandFlag::kAdmin, 0, 0, 0});
+}
+
+}  // namespace async
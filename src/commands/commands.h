@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "registry.h"
+
+namespace async {
+
+// Built-in command groups; each registers its handlers with the registry.
+// New commands are added by registering them from one of these (or a new
+// group listed in registerBuiltinCommands).
+void registerStringCommands(CommandRegistry& registry);
+void registerKeyCommands(CommandRegistry& registry);
+void registerServerCommands(CommandRegistry& registry);
+void registerSortedSetCommands(CommandRegistry& registry);
+void registerHashCommands(CommandRegistry& registry);
+void registerListCommands(CommandRegistry& registry);
+void registerReplicationCommands(CommandRegistry& registry);
+void registerClusterCommands(CommandRegistry& registry);
+
+// Registers every group above.
+void registerBuiltinCommands(CommandRegistry& registry);
+
+// Server statistics as INFO text: "# Section" blocks of key:value lines,
+// all sections or only 'section' (case-insensitive). Counters are summed
+// over the event loops at the time of the call.
+std::string renderInfo(const KVStore& store, std::string_view section = {});
+
+// The same statistics in the Prometheus text exposition format.
+std::string renderPrometheus(const KVStore& store);
+
+// Argument helpers shared by handlers.
+
+// Parses a base-10 signed integer that spans the whole argument.
+bool parseInt64(std::string_view arg, std::int64_t& out);
+
+// Parses a floating-point number that spans the whole argument, including
+// "inf", "+inf" and "-inf"; NaN is rejected.
+bool parseDouble(std::string_view arg, double& out);
+
+// ASCII case-insensitive comparison, for option keywords like "PX".
+bool equalsIgnoreCase(std::string_view a, std::string_view b);
+
+}  // namespace async
@@ -0,0 +1,117 @@
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "commands.h"
+#include "../multithreading/asyncio.h"
+#include "../storage/hash.h"
+#include "../storage/kvstore.h"
+
+namespace async {
+
+namespace {
+
+using KeyResult = KVStore::KeyResult;
+
+// hset key field value [field value ...]: replies with the number of fields
+// that were new.
+void cmdHset(CommandContext& ctx) {
+  const std::vector<std::string_view>& args = ctx.args;
+  if (args.size() % 2 != 0) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  std::size_t added = 0;
+  const KeyResult result = ctx.store.writeObject<Hash>(
+      args[1], true, args.data(), args.size(), [&](Hash& hash) {
+        for (std::size_t i = 2; i < args.size(); i += 2) {
+          if (hash.set(args[i], args[i + 1])) ++added;
+        }
+        return true;
+      });
+  if (result == KeyResult::WrongType) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  ctx.conn.appendResponse(0, std::to_string(added));
+}
+
+// hget key field: RES_NX if the field (or key) does not exist.
+void cmdHget(CommandContext& ctx) {
+  Connection& conn = ctx.conn;
+  bool found = false;
+  const KeyResult result = ctx.store.readObject<Hash>(ctx.args[1], [&](const Hash& hash) {
+    std::string_view value;
+    found = hash.get(ctx.args[2], value);
+    // Copied into the output while the shard lock still holds it in place.
+    if (found) conn.appendResponse(0, value);
+  });
+  if (result == KeyResult::WrongType) {
+    conn.appendResponse(ResponseStatus::RES_ERR, {});
+  } else if (!found) {
+    conn.appendResponse(ResponseStatus::RES_NX, {});
+  }
+}
+
+// hgetall key: an array of field, value, field, value, ...; empty for a
+// missing key.
+void cmdHgetall(CommandContext& ctx) {
+  Connection& conn = ctx.conn;
+  const KeyResult result = ctx.store.readObject<Hash>(ctx.args[1], [&](const Hash& hash) {
+    conn.beginArrayResponse();
+    hash.forEach([&conn](std::string_view field, std::string_view value) {
+      conn.appendArrayElement(0, field);
+      conn.appendArrayElement(0, value);
+    });
+    conn.endResponse();
+  });
+  if (result == KeyResult::WrongType) {
+    conn.appendResponse(ResponseStatus::RES_ERR, {});
+  } else if (result == KeyResult::Missing) {
+    conn.beginArrayResponse();
+    conn.endResponse();
+  }
+}
+
+// hdel key field [field ...]: replies with the number removed.
+void cmdHdel(CommandContext& ctx) {
+  const std::vector<std::string_view>& args = ctx.args;
+  std::size_t removed = 0;
+  const KeyResult result = ctx.store.writeObject<Hash>(
+      args[1], false, args.data(), args.size(), [&](Hash& hash) {
+        for (std::size_t i = 2; i < args.size(); ++i) {
+          if (hash.remove(args[i])) ++removed;
+        }
+        return removed > 0;
+      });
+  if (result == KeyResult::WrongType) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  ctx.conn.appendResponse(0, std::to_string(removed));
+}
+
+// hlen key: the number of fields, 0 for a missing key.
+void cmdHlen(CommandContext& ctx) {
+  std::size_t size = 0;
+  const KeyResult result =
+      ctx.store.readObject<Hash>(ctx.args[1], [&](const Hash& hash) { size = hash.size(); });
+  if (result == KeyResult::WrongType) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  ctx.conn.appendResponse(0, std::to_string(size));
+}
+
+}  // namespace
+
+void registerHashCommands(CommandRegistry& registry) {
+  registry.add({"hset", cmdHset, -4, CommandFlag::kWrite | CommandFlag::kDenyOom, 1, 1, 1});
+  registry.add({"hget", cmdHget, 3, CommandFlag::kRead, 1, 1, 1});
+  registry.add({"hgetall", cmdHgetall, 2, CommandFlag::kRead, 1, 1, 1});
+  registry.add({"hdel", cmdHdel, -3, CommandFlag::kWrite, 1, 1, 1});
+  registry.add({"hlen", cmdHlen, 2, CommandFlag::kRead, 1, 1, 1});
+}
+
+}  // namespace async
@@ -0,0 +1,205 @@
+#include <charconv>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "commands.h"
+#include "../multithreading/asyncio.h"
+#include "../storage/kvstore.h"
+#include "../utils/hashslot.h"
+#include "../utils/utils.h"
+
+namespace async {
+
+namespace {
+
+// expire/pexpire key <ttl>: 'unit_ms' converts the argument to milliseconds.
+void setRelativeExpiry(CommandContext& ctx, int64_t unit_ms) {
+  int64_t ttl = 0;
+  const int64_t now = unix_time_ms();
+  // A deadline outside int64_t is an invalid expire time, as in Redis.
+  if (!parseInt64(ctx.args[2], ttl) || ttl > (INT64_MAX - now) / unit_ms ||
+      ttl < (INT64_MIN + now) / unit_ms) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  // A non-positive TTL deletes the key, as in Redis.
+  const bool existed = ctx.store.expireAt(ctx.args[1], now + ttl * unit_ms);
+  ctx.conn.appendResponse(existed ? 0 : ResponseStatus::RES_NX, {});
+}
+
+void cmdExpire(CommandContext& ctx) { setRelativeExpiry(ctx, 1000); }
+
+void cmdPexpire(CommandContext& ctx) { setRelativeExpiry(ctx, 1); }
+
+// expireat/pexpireat key <unix time>, in seconds or milliseconds.
+void setAbsoluteExpiry(CommandContext& ctx, int64_t unit_ms) {
+  int64_t when = 0;
+  if (!parseInt64(ctx.args[2], when) || when > INT64_MAX / unit_ms ||
+      when < -INT64_MAX / unit_ms) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  const bool existed = ctx.store.expireAt(ctx.args[1], when * unit_ms);
+  ctx.conn.appendResponse(existed ? 0 : ResponseStatus::RES_NX, {});
+}
+
+void cmdExpireat(CommandContext& ctx) { setAbsoluteExpiry(ctx, 1000); }
+
+void cmdPexpireat(CommandContext& ctx) { setAbsoluteExpiry(ctx, 1); }
+
+// ttl/pttl key: replies with the remaining time as a decimal string, -1 for
+// keys without expiry, and RES_NX for missing keys.
+void replyTtl(CommandContext& ctx, int64_t unit_ms) {
+  int64_t remaining = 0;
+  if (!ctx.store.ttl(ctx.args[1], remaining)) {
+    ctx.conn.appendResponse(ResponseStatus::RES_NX, {});
+    return;
+  }
+  // Round up so a key with any time left never reports 0 seconds.
+  if (remaining > 0) remaining = (remaining + unit_ms - 1) / unit_ms;
+  ctx.conn.appendResponse(0, std::to_string(remaining));
+}
+
+void cmdTtl(CommandContext& ctx) { replyTtl(ctx, 1000); }
+
+void cmdPttl(CommandContext& ctx) { replyTtl(ctx, 1); }
+
+void cmdPersist(CommandContext& ctx) {
+  const bool existed = ctx.store.persist(ctx.args[1]);
+  ctx.conn.appendResponse(existed ? 0 : ResponseStatus::RES_NX, {});
+}
+
+// type key: "string", "zset", ..., or "none" for missing keys.
+void cmdType(CommandContext& ctx) {
+  ValueType type;
+  ctx.conn.appendResponse(0, ctx.store.type(ctx.args[1], type) ? valueTypeName(type) : "none");
+}
+
+// Matches the one-character token at pattern[p] ('?', a "[...]" class, an
+// escaped or a plain character) against c, and sets 'next' past it.
+bool matchToken(std::string_view pattern, std::size_t p, char c, std::size_t& next) {
+  const auto uc = static_cast<unsigned char>(c);
+  if (pattern[p] == '?') {
+    next = p + 1;
+    return true;
+  }
+  if (pattern[p] == '\\' && p + 1 < pattern.size()) {
+    next = p + 2;
+    return pattern[p + 1] == c;
+  }
+  if (pattern[p] != '[') {
+    next = p + 1;
+    return pattern[p] == c;
+  }
+  std::size_t i = p + 1;
+  const bool negate = i < pattern.size() && pattern[i] == '^';
+  if (negate) ++i;
+  bool match = false;
+  for (; i < pattern.size() && pattern[i] != ']'; ++i) {
+    if (pattern[i] == '\\' && i + 1 < pattern.size()) {
+      match |= pattern[++i] == c;
+    } else if (i + 2 < pattern.size() && pattern[i + 1] == '-' && pattern[i + 2] != ']') {
+      auto lo = static_cast<unsigned char>(pattern[i]);
+      auto hi = static_cast<unsigned char>(pattern[i + 2]);
+      if (lo > hi) std::swap(lo, hi);
+      match |= uc >= lo && uc <= hi;
+      i += 2;
+    } else {
+      match |= pattern[i] == c;
+    }
+  }
+  // An unterminated class runs to the end of the pattern.
+  next = i < pattern.size() ? i + 1 : i;
+  return match != negate;
+}
+
+// Glob-style match of the whole key, as Redis's MATCH: '*', '?', "[abc]",
+// "[^a-z]" and backslash escapes. Every token but '*' takes one character, so
+// backtracking to the last '*' is enough.
+bool globMatch(std::string_view pattern, std::string_view str) {
+  std::size_t p = 0;
+  std::size_t s = 0;
+  std::size_t star = std::string_view::npos;
+  std::size_t star_s = 0;
+  while (s < str.size()) {
+    std::size_t next = 0;
+    if (p < pattern.size() && pattern[p] == '*') {
+      star = ++p;
+      star_s = s;
+    } else if (p < pattern.size() && matchToken(pattern, p, str[s], next)) {
+      p = next;
+      ++s;
+    } else if (star == std::string_view::npos) {
+      return false;
+    } else {
+      p = star;
+      s = ++star_s;
+    }
+  }
+  while (p < pattern.size() && pattern[p] == '*') ++p;
+  return p == pattern.size();
+}
+
+// scan cursor [MATCH pattern] [COUNT n] [SLOT s]: replies with an array of
+// the cursor to pass next (0 once the walk is complete) followed by keys.
+// COUNT (default 10) bounds the work per call; MATCH and SLOT (the cluster
+// hash slot, for migrating one) filter the keys read, so a call may return
+// fewer than COUNT, or none, before the end.
+void cmdScan(CommandContext& ctx) {
+  const std::vector<std::string_view>& args = ctx.args;
+  uint64_t cursor = 0;
+  const auto res = std::from_chars(args[1].data(), args[1].data() + args[1].size(), cursor);
+  bool ok = res.ec == std::errc() && res.ptr == args[1].data() + args[1].size();
+  std::string_view pattern;
+  bool match = false;
+  int64_t count = 10;
+  int64_t slot = -1;
+  for (std::size_t i = 2; ok && i < args.size(); i += 2) {
+    if (i + 1 == args.size()) {
+      ok = false;
+    } else if (equalsIgnoreCase(args[i], "match")) {
+      pattern = args[i + 1];
+      match = pattern != "*";
+    } else if (equalsIgnoreCase(args[i], "count")) {
+      ok = parseInt64(args[i + 1], count) && count > 0;
+    } else if (equalsIgnoreCase(args[i], "slot")) {
+      ok = parseInt64(args[i + 1], slot) && slot >= 0 &&
+           slot < static_cast<int64_t>(kClusterSlots);
+    } else {
+      ok = false;
+    }
+  }
+  if (!ok) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  std::vector<std::string> keys;
+  cursor = ctx.store.scan(cursor, static_cast<std::size_t>(count), [&](std::string_view key) {
+    if ((!match || globMatch(pattern, key)) && (slot < 0 || keyHashSlot(key) == slot)) {
+      keys.emplace_back(key);
+    }
+  });
+  ctx.conn.beginArrayResponse();
+  ctx.conn.appendArrayElement(0, std::to_string(cursor));
+  for (const std::string& key : keys) ctx.conn.appendArrayElement(0, key);
+  ctx.conn.endResponse();
+}
+
+}  // namespace
+
+void registerKeyCommands(CommandRegistry& registry) {
+  registry.add({"expire", cmdExpire, 3, CommandFlag::kWrite, 1, 1, 1});
+  registry.add({"pexpire", cmdPexpire, 3, CommandFlag::kWrite, 1, 1, 1});
+  registry.add({"expireat", cmdExpireat, 3, CommandFlag::kWrite, 1, 1, 1});
+  registry.add({"pexpireat", cmdPexpireat, 3, CommandFlag::kWrite, 1, 1, 1});
+  registry.add({"ttl", cmdTtl, 2, CommandFlag::kRead, 1, 1, 1});
+  registry.add({"pttl", cmdPttl, 2, CommandFlag::kRead, 1, 1, 1});
+  registry.add({"persist", cmdPersist, 2, CommandFlag::kWrite, 1, 1, 1});
+  registry.add({"type", cmdType, 2, CommandFlag::kRead, 1, 1, 1});
+  registry.add({"scan", cmdScan, -2, CommandFlag::kRead, 0, 0, 0});
+}
+
+}  // namespace async
@@ -0,0 +1,124 @@
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "commands.h"
+#include "../multithreading/asyncio.h"
+#include "../storage/kvstore.h"
+#include "../storage/list.h"
+
+namespace async {
+
+namespace {
+
+using KeyResult = KVStore::KeyResult;
+
+// lpush/rpush key value [value ...]: replies with the new length. LPUSH
+// adds each value at the head in turn, so they end up in reverse order.
+void pushValues(CommandContext& ctx, bool front) {
+  const std::vector<std::string_view>& args = ctx.args;
+  std::size_t length = 0;
+  const KeyResult result = ctx.store.writeObject<List>(
+      args[1], true, args.data(), args.size(), [&](List& list) {
+        for (std::size_t i = 2; i < args.size(); ++i) {
+          if (front) {
+            list.pushFront(args[i]);
+          } else {
+            list.pushBack(args[i]);
+          }
+        }
+        length = list.size();
+        return true;
+      });
+  if (result == KeyResult::WrongType) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  ctx.conn.appendResponse(0, std::to_string(length));
+}
+
+void cmdLpush(CommandContext& ctx) { pushValues(ctx, true); }
+
+void cmdRpush(CommandContext& ctx) { pushValues(ctx, false); }
+
+// lpop/rpop key: the removed element, or RES_NX for a missing key.
+void popValue(CommandContext& ctx, bool front) {
+  std::string value;
+  bool popped = false;
+  const KeyResult result = ctx.store.writeObject<List>(
+      ctx.args[1], false, ctx.args.data(), ctx.args.size(), [&](List& list) {
+        popped = front ? list.popFront(value) : list.popBack(value);
+        return popped;
+      });
+  if (result == KeyResult::WrongType) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+  } else if (!popped) {
+    ctx.conn.appendResponse(ResponseStatus::RES_NX, {});
+  } else {
+    ctx.conn.appendResponse(0, value);
+  }
+}
+
+void cmdLpop(CommandContext& ctx) { popValue(ctx, true); }
+
+void cmdRpop(CommandContext& ctx) { popValue(ctx, false); }
+
+// lrange key start stop: elements start..stop inclusive; negative indexes
+// count from the end, as in Redis.
+void cmdLrange(CommandContext& ctx) {
+  int64_t start = 0;
+  int64_t stop = 0;
+  if (!parseInt64(ctx.args[2], start) || !parseInt64(ctx.args[3], stop)) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  Connection& conn = ctx.conn;
+  const KeyResult result = ctx.store.readObject<List>(ctx.args[1], [&](const List& list) {
+    const int64_t n = static_cast<int64_t>(list.size());
+    int64_t from = start < 0 ? start + n : start;
+    int64_t to = stop < 0 ? stop + n : stop;
+    if (from < 0) from = 0;
+    if (to >= n) to = n - 1;
+    conn.beginArrayResponse();
+    if (from <= to) {
+      int64_t left = to - from + 1;
+      list.range(static_cast<std::size_t>(from), [&](std::string_view value) {
+        conn.appendArrayElement(0, value);
+        return --left > 0;
+      });
+    }
+    conn.endResponse();
+  });
+  if (result == KeyResult::WrongType) {
+    conn.appendResponse(ResponseStatus::RES_ERR, {});
+  } else if (result == KeyResult::Missing) {
+    conn.beginArrayResponse();
+    conn.endResponse();
+  }
+}
+
+// llen key: the length, 0 for a missing key.
+void cmdLlen(CommandContext& ctx) {
+  std::size_t size = 0;
+  const KeyResult result =
+      ctx.store.readObject<List>(ctx.args[1], [&](const List& list) { size = list.size(); });
+  if (result == KeyResult::WrongType) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  ctx.conn.appendResponse(0, std::to_string(size));
+}
+
+}  // namespace
+
+void registerListCommands(CommandRegistry& registry) {
+  registry.add({"lpush", cmdLpush, -3, CommandFlag::kWrite | CommandFlag::kDenyOom, 1, 1, 1});
+  registry.add({"rpush", cmdRpush, -3, CommandFlag::kWrite | CommandFlag::kDenyOom, 1, 1, 1});
+  registry.add({"lpop", cmdLpop, 2, CommandFlag::kWrite, 1, 1, 1});
+  registry.add({"rpop", cmdRpop, 2, CommandFlag::kWrite, 1, 1, 1});
+  registry.add({"lrange", cmdLrange, 4, CommandFlag::kRead, 1, 1, 1});
+  registry.add({"llen", cmdLlen, 2, CommandFlag::kRead, 1, 1, 1});
+}
+
+}  // namespace async
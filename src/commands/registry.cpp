@@ -0,0 +1,128 @@
+#include "registry.h"
+
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "commands.h"
+
+namespace async {
+
+void registerBuiltinCommands(CommandRegistry& registry) {
+  registerStringCommands(registry);
+  registerKeyCommands(registry);
+  registerServerCommands(registry);
+  registerSortedSetCommands(registry);
+  registerHashCommands(registry);
+  registerListCommands(registry);
+  registerReplicationCommands(registry);
+  registerClusterCommands(registry);
+}
+
+bool parseInt64(std::string_view arg, std::int64_t& out) {
+  if (arg.empty() || arg.size() > 20) return false;
+  const auto res = std::from_chars(arg.data(), arg.data() + arg.size(), out);
+  return res.ec == std::errc() && res.ptr == arg.data() + arg.size();
+}
+
+bool parseDouble(std::string_view arg, double& out) {
+  if (arg.empty() || arg.size() > 64) return false;
+  // strtod wants a terminated string; it also takes "inf" and "+inf".
+  char buf[65];
+  std::memcpy(buf, arg.data(), arg.size());
+  buf[arg.size()] = '\0';
+  if (std::isspace(static_cast<unsigned char>(buf[0]))) return false;
+  char* end = nullptr;
+  out = std::strtod(buf, &end);
+  return end == buf + arg.size() && !std::isnan(out);
+}
+
+bool equalsIgnoreCase(std::string_view a, std::string_view b) {
+  if (a.size() != b.size()) return false;
+  for (std::size_t i = 0; i < a.size(); ++i) {
+    if (std::tolower(static_cast<unsigned char>(a[i])) !=
+        std::tolower(static_cast<unsigned char>(b[i]))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+CommandRegistry::CommandRegistry() : table_(1, nullptr) {}
+
+CommandRegistry::~CommandRegistry() {
+  for (std::atomic<CommandStats*>& slot : slots_) delete[] slot.load();
+}
+
+CommandRegistry& CommandRegistry::instance() {
+  static CommandRegistry* registry = [] {
+    auto* r = new CommandRegistry();
+    registerBuiltinCommands(*r);
+    return r;
+  }();
+  return *registry;
+}
+
+void CommandRegistry::add(const CommandSpec& spec) {
+  if (find(spec.name)) {
+    throw std::runtime_error(std::string("duplicate command: ") + spec.name);
+  }
+  if (commands_.size() == kMaxCommands) {
+    throw std::runtime_error("too many commands");
+  }
+  storage_.push_back(std::make_unique<Command>(Command{spec, commands_.size()}));
+  commands_.push_back(storage_.back().get());
+  rebuildTable();
+}
+
+void CommandRegistry::rebuildTable() {
+  // Keep the table at most 1/4 full so a collision-free seed is found fast.
+  std::size_t size = 1;
+  while (size < commands_.size() * 4) size <<= 1;
+
+  for (std::uint64_t seed = 1;; ++seed) {
+    std::vector<const Command*> table(size, nullptr);
+    bool ok = true;
+    for (const Command* cmd : commands_) {
+      const Command*& slot = table[hashName(cmd->spec.name, seed) & (size - 1)];
+      if (slot) {
+        ok = false;
+        break;
+      }
+      slot = cmd;
+    }
+    if (!ok) continue;
+    table_ = std::move(table);
+    seed_ = seed;
+    mask_ = size - 1;
+    return;
+  }
+}
+
+CommandStats* CommandRegistry::statsSlot(std::size_t slot) {
+  CommandStats* stats = slots_[slot].load(std::memory_order_acquire);
+  if (stats) return stats;
+  auto* fresh = new CommandStats[kMaxCommands]();
+  if (slots_[slot].compare_exchange_strong(stats, fresh, std::memory_order_acq_rel)) return fresh;
+  delete[] fresh;  // another thread attached the slot first
+  return stats;
+}
+
+LatencyTotals CommandRegistry::totals(const Command& cmd) const {
+  LatencyTotals t;
+  for (const std::atomic<CommandStats*>& slot : slots_) {
+    const CommandStats* stats = slot.load(std::memory_order_acquire);
+    if (!stats) continue;
+    const CommandStats& s = stats[cmd.id];
+    t.add(s.latency, s.calls.load(std::memory_order_relaxed),
+          s.nanos.load(std::memory_order_relaxed));
+  }
+  return t;
+}
+
+}  // namespace async
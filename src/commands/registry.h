@@ -0,0 +1,149 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../utils/stats.h"
+
+namespace async {
+
+class Connection;
+class KVStore;
+
+namespace CommandFlag {
+inline constexpr std::uint32_t kRead = 1u << 0;   // reads the keyspace
+inline constexpr std::uint32_t kWrite = 1u << 1;  // mutates the keyspace
+inline constexpr std::uint32_t kAdmin = 1u << 2;  // server administration
+// May allocate; rejected while over maxmemory and eviction cannot free room.
+inline constexpr std::uint32_t kDenyOom = 1u << 3;
+}  // namespace CommandFlag
+
+// Everything a handler needs to execute one request.
+struct CommandContext {
+  KVStore& store;
+  // args[0] is the command name; views are valid for the handler call only.
+  const std::vector<std::string_view>& args;
+  Connection& conn;
+  // Set when the request was too large to buffer and its arguments were
+  // received into owned strings; args[i] views owned->at(i).
+  std::vector<std::string>* owned = nullptr;
+
+  // Argument i as a string the handler may move from (e.g. into the
+  // store), or nullptr if the request was parsed in place. Once moved
+  // from, args[i] must not be used.
+  std::string* takeArg(std::size_t i) const { return owned ? &(*owned)[i] : nullptr; }
+};
+
+using CommandHandler = void (*)(CommandContext& ctx);
+
+// Static description of a command, as registered.
+struct CommandSpec {
+  const char* name;
+  CommandHandler handler;
+  // Redis convention: N > 0 means exactly N arguments (name included),
+  // -N means at least N.
+  int arity;
+  std::uint32_t flags;
+  // Key arguments, as in Redis's command table: every key_step-th from
+  // first_key to last_key (negative: from the end, -1 being the last
+  // argument). first_key 0: no keys. Cluster mode routes by them.
+  int first_key;
+  int last_key;
+  int key_step;
+};
+
+// Call statistics for one command in one stats slot. Each slot has a single
+// writer (one event loop), so updates are plain relaxed load/store pairs and
+// never bounce cache lines between loops; readers sum all slots.
+struct CommandStats {
+  std::atomic<std::uint64_t> calls{0};
+  std::atomic<std::uint64_t> nanos{0};
+  LatencyBuckets latency;
+
+  void record(std::uint64_t ns) {
+    bump(calls);
+    bump(nanos, ns);
+    latency.record(ns);
+  }
+};
+
+struct Command {
+  CommandSpec spec;
+  std::size_t id = 0;  // dense index, used for stats slots
+
+  bool arityOk(std::size_t argc) const {
+    return spec.arity >= 0 ? argc == static_cast<std::size_t>(spec.arity)
+                           : argc >= static_cast<std::size_t>(-spec.arity);
+  }
+};
+
+// Maps command names to handlers. Lookup is one hash and one comparison:
+// after every registration the name table is rebuilt with a seed that makes
+// the hash collision-free (a perfect hash over the registered names).
+//
+// Registration happens at startup, before event loops run; lookups and
+// stats updates are safe from any number of loops afterwards.
+class CommandRegistry {
+ public:
+  // Number of independent stats slots, i.e. the maximum number of event
+  // loops that can record statistics without sharing a slot.
+  static constexpr std::size_t kMaxStatSlots = async::kMaxStatSlots;
+
+  CommandRegistry();
+  ~CommandRegistry();
+  CommandRegistry(const CommandRegistry&) = delete;
+  CommandRegistry& operator=(const CommandRegistry&) = delete;
+
+  // Process-wide registry with all built-in commands registered.
+  static CommandRegistry& instance();
+
+  // Adds a command. Throws std::runtime_error on a duplicate name.
+  void add(const CommandSpec& spec);
+
+  // Returns the command called 'name', or nullptr.
+  const Command* find(std::string_view name) const {
+    const Command* cmd = table_[hashName(name, seed_) & mask_];
+    return cmd && name == cmd->spec.name ? cmd : nullptr;
+  }
+
+  // Statistics of every command in 'slot', indexed by Command::id. Slots
+  // are allocated on first use, so idle slots cost no memory; the pointer
+  // stays valid for the registry's lifetime. Safe to call concurrently.
+  CommandStats* statsSlot(std::size_t slot);
+
+  CommandStats& stats(std::size_t slot, const Command& cmd) { return statsSlot(slot)[cmd.id]; }
+
+  // Sum of one command's statistics over all slots.
+  LatencyTotals totals(const Command& cmd) const;
+
+  const std::vector<Command*>& commands() const { return commands_; }
+
+ private:
+  static constexpr std::size_t kMaxCommands = 128;
+
+  // FNV-1a, seeded.
+  static std::uint64_t hashName(std::string_view name, std::uint64_t seed) {
+    std::uint64_t h = 1469598103934665603ull ^ seed;
+    for (char c : name) {
+      h ^= static_cast<unsigned char>(c);
+      h *= 1099511628211ull;
+    }
+    return h ^ (h >> 29);
+  }
+
+  void rebuildTable();
+
+  std::vector<std::unique_ptr<Command>> storage_;
+  std::vector<Command*> commands_;
+  std::vector<const Command*> table_;
+  std::uint64_t seed_ = 0;
+  std::size_t mask_ = 0;
+  std::atomic<CommandStats*> slots_[kMaxStatSlots] = {};
+};
+
+}  // namespace async
@@ -0,0 +1,71 @@
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+
+#include "commands.h"
+#include "../multithreading/asyncio.h"
+#include "../replication/replication.h"
+
+namespace async {
+
+namespace {
+
+// psync replid offset [listening-port]: sent by a replica; the connection
+// leaves the event loop and becomes its replication link (see
+// Replication). Errors if replication is off or an argument is malformed.
+void cmdPsync(CommandContext& ctx) {
+  const std::vector<std::string_view>& args = ctx.args;
+  Replication& replication = Replication::instance();
+  std::int64_t offset = 0;
+  std::int64_t port = 0;
+  if (!replication.enabled() || args.size() > 4 || !parseInt64(args[2], offset) || offset < 0 ||
+      (args.size() == 4 && (!parseInt64(args[3], port) || port < 0 || port > 65535))) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  const int fd = ::fcntl(ctx.conn.getFd(), F_DUPFD_CLOEXEC, 0);
+  if (fd < 0) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  // The loop closes its descriptor; the socket stays open through 'fd',
+  // and the sender thread replies.
+  ctx.conn.markClosed();
+  replication.addReplica(fd, args[1], static_cast<std::uint64_t>(offset), static_cast<int>(port));
+}
+
+// replicaof host port: replicates from that primary, replacing the keyspace
+// once synced; replicaof no one: stops and accepts writes again. Replies
+// once the link to the previous primary, if any, has stopped.
+void cmdReplicaof(CommandContext& ctx) {
+  const std::vector<std::string_view>& args = ctx.args;
+  Replication& replication = Replication::instance();
+  if (!replication.enabled()) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  if (equalsIgnoreCase(args[1], "no") && equalsIgnoreCase(args[2], "one")) {
+    replication.promote();
+    ctx.conn.appendResponse(0, {});
+    return;
+  }
+  std::int64_t port = 0;
+  if (args[1].empty() || !parseInt64(args[2], port) || port < 1 || port > 65535) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  replication.replicaOf(std::string(args[1]), static_cast<int>(port));
+  ctx.conn.appendResponse(0, {});
+}
+
+}  // namespace
+
+void registerReplicationCommands(CommandRegistry& registry) {
+  registry.add({"psync", cmdPsync, -3, CommandFlag::kAdmin, 0, 0, 0});
+  registry.add({"replicaof", cmdReplicaof, 3, CommandFlag::kAdmin, 0, 0, 0});
+}
+
+}  // namespace async
@@ -0,0 +1,454 @@
+#include <algorithm>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+#include <unistd.h>
+
+#include "commands.h"
+#include "../cluster/cluster.h"
+#include "../multithreading/asyncio.h"
+#include "../persistence/aof.h"
+#include "../persistence/snapshot.h"
+#include "../replication/replication.h"
+#include "../storage/kvstore.h"
+#include "../storage/lazyfree.h"
+#include "../utils/slowlog.h"
+#include "../utils/stats.h"
+#include "../utils/utils.h"
+
+namespace async {
+
+namespace {
+
+void appendf(std::string& out, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+void appendf(std::string& out, const char* fmt, ...) {
+  char buf[512];
+  va_list ap;
+  va_start(ap, fmt);
+  const int n = std::vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  if (n > 0) out.append(buf, static_cast<std::size_t>(n) < sizeof(buf) ? n : sizeof(buf) - 1);
+}
+
+unsigned long long ull(std::uint64_t v) { return static_cast<unsigned long long>(v); }
+
+double usec(std::uint64_t ns) { return static_cast<double>(ns) / 1000.0; }
+
+// Everything INFO and the metrics endpoint report, collected in one pass.
+struct Snapshot {
+  LoopTotals loops = LoopTotals::collect();
+  std::uint64_t commands = 0;
+  std::size_t keys = 0;
+
+  explicit Snapshot(const KVStore& store) : keys(store.size()) {
+    CommandRegistry& registry = CommandRegistry::instance();
+    for (const Command* cmd : registry.commands()) commands += registry.totals(*cmd).count;
+  }
+};
+
+bool wantSection(std::string_view filter, std::string_view name) {
+  return filter.empty() || equalsIgnoreCase(filter, "all") || equalsIgnoreCase(filter, "default") ||
+         equalsIgnoreCase(filter, name);
+}
+
+// ping [message]: replies with the message, or "PONG". Primaries also
+// send it down idle replication links.
+void cmdPing(CommandContext& ctx) {
+  if (ctx.args.size() > 2) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  ctx.conn.appendResponse(0, ctx.args.size() > 1 ? ctx.args[1] : std::string_view("PONG"));
+}
+
+// info [section]: Redis-style "# Section" blocks of key:value lines.
+void cmdInfo(CommandContext& ctx) {
+  const std::string_view section = ctx.args.size() > 1 ? ctx.args[1] : std::string_view();
+  if (ctx.args.size() > 2) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  ctx.conn.appendResponse(0, renderInfo(ctx.store, section));
+}
+
+// slowlog get [N] | len | reset. The protocol has no arrays, so GET
+// replies with text: one entry per line, newest first.
+void cmdSlowlog(CommandContext& ctx) {
+  SlowLog& log = SlowLog::instance();
+  const std::string_view sub = ctx.args[1];
+  if (equalsIgnoreCase(sub, "get") && ctx.args.size() <= 3) {
+    std::int64_t n = 10;
+    if (ctx.args.size() == 3 && (!parseInt64(ctx.args[2], n) || n < 0)) {
+      ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+      return;
+    }
+    std::string out;
+    for (const SlowLog::Entry& e : log.get(static_cast<std::size_t>(n))) {
+      appendf(out, "id=%llu time=%lld duration_us=%.0f argc=%u bytes=%llu args=", ull(e.id),
+              static_cast<long long>(e.time_ms / 1000), usec(e.duration_ns), e.argc,
+              ull(e.request_bytes));
+      out += e.args;
+      out += "\r\n";
+    }
+    ctx.conn.appendResponse(0, out);
+  } else if (equalsIgnoreCase(sub, "len") && ctx.args.size() == 2) {
+    ctx.conn.appendResponse(0, std::to_string(log.len()));
+  } else if (equalsIgnoreCase(sub, "reset") && ctx.args.size() == 2) {
+    log.reset();
+    ctx.conn.appendResponse(0, {});
+  } else {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+  }
+}
+
+// bgrewriteaof: starts compacting the AOF in the background. Errors if AOF
+// is off or a rewrite is already running.
+void cmdBgrewriteaof(CommandContext& ctx) {
+  const bool started = AppendOnlyFile::instance().rewrite();
+  ctx.conn.appendResponse(started ? 0 : ResponseStatus::RES_ERR, {});
+}
+
+// save: writes a snapshot and replies once it is on disk. bgsave: starts
+// one in the background. Both error if snapshots are off or one is
+// already being written; save also if it failed.
+void cmdSave(CommandContext& ctx) {
+  const bool ok = SnapshotFile::instance().save();
+  ctx.conn.appendResponse(ok ? 0 : ResponseStatus::RES_ERR, {});
+}
+
+void cmdBgsave(CommandContext& ctx) {
+  const bool started = SnapshotFile::instance().bgsave();
+  ctx.conn.appendResponse(started ? 0 : ResponseStatus::RES_ERR, {});
+}
+
+}  // namespace
+
+std::string renderInfo(const KVStore& store, std::string_view section) {
+  const Snapshot snap(store);
+  const LoopTotals& loops = snap.loops;
+  std::string out;
+
+  if (wantSection(section, "server")) {
+    appendf(out, "# Server\r\n");
+    appendf(out, "process_id:%d\r\n", static_cast<int>(::getpid()));
+    appendf(out, "uptime_in_seconds:%lld\r\n",
+            static_cast<long long>((unix_time_ms() - processStartMs()) / 1000));
+    appendf(out, "event_loops:%llu\r\n", ull(loops.loops));
+    appendf(out, "\r\n");
+  }
+  if (wantSection(section, "clients")) {
+    appendf(out, "# Clients\r\n");
+    appendf(out, "connected_clients:%llu\r\n",
+            ull(loops.connections_accepted - loops.connections_closed));
+    appendf(out, "\r\n");
+  }
+  if (wantSection(section, "memory")) {
+    appendf(out, "# Memory\r\n");
+    appendf(out, "used_memory:%zu\r\n", store.usedMemory());
+    appendf(out, "maxmemory:%zu\r\n", store.maxMemory());
+    appendf(out, "maxmemory_policy:%s\r\n", evictionPolicyName(store.evictionPolicy()));
+    appendf(out, "buffer_memory:%llu\r\n", ull(loops.buffer_bytes));
+    appendf(out, "lazyfree_enabled:%d\r\n", store.lazyFreeEnabled() ? 1 : 0);
+    appendf(out, "lazyfree_pending_memory:%zu\r\n", store.lazyFree().pendingBytes());
+    appendf(out, "lazyfree_pending_objects:%zu\r\n", store.lazyFree().pendingValues());
+    appendf(out, "\r\n");
+  }
+  if (wantSection(section, "persistence")) {
+    const AppendOnlyFile::Status aof = AppendOnlyFile::instance().status();
+    appendf(out, "# Persistence\r\n");
+    appendf(out, "aof_enabled:%d\r\n", aof.enabled ? 1 : 0);
+    if (aof.enabled) {
+      appendf(out, "aof_fsync:%s\r\n", fsyncPolicyName(aof.fsync));
+      appendf(out, "aof_rewrite_in_progress:%d\r\n", aof.rewrite_in_progress ? 1 : 0);
+      appendf(out, "aof_rewrites:%llu\r\n", ull(aof.rewrites));
+      appendf(out, "aof_last_bgrewrite_status:%s\r\n", aof.last_rewrite_ok ? "ok" : "err");
+      appendf(out, "aof_last_write_status:%s\r\n", aof.last_write_ok ? "ok" : "err");
+      appendf(out, "aof_current_size:%llu\r\n", ull(aof.current_size));
+      appendf(out, "aof_base_size:%llu\r\n", ull(aof.base_size));
+      appendf(out, "aof_buffer_length:%llu\r\n", ull(aof.buffered));
+      appendf(out, "aof_delayed_fsync:%llu\r\n", ull(aof.delayed_fsyncs));
+    }
+    const SnapshotFile::Status rdb = SnapshotFile::instance().status();
+    appendf(out, "rdb_enabled:%d\r\n", rdb.enabled ? 1 : 0);
+    if (rdb.enabled) {
+      appendf(out, "rdb_bgsave_in_progress:%d\r\n", rdb.in_progress ? 1 : 0);
+      appendf(out, "rdb_saves:%llu\r\n", ull(rdb.saves));
+      appendf(out, "rdb_last_save_time:%lld\r\n",
+              static_cast<long long>(rdb.last_save_time_ms / 1000));
+      appendf(out, "rdb_last_bgsave_status:%s\r\n", rdb.last_ok ? "ok" : "err");
+      appendf(out, "rdb_last_bgsave_time_ms:%llu\r\n", ull(rdb.last_duration_ms));
+      appendf(out, "rdb_last_save_keys:%llu\r\n", ull(rdb.last_keys));
+      appendf(out, "rdb_last_save_size:%llu\r\n", ull(rdb.last_bytes));
+      appendf(out, "rdb_last_cow_size:%llu\r\n", ull(rdb.last_cow_bytes));
+      appendf(out, "latest_fork_usec:%llu\r\n", ull(rdb.last_fork_us));
+    }
+    appendf(out, "\r\n");
+  }
+  if (wantSection(section, "stats")) {
+    const LatencyTotals& it = loops.iteration_time;
+    appendf(out, "# Stats\r\n");
+    appendf(out, "total_connections_received:%llu\r\n", ull(loops.connections_accepted));
+    appendf(out, "total_commands_processed:%llu\r\n", ull(snap.commands));
+    appendf(out, "rejected_commands:%llu\r\n", ull(loops.rejected_commands));
+    appendf(out, "client_idle_timeout_disconnections:%llu\r\n", ull(loops.idle_disconnects));
+    appendf(out, "client_output_buffer_limit_disconnections:%llu\r\n",
+            ull(loops.output_limit_disconnects));
+    appendf(out, "total_net_input_bytes:%llu\r\n", ull(loops.bytes_in));
+    appendf(out, "total_net_output_bytes:%llu\r\n", ull(loops.bytes_out));
+    appendf(out, "expired_keys:%llu\r\n", ull(store.expiredKeys()));
+    appendf(out, "evicted_keys:%llu\r\n", ull(store.evictedKeys()));
+    appendf(out, "lazyfreed_objects:%llu\r\n", ull(store.lazyFree().freedValues()));
+    appendf(out, "eventloop_cycles:%llu\r\n", ull(it.count));
+    appendf(out, "eventloop_busy_usec:%.0f\r\n", usec(it.sum_ns));
+    appendf(out, "eventloop_usec_per_cycle:%.2f\r\n", it.count ? usec(it.sum_ns) / it.count : 0.0);
+    appendf(out, "eventloop_cycle_percentiles_usec:p50=%.3f,p99=%.3f,p99.9=%.3f\r\n",
+            usec(it.percentileNs(0.5)), usec(it.percentileNs(0.99)),
+            usec(it.percentileNs(0.999)));
+    appendf(out, "eventloop_stalls:%llu\r\n", ull(loops.stalls));
+    appendf(out, "slowlog_recorded:%llu\r\n", ull(SlowLog::instance().totalRecorded()));
+    appendf(out, "slowlog_len:%zu\r\n", SlowLog::instance().len());
+    appendf(out, "\r\n");
+  }
+  if (wantSection(section, "replication")) {
+    const Replication::Status repl = Replication::instance().status();
+    appendf(out, "# Replication\r\n");
+    appendf(out, "role:%s\r\n", repl.replica ? "replica" : "primary");
+    if (repl.replica) {
+      appendf(out, "primary_host:%s\r\n", repl.primary_host.c_str());
+      appendf(out, "primary_port:%d\r\n", repl.primary_port);
+      appendf(out, "primary_link_status:%s\r\n", repl.link_up ? "up" : "down");
+      appendf(out, "primary_last_io_seconds_ago:%lld\r\n",
+              static_cast<long long>(repl.last_io_age_ms < 0 ? -1 : repl.last_io_age_ms / 1000));
+      appendf(out, "primary_sync_in_progress:%d\r\n", repl.sync_in_progress ? 1 : 0);
+    }
+    appendf(out, "connected_replicas:%zu\r\n", repl.replicas.size());
+    for (std::size_t i = 0; i < repl.replicas.size(); ++i) {
+      const Replication::ReplicaStatus& r = repl.replicas[i];
+      appendf(out, "replica%zu:ip=%s,port=%d,state=%s,offset=%llu,lag=%llu,lag_bytes=%llu\r\n", i,
+              r.ip.c_str(), r.port, r.online ? "online" : "sync", ull(r.ack_offset),
+              ull(r.ack_age_ms / 1000), ull(repl.offset - std::min(repl.offset, r.ack_offset)));
+    }
+    appendf(out, "replid:%s\r\n", repl.replid.c_str());
+    appendf(out, "replid2:%s\r\n", repl.replid2.empty() ? "-" : repl.replid2.c_str());
+    appendf(out, "repl_offset:%llu\r\n", ull(repl.offset));
+    appendf(out, "second_repl_offset:%llu\r\n", ull(repl.second_offset));
+    appendf(out, "repl_backlog_active:%d\r\n", repl.backlog_active ? 1 : 0);
+    appendf(out, "repl_backlog_size:%llu\r\n", ull(repl.backlog_bytes));
+    appendf(out, "repl_backlog_first_byte_offset:%llu\r\n", ull(repl.backlog_first_offset));
+    appendf(out, "repl_backlog_histlen:%llu\r\n", ull(repl.backlog_histlen));
+    appendf(out, "sync_full:%llu\r\n", ull(repl.full_syncs));
+    appendf(out, "sync_partial_ok:%llu\r\n", ull(repl.partial_syncs));
+    appendf(out, "sync_partial_err:%llu\r\n", ull(repl.partial_sync_errors));
+    appendf(out, "\r\n");
+  }
+  if (wantSection(section, "cluster")) {
+    const Cluster::Status cluster = Cluster::instance().status();
+    appendf(out, "# Cluster\r\n");
+    appendf(out, "cluster_enabled:%d\r\n", cluster.enabled ? 1 : 0);
+    if (cluster.enabled) {
+      appendf(out, "cluster_state:%s\r\n",
+              cluster.slots_assigned == kClusterSlots ? "ok" : "fail");
+      appendf(out, "cluster_myself:%s\r\n", cluster.self.c_str());
+      appendf(out, "cluster_slots_assigned:%zu\r\n", cluster.slots_assigned);
+      appendf(out, "cluster_slots_served:%zu\r\n", cluster.slots_served);
+      appendf(out, "cluster_slots_migrating:%zu\r\n", cluster.slots_migrating);
+      appendf(out, "cluster_slots_importing:%zu\r\n", cluster.slots_importing);
+      appendf(out, "cluster_known_nodes:%zu\r\n", cluster.known_nodes);
+      appendf(out, "cluster_moved_redirects:%llu\r\n", ull(cluster.moved));
+      appendf(out, "cluster_ask_redirects:%llu\r\n", ull(cluster.asked));
+    }
+    appendf(out, "\r\n");
+  }
+  if (wantSection(section, "keyspace")) {
+    appendf(out, "# Keyspace\r\n");
+    appendf(out, "db0:keys=%zu,shards=%zu\r\n", snap.keys, store.shardCount());
+    appendf(out, "\r\n");
+  }
+
+  CommandRegistry& registry = CommandRegistry::instance();
+  if (wantSection(section, "commandstats")) {
+    appendf(out, "# Commandstats\r\n");
+    for (const Command* cmd : registry.commands()) {
+      const LatencyTotals t = registry.totals(*cmd);
+      if (t.count == 0) continue;
+      appendf(out, "cmdstat_%s:calls=%llu,usec=%.0f,usec_per_call=%.3f\r\n", cmd->spec.name,
+              ull(t.count), usec(t.sum_ns), usec(t.sum_ns) / t.count);
+    }
+    appendf(out, "\r\n");
+  }
+  if (wantSection(section, "latencystats")) {
+    // Bucket upper bounds: powers of two, so within 2x of the true value.
+    appendf(out, "# Latencystats\r\n");
+    for (const Command* cmd : registry.commands()) {
+      const LatencyTotals t = registry.totals(*cmd);
+      if (t.count == 0) continue;
+      appendf(out, "latency_percentiles_usec_%s:p50=%.3f,p99=%.3f,p99.9=%.3f\r\n", cmd->spec.name,
+              usec(t.percentileNs(0.5)), usec(t.percentileNs(0.99)),
+              usec(t.percentileNs(0.999)));
+    }
+    appendf(out, "\r\n");
+  }
+  return out;
+}
+
+namespace {
+
+void metricHeader(std::string& out, const char* name, const char* type, const char* help) {
+  appendf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metric(std::string& out, const char* name, const char* type, const char* help,
+            unsigned long long value) {
+  metricHeader(out, name, type, help);
+  appendf(out, "%s %llu\n", name, value);
+}
+
+// Cumulative buckets in seconds, as Prometheus histograms expect. 'labels'
+// is either empty or 'key="value",'.
+void histogram(std::string& out, const char* name, const char* labels, const LatencyTotals& t) {
+  std::uint64_t cumulative = 0;
+  for (std::size_t i = 0; i < LatencyBuckets::kCount; ++i) {
+    cumulative += t.buckets[i];
+    const std::uint64_t bound = LatencyBuckets::boundNs(i);
+    if (bound) {
+      appendf(out, "%s_bucket{%sle=\"%.9g\"} %llu\n", name, labels, bound / 1e9, ull(cumulative));
+    } else {
+      appendf(out, "%s_bucket{%sle=\"+Inf\"} %llu\n", name, labels, ull(cumulative));
+    }
+  }
+  std::string set;
+  if (*labels) {
+    set = std::string("{") + labels;
+    set.back() = '}';  // replaces the trailing comma
+  }
+  appendf(out, "%s_sum%s %.9f\n", name, set.c_str(), t.sum_ns / 1e9);
+  appendf(out, "%s_count%s %llu\n", name, set.c_str(), ull(t.count));
+}
+
+}  // namespace
+
+std::string renderPrometheus(const KVStore& store) {
+  const Snapshot snap(store);
+  const LoopTotals& loops = snap.loops;
+  std::string out;
+
+  metric(out, "kv_uptime_seconds", "gauge", "Seconds since the server started.",
+         static_cast<unsigned long long>((unix_time_ms() - processStartMs()) / 1000));
+  metric(out, "kv_connected_clients", "gauge", "Open client connections.",
+         loops.connections_accepted - loops.connections_closed);
+  metric(out, "kv_connections_received_total", "counter", "Client connections accepted.",
+         loops.connections_accepted);
+  metric(out, "kv_commands_processed_total", "counter", "Commands executed.", snap.commands);
+  metric(out, "kv_commands_rejected_total", "counter",
+         "Requests rejected before running (unknown command, arity, maxmemory).",
+         loops.rejected_commands);
+  metric(out, "kv_client_idle_timeouts_total", "counter",
+         "Client connections closed for idling past the timeout.", loops.idle_disconnects);
+  metric(out, "kv_client_output_limit_disconnections_total", "counter",
+         "Client connections closed for exceeding the output buffer limits.",
+         loops.output_limit_disconnects);
+  metric(out, "kv_net_input_bytes_total", "counter", "Bytes read from clients.", loops.bytes_in);
+  metric(out, "kv_net_output_bytes_total", "counter", "Bytes written to clients.",
+         loops.bytes_out);
+  metric(out, "kv_buffer_memory_bytes", "gauge", "Bytes held by connection I/O buffers.",
+         loops.buffer_bytes);
+  metric(out, "kv_used_memory_bytes", "gauge", "Approximate memory used by the keyspace.",
+         store.usedMemory());
+  metric(out, "kv_maxmemory_bytes", "gauge", "Configured memory limit (0 = none).",
+         store.maxMemory());
+  metric(out, "kv_lazyfree_pending_memory_bytes", "gauge",
+         "Bytes of deleted values not yet freed by the lazy-free thread.",
+         store.lazyFree().pendingBytes());
+  metric(out, "kv_lazyfreed_objects_total", "counter",
+         "Values freed by the lazy-free thread.", store.lazyFree().freedValues());
+  metric(out, "kv_keys", "gauge", "Keys in the keyspace.", snap.keys);
+  metric(out, "kv_expired_keys_total", "counter", "Keys removed because their TTL elapsed.",
+         store.expiredKeys());
+  metric(out, "kv_evicted_keys_total", "counter", "Keys evicted to stay under maxmemory.",
+         store.evictedKeys());
+
+  metric(out, "kv_eventloop_stalls_total", "counter",
+         "Event loop iterations over the stall budget.", loops.stalls);
+  metric(out, "kv_slowlog_recorded_total", "counter", "Commands logged as slow.",
+         SlowLog::instance().totalRecorded());
+
+  const AppendOnlyFile::Status aof = AppendOnlyFile::instance().status();
+  metric(out, "kv_aof_enabled", "gauge", "1 if the append-only file is on.", aof.enabled ? 1 : 0);
+  if (aof.enabled) {
+    metric(out, "kv_aof_size_bytes", "gauge", "Size of the append-only file.", aof.current_size);
+    metric(out, "kv_aof_buffer_bytes", "gauge", "AOF bytes not written yet.", aof.buffered);
+    metric(out, "kv_aof_rewrites_total", "counter", "Completed AOF rewrites.", aof.rewrites);
+    metric(out, "kv_aof_delayed_fsync_total", "counter",
+           "AOF writes that had to wait for a running fsync.", aof.delayed_fsyncs);
+  }
+  const SnapshotFile::Status rdb = SnapshotFile::instance().status();
+  if (rdb.enabled) {
+    metric(out, "kv_snapshot_in_progress", "gauge", "1 while a snapshot is being written.",
+           rdb.in_progress ? 1 : 0);
+    metric(out, "kv_snapshots_total", "counter", "Completed snapshots.", rdb.saves);
+    metric(out, "kv_snapshot_last_duration_ms", "gauge", "Time the last snapshot took, in ms.",
+           rdb.last_duration_ms);
+    metric(out, "kv_snapshot_last_size_bytes", "gauge", "Size of the last snapshot.",
+           rdb.last_bytes);
+    metric(out, "kv_snapshot_last_cow_bytes", "gauge",
+           "Memory copied on write while the last snapshot was written.", rdb.last_cow_bytes);
+    metric(out, "kv_snapshot_last_fork_us", "gauge", "Time the last fork took, in microseconds.",
+           rdb.last_fork_us);
+  }
+
+  const Replication::Status repl = Replication::instance().status();
+  std::uint64_t max_lag = 0;
+  for (const Replication::ReplicaStatus& r : repl.replicas) {
+    max_lag = std::max(max_lag, repl.offset - std::min(repl.offset, r.ack_offset));
+  }
+  metric(out, "kv_replica", "gauge", "1 if this server is a replica.", repl.replica ? 1 : 0);
+  metric(out, "kv_replication_offset_bytes", "gauge", "Length of the replication stream.",
+         repl.offset);
+  metric(out, "kv_connected_replicas", "gauge", "Replicas connected to this server.",
+         repl.replicas.size());
+  metric(out, "kv_replication_max_lag_bytes", "gauge",
+         "Stream bytes the furthest-behind replica has not acknowledged.", max_lag);
+  if (repl.replica) {
+    metric(out, "kv_replication_link_up", "gauge", "1 while the link to the primary is up.",
+           repl.link_up ? 1 : 0);
+  }
+
+  const Cluster::Status cluster = Cluster::instance().status();
+  if (cluster.enabled) {
+    metric(out, "kv_cluster_slots_served", "gauge", "Hash slots served by this node.",
+           cluster.slots_served);
+    metric(out, "kv_cluster_slots_migrating", "gauge", "Slots being migrated to other nodes.",
+           cluster.slots_migrating);
+    metric(out, "kv_cluster_redirects_total", "counter", "MOVED and ASK replies sent.",
+           cluster.moved + cluster.asked);
+  }
+
+  metricHeader(out, "kv_eventloop_cycle_seconds", "histogram",
+               "Time spent per event loop iteration, excluding the wait for events.");
+  histogram(out, "kv_eventloop_cycle_seconds", "", loops.iteration_time);
+
+  CommandRegistry& registry = CommandRegistry::instance();
+  metricHeader(out, "kv_command_duration_seconds", "histogram", "Command execution time.");
+  for (const Command* cmd : registry.commands()) {
+    const LatencyTotals t = registry.totals(*cmd);
+    if (t.count == 0) continue;
+    const std::string labels = std::string("cmd=\"") + cmd->spec.name + "\",";
+    histogram(out, "kv_command_duration_seconds", labels.c_str(), t);
+  }
+  return out;
+}
+
+void registerServerCommands(CommandRegistry& registry) {
+  registry.add({"ping", cmdPing, -1, 0, 0, 0, 0});
+  registry.add({"info", cmdInfo, -1, 0, 0, 0, 0});
+  registry.add({"slowlog", cmdSlowlog, -2, 0, 0, 0, 0});
+  registry.add({"bgrewriteaof", cmdBgrewriteaof, 1, CommandFlag::kAdmin, 0, 0, 0});
+  registry.add({"save", cmdSave, 1, CommandFlag::kAdmin, 0, 0, 0});
+  registry.add({"bgsave", cmdBgsave, 1, CommandFlag::kAdmin, 0, 0, 0});
+}
+
+}  // namespace async
@@ -0,0 +1,131 @@
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "commands.h"
+#include "../multithreading/asyncio.h"
+#include "../storage/kvstore.h"
+#include "../utils/utils.h"
+
+namespace async {
+
+namespace {
+
+void cmdGet(CommandContext& ctx) {
+  // Large values are queued by reference; small ones are copied once,
+  // straight into the output buffer, under the shard lock.
+  const KVStore::KeyResult result = ctx.store.viewShared(
+      ctx.args[1], [&ctx](std::string_view value, const SharedValue* shared) {
+        if (shared && value.size() >= KVStore::kSharedValueBytes) {
+          ctx.conn.appendSharedResponse(0, *shared);
+        } else {
+          ctx.conn.appendResponse(0, value);
+        }
+      });
+  if (result == KVStore::KeyResult::Missing) {
+    ctx.conn.appendResponse(ResponseStatus::RES_NX, {});
+  } else if (result == KVStore::KeyResult::WrongType) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+  }
+}
+
+// set key value [EX seconds | PX milliseconds | EXAT unix-seconds | PXAT unix-ms]
+void cmdSet(CommandContext& ctx) {
+  int64_t expire_at = KVStore::kNoExpiry;
+  const std::vector<std::string_view>& args = ctx.args;
+  for (std::size_t i = 3; i < args.size(); i += 2) {
+    const std::string_view opt = args[i];
+    int64_t n = 0;
+    if (i + 1 >= args.size() || !parseInt64(args[i + 1], n) || n <= 0 ||
+        n > INT64_MAX / 1000 / 2) {
+      ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+      return;
+    }
+    if (equalsIgnoreCase(opt, "ex")) {
+      expire_at = unix_time_ms() + n * 1000;
+    } else if (equalsIgnoreCase(opt, "px")) {
+      expire_at = unix_time_ms() + n;
+    } else if (equalsIgnoreCase(opt, "exat")) {
+      expire_at = n * 1000;
+    } else if (equalsIgnoreCase(opt, "pxat")) {
+      expire_at = n;
+    } else {
+      ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+      return;
+    }
+  }
+  // Large values were received into their own string; move it in whole.
+  if (std::string* value = ctx.takeArg(2)) {
+    ctx.store.setOwned(args[1], std::move(*value), expire_at);
+  } else {
+    ctx.store.set(args[1], args[2], expire_at);
+  }
+  ctx.conn.appendResponse(0, {});
+}
+
+void cmdDel(CommandContext& ctx) {
+  bool existed = ctx.store.del(ctx.args[1]);
+  // Could encode existence in the data or status if desired; keep status 0 for success.
+  (void)existed;
+  ctx.conn.appendResponse(0, {});
+}
+
+// mget key [key ...]: an array reply with status 0 or RES_NX per key.
+void cmdMget(CommandContext& ctx) {
+  Connection& conn = ctx.conn;
+  conn.beginArrayResponse();
+  // Values are copied (or referenced) straight into the output, in key
+  // order, while the batch holds its shard locks.
+  ctx.store.viewMany(
+      &ctx.args[1], ctx.args.size() - 1,
+      [&conn](std::size_t, const std::string_view* value, const SharedValue* shared) {
+        if (!value) {
+          conn.appendArrayElement(ResponseStatus::RES_NX, {});
+        } else if (shared && value->size() >= KVStore::kSharedValueBytes) {
+          conn.appendSharedArrayElement(*shared);
+        } else {
+          conn.appendArrayElement(0, *value);
+        }
+      });
+  conn.endResponse();
+}
+
+// mset key value [key value ...]
+void cmdMset(CommandContext& ctx) {
+  const std::size_t n = ctx.args.size() - 1;
+  if (n % 2 != 0) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  ctx.store.setMany(&ctx.args[1], n / 2);
+  ctx.conn.appendResponse(0, {});
+}
+
+// mdel key [key ...]: replies with the number of keys that existed.
+void cmdMdel(CommandContext& ctx) {
+  const std::size_t deleted = ctx.store.delMany(&ctx.args[1], ctx.args.size() - 1);
+  ctx.conn.appendResponse(0, std::to_string(deleted));
+}
+
+// unlink key [key ...]: like mdel, but large values are freed on the
+// LazyFree thread after the keys are gone.
+void cmdUnlink(CommandContext& ctx) {
+  const std::size_t unlinked = ctx.store.unlinkMany(&ctx.args[1], ctx.args.size() - 1);
+  ctx.conn.appendResponse(0, std::to_string(unlinked));
+}
+
+}  // namespace
+
+void registerStringCommands(CommandRegistry& registry) {
+  registry.add({"get", cmdGet, 2, CommandFlag::kRead, 1, 1, 1});
+  registry.add({"set", cmdSet, -3, CommandFlag::kWrite | CommandFlag::kDenyOom, 1, 1, 1});
+  registry.add({"del", cmdDel, 2, CommandFlag::kWrite, 1, 1, 1});
+  registry.add({"mget", cmdMget, -2, CommandFlag::kRead, 1, -1, 1});
+  registry.add({"mset", cmdMset, -3, CommandFlag::kWrite | CommandFlag::kDenyOom, 1, -1, 2});
+  registry.add({"mdel", cmdMdel, -2, CommandFlag::kWrite, 1, -1, 1});
+  registry.add({"unlink", cmdUnlink, -2, CommandFlag::kWrite, 1, -1, 1});
+}
+
+}  // namespace async
@@ -0,0 +1,250 @@
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "commands.h"
+#include "../multithreading/asyncio.h"
+#include "../storage/kvstore.h"
+#include "../storage/zset.h"
+
+namespace async {
+
+namespace {
+
+using KeyResult = KVStore::KeyResult;
+
+// Range replies are arrays of members, each followed by its score when
+// WITHSCORES is given.
+void appendMember(Connection& conn, std::string_view member, double score, bool with_scores) {
+  conn.appendArrayElement(0, member);
+  if (with_scores) {
+    char buf[32];
+    conn.appendArrayElement(0, formatScore(score, buf));
+  }
+}
+
+// What a range command replies when there was no set to read.
+void replyNoRange(Connection& conn, KeyResult result) {
+  if (result == KeyResult::WrongType) {
+    conn.appendResponse(ResponseStatus::RES_ERR, {});
+  } else if (result == KeyResult::Missing) {
+    conn.beginArrayResponse();
+    conn.endResponse();
+  }
+}
+
+// A ZRANGEBYSCORE bound: a score, "(" before it for an exclusive bound, or
+// "-inf" / "+inf".
+bool parseBound(std::string_view arg, double& score, bool& exclusive) {
+  exclusive = !arg.empty() && arg[0] == '(';
+  if (exclusive) arg.remove_prefix(1);
+  return parseDouble(arg, score);
+}
+
+// zadd key [NX|XX] [CH] score member [score member ...]: replies with the
+// number of members added, or with CH the number added or updated.
+void cmdZadd(CommandContext& ctx) {
+  const std::vector<std::string_view>& args = ctx.args;
+  bool nx = false;
+  bool xx = false;
+  bool ch = false;
+  std::size_t i = 2;
+  for (; i < args.size(); ++i) {
+    if (equalsIgnoreCase(args[i], "nx")) {
+      nx = true;
+    } else if (equalsIgnoreCase(args[i], "xx")) {
+      xx = true;
+    } else if (equalsIgnoreCase(args[i], "ch")) {
+      ch = true;
+    } else {
+      break;
+    }
+  }
+  const std::size_t first = i;
+  if ((nx && xx) || first == args.size() || (args.size() - first) % 2 != 0) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  // Every score is checked before anything changes.
+  std::vector<double> scores((args.size() - first) / 2);
+  for (std::size_t j = 0; j < scores.size(); ++j) {
+    if (!parseDouble(args[first + 2 * j], scores[j])) {
+      ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+      return;
+    }
+  }
+  std::size_t added = 0;
+  std::size_t updated = 0;
+  const KeyResult result = ctx.store.writeObject<SortedSet>(
+      args[1], !xx, args.data(), args.size(), [&](SortedSet& set) {
+        for (std::size_t j = 0; j < scores.size(); ++j) {
+          const std::string_view member = args[first + 2 * j + 1];
+          double old = 0;
+          const bool exists = set.score(member, old);
+          if ((nx && exists) || (xx && !exists)) continue;
+          if (!exists) {
+            set.add(member, scores[j]);
+            ++added;
+          } else if (old != scores[j]) {
+            set.add(member, scores[j]);
+            ++updated;
+          }
+        }
+        return added + updated > 0;
+      });
+  if (result == KeyResult::WrongType) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  ctx.conn.appendResponse(0, std::to_string(ch ? added + updated : added));
+}
+
+// zrem key member [member ...]: replies with the number removed.
+void cmdZrem(CommandContext& ctx) {
+  const std::vector<std::string_view>& args = ctx.args;
+  std::size_t removed = 0;
+  const KeyResult result = ctx.store.writeObject<SortedSet>(
+      args[1], false, args.data(), args.size(), [&](SortedSet& set) {
+        for (std::size_t i = 2; i < args.size(); ++i) {
+          if (set.remove(args[i])) ++removed;
+        }
+        return removed > 0;
+      });
+  if (result == KeyResult::WrongType) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  ctx.conn.appendResponse(0, std::to_string(removed));
+}
+
+// zscore key member: RES_NX if the member (or key) does not exist.
+void cmdZscore(CommandContext& ctx) {
+  double score = 0;
+  bool found = false;
+  const KeyResult result = ctx.store.readObject<SortedSet>(
+      ctx.args[1], [&](const SortedSet& set) { found = set.score(ctx.args[2], score); });
+  if (result == KeyResult::WrongType) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+  } else if (!found) {
+    ctx.conn.appendResponse(ResponseStatus::RES_NX, {});
+  } else {
+    char buf[32];
+    ctx.conn.appendResponse(0, formatScore(score, buf));
+  }
+}
+
+// zcard key: the number of members, 0 for a missing key.
+void cmdZcard(CommandContext& ctx) {
+  std::size_t size = 0;
+  const KeyResult result = ctx.store.readObject<SortedSet>(
+      ctx.args[1], [&](const SortedSet& set) { size = set.size(); });
+  if (result == KeyResult::WrongType) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  ctx.conn.appendResponse(0, std::to_string(size));
+}
+
+// zrank key member: the 0-based rank by ascending score, or RES_NX.
+void cmdZrank(CommandContext& ctx) {
+  std::size_t rank = 0;
+  bool found = false;
+  const KeyResult result = ctx.store.readObject<SortedSet>(
+      ctx.args[1], [&](const SortedSet& set) { found = set.rank(ctx.args[2], rank); });
+  if (result == KeyResult::WrongType) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+  } else if (!found) {
+    ctx.conn.appendResponse(ResponseStatus::RES_NX, {});
+  } else {
+    ctx.conn.appendResponse(0, std::to_string(rank));
+  }
+}
+
+// zrange key start stop [WITHSCORES]: members of rank start..stop
+// inclusive; negative ranks count from the end, as in Redis.
+void cmdZrange(CommandContext& ctx) {
+  const std::vector<std::string_view>& args = ctx.args;
+  int64_t start = 0;
+  int64_t stop = 0;
+  const bool with_scores = args.size() == 5 && equalsIgnoreCase(args[4], "withscores");
+  if (!parseInt64(args[2], start) || !parseInt64(args[3], stop) ||
+      args.size() > 5 || (args.size() == 5 && !with_scores)) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  Connection& conn = ctx.conn;
+  const KeyResult result = ctx.store.readObject<SortedSet>(args[1], [&](const SortedSet& set) {
+    const int64_t n = static_cast<int64_t>(set.size());
+    int64_t from = start < 0 ? start + n : start;
+    int64_t to = stop < 0 ? stop + n : stop;
+    if (from < 0) from = 0;
+    if (to >= n) to = n - 1;
+    conn.beginArrayResponse();
+    if (from <= to) {
+      int64_t left = to - from + 1;
+      set.range(static_cast<std::size_t>(from), [&](std::string_view member, double score) {
+        appendMember(conn, member, score, with_scores);
+        return --left > 0;
+      });
+    }
+    conn.endResponse();
+  });
+  replyNoRange(conn, result);
+}
+
+// zrangebyscore key min max [WITHSCORES] [LIMIT offset count]: members with
+// min <= score <= max in order; a negative count means all.
+void cmdZrangebyscore(CommandContext& ctx) {
+  const std::vector<std::string_view>& args = ctx.args;
+  ScoreRange range;
+  bool ok = parseBound(args[2], range.min, range.min_exclusive) &&
+            parseBound(args[3], range.max, range.max_exclusive);
+  bool with_scores = false;
+  int64_t offset = 0;
+  int64_t count = -1;
+  for (std::size_t i = 4; ok && i < args.size(); ++i) {
+    if (equalsIgnoreCase(args[i], "withscores")) {
+      with_scores = true;
+    } else if (equalsIgnoreCase(args[i], "limit") && i + 2 < args.size()) {
+      ok = parseInt64(args[i + 1], offset) && parseInt64(args[i + 2], count) && offset >= 0;
+      i += 2;
+    } else {
+      ok = false;
+    }
+  }
+  if (!ok) {
+    ctx.conn.appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  Connection& conn = ctx.conn;
+  const KeyResult result = ctx.store.readObject<SortedSet>(args[1], [&](const SortedSet& set) {
+    conn.beginArrayResponse();
+    const std::size_t first = set.firstInRange(range);
+    if (count != 0 && static_cast<uint64_t>(offset) < set.size() - first) {
+      int64_t left = count;
+      set.range(first + static_cast<std::size_t>(offset),
+                [&](std::string_view member, double score) {
+                  if (!range.belowMax(score)) return false;
+                  appendMember(conn, member, score, with_scores);
+                  return --left != 0;
+                });
+    }
+    conn.endResponse();
+  });
+  replyNoRange(conn, result);
+}
+
+}  // namespace
+
+void registerSortedSetCommands(CommandRegistry& registry) {
+  registry.add({"zadd", cmdZadd, -4, CommandFlag::kWrite | CommandFlag::kDenyOom, 1, 1, 1});
+  registry.add({"zrem", cmdZrem, -3, CommandFlag::kWrite, 1, 1, 1});
+  registry.add({"zscore", cmdZscore, 3, CommandFlag::kRead, 1, 1, 1});
+  registry.add({"zcard", cmdZcard, 2, CommandFlag::kRead, 1, 1, 1});
+  registry.add({"zrank", cmdZrank, 3, CommandFlag::kRead, 1, 1, 1});
+  registry.add({"zrange", cmdZrange, -4, CommandFlag::kRead, 1, 1, 1});
+  registry.add({"zrangebyscore", cmdZrangebyscore, -4, CommandFlag::kRead, 1, 1, 1});
+}
+
+}  // namespace async
@@ -1,69 +1,50 @@
 #include "asyncio.h"
 
 
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
+#include <climits>
+#include <cstdio>
 #include <cstring>
 #include <fcntl.h>
+#include <shared_mutex>
 #include <stdexcept>
 #include <string>
-#include <unordered_map>
 #include <utility>
 #include <vector>
 
-#include <poll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "uring.h"
+#include "../cluster/cluster.h"
+#include "../persistence/aof.h"
+#include "../replication/replication.h"
 #include "../utils/utils.h"
 
 namespace async {
 
-// ===================== KVStore =====================
-
-struct KVStore::Impl {
-  std::unordered_map<std::string, std::string> data;
-};
-
-bool KVStore::get(const std::string& key, std::string& out) const {
-  // Lazy allocation to avoid relying on a constructor we didn't declare in the header.
-  if (!impl_) {
-    // Casting away const for lazy initialization; safe because it's internal and transparent.
-    KVStore* self = const_cast<KVStore*>(this);
-    self->impl_ = new Impl();
-  }
-  auto it = impl_->data.find(key);
-  if (it == impl_->data.end()) return false;
-  out = it->second;
-  return true;
-}
-
-void KVStore::set(const std::string& key, std::string value) {
-  if (!impl_) impl_ = new Impl();
-  impl_->data[key] = std::move(value);
-}
-
-bool KVStore::del(const std::string& key) {
-  if (!impl_) impl_ = new Impl();
-  return impl_->data.erase(key) > 0;
-}
-
 // ===================== Connection =====================
 
 namespace {
-inline void bufConsume(std::vector<uint8_t>& buf, size_t n) {
-  if (n == 0) return;
-  if (n >= buf.size()) {
-    buf.clear();
-    return;
-  }
-  buf.erase(buf.begin(), buf.begin() + static_cast<long>(n));
-}
-
-inline void bufAppend(std::vector<uint8_t>& buf, const uint8_t* data, size_t n) {
-  if (n == 0) return;
-  buf.insert(buf.end(), data, data + n);
-}
+// Free space guaranteed at the tail of incoming_ before every read().
+constexpr size_t kMinReadSpace = 4096;
+// Frames up to this size are buffered whole in incoming_ and parsed in
+// place; larger ones are parsed as they arrive (see LargeRequest).
+constexpr size_t kMaxBufferedFrame = 64 * 1024;
+// Within a large frame, arguments of at least this size are read from the
+// socket straight into their own string instead of through incoming_.
+constexpr size_t kDirectArgBytes = 16 * 1024;
+// iovecs handed to one writev(); well under IOV_MAX.
+constexpr int kMaxWriteSegments = 64;
+// Argument slots reserved up front for a large request; the count comes
+// from the peer, so more are only allocated as arguments actually arrive.
+constexpr uint32_t kMaxReservedArgs = 1024;
+// Completion backends keep receiving while a send is in flight; past this
+// much unprocessed input they stop until the send completes.
+constexpr size_t kMaxPendingInput = 1024 * 1024;
 
 inline bool readU32(const uint8_t*& cur, const uint8_t* end, uint32_t& out) {
   if (cur + 4 > end) return false;
@@ -72,131 +53,354 @@ inline bool readU32(const uint8_t*& cur, const uint8_t* end, uint32_t& out) {
   return true;
 }
 
-inline bool readStr(const uint8_t*& cur, const uint8_t* end, size_t n, std::string& out) {
-  if (cur + n > end) return false;
-  out.assign(reinterpret_cast<const char*>(cur), reinterpret_cast<const char*>(cur + n));
+inline bool readStr(const uint8_t*& cur, const uint8_t* end, size_t n, std::string_view& out) {
+  if (n > static_cast<size_t>(end - cur)) return false;
+  out = std::string_view(reinterpret_cast<const char*>(cur), n);
   cur += n;
   return true;
 }
 }  // namespace
 
-Connection::Connection(int fd)
-  : fd_(fd), want_read_(true), want_write_(false), want_close_(false) {}
+// A request frame larger than kMaxBufferedFrame. Its arguments are copied
+// (small ones) or read directly (big ones) into owned strings, so the frame
+// is never held in incoming_ and big values are received exactly once.
+struct Connection::LargeRequest {
+  uint32_t remaining = 0;  // frame bytes not parsed yet
+  uint32_t nargs = 0;
+  bool have_nargs = false;
+  std::vector<std::string> args;
+  // While set, args.back() is being filled; incoming_ is then empty and
+  // handleReadable() reads into the argument instead.
+  bool in_bulk = false;
+  size_t bulk_filled = 0;
+};
+
+Connection::Connection(int fd, LoopContext& loop)
+  : loop_(loop), incoming_(loop.buffer_pool), outgoing_(loop.buffer_pool) {
+  reopen(fd);
+}
 
 Connection::~Connection() = default;
 
+void Connection::detach() {
+  fd_ = -1;
+  incoming_.clear();
+  outgoing_.clear();
+  args_.clear();
+  large_.reset();
+}
+
+void Connection::reopen(int fd) {
+  fd_ = fd;
+  last_active_ms_ = loop_.clock_ms;
+  soft_limit_since_ms_ = 0;
+  want_read_ = true;
+  want_write_ = false;
+  want_close_ = false;
+  send_in_flight_ = false;
+  asking_ = false;
+  array_response_ = false;
+  array_count_ = 0;
+}
+
 int Connection::getFd() const { return fd_; }
 bool Connection::wantsRead() const { return want_read_; }
 bool Connection::wantsWrite() const { return want_write_; }
 bool Connection::wantsClose() const { return want_close_; }
 
 void Connection::handleReadable(KVStore& store) {
-  uint8_t buf[64 * 1024];
-  ssize_t rv = ::read(fd_, buf, sizeof(buf));
-  if (rv < 0 && errno == EAGAIN) return;
+  while (want_read_ && !want_close_) {
+    // Read straight into the tail of incoming_, or into the large argument
+    // being received.
+    const bool bulk = large_ && large_->in_bulk;
+    uint8_t* dst = nullptr;
+    size_t room = 0;
+    if (bulk) {
+      std::string& arg = large_->args.back();
+      dst = reinterpret_cast<uint8_t*>(&arg[0]) + large_->bulk_filled;
+      room = arg.size() - large_->bulk_filled;
+    } else {
+      dst = incoming_.prepare(kMinReadSpace);
+      room = incoming_.writable();
+    }
+    ssize_t rv = ::read(fd_, dst, room);
+    if (rv < 0 && errno == EINTR) continue;
+    if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      // Nothing buffered: hand the block back so idle connections hold none.
+      incoming_.shrinkIfEmpty();
+      return;
+    }
 
-  if (rv < 0) {
-    want_close_ = true;
-    return;
-  }
+    if (rv < 0) {
+      want_close_ = true;
+      return;
+    }
 
-  if (rv == 0) {
-    // Peer closed. If we have partial data, it's a protocol error.
-    if (!incoming_.empty()) {
+    if (rv == 0) {
+      // Peer closed. If we have partial data, it's a protocol error.
+      if (!incoming_.empty()) {
+        want_close_ = true;
+        return;
+      }
       want_close_ = true;
       return;
     }
-    want_close_ = true;
-    return;
-  }
 
-  bufAppend(incoming_, buf, static_cast<size_t>(rv));
+    bump(loop_.stats.bytes_in, static_cast<size_t>(rv));
+    last_active_ms_ = loop_.clock_ms;
+    if (bulk) {
+      large_->bulk_filled += static_cast<size_t>(rv);
+    } else {
+      incoming_.commit(static_cast<size_t>(rv));
+    }
 
-  // Process as many complete requests as possible.
-  while (tryOneRequest(store)) {}
+    processInput(store);
 
-  if (!outgoing_.empty()) {
-    want_read_ = false;
-    want_write_ = true;
-    // Try to write immediately to reduce latency.
-    handleWritable();
+    if (!outgoing_.empty()) {
+      want_read_ = false;
+      want_write_ = true;
+      // Held replies are sent by the event loop after its AOF flush.
+      if (loop_.defer_replies) return;
+      // Try to write immediately to reduce latency. If the socket buffer is
+      // full we stop reading until the event loop reports writability.
+      handleWritable();
+    }
   }
 }
 
 void Connection::handleWritable() {
-  if (outgoing_.empty()) {
-    want_write_ = false;
-    want_read_ = true;
-    return;
+  iovec iov[kMaxWriteSegments];
+  while (!outgoing_.empty()) {
+    const int n = outgoing_.gather(iov, kMaxWriteSegments);
+    ssize_t rv = ::writev(fd_, iov, n);
+    if (rv < 0 && errno == EINTR) continue;
+    if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+    if (rv < 0) {
+      want_close_ = true;
+      return;
+    }
+
+    outgoing_.consume(static_cast<size_t>(rv));
+    bump(loop_.stats.bytes_out, static_cast<size_t>(rv));
   }
 
-  ssize_t rv = ::write(fd_, outgoing_.data(), outgoing_.size());
-  if (rv < 0 && errno == EAGAIN) return;
+  want_write_ = false;
+  want_read_ = true;
+}
 
-  if (rv < 0) {
-    want_close_ = true;
-    return;
+void Connection::onReceived(const uint8_t* data, size_t n, KVStore& store) {
+  bump(loop_.stats.bytes_in, n);
+  last_active_ms_ = loop_.clock_ms;
+  if (large_ && large_->in_bulk) {
+    // incoming_ is empty while an argument is being filled; copy into the
+    // argument directly, as handleReadable() would have read into it.
+    std::string& arg = large_->args.back();
+    const size_t k = std::min(n, arg.size() - large_->bulk_filled);
+    std::memcpy(&arg[large_->bulk_filled], data, k);
+    large_->bulk_filled += k;
+    data += k;
+    n -= k;
   }
+  incoming_.append(data, n);
+  processInput(store);
+}
 
-  bufConsume(outgoing_, static_cast<size_t>(rv));
+void Connection::finishSend(size_t n, KVStore& store) {
+  outgoing_.consume(n);
+  bump(loop_.stats.bytes_out, n);
+  send_in_flight_ = false;
+  processInput(store);
+}
 
-  if (outgoing_.empty()) {
-    want_write_ = false;
-    want_read_ = true;
+void Connection::processInput(KVStore& store) {
+  // Responses must not be appended while a send references outgoing_.
+  if (send_in_flight_) {
+    // Stop receiving once enough input is waiting on a slow reader.
+    want_read_ = incoming_.size() < kMaxPendingInput;
+    return;
   }
+  // Process as many complete requests as possible.
+  while (!want_close_ && tryOneRequest(store)) checkOutputLimits();
+  want_read_ = true;
+}
+
+void Connection::checkOutputLimits() {
+  if (want_close_) return;
+  const size_t queued = outgoing_.size();
+  if (loop_.output_hard_limit != 0 && queued > loop_.output_hard_limit) {
+    want_close_ = true;
+  } else if (loop_.output_soft_limit != 0 && queued > loop_.output_soft_limit) {
+    if (soft_limit_since_ms_ == 0) soft_limit_since_ms_ = loop_.clock_ms;
+    want_close_ = loop_.clock_ms - soft_limit_since_ms_ >= loop_.output_soft_ms;
+  } else {
+    soft_limit_since_ms_ = 0;
+  }
+  if (want_close_) bump(loop_.stats.output_limit_disconnects);
 }
 
 bool Connection::tryOneRequest(KVStore& store) {
+  if (large_) return continueLargeRequest(store);
+
   // Basic framing: [len: u32][payload: len bytes]
   if (incoming_.size() < 4) return false;
 
   uint32_t len = 0;
   std::memcpy(&len, incoming_.data(), 4);
-  if (len > k_max_msg) {
+  if (len > loop_.max_request_bytes) {
     want_close_ = true;
     return false;
   }
-  if (incoming_.size() < 4u + len) return false;
+  if (incoming_.size() < 4u + len) {
+    if (len <= kMaxBufferedFrame) return false;
+    large_ = std::make_unique<LargeRequest>();
+    large_->remaining = len;
+    incoming_.consume(4);
+    return continueLargeRequest(store);
+  }
 
   const uint8_t* req = incoming_.data() + 4u;
 
   // Parse request as: [nstr: u32] { [len: u32][bytes...] } * nstr
-  std::vector<std::string> cmd;
-  if (!parseRequest(req, len, cmd)) {
+  if (!parseRequest(req, len, args_)) {
     want_close_ = true;
-    bufConsume(incoming_, 4u + len);
+    incoming_.consume(4u + len);
     return false;
   }
 
-  // Execute command against store.
-  uint32_t status = 0;
-  std::string data;
+  dispatch(store);
 
-  if (cmd.size() == 2 && cmd[0] == "get") {
-    std::string value;
-    if (store.get(cmd[1], value)) {
-      data = std::move(value);
-    } else {
-      status = ResponseStatus::RES_NX;
+  // Consume this request from incoming buffer.
+  incoming_.consume(4u + len);
+  return true;
+}
+
+bool Connection::continueLargeRequest(KVStore& store) {
+  LargeRequest& req = *large_;
+  // Same layout as parseRequest(), consumed piecewise from incoming_.
+  if (!req.have_nargs) {
+    if (incoming_.size() < 4) return false;
+    std::memcpy(&req.nargs, incoming_.data(), 4);
+    incoming_.consume(4);
+    if (req.remaining < 4 || req.nargs > (req.remaining - 4) / 4) {
+      want_close_ = true;
+      return false;
     }
-  } else if (cmd.size() == 3 && cmd[0] == "set") {
-    store.set(cmd[1], std::move(cmd[2]));
-  } else if (cmd.size() == 2 && cmd[0] == "del") {
-    bool existed = store.del(cmd[1]);
-    // Could encode existence in the data or status if desired; keep status 0 for success.
-    (void)existed;
-  } else {
-    status = ResponseStatus::RES_ERR;
+    req.remaining -= 4;
+    req.have_nargs = true;
+    req.args.reserve(std::min(req.nargs, kMaxReservedArgs));
   }
 
-  appendResponse(status, data);
+  while (req.in_bulk || req.args.size() < req.nargs) {
+    if (req.in_bulk) {
+      std::string& arg = req.args.back();
+      const size_t n = std::min(incoming_.size(), arg.size() - req.bulk_filled);
+      if (n) std::memcpy(&arg[req.bulk_filled], incoming_.data(), n);
+      incoming_.consume(n);
+      req.bulk_filled += n;
+      if (req.bulk_filled < arg.size()) return false;
+      req.in_bulk = false;
+      continue;
+    }
 
-  // Consume this request from incoming buffer.
-  bufConsume(incoming_, 4u + len);
+    if (incoming_.size() < 4) return false;
+    uint32_t slen = 0;
+    std::memcpy(&slen, incoming_.data(), 4);
+    if (req.remaining < 4 || slen > req.remaining - 4) {
+      want_close_ = true;
+      return false;
+    }
+    if (slen >= kDirectArgBytes) {
+      incoming_.consume(4);
+      req.remaining -= 4 + slen;
+      req.args.emplace_back(slen, '\0');
+      req.in_bulk = true;
+      req.bulk_filled = 0;
+      continue;
+    }
+    if (incoming_.size() < 4u + slen) return false;
+    req.args.emplace_back(reinterpret_cast<const char*>(incoming_.data()) + 4, slen);
+    incoming_.consume(4u + slen);
+    req.remaining -= 4 + slen;
+  }
+  if (req.remaining != 0) {  // trailing garbage
+    want_close_ = true;
+    return false;
+  }
+
+  args_.clear();
+  for (const std::string& arg : req.args) args_.push_back(arg);
+  dispatch(store, &req.args);
+  // Frees any argument the handler did not take over.
+  large_.reset();
   return true;
 }
 
-void Connection::appendResponse(uint32_t status, const std::string& data) {
+void Connection::dispatch(KVStore& store, std::vector<std::string>* owned) {
+  // "asking" covers the one command after it.
+  const bool asking = asking_;
+  asking_ = false;
+  // Arguments are views into incoming_; they stay valid until the request
+  // is consumed by the caller.
+  const Command* command = args_.empty() ? nullptr : loop_.commands.find(args_[0]);
+  if (!command || !command->arityOk(args_.size())) {
+    bump(loop_.stats.rejected_commands);
+    appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  // Held while the command runs in a slot being migrated away.
+  std::shared_lock<std::shared_mutex> migrating;
+  if (loop_.cluster) {
+    std::uint16_t slot = 0;
+    std::string_view node;
+    const Cluster::Route route =
+        loop_.cluster->route(*command, args_, store, asking, slot, node, migrating);
+    if (route != Cluster::Route::Serve) {
+      if (route == Cluster::Route::Moved || route == Cluster::Route::Ask) {
+        loop_.cluster->noteRedirect(route);
+        const std::string where = std::to_string(slot) + " " + std::string(node);
+        appendResponse(route == Cluster::Route::Moved ? ResponseStatus::RES_MOVED
+                                                      : ResponseStatus::RES_ASK,
+                       where);
+      } else {
+        bump(loop_.stats.rejected_commands);
+        appendResponse(ResponseStatus::RES_ERR, {});
+      }
+      return;
+    }
+  }
+  if ((command->spec.flags & CommandFlag::kWrite) && loop_.replication &&
+      loop_.replication->readOnly()) {
+    bump(loop_.stats.rejected_commands);
+    appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+  if ((command->spec.flags & CommandFlag::kDenyOom) && !store.ensureMemory()) {
+    bump(loop_.stats.rejected_commands);
+    appendResponse(ResponseStatus::RES_ERR, {});
+    return;
+  }
+
+  CommandContext ctx{store, args_, *this, owned};
+  const uint64_t start = monotonic_ns();
+  command->spec.handler(ctx);
+  const uint64_t elapsed = monotonic_ns() - start;
+  loop_.command_stats[command->id].record(elapsed);
+  if (elapsed >= loop_.slowlog_threshold_ns) logSlow(owned, elapsed);
+}
+
+void Connection::logSlow(const std::vector<std::string>* owned, uint64_t elapsed_ns) {
+  // Arguments the handler moved out of 'owned' (e.g. a large SET value)
+  // no longer have their bytes; args_ still has their sizes.
+  std::vector<bool> taken;
+  if (owned) {
+    taken.resize(args_.size());
+    for (size_t i = 0; i < args_.size(); ++i) taken[i] = (*owned)[i].size() != args_[i].size();
+  }
+  SlowLog::instance().record(args_, owned ? &taken : nullptr, elapsed_ns);
+}
+
+void Connection::appendResponse(uint32_t status, std::string_view data) {
   // Response: [len: u32 = 4 + data.size()][status: u32][data: bytes...]
   uint32_t resp_len = 4u + static_cast<uint32_t>(data.size());
   appendOutgoing(reinterpret_cast<const uint8_t*>(&resp_len), 4);
@@ -206,30 +410,76 @@ void Connection::appendResponse(uint32_t status, const std::string& data) {
   }
 }
 
+void Connection::appendSharedResponse(uint32_t status, SharedValue data) {
+  uint32_t header[2] = {4u + static_cast<uint32_t>(data->size()), status};
+  appendOutgoing(reinterpret_cast<const uint8_t*>(header), sizeof(header));
+  outgoing_.appendShared(std::move(data));
+}
+
+void Connection::beginResponse(uint32_t status) {
+  const uint32_t header[2] = {0, status};
+  response_len_pos_ = outgoing_.copiedEnd();
+  appendOutgoing(reinterpret_cast<const uint8_t*>(header), sizeof(header));
+  response_start_ = outgoing_.size();
+}
+
+void Connection::endResponse() {
+  const uint32_t resp_len = 4u + static_cast<uint32_t>(outgoing_.size() - response_start_);
+  outgoing_.patch(response_len_pos_, reinterpret_cast<const uint8_t*>(&resp_len), 4);
+  if (array_response_) {
+    // The count directly follows the 8-byte header.
+    outgoing_.patch(response_len_pos_ + 8, reinterpret_cast<const uint8_t*>(&array_count_), 4);
+    array_response_ = false;
+  }
+}
+
+void Connection::beginArrayResponse() {
+  beginResponse(0);
+  const uint32_t count = 0;
+  appendOutgoing(reinterpret_cast<const uint8_t*>(&count), 4);
+  array_response_ = true;
+  array_count_ = 0;
+}
+
+void Connection::appendArrayElement(uint32_t status, std::string_view data) {
+  const uint32_t header[2] = {status, static_cast<uint32_t>(data.size())};
+  appendOutgoing(reinterpret_cast<const uint8_t*>(header), sizeof(header));
+  if (!data.empty()) appendOutgoing(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+  ++array_count_;
+}
+
+void Connection::appendSharedArrayElement(SharedValue data) {
+  const uint32_t header[2] = {0, static_cast<uint32_t>(data->size())};
+  appendOutgoing(reinterpret_cast<const uint8_t*>(header), sizeof(header));
+  outgoing_.appendShared(std::move(data));
+  ++array_count_;
+}
+
 void Connection::consumeIncoming(size_t n) {
-  bufConsume(incoming_, n);
+  incoming_.consume(n);
 }
 
 void Connection::appendOutgoing(const uint8_t* data, size_t n) {
-  bufAppend(outgoing_, data, n);
+  outgoing_.append(data, n);
 }
 
-bool Connection::parseRequest(const uint8_t* data, size_t size, std::vector<std::string>& out) {
+bool Connection::parseRequest(const uint8_t* data, size_t size,
+                              std::vector<std::string_view>& out) {
   const uint8_t* cur = data;
   const uint8_t* end = data + size;
 
   uint32_t nstr = 0;
   if (!readU32(cur, end, nstr)) return false;
-  if (nstr > k_max_msg) return false;  // safety limit
+  if (nstr > size / 4) return false;  // every argument needs a length
 
+  // clear() keeps capacity, so steady-state parsing does not allocate.
   out.clear();
-  out.reserve(nstr);
   for (uint32_t i = 0; i < nstr; ++i) {
     uint32_t slen = 0;
     if (!readU32(cur, end, slen)) return false;
-    std::string s;
+    std::string_view s;
     if (!readStr(cur, end, slen, s)) return false;
-    out.emplace_back(std::move(s));
+    out.push_back(s);
   }
   if (cur != end) return false;  // trailing garbage
   return true;
@@ -237,16 +487,53 @@ bool Connection::parseRequest(const uint8_t* data, size_t size, std::vector<std:
 
 // ===================== EventLoop =====================
 
-EventLoop::EventLoop(int listen_fd, KVStore& store)
-  : listen_fd_(listen_fd), store_(store) {}
+namespace {
+// Wake-up interval while the store has background work pending.
+constexpr int kBackgroundIntervalMs = 10;
+// Hash groups (16 slots each) moved per owned shard per loop iteration.
+constexpr std::size_t kRehashGroupsPerTick = 64;
+// Expired keys deleted per loop iteration, so a mass expiry is spread over
+// many iterations instead of stalling one.
+constexpr std::size_t kExpireKeysPerTick = 200;
+// Idle timers: resolution and wheel size (about 100 s per turn).
+constexpr std::uint64_t kTimerTickMs = 100;
+constexpr std::size_t kTimerBuckets = 1024;
+// Closed connections kept for reuse per loop; the rest are freed.
+constexpr std::size_t kMaxFreeConnections = 256;
+
+std::uint64_t monotonic_ms() { return monotonic_ns() / 1000000; }
+}  // namespace
+
+EventLoop::EventLoop(int listen_fd, KVStore& store, const LoopConfig& config)
+  : listen_fd_(listen_fd), store_(store), config_(config), ctx_(config.index),
+    timers_(kTimerTickMs, kTimerBuckets, monotonic_ms()) {
+  ctx_.clock_ms = monotonic_ms();
+  ctx_.output_hard_limit = config.output_hard_limit;
+  ctx_.output_soft_limit = config.output_soft_limit;
+  ctx_.output_soft_ms = config.output_soft_ms;
+  ctx_.max_request_bytes = config.max_request_bytes;
+  ctx_.defer_replies = config.aof && config.aof->fsyncPolicy() == FsyncPolicy::Always;
+  ctx_.replication = config.replication;
+  ctx_.cluster = config.cluster;
+  if (config.backend == Backend::IoUring) startUring();
+  if (!uring_) {
+    poller_ = makePoller(config.backend);
+    poller_->add(listen_fd_, PollEvent::kReadable);
+  }
+  ctx_.stats.running.store(1, std::memory_order_relaxed);
+}
 
 EventLoop::~EventLoop() {
+  ctx_.stats.running.store(0, std::memory_order_relaxed);
+  // Tear the ring down first so the kernel drops references into buffers.
+  uring_.reset();
   // Close and delete any remaining connections.
   for (Connection* c : fd2conn_) {
     if (!c) continue;
     ::close(c->getFd());
     delete c;
   }
+  for (Connection* c : free_connections_) delete c;
 }
 
 void EventLoop::run() {
@@ -256,80 +543,259 @@ void EventLoop::run() {
 }
 
 void EventLoop::runOnce() {
-  preparePollArgs();
-  waitForEvents();
-  handleListeningSocket();
-  handleConnectionSockets();
-}
-
-void EventLoop::preparePollArgs() {
-  poll_args_.clear();
-  // Always poll the listening socket for readable events.
-  pollfd pfd_listen{};
-  pfd_listen.fd = listen_fd_;
-  pfd_listen.events = POLLIN;
-  pfd_listen.revents = 0;
-  poll_args_.push_back(pfd_listen);
-
-  // Add all active connections.
-  for (Connection* conn : fd2conn_) {
-    if (!conn) continue;
-    pollfd pfd{};
-    pfd.fd = conn->getFd();
-    pfd.events = POLLERR;
-    if (conn->wantsRead()) pfd.events |= POLLIN;
-    if (conn->wantsWrite()) pfd.events |= POLLOUT;
-    pfd.revents = 0;
-    poll_args_.push_back(pfd);
+  if (uring_) {
+    runOnceUring();
+  } else {
+    waitForEvents();
+    handleListeningSocket();
+    phases_.accepted = monotonic_ns();
+    handleConnectionSockets();
+    flushAof();
+  }
+  phases_.dispatched = monotonic_ns();
+  runBackgroundTasks();
+  finishIteration();
+}
+
+void EventLoop::finishIteration() {
+  const uint64_t end = monotonic_ns();
+  Phases& p = phases_;
+  if (p.start == 0) p.start = p.wait;  // first iteration
+  const uint64_t busy = (p.wait - p.start) + (end - p.wake);
+
+  LoopStats& stats = ctx_.stats;
+  bump(stats.iterations);
+  bump(stats.busy_ns, busy);
+  stats.iteration_time.record(busy);
+  stats.buffer_bytes.store(ctx_.buffer_pool.bytesInUse(), std::memory_order_relaxed);
+
+  if (config_.stall_budget_us != 0 && busy > config_.stall_budget_us * 1000) {
+    bump(stats.stalls);
+    ++stalls_unreported_;
+    // At most one report per second per loop, so a slow spell does not
+    // turn into a log flood that slows the loop further.
+    if (end - last_stall_log_ns_ >= 1000000000ull) {
+      std::fprintf(stderr,
+                   "event loop %u: iteration took %.3f ms (budget %.3f ms): prepare %.3f, "
+                   "accept %.3f, dispatch %.3f, background %.3f ms; wait %.3f ms",
+                   config_.index, busy / 1e6, config_.stall_budget_us / 1e3,
+                   (p.wait - p.start) / 1e6, (p.accepted - p.wake) / 1e6,
+                   (p.dispatched - p.accepted) / 1e6, (end - p.dispatched) / 1e6,
+                   (p.wake - p.wait) / 1e6);
+      if (stalls_unreported_ > 1) {
+        std::fprintf(stderr, " (%llu stalls since last report)",
+                     static_cast<unsigned long long>(stalls_unreported_));
+      }
+      std::fputc('\n', stderr);
+      stalls_unreported_ = 0;
+      last_stall_log_ns_ = end;
+    }
   }
+  p.start = end;
 }
 
 void EventLoop::waitForEvents() {
-  int rv = ::poll(poll_args_.data(), static_cast<nfds_t>(poll_args_.size()), -1);
-  if (rv < 0 && errno == EINTR) return;
-  if (rv < 0) {
-    throw std::runtime_error("poll() failed");
+  const int timeout_ms = nextTimeoutMs();
+  phases_.wait = monotonic_ns();
+  poller_->wait(timeout_ms, ready_);
+  phases_.wake = monotonic_ns();
+  ctx_.clock_ms = phases_.wake / 1000000;
+}
+
+int EventLoop::nextTimeoutMs() const {
+  // More keys were due than the last iteration's budget, or replies are
+  // waiting for the next AOF flush: don't sleep.
+  if (expire_backlog_ || !deferred_writes_.empty()) return 0;
+
+  int timeout_ms = -1;
+  const int64_t next_expiry = store_.nextExpiry(config_.index, config_.count);
+  if (next_expiry != KVStore::kNoExpiry) {
+    const int64_t delta = next_expiry - unix_time_ms();
+    timeout_ms = static_cast<int>(std::clamp<int64_t>(delta, 0, INT_MAX));
   }
+  const bool aof_pending = config_.aof && config_.aof->pending();
+  if ((store_.rehashPending() || aof_pending) &&
+      (timeout_ms < 0 || timeout_ms > kBackgroundIntervalMs)) {
+    timeout_ms = kBackgroundIntervalMs;
+  }
+  const int timer_ms = timers_.untilNextMs(monotonic_ms());
+  if (timer_ms >= 0 && (timeout_ms < 0 || timer_ms < timeout_ms)) timeout_ms = timer_ms;
+  return timeout_ms;
 }
 
 void EventLoop::handleListeningSocket() {
-  if (poll_args_.empty()) return;
-  const pollfd& pfd = poll_args_[0];
-  if (!(pfd.revents & POLLIN)) return;
+  bool listen_ready = false;
+  for (const ReadyEvent& ev : ready_) {
+    if (ev.fd == listen_fd_) {
+      listen_ready = true;
+      break;
+    }
+  }
+  if (!listen_ready) return;
 
-  if (Connection* conn = acceptOne()) {
+  // Drain the accept queue: the listening socket may be edge-triggered.
+  while (Connection* conn = acceptOne()) {
     const int cfd = conn->getFd();
     if (static_cast<size_t>(cfd) >= fd2conn_.size()) {
       fd2conn_.resize(static_cast<size_t>(cfd) + 1, nullptr);
+      fd2interest_.resize(static_cast<size_t>(cfd) + 1, 0);
     }
     fd2conn_[static_cast<size_t>(cfd)] = conn;
+    fd2interest_[static_cast<size_t>(cfd)] = interestOf(conn);
+    poller_->add(cfd, fd2interest_[static_cast<size_t>(cfd)]);
   }
 }
 
 void EventLoop::handleConnectionSockets() {
-  // Iterate poll results for connection fds.
-  for (size_t i = 1; i < poll_args_.size(); ++i) {
-    const uint32_t ready = static_cast<uint32_t>(poll_args_[i].revents);
-    const int fd = poll_args_[i].fd;
+  // Only fds reported ready by the poller are visited.
+  for (const ReadyEvent& ev : ready_) {
+    const int fd = ev.fd;
+    if (fd == listen_fd_) continue;
     if (fd < 0 || static_cast<size_t>(fd) >= fd2conn_.size()) continue;
     Connection* conn = fd2conn_[static_cast<size_t>(fd)];
     if (!conn) continue;
 
-    if (ready & POLLIN) {
+    if (ev.events & PollEvent::kReadable) {
       conn->handleReadable(store_);
     }
-    if (ready & POLLOUT) {
+    if ((ev.events & PollEvent::kWritable) && conn->wantsWrite() && !ctx_.defer_replies) {
       conn->handleWritable();
     }
 
-    if (ready & (POLLERR | POLLHUP | POLLNVAL) || conn->wantsClose()) {
-      ::close(conn->getFd());
-      fd2conn_[static_cast<size_t>(fd)] = nullptr;
-      delete conn;
+    if ((ev.events & PollEvent::kError) || conn->wantsClose()) {
+      closeConnection(conn);
+      continue;
+    }
+    if (ctx_.defer_replies && conn->wantsWrite()) {
+      deferred_writes_.push_back(fd);
+      continue;
+    }
+    updateInterest(conn);
+  }
+}
+
+void EventLoop::flushAof() {
+  if (!config_.aof) return;
+  config_.aof->flush();
+  if (deferred_writes_.empty()) return;
+
+  std::vector<int> fds;
+  fds.swap(deferred_writes_);
+  for (int fd : fds) {
+    Connection* conn = fd2conn_[static_cast<size_t>(fd)];
+    if (!conn) continue;
+    conn->handleWritable();
+    // Reading stopped when the replies were queued; with edge-triggered
+    // readiness nothing reports input that arrived meanwhile, so carry on
+    // here. New replies are held for the next iteration's flush. If the
+    // socket is full, wait for writability as usual instead.
+    const bool drained = !conn->wantsWrite();
+    if (drained && !conn->wantsClose()) conn->handleReadable(store_);
+    if (conn->wantsClose()) {
+      closeConnection(conn);
+    } else if (drained && conn->wantsWrite()) {
+      deferred_writes_.push_back(fd);
+    } else {
+      updateInterest(conn);
+    }
+  }
+  // Keep the vector's capacity for the next iteration.
+  fds.clear();
+  if (deferred_writes_.empty()) deferred_writes_.swap(fds);
+}
+
+void EventLoop::runBackgroundTasks() {
+  store_.updateClock();
+
+  const size_t expired = store_.activeExpire(config_.index, config_.count, kExpireKeysPerTick);
+  expire_backlog_ = expired == kExpireKeysPerTick;
+
+  if (store_.rehashPending()) {
+    store_.incrementalRehash(config_.index, config_.count, kRehashGroupsPerTick);
+  }
+  if (config_.replication) config_.replication->flush();
+  expireIdleConnections();
+}
+
+void EventLoop::expireIdleConnections() {
+  if (timers_.size() == 0) return;
+  const std::uint64_t now = monotonic_ms();
+  timers_.advance(now, due_timers_);
+  for (int fd : due_timers_) {
+    Connection* conn = fd2conn_[static_cast<size_t>(fd)];
+    const std::uint64_t idle_until = conn->lastActiveMs() + config_.idle_timeout_ms;
+    if (idle_until > now) {
+      fd2timer_[static_cast<size_t>(fd)] = timers_.schedule(idle_until, fd);
+      continue;
+    }
+    fd2timer_[static_cast<size_t>(fd)] = TimerWheel::kNoTimer;
+    bump(ctx_.stats.idle_disconnects);
+    if (uring_) {
+      conn->markClosed();
+      pumpUring(fd);
+    } else {
+      closeConnection(conn);
     }
   }
 }
 
+void EventLoop::updateInterest(Connection* conn) {
+  const size_t fd = static_cast<size_t>(conn->getFd());
+  const std::uint32_t interest = interestOf(conn);
+  if (fd2interest_[fd] == interest) return;
+  fd2interest_[fd] = interest;
+  poller_->modify(conn->getFd(), interest);
+}
+
+void EventLoop::closeConnection(Connection* conn) {
+  const int fd = conn->getFd();
+  poller_->remove(fd);
+  ::close(fd);
+  fd2conn_[static_cast<size_t>(fd)] = nullptr;
+  fd2interest_[static_cast<size_t>(fd)] = 0;
+  recycleConnection(conn);
+}
+
+Connection* EventLoop::openConnection(int fd) {
+  Connection* conn = nullptr;
+  if (free_connections_.empty()) {
+    conn = new Connection(fd, ctx_);
+  } else {
+    conn = free_connections_.back();
+    free_connections_.pop_back();
+    conn->reopen(fd);
+  }
+  bump(ctx_.stats.connections_accepted);
+  if (config_.idle_timeout_ms != 0) {
+    const size_t i = static_cast<size_t>(fd);
+    if (i >= fd2timer_.size()) fd2timer_.resize(i + 1, TimerWheel::kNoTimer);
+    fd2timer_[i] = timers_.schedule(ctx_.clock_ms + config_.idle_timeout_ms, fd);
+  }
+  return conn;
+}
+
+void EventLoop::recycleConnection(Connection* conn) {
+  bump(ctx_.stats.connections_closed);
+  const size_t fd = static_cast<size_t>(conn->getFd());
+  if (fd < fd2timer_.size() && fd2timer_[fd] != TimerWheel::kNoTimer) {
+    timers_.cancel(fd2timer_[fd]);
+    fd2timer_[fd] = TimerWheel::kNoTimer;
+  }
+  if (free_connections_.size() == kMaxFreeConnections) {
+    delete conn;
+    return;
+  }
+  conn->detach();
+  free_connections_.push_back(conn);
+}
+
+std::uint32_t EventLoop::interestOf(const Connection* conn) {
+  std::uint32_t interest = 0;
+  if (conn->wantsRead()) interest |= PollEvent::kReadable;
+  if (conn->wantsWrite()) interest |= PollEvent::kWritable;
+  return interest;
+}
+
 Connection* EventLoop::acceptOne() {
   sockaddr_storage ss{};
   socklen_t slen = sizeof(ss);
@@ -341,8 +807,7 @@ Connection* EventLoop::acceptOne() {
   }
 
   setNonBlocking(cfd);
-  Connection* conn = new Connection(cfd);
-  return conn;
+  return openConnection(cfd);
 }
 
 void EventLoop::setNonBlocking(int fd) {
@@ -357,4 +822,221 @@ void EventLoop::setNonBlocking(int fd) {
   }
 }
 
+// ===================== EventLoop (io_uring) =====================
+
+#ifdef ASYNC_HAVE_IO_URING
+
+namespace {
+constexpr unsigned kRingEntries = 1024;
+// Provided receive buffers (count must be a power of two).
+constexpr unsigned kRecvBuffers = 256;
+constexpr size_t kRecvBufferSize = 16 * 1024;
+
+// user_data layout: operation in the high 32 bits, fd in the low 32.
+enum UringOp : uint64_t { kOpAccept = 1, kOpRecv = 2, kOpSend = 3, kOpCancel = 4 };
+
+uint64_t userData(UringOp op, int fd) {
+  return (static_cast<uint64_t>(op) << 32) | static_cast<uint32_t>(fd);
+}
+}  // namespace
+
+struct EventLoop::Uring {
+  // Operations in flight for one connection. Heap-allocated so the msghdr
+  // and iovecs handed to the kernel never move.
+  struct Slot {
+    bool recv_armed = false;
+    bool recv_cancelling = false;
+    bool send_armed = false;
+    bool closing = false;
+    bool dirty = false;
+    msghdr msg{};
+    iovec iov[kMaxWriteSegments];
+  };
+
+  Uring() : ring(kRingEntries, kRecvBuffers, kRecvBufferSize) {}
+
+  Slot& slot(int fd) {
+    const size_t i = static_cast<size_t>(fd);
+    if (i >= slots.size()) slots.resize(i + 1);
+    if (!slots[i]) slots[i] = std::make_unique<Slot>();
+    return *slots[i];
+  }
+
+  // Connections touched by this batch of completions; pumped once each.
+  void markDirty(int fd) {
+    Slot& s = slot(fd);
+    if (s.dirty) return;
+    s.dirty = true;
+    dirty.push_back(fd);
+  }
+
+  IoUring ring;
+  std::vector<std::unique_ptr<Slot>> slots;
+  std::vector<int> dirty;
+  bool accept_armed = false;
+};
+
+void EventLoop::startUring() {
+  try {
+    uring_ = std::make_unique<Uring>();
+  } catch (const std::runtime_error&) {
+    // Kernel without (usable) io_uring: the constructor falls back to epoll.
+    uring_.reset();
+  }
+}
+
+void EventLoop::runOnceUring() {
+  Uring& u = *uring_;
+  if (!u.accept_armed) {
+    io_uring_sqe* sqe = u.ring.sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd_;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = userData(kOpAccept, listen_fd_);
+    u.accept_armed = true;
+  }
+
+  // One syscall per iteration: submits everything queued by the previous
+  // iteration (sends, re-arms) and waits for completions.
+  const int timeout_ms = nextTimeoutMs();
+  phases_.wait = monotonic_ns();
+  u.ring.submitAndWait(timeout_ms);
+  // Accepts complete along with everything else; they count as dispatch.
+  phases_.wake = phases_.accepted = monotonic_ns();
+  ctx_.clock_ms = phases_.wake / 1000000;
+  u.ring.drainCompletions([this](const io_uring_cqe& cqe) {
+    onUringCompletion(cqe.user_data, cqe.res, cqe.flags);
+  });
+  // Sends are only queued below and submitted with the next wait, after
+  // the flush, so replies never get ahead of the AOF.
+  if (config_.aof) config_.aof->flush();
+
+  std::vector<int> dirty;
+  dirty.swap(u.dirty);
+  for (int fd : dirty) {
+    u.slot(fd).dirty = false;
+    pumpUring(fd);
+  }
+  // Keep the vector's capacity for the next iteration.
+  dirty.clear();
+  if (u.dirty.empty()) u.dirty.swap(dirty);
+}
+
+void EventLoop::onUringCompletion(uint64_t user_data, int32_t res, uint32_t flags) {
+  Uring& u = *uring_;
+  const UringOp op = static_cast<UringOp>(user_data >> 32);
+  const int fd = static_cast<int>(static_cast<uint32_t>(user_data));
+  const bool more = flags & IORING_CQE_F_MORE;
+
+  if (op == kOpCancel) return;
+  if (op == kOpAccept) {
+    if (!more) u.accept_armed = false;
+    if (res < 0) return;  // e.g. EMFILE; re-armed next iteration
+    const int cfd = res;
+    if (static_cast<size_t>(cfd) >= fd2conn_.size()) {
+      fd2conn_.resize(static_cast<size_t>(cfd) + 1, nullptr);
+    }
+    fd2conn_[static_cast<size_t>(cfd)] = openConnection(cfd);
+    u.slot(cfd) = Uring::Slot{};
+    u.markDirty(cfd);
+    return;
+  }
+
+  Connection* conn = fd2conn_[static_cast<size_t>(fd)];
+  Uring::Slot& slot = u.slot(fd);
+  if (op == kOpRecv) {
+    if (!more) {
+      slot.recv_armed = false;
+      slot.recv_cancelling = false;
+    }
+    if (flags & IORING_CQE_F_BUFFER) {
+      const auto bid = static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+      if (res > 0 && !slot.closing) {
+        conn->onReceived(u.ring.buffer(bid), static_cast<size_t>(res), store_);
+      }
+      u.ring.recycleBuffer(bid);
+    }
+    // ENOBUFS (all buffers in use) and ECANCELED only end the multishot.
+    if (res == 0 || (res < 0 && res != -ENOBUFS && res != -ECANCELED)) conn->markClosed();
+  } else if (op == kOpSend) {
+    slot.send_armed = false;
+    if (res >= 0 && !slot.closing) {
+      conn->finishSend(static_cast<size_t>(res), store_);
+    } else if (res < 0) {
+      conn->markClosed();
+    }
+  }
+  u.markDirty(fd);
+}
+
+void EventLoop::pumpUring(int fd) {
+  Uring& u = *uring_;
+  Connection* conn = fd2conn_[static_cast<size_t>(fd)];
+  Uring::Slot& slot = u.slot(fd);
+
+  if (conn->wantsClose() || slot.closing) {
+    if (!slot.closing) {
+      slot.closing = true;
+      if (slot.recv_armed || slot.send_armed) {
+        io_uring_sqe* sqe = u.ring.sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = userData(kOpCancel, fd);
+      }
+    }
+    // The fd stays open, and cannot be reused, until nothing references it.
+    if (slot.recv_armed || slot.send_armed) return;
+    ::close(fd);
+    fd2conn_[static_cast<size_t>(fd)] = nullptr;
+    recycleConnection(conn);
+    return;
+  }
+
+  if (!slot.send_armed && !conn->output().empty()) {
+    slot.msg = msghdr{};
+    slot.msg.msg_iov = slot.iov;
+    slot.msg.msg_iovlen = static_cast<size_t>(conn->output().gather(slot.iov, kMaxWriteSegments));
+    io_uring_sqe* sqe = u.ring.sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&slot.msg);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = userData(kOpSend, fd);
+    conn->beginSend();
+    slot.send_armed = true;
+  }
+
+  if (conn->wantsRead() && !slot.recv_armed) {
+    // Multishot: one submission keeps delivering data into provided
+    // buffers until it is cancelled or runs out of buffers.
+    io_uring_sqe* sqe = u.ring.sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = IoUring::kBufferGroup;
+    sqe->user_data = userData(kOpRecv, fd);
+    slot.recv_armed = true;
+  } else if (!conn->wantsRead() && slot.recv_armed && !slot.recv_cancelling) {
+    // Backpressure: the peer is not reading its responses.
+    io_uring_sqe* sqe = u.ring.sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = userData(kOpRecv, fd);
+    sqe->user_data = userData(kOpCancel, fd);
+    slot.recv_cancelling = true;
+  }
+}
+
+#else  // !ASYNC_HAVE_IO_URING
+
+struct EventLoop::Uring {};
+void EventLoop::startUring() {}
+void EventLoop::runOnceUring() {}
+void EventLoop::onUringCompletion(uint64_t, int32_t, uint32_t) {}
+void EventLoop::pumpUring(int) {}
+
+#endif  // ASYNC_HAVE_IO_URING
+
 }  // namespace async
\ No newline at end of file
@@ -1,81 +1,208 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
-#include <poll.h>
+
+#include "buffer.h"
+#include "poller.h"
+#include "timerwheel.h"
+#include "../commands/registry.h"
+#include "../storage/kvstore.h"
+#include "../utils/slowlog.h"
+#include "../utils/stats.h"
+#include "../utils/utils.h"
 
 namespace async {
 
 // Forward-declare to avoid including system headers in clients.
 class Connection;
+class AppendOnlyFile;
+class Replication;
+class Cluster;
 
-// Simple in-memory key-value store.
-class KVStore {
- public:
-  KVStore() = default;
-  // Non-copyable, but movable
-  KVStore(const KVStore&) = delete;
-  KVStore& operator=(const KVStore&) = delete;
-
-  // Returns true and fills 'out' if key exists; false otherwise.
-  bool get(const std::string& key, std::string& out) const;
-
-  // Sets key to value (move).
-  void set(const std::string& key, std::string value);
+// Loop-owned state shared with the loop's connections.
+struct LoopContext {
+  explicit LoopContext(unsigned slot)
+    : stats_slot(slot), stats(loopStats(slot)), command_stats(commands.statsSlot(slot)) {}
 
-  // Deletes key; returns true if existed.
-  bool del(const std::string& key);
-
- private:
-  // Pimpl-friendly: we keep implementation details in the .cpp
-  struct Impl;
-  Impl* impl_ = nullptr;
+  BufferPool buffer_pool;
+  CommandRegistry& commands = CommandRegistry::instance();
+  // Slot of this loop in per-loop statistics arrays.
+  unsigned stats_slot = 0;
+  // This loop's counters; written only from the loop thread.
+  LoopStats& stats;
+  // This loop's per-command statistics, indexed by Command::id.
+  CommandStats* command_stats = nullptr;
+  // Largest request frame accepted; bigger ones close the connection.
+  std::size_t max_request_bytes = 0;
+  // Commands running at least this long go to the slow log.
+  std::uint64_t slowlog_threshold_ns = SlowLog::instance().thresholdNs();
+  // Replies are held until the loop has made the iteration's writes
+  // durable (AOF with fsync "always"); the loop sends them afterwards.
+  bool defer_replies = false;
+  // Set when replication is on; writes are rejected while it is a replica.
+  const Replication* replication = nullptr;
+  // Set in cluster mode; commands are routed by the hash slot of their keys.
+  Cluster* cluster = nullptr;
+  // Monotonic time (ms) of the current iteration's wake-up.
+  std::uint64_t clock_ms = 0;
+  // Output buffer limits (0: none). A connection whose unsent replies
+  // exceed the hard limit, or the soft limit for output_soft_ms straight,
+  // is closed.
+  std::size_t output_hard_limit = 0;
+  std::size_t output_soft_limit = 0;
+  std::uint64_t output_soft_ms = 0;
 };
 
 // A single client TCP connection with its I/O buffers and request processing.
 class Connection {
  public:
-  explicit Connection(int fd);
+  // 'loop' must outlive the connection.
+  Connection(int fd, LoopContext& loop);
   ~Connection();
 
+  // Drops the buffered input and output and forgets the socket, so that the
+  // object can be kept for reuse; reopen() then starts a new connection on
+  // it, keeping its buffers' capacity.
+  void detach();
+  void reopen(int fd);
+
   // File descriptor associated with this connection.
   int getFd() const;
+  // Loop clock (LoopContext::clock_ms) when the peer last sent anything.
+  std::uint64_t lastActiveMs() const { return last_active_ms_; }
 
   // Interest flags for the event loop.
   bool wantsRead() const;
   bool wantsWrite() const;
   bool wantsClose() const;
 
-  // Called by the event loop when socket is readable/writable.
+  // Called by the event loop when socket is readable/writable. Both drain the
+  // socket until EAGAIN (or until output backs up), so they are safe to use
+  // with edge-triggered readiness.
   void handleReadable(KVStore& store);
   void handleWritable();
 
+  // Completion-based backends (io_uring) do the socket I/O themselves and
+  // report it through these; request handling is shared with the above.
+  // Feeds received bytes and runs the complete requests.
+  void onReceived(const uint8_t* data, size_t n, KVStore& store);
+  // Output to send. While a send is in flight its bytes stay in place:
+  // requests are not run until finishSend().
+  const OutputQueue& output() const { return outgoing_; }
+  void beginSend() { send_in_flight_ = true; }
+  void finishSend(size_t n, KVStore& store);
+  // Peer closed or the socket failed.
+  void markClosed() { want_close_ = true; }
+  // The next command may run in a slot this node is importing ("asking").
+  void setAsking() { asking_ = true; }
+
+  // Queues a response frame; used by command handlers.
+  void appendResponse(uint32_t status, std::string_view data);
+  // Same, but the data is sent from the shared buffer without being copied.
+  void appendSharedResponse(uint32_t status, SharedValue data);
+  // Queues a response frame whose data is appended in pieces, for replies
+  // built while locks are held: beginResponse(), any number of
+  // appendResponseData() / appendSharedResponseData(), then endResponse(),
+  // which fills in the frame length.
+  void beginResponse(uint32_t status);
+  void appendResponseData(std::string_view data) {
+    appendOutgoing(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+  }
+  void appendSharedResponseData(SharedValue data) { outgoing_.appendShared(std::move(data)); }
+  void endResponse();
+  // Array replies carry [count: u32] then [status: u32][len: u32][bytes]
+  // per element in their data. beginArrayResponse() starts one with status
+  // 0; elements follow, and endResponse() fills in the count as well.
+  void beginArrayResponse();
+  void appendArrayElement(uint32_t status, std::string_view data);
+  // Same, sending the bytes from the shared buffer without copying them.
+  void appendSharedArrayElement(SharedValue data);
+
+  // Splits a request payload into views that point into 'data'. Returns
+  // false if the payload is malformed.
+  static bool parseRequest(const uint8_t* data, size_t size, std::vector<std::string_view>& out);
+
   // Non-copyable
   Connection(const Connection&) = delete;
   Connection& operator=(const Connection&) = delete;
 
  private:
+  // Receive state of a request too large to buffer whole (defined in .cpp).
+  struct LargeRequest;
+
   // Internal helpers (defined in .cpp)
+  void processInput(KVStore& store);
   bool tryOneRequest(KVStore& store);
-  void appendResponse(uint32_t status, const std::string& data);
+  bool continueLargeRequest(KVStore& store);
+  void dispatch(KVStore& store, std::vector<std::string>* owned = nullptr);
+  void logSlow(const std::vector<std::string>* owned, uint64_t elapsed_ns);
   void consumeIncoming(size_t n);
   void appendOutgoing(const uint8_t* data, size_t n);
-  static bool parseRequest(const uint8_t* data, size_t size, std::vector<std::string>& out);
+  // Closes the connection if its output is over LoopContext's limits.
+  void checkOutputLimits();
 
   int fd_ = -1;
+  LoopContext& loop_;
+  std::uint64_t last_active_ms_ = 0;
+  // When the output went over the soft limit; 0 while it is under.
+  std::uint64_t soft_limit_since_ms_ = 0;
   bool want_read_ = false;
   bool want_write_ = false;
   bool want_close_ = false;
-  std::vector<uint8_t> incoming_;
-  std::vector<uint8_t> outgoing_;
+  bool send_in_flight_ = false;
+  bool asking_ = false;
+  Buffer incoming_;
+  OutputQueue outgoing_;
+  // Arguments of the request being executed; views into incoming_, reused
+  // across requests so parsing does not allocate.
+  std::vector<std::string_view> args_;
+  // Only allocated while a large request is being received.
+  std::unique_ptr<LargeRequest> large_;
+  // Response being built by beginResponse(): where its length goes, and
+  // the queue size right after its header.
+  size_t response_len_pos_ = 0;
+  size_t response_start_ = 0;
+  // For an array reply: whether one is open, and its count so far.
+  bool array_response_ = false;
+  uint32_t array_count_ = 0;
+};
+
+// Per-loop settings.
+struct LoopConfig {
+  Backend backend = Backend::Epoll;
+  // Position of this loop among the loops sharing one store. Background
+  // store work is split between loops by shard index modulo 'count'.
+  unsigned index = 0;
+  unsigned count = 1;
+  std::size_t max_request_bytes = k_max_msg;
+  // Iterations whose non-wait time exceeds this are logged as stalls, with
+  // a breakdown by phase; 0 disables the check.
+  std::uint64_t stall_budget_us = 0;
+  // Append-only file the store logs to; flushed once per iteration.
+  AppendOnlyFile* aof = nullptr;
+  // Replication stream the store feeds; its senders are woken once per
+  // iteration.
+  Replication* replication = nullptr;
+  // Set in cluster mode.
+  Cluster* cluster = nullptr;
+  // Connections the peer sent nothing on for this long are closed; 0: never.
+  std::uint64_t idle_timeout_ms = 0;
+  // See LoopContext.
+  std::size_t output_hard_limit = 0;
+  std::size_t output_soft_limit = 0;
+  std::uint64_t output_soft_ms = 0;
 };
 
-// A poll-based event loop that accepts and drives connections.
+// A readiness-based event loop that accepts and drives connections.
 class EventLoop {
  public:
   // The event loop does not own listen_fd; caller owns its lifecycle.
-  EventLoop(int listen_fd, KVStore& store);
+  EventLoop(int listen_fd, KVStore& store, const LoopConfig& config = LoopConfig());
   ~EventLoop();
 
   // Run the loop until fatal error or external termination.
@@ -89,17 +216,75 @@ class EventLoop {
   EventLoop& operator=(const EventLoop&) = delete;
 
  private:
-  void preparePollArgs();
   void waitForEvents();
+  // Poll timeout: time until the next key expiry or pending background work.
+  int nextTimeoutMs() const;
   void handleListeningSocket();
   void handleConnectionSockets();
+  void runBackgroundTasks();
+  // Writes the iteration's AOF records, then (with defer_replies) the
+  // replies held back until they were durable.
+  void flushAof();
+  // Records the iteration's time and reports it if it blew the budget.
+  void finishIteration();
+  // io_uring backend (defined with its own section in asyncio.cpp).
+  struct Uring;
+  void startUring();
+  void runOnceUring();
+  void onUringCompletion(std::uint64_t user_data, std::int32_t res, std::uint32_t flags);
+  // Submits whatever conn needs next: a send, (re)arming or cancelling its
+  // receive, or closing it once no operation is in flight.
+  void pumpUring(int fd);
+  void updateInterest(Connection* conn);
+  void closeConnection(Connection* conn);
   Connection* acceptOne();
+  // A connection object for fd, from the free list if it has one, and its
+  // idle timer.
+  Connection* openConnection(int fd);
+  // Returns a closed connection to the free list (or deletes it).
+  void recycleConnection(Connection* conn);
+  // Closes the connections whose idle timers show no activity since.
+  void expireIdleConnections();
   static void setNonBlocking(int fd);
+  static std::uint32_t interestOf(const Connection* conn);
 
   int listen_fd_ = -1;
   KVStore& store_;
+  LoopConfig config_;
+  // Exactly one of poller_ (readiness backends) and uring_ is set.
+  std::unique_ptr<Poller> poller_;
+  std::unique_ptr<Uring> uring_;
+  // Declared before connections are created so it outlives them.
+  LoopContext ctx_;
   std::vector<Connection*> fd2conn_;
-  std::vector<pollfd> poll_args_;
+  // Closed connections kept for reuse, with their buffers.
+  std::vector<Connection*> free_connections_;
+  // Idle timers, one per connection while idle_timeout_ms is set, and
+  // cancelled when it closes. A timer fires at the earliest time the
+  // connection can have been idle long enough; if it has been active
+  // meanwhile, it is set again from then.
+  TimerWheel timers_;
+  std::vector<TimerWheel::TimerId> fd2timer_;
+  std::vector<int> due_timers_;
+  // Interest currently registered with poller_, indexed by fd.
+  std::vector<std::uint32_t> fd2interest_;
+  std::vector<ReadyEvent> ready_;
+  // Connections with replies held back until flushAof().
+  std::vector<int> deferred_writes_;
+  bool expire_backlog_ = false;
+  // Phase boundaries of the current iteration (monotonic ns). It starts
+  // where the previous one ended, so each boundary costs one clock read.
+  struct Phases {
+    std::uint64_t start = 0;     // prepare: timers, submissions
+    std::uint64_t wait = 0;      // waiting for events
+    std::uint64_t wake = 0;      // accepting
+    std::uint64_t accepted = 0;  // reading, dispatching, writing
+    std::uint64_t dispatched = 0;  // background tasks
+  };
+  Phases phases_;
+  // Stalls since the last one was logged, and when that was.
+  std::uint64_t stalls_unreported_ = 0;
+  std::uint64_t last_stall_log_ns_ = 0;
 };
 
 }  // namespace async
\ No newline at end of file
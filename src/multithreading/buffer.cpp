@@ -0,0 +1,171 @@
+#include "buffer.h"
+
+#include <cstring>
+#include <new>
+#include <utility>
+
+namespace async {
+
+// ===================== BufferPool =====================
+
+BufferPool::BufferPool(std::size_t max_free) : max_free_(max_free) {}
+
+BufferPool::~BufferPool() {
+  for (uint8_t* block : free_) ::operator delete(block);
+}
+
+uint8_t* BufferPool::acquire(std::size_t size, std::size_t& capacity) {
+  if (size <= kBlockSize) {
+    capacity = kBlockSize;
+    in_use_ += capacity;
+    if (!free_.empty()) {
+      uint8_t* block = free_.back();
+      free_.pop_back();
+      return block;
+    }
+    return static_cast<uint8_t*>(::operator new(kBlockSize));
+  }
+  // Oversized blocks are rare (large frames) and are not pooled.
+  capacity = size;
+  in_use_ += capacity;
+  return static_cast<uint8_t*>(::operator new(size));
+}
+
+void BufferPool::release(uint8_t* block, std::size_t capacity) {
+  in_use_ -= capacity;
+  if (capacity == kBlockSize && free_.size() < max_free_) {
+    free_.push_back(block);
+    return;
+  }
+  ::operator delete(block);
+}
+
+// ===================== Buffer =====================
+
+void Buffer::append(const uint8_t* data, std::size_t n) {
+  if (n == 0) return;
+  std::memcpy(prepare(n), data, n);
+  commit(n);
+}
+
+void Buffer::consume(std::size_t n) {
+  if (n >= size()) {
+    rpos_ = wpos_ = 0;
+    release();
+    return;
+  }
+  rpos_ += n;
+}
+
+uint8_t* Buffer::prepare(std::size_t n) {
+  if (writable() >= n) return block_ + wpos_;
+
+  const std::size_t live = size();
+  if (block_ && capacity_ - live >= n) {
+    // Enough room overall: compact instead of growing.
+    std::memmove(block_, block_ + rpos_, live);
+  } else {
+    std::size_t want = capacity_ ? capacity_ * 2 : n;
+    if (want < live + n) want = live + n;
+    std::size_t cap = 0;
+    uint8_t* grown = pool_->acquire(want, cap);
+    if (live) std::memcpy(grown, block_ + rpos_, live);
+    if (block_) pool_->release(block_, capacity_);
+    block_ = grown;
+    capacity_ = cap;
+  }
+  rpos_ = 0;
+  wpos_ = live;
+  return block_ + wpos_;
+}
+
+void Buffer::release() {
+  if (!block_) return;
+  pool_->release(block_, capacity_);
+  block_ = nullptr;
+  capacity_ = 0;
+  rpos_ = wpos_ = 0;
+}
+
+// ===================== OutputQueue =====================
+
+void OutputQueue::append(const uint8_t* data, std::size_t n) {
+  if (n == 0) return;
+  inline_.append(data, n);
+  bytes_ += n;
+  copied_ += n;
+  // Consecutive copies share one segment, so headers and small values
+  // coalesce into a single iovec.
+  if (head_ < segments_.size() && !segments_.back().shared) {
+    segments_.back().len += n;
+    return;
+  }
+  segments_.push_back(Segment{nullptr, 0, n});
+}
+
+void OutputQueue::appendShared(std::shared_ptr<const std::string_view> value) {
+  const std::size_t n = value->size();
+  if (n == 0) return;
+  bytes_ += n;
+  segments_.push_back(Segment{std::move(value), 0, n});
+}
+
+void OutputQueue::patch(std::size_t pos, const uint8_t* data, std::size_t n) {
+  // inline_ holds the last inline_.size() bytes copied in.
+  std::memcpy(inline_.data() + (pos - (copied_ - inline_.size())), data, n);
+}
+
+int OutputQueue::gather(iovec* iov, int max) const {
+  int count = 0;
+  // Inline segments are laid out back to back in inline_, in queue order.
+  const uint8_t* inline_pos = inline_.data();
+  for (std::size_t i = head_; i < segments_.size() && count < max; ++i) {
+    const Segment& seg = segments_[i];
+    if (seg.shared) {
+      iov[count].iov_base = const_cast<char*>(seg.shared->data() + seg.offset);
+    } else {
+      iov[count].iov_base = const_cast<uint8_t*>(inline_pos);
+      inline_pos += seg.len;
+    }
+    iov[count].iov_len = seg.len;
+    ++count;
+  }
+  return count;
+}
+
+void OutputQueue::consume(std::size_t n) {
+  bytes_ -= n;
+  while (n > 0) {
+    Segment& seg = segments_[head_];
+    const std::size_t k = n < seg.len ? n : seg.len;
+    if (seg.shared) {
+      seg.offset += k;
+    } else {
+      inline_.consume(k);
+    }
+    seg.len -= k;
+    n -= k;
+    if (seg.len == 0) {
+      seg.shared.reset();
+      ++head_;
+    }
+  }
+  if (head_ == segments_.size()) {
+    segments_.clear();
+    head_ = 0;
+  } else if (head_ >= 64 && head_ * 2 >= segments_.size()) {
+    // A queue that never drains fully: drop the written prefix now and then.
+    segments_.erase(segments_.begin(), segments_.begin() + static_cast<std::ptrdiff_t>(head_));
+    head_ = 0;
+  }
+}
+
+void OutputQueue::clear() {
+  inline_.clear();
+  segments_.clear();
+  head_ = 0;
+  bytes_ = 0;
+  copied_ = 0;
+}
+
+}  // namespace async
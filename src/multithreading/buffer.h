@@ -0,0 +1,141 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/uio.h>
+
+namespace async {
+
+// Free list of fixed-size I/O blocks shared by the connections of one event
+// loop. Not thread-safe: each loop owns its pool.
+class BufferPool {
+ public:
+  static constexpr std::size_t kBlockSize = 16 * 1024;
+
+  // 'max_free' bounds how many idle blocks the pool keeps around.
+  explicit BufferPool(std::size_t max_free = 1024);
+  ~BufferPool();
+  BufferPool(const BufferPool&) = delete;
+  BufferPool& operator=(const BufferPool&) = delete;
+
+  // Returns a block of at least 'size' bytes and stores its real capacity in
+  // 'capacity'. Sizes up to kBlockSize are served from the free list.
+  uint8_t* acquire(std::size_t size, std::size_t& capacity);
+
+  // Returns a block obtained from acquire().
+  void release(uint8_t* block, std::size_t capacity);
+
+  // Bytes currently handed out to buffers.
+  std::size_t bytesInUse() const { return in_use_; }
+
+ private:
+  std::vector<uint8_t*> free_;
+  std::size_t max_free_;
+  std::size_t in_use_ = 0;
+};
+
+// Byte queue with separate read and write offsets. Consuming from the front
+// only advances the read offset; live bytes are moved to the front only when
+// the tail runs out of room. Storage comes from a BufferPool and is given
+// back as soon as the buffer drains, so an idle connection holds no memory.
+class Buffer {
+ public:
+  explicit Buffer(BufferPool& pool) : pool_(&pool) {}
+  ~Buffer() { release(); }
+  Buffer(const Buffer&) = delete;
+  Buffer& operator=(const Buffer&) = delete;
+
+  const uint8_t* data() const { return block_ + rpos_; }
+  uint8_t* data() { return block_ + rpos_; }
+  std::size_t size() const { return wpos_ - rpos_; }
+  bool empty() const { return wpos_ == rpos_; }
+  std::size_t capacity() const { return capacity_; }
+
+  // Copies n bytes to the tail.
+  void append(const uint8_t* data, std::size_t n);
+
+  // Drops n bytes from the front; storage is returned to the pool once the
+  // buffer is empty.
+  void consume(std::size_t n);
+
+  // Makes at least n bytes writable at the tail and returns a pointer to
+  // them; writable() may be larger. Follow with commit().
+  uint8_t* prepare(std::size_t n);
+  std::size_t writable() const { return capacity_ - wpos_; }
+
+  // Marks n bytes written after prepare() as readable.
+  void commit(std::size_t n) { wpos_ += n; }
+
+  // Returns storage to the pool if the buffer holds no data.
+  void shrinkIfEmpty() {
+    if (empty()) release();
+  }
+
+  // Drops all data and returns storage to the pool.
+  void clear() { release(); }
+
+ private:
+  void release();
+
+  BufferPool* pool_;
+  uint8_t* block_ = nullptr;
+  std::size_t capacity_ = 0;
+  std::size_t rpos_ = 0;
+  std::size_t wpos_ = 0;
+};
+
+// Output queue of byte segments for scatter-gather writes. Small pieces
+// (headers, short values) are copied into one coalescing Buffer; large
+// values are queued by reference to shared immutable bytes, which stay
+// alive until they have been written even if the store drops them meanwhile.
+class OutputQueue {
+ public:
+  explicit OutputQueue(BufferPool& pool) : inline_(pool) {}
+  OutputQueue(const OutputQueue&) = delete;
+  OutputQueue& operator=(const OutputQueue&) = delete;
+
+  bool empty() const { return bytes_ == 0; }
+  // Bytes queued and not yet consumed.
+  std::size_t size() const { return bytes_; }
+
+  // Copies n bytes into the coalescing buffer.
+  void append(const uint8_t* data, std::size_t n);
+
+  // Queues 'value' without copying its bytes.
+  void appendShared(std::shared_ptr<const std::string_view> value);
+
+  // Position just past the last byte copied in so far. Bytes copied in can
+  // be overwritten with patch(pos, ...) until they have been consumed,
+  // e.g. to fill in a length once what follows it is known.
+  std::size_t copiedEnd() const { return copied_; }
+  void patch(std::size_t pos, const uint8_t* data, std::size_t n);
+
+  // Fills up to 'max' iovecs with the front of the queue; returns the count.
+  int gather(iovec* iov, int max) const;
+
+  // Drops n bytes from the front, e.g. after a partial writev().
+  void consume(std::size_t n);
+
+  // Drops everything queued; the segment list keeps its capacity.
+  void clear();
+
+ private:
+  struct Segment {
+    std::shared_ptr<const std::string_view> shared;  // null: bytes are in inline_
+    std::size_t offset = 0;                           // into *shared
+    std::size_t len = 0;                              // bytes left
+  };
+
+  Buffer inline_;
+  std::vector<Segment> segments_;
+  std::size_t head_ = 0;
+  std::size_t bytes_ = 0;
+  std::size_t copied_ = 0;  // bytes ever appended to inline_
+};
+
+}  // namespace async
@@ -0,0 +1,197 @@
+#include "poller.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <poll.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+namespace async {
+
+// ===================== PollPoller =====================
+
+namespace {
+
+class PollPoller final : public Poller {
+ public:
+  void add(int fd, std::uint32_t interest) override {
+    if (static_cast<size_t>(fd) >= fd2index_.size()) {
+      fd2index_.resize(static_cast<size_t>(fd) + 1, -1);
+    }
+    if (fd2index_[static_cast<size_t>(fd)] >= 0) {
+      throw std::runtime_error("poll: fd already registered");
+    }
+    pollfd pfd{};
+    pfd.fd = fd;
+    pfd.events = toPollEvents(interest);
+    fd2index_[static_cast<size_t>(fd)] = static_cast<int>(fds_.size());
+    fds_.push_back(pfd);
+  }
+
+  void modify(int fd, std::uint32_t interest) override {
+    fds_[static_cast<size_t>(indexOf(fd))].events = toPollEvents(interest);
+  }
+
+  void remove(int fd) override {
+    // Swap-remove keeps the pollfd array dense without shifting.
+    const int idx = indexOf(fd);
+    const size_t last = fds_.size() - 1;
+    if (static_cast<size_t>(idx) != last) {
+      fds_[static_cast<size_t>(idx)] = fds_[last];
+      fd2index_[static_cast<size_t>(fds_[last].fd)] = idx;
+    }
+    fds_.pop_back();
+    fd2index_[static_cast<size_t>(fd)] = -1;
+  }
+
+  void wait(int timeout_ms, std::vector<ReadyEvent>& out) override {
+    out.clear();
+    int rv = ::poll(fds_.data(), static_cast<nfds_t>(fds_.size()), timeout_ms);
+    if (rv < 0 && errno == EINTR) return;
+    if (rv < 0) {
+      throw std::runtime_error("poll() failed");
+    }
+    for (size_t i = 0; i < fds_.size() && rv > 0; ++i) {
+      const short re = fds_[i].revents;
+      if (re == 0) continue;
+      --rv;
+      ReadyEvent ev;
+      ev.fd = fds_[i].fd;
+      if (re & POLLIN) ev.events |= PollEvent::kReadable;
+      if (re & POLLOUT) ev.events |= PollEvent::kWritable;
+      if (re & (POLLERR | POLLHUP | POLLNVAL)) ev.events |= PollEvent::kError;
+      out.push_back(ev);
+    }
+  }
+
+  const char* name() const override { return "poll"; }
+
+ private:
+  static short toPollEvents(std::uint32_t interest) {
+    short ev = POLLERR;
+    if (interest & PollEvent::kReadable) ev |= POLLIN;
+    if (interest & PollEvent::kWritable) ev |= POLLOUT;
+    return ev;
+  }
+
+  int indexOf(int fd) const {
+    if (fd < 0 || static_cast<size_t>(fd) >= fd2index_.size() ||
+        fd2index_[static_cast<size_t>(fd)] < 0) {
+      throw std::runtime_error("poll: fd not registered");
+    }
+    return fd2index_[static_cast<size_t>(fd)];
+  }
+
+  std::vector<pollfd> fds_;
+  std::vector<int> fd2index_;
+};
+
+// ===================== EpollPoller =====================
+
+#ifdef __linux__
+
+class EpollPoller final : public Poller {
+ public:
+  EpollPoller() : epfd_(::epoll_create1(EPOLL_CLOEXEC)), events_(kInitialEvents) {
+    if (epfd_ < 0) {
+      throw std::runtime_error("epoll_create1() failed");
+    }
+  }
+
+  ~EpollPoller() override { ::close(epfd_); }
+
+  void add(int fd, std::uint32_t interest) override { ctl(EPOLL_CTL_ADD, fd, interest); }
+
+  void modify(int fd, std::uint32_t interest) override { ctl(EPOLL_CTL_MOD, fd, interest); }
+
+  void remove(int fd) override {
+    if (::epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr) != 0) {
+      throw std::runtime_error("epoll_ctl(EPOLL_CTL_DEL) failed");
+    }
+  }
+
+  void wait(int timeout_ms, std::vector<ReadyEvent>& out) override {
+    out.clear();
+    int rv = ::epoll_wait(epfd_, events_.data(), static_cast<int>(events_.size()), timeout_ms);
+    if (rv < 0 && errno == EINTR) return;
+    if (rv < 0) {
+      throw std::runtime_error("epoll_wait() failed");
+    }
+    for (int i = 0; i < rv; ++i) {
+      const uint32_t re = events_[static_cast<size_t>(i)].events;
+      ReadyEvent ev;
+      ev.fd = events_[static_cast<size_t>(i)].data.fd;
+      if (re & EPOLLIN) ev.events |= PollEvent::kReadable;
+      if (re & EPOLLOUT) ev.events |= PollEvent::kWritable;
+      if (re & (EPOLLERR | EPOLLHUP)) ev.events |= PollEvent::kError;
+      out.push_back(ev);
+    }
+    // A full batch suggests more fds are ready; grow for the next wait.
+    if (static_cast<size_t>(rv) == events_.size()) {
+      events_.resize(events_.size() * 2);
+    }
+  }
+
+  const char* name() const override { return "epoll"; }
+
+ private:
+  static constexpr size_t kInitialEvents = 256;
+
+  void ctl(int op, int fd, std::uint32_t interest) {
+    epoll_event ev{};
+    ev.events = EPOLLET;
+    if (interest & PollEvent::kReadable) ev.events |= EPOLLIN;
+    if (interest & PollEvent::kWritable) ev.events |= EPOLLOUT;
+    ev.data.fd = fd;
+    if (::epoll_ctl(epfd_, op, fd, &ev) != 0) {
+      throw std::runtime_error(op == EPOLL_CTL_ADD ? "epoll_ctl(EPOLL_CTL_ADD) failed"
+                                                   : "epoll_ctl(EPOLL_CTL_MOD) failed");
+    }
+  }
+
+  int epfd_ = -1;
+  std::vector<epoll_event> events_;
+};
+
+#endif  // __linux__
+
+}  // namespace
+
+std::unique_ptr<Poller> makePoller(Backend backend) {
+  switch (backend) {
+    case Backend::Epoll:
+    case Backend::IoUring:
+#ifdef __linux__
+      return std::make_unique<EpollPoller>();
+#else
+      return std::make_unique<PollPoller>();
+#endif
+    case Backend::Poll:
+      break;
+  }
+  return std::make_unique<PollPoller>();
+}
+
+bool parseBackend(const char* name, Backend& out) {
+  if (std::strcmp(name, "poll") == 0) {
+    out = Backend::Poll;
+    return true;
+  }
+  if (std::strcmp(name, "epoll") == 0) {
+    out = Backend::Epoll;
+    return true;
+  }
+  if (std::strcmp(name, "io_uring") == 0) {
+    out = Backend::IoUring;
+    return true;
+  }
+  return false;
+}
+
+}  // namespace async
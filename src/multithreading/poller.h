@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace async {
+
+// Backend-independent readiness bits used by Poller.
+namespace PollEvent {
+inline constexpr std::uint32_t kReadable = 1u << 0;
+inline constexpr std::uint32_t kWritable = 1u << 1;
+// Error or hang-up reported by the kernel; never part of the interest set.
+inline constexpr std::uint32_t kError = 1u << 2;
+}  // namespace PollEvent
+
+// A ready file descriptor as reported by Poller::wait().
+struct ReadyEvent {
+  int fd = -1;
+  std::uint32_t events = 0;
+};
+
+// Available readiness backends for the event loop.
+enum class Backend {
+  Poll,   // portable fallback, O(registered fds) per wait
+  Epoll,  // edge-triggered epoll, O(ready fds) per wait (Linux only)
+  // Completion-based io_uring with multishot accept/recv (Linux only).
+  // Not a Poller; EventLoop drives it and falls back to Epoll if the
+  // kernel refuses it.
+  IoUring,
+};
+
+// Interest registry over a set of file descriptors. Interest is registered
+// once and updated only when it changes; wait() reports ready fds only.
+// Backends may be edge-triggered, so callers must drain fds until EAGAIN.
+class Poller {
+ public:
+  virtual ~Poller() = default;
+
+  // Register fd with the given PollEvent::kReadable/kWritable interest.
+  virtual void add(int fd, std::uint32_t interest) = 0;
+
+  // Replace the interest set for an already registered fd.
+  virtual void modify(int fd, std::uint32_t interest) = 0;
+
+  // Unregister fd. Must be called before the fd is closed.
+  virtual void remove(int fd) = 0;
+
+  // Wait up to timeout_ms (-1 = forever) and fill 'out' with ready fds.
+  // Returns normally with an empty 'out' on EINTR.
+  virtual void wait(int timeout_ms, std::vector<ReadyEvent>& out) = 0;
+
+  virtual const char* name() const = 0;
+};
+
+// Create a poller for the requested backend. Falls back to poll() when the
+// backend is not available on this platform; IoUring yields epoll.
+std::unique_ptr<Poller> makePoller(Backend backend);
+
+// Parse "poll" / "epoll" / "io_uring"; returns false on unknown names.
+bool parseBackend(const char* name, Backend& out);
+
+}  // namespace async
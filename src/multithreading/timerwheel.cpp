@@ -0,0 +1,77 @@
+#include "timerwheel.h"
+
+#include <algorithm>
+#include <climits>
+
+namespace async {
+
+TimerWheel::TimerWheel(std::uint64_t tick_ms, std::size_t buckets, std::uint64_t now_ms)
+  : tick_ms_(tick_ms), mask_(buckets - 1), tick_(now_ms / tick_ms), buckets_(buckets) {}
+
+TimerWheel::TimerId TimerWheel::schedule(std::uint64_t due_ms, int fd) {
+  TimerId id = 0;
+  if (free_.empty()) {
+    id = static_cast<TimerId>(timers_.size());
+    timers_.emplace_back();
+  } else {
+    id = free_.back();
+    free_.pop_back();
+  }
+  const std::uint64_t tick = std::max((due_ms + tick_ms_ - 1) / tick_ms_, tick_ + 1);
+  std::vector<TimerId>& bucket = buckets_[tick & mask_];
+  timers_[id] = Timer{tick, fd, static_cast<std::uint32_t>(tick & mask_),
+                      static_cast<std::uint32_t>(bucket.size())};
+  bucket.push_back(id);
+  ++count_;
+  return id;
+}
+
+void TimerWheel::cancel(TimerId id) { remove(id); }
+
+void TimerWheel::remove(TimerId id) {
+  const Timer& timer = timers_[id];
+  std::vector<TimerId>& bucket = buckets_[timer.bucket];
+  const TimerId last = bucket.back();
+  bucket[timer.pos] = last;
+  timers_[last].pos = timer.pos;
+  bucket.pop_back();
+  free_.push_back(id);
+  --count_;
+}
+
+void TimerWheel::advance(std::uint64_t now_ms, std::vector<int>& due) {
+  due.clear();
+  const std::uint64_t target = now_ms / tick_ms_;
+  if (target <= tick_ || count_ == 0) {
+    tick_ = std::max(tick_, target);
+    return;
+  }
+  // After a long gap every bucket is visited once.
+  const std::uint64_t steps = std::min<std::uint64_t>(target - tick_, mask_ + 1);
+  for (std::uint64_t s = 1; s <= steps; ++s) {
+    std::vector<TimerId>& bucket = buckets_[(tick_ + s) & mask_];
+    for (std::size_t i = 0; i < bucket.size();) {
+      const Timer& timer = timers_[bucket[i]];
+      if (timer.due_tick > target) {
+        ++i;
+        continue;
+      }
+      // remove() moves the bucket's last entry to i.
+      due.push_back(timer.fd);
+      remove(bucket[i]);
+    }
+  }
+  tick_ = target;
+}
+
+int TimerWheel::untilNextMs(std::uint64_t now_ms) const {
+  if (count_ == 0) return -1;
+  for (std::uint64_t s = 1; s <= mask_ + 1; ++s) {
+    if (buckets_[(tick_ + s) & mask_].empty()) continue;
+    const std::uint64_t at = (tick_ + s) * tick_ms_;
+    return at <= now_ms ? 0 : static_cast<int>(std::min<std::uint64_t>(at - now_ms, INT_MAX));
+  }
+  return -1;  // unreachable while count_ != 0
+}
+
+}  // namespace async
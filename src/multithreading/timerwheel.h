@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace async {
+
+// Hashed timing wheel: a timer goes into the bucket of the tick it is due
+// in, modulo the number of buckets, so scheduling and cancelling are O(1)
+// and each tick looks at one bucket. Timers more than one turn out stay in
+// their bucket, skipped, until their turn comes round.
+//
+// A timer carries an fd, which is what advance() reports. Not thread-safe:
+// each event loop owns its wheel.
+class TimerWheel {
+ public:
+  using TimerId = std::uint32_t;
+  static constexpr TimerId kNoTimer = UINT32_MAX;
+
+  // 'buckets' must be a power of two. Times are milliseconds on any
+  // monotonic clock; 'now_ms' is the current one.
+  TimerWheel(std::uint64_t tick_ms, std::size_t buckets, std::uint64_t now_ms);
+
+  // Adds a timer firing once the clock reaches 'due_ms', rounded up to the
+  // next tick (and never in the current one).
+  TimerId schedule(std::uint64_t due_ms, int fd);
+
+  // Removes a timer that has not fired yet.
+  void cancel(TimerId id);
+
+  // Removes the timers due by 'now_ms' and puts their fds in 'due'
+  // (cleared first).
+  void advance(std::uint64_t now_ms, std::vector<int>& due);
+
+  // Milliseconds until the first tick with a timer in its bucket, 0 if it
+  // has passed; -1 while the wheel is empty. The timers found may be due a
+  // turn later, so this is a lower bound.
+  int untilNextMs(std::uint64_t now_ms) const;
+
+  std::size_t size() const { return count_; }
+
+ private:
+  struct Timer {
+    std::uint64_t due_tick = 0;
+    int fd = -1;
+    // Where the timer's id sits in buckets_, kept up to date as bucket
+    // entries are moved by removals.
+    std::uint32_t bucket = 0;
+    std::uint32_t pos = 0;
+  };
+
+  // Takes timer 'id' out of its bucket and puts it on the free list.
+  void remove(TimerId id);
+
+  std::uint64_t tick_ms_;
+  std::size_t mask_;
+  std::uint64_t tick_;  // last tick advanced to
+  std::size_t count_ = 0;
+  std::vector<Timer> timers_;  // indexed by TimerId
+  std::vector<TimerId> free_;
+  std::vector<std::vector<TimerId>> buckets_;
+};
+
+}  // namespace async
@@ -0,0 +1,188 @@
+#include "uring.h"
+
+#ifdef ASYNC_HAVE_IO_URING
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <stdexcept>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace async {
+
+namespace {
+int sysSetup(unsigned entries, io_uring_params* p) {
+  return static_cast<int>(::syscall(__NR_io_uring_setup, entries, p));
+}
+
+int sysEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void* arg,
+             std::size_t argsz) {
+  return static_cast<int>(
+      ::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz));
+}
+
+int sysRegister(int fd, unsigned opcode, void* arg, unsigned nr) {
+  return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg, nr));
+}
+
+void* mapRing(int fd, std::size_t size, off_t offset) {
+  void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+  return p == MAP_FAILED ? nullptr : p;
+}
+
+template <typename T>
+T* at(void* base, unsigned offset) {
+  return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+}
+}  // namespace
+
+IoUring::IoUring(unsigned entries, unsigned nbuffers, std::size_t buffer_size) {
+  io_uring_params params{};
+  // One thread submits and reaps; completions are only processed when we
+  // enter the kernel, which avoids task-work interrupts while handling
+  // requests. Older kernels reject these flags, so retry without them.
+  params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  fd_ = sysSetup(entries, &params);
+  if (fd_ < 0 && errno == EINVAL) {
+    params = io_uring_params{};
+    fd_ = sysSetup(entries, &params);
+  }
+  if (fd_ < 0) {
+    throw std::runtime_error("io_uring_setup() failed");
+  }
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+    ::close(fd_);
+    throw std::runtime_error("io_uring: kernel lacks required features");
+  }
+
+  // Both rings live in one mapping (IORING_FEAT_SINGLE_MMAP).
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  const std::size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  if (cq_size > sq_ring_size_) sq_ring_size_ = cq_size;
+  sq_ring_ = mapRing(fd_, sq_ring_size_, IORING_OFF_SQ_RING);
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  sqes_ = sq_ring_ ? static_cast<io_uring_sqe*>(mapRing(fd_, sqes_size_, IORING_OFF_SQES))
+                   : nullptr;
+  if (!sqes_) {
+    if (sq_ring_) ::munmap(sq_ring_, sq_ring_size_);
+    ::close(fd_);
+    throw std::runtime_error("io_uring: mmap() failed");
+  }
+  cq_ring_ = sq_ring_;
+
+  sq_head_ = at<unsigned>(sq_ring_, params.sq_off.head);
+  sq_tail_ = at<unsigned>(sq_ring_, params.sq_off.tail);
+  sq_mask_ = *at<unsigned>(sq_ring_, params.sq_off.ring_mask);
+  sq_entries_ = *at<unsigned>(sq_ring_, params.sq_off.ring_entries);
+  sq_array_ = at<unsigned>(sq_ring_, params.sq_off.array);
+  sq_local_tail_ = submitted_tail_ = *sq_tail_;
+  cq_head_ = at<unsigned>(cq_ring_, params.cq_off.head);
+  cq_tail_ = at<unsigned>(cq_ring_, params.cq_off.tail);
+  cq_mask_ = *at<unsigned>(cq_ring_, params.cq_off.ring_mask);
+  cqes_ = at<io_uring_cqe>(cq_ring_, params.cq_off.cqes);
+
+  // Provided buffer ring: the kernel picks a free buffer for each receive,
+  // so idle connections do not pin a buffer each.
+  nbuffers_ = nbuffers;
+  buffer_size_ = buffer_size;
+  buf_mask_ = nbuffers - 1;
+  buf_ring_size_ = nbuffers * sizeof(io_uring_buf);
+  void* ring = ::mmap(nullptr, buf_ring_size_, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  void* bufs = ::mmap(nullptr, nbuffers * buffer_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED || bufs == MAP_FAILED) {
+    if (ring != MAP_FAILED) ::munmap(ring, buf_ring_size_);
+    if (bufs != MAP_FAILED) ::munmap(bufs, nbuffers * buffer_size);
+    release();
+    throw std::runtime_error("io_uring: buffer allocation failed");
+  }
+  buf_ring_ = static_cast<io_uring_buf_ring*>(ring);
+  buffers_ = static_cast<std::uint8_t*>(bufs);
+
+  io_uring_buf_reg reg{};
+  reg.ring_addr = reinterpret_cast<std::uint64_t>(buf_ring_);
+  reg.ring_entries = nbuffers;
+  reg.bgid = kBufferGroup;
+  if (sysRegister(fd_, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+    release();
+    throw std::runtime_error("io_uring: IORING_REGISTER_PBUF_RING failed");
+  }
+  for (unsigned i = 0; i < nbuffers; ++i) recycleBuffer(static_cast<std::uint16_t>(i));
+}
+
+IoUring::~IoUring() { release(); }
+
+void IoUring::release() {
+  if (buffers_) ::munmap(buffers_, nbuffers_ * buffer_size_);
+  if (buf_ring_) ::munmap(buf_ring_, buf_ring_size_);
+  if (sqes_) ::munmap(sqes_, sqes_size_);
+  if (sq_ring_) ::munmap(sq_ring_, sq_ring_size_);
+  if (fd_ >= 0) ::close(fd_);
+  buffers_ = nullptr;
+  buf_ring_ = nullptr;
+  sqes_ = nullptr;
+  sq_ring_ = nullptr;
+  fd_ = -1;
+}
+
+io_uring_sqe* IoUring::sqe() {
+  const unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  if (sq_local_tail_ - head >= sq_entries_) {
+    enter(sq_local_tail_ - submitted_tail_, 0, 0);
+  }
+  const unsigned idx = sq_local_tail_ & sq_mask_;
+  io_uring_sqe* e = &sqes_[idx];
+  std::memset(e, 0, sizeof(*e));
+  sq_array_[idx] = idx;
+  ++sq_local_tail_;
+  return e;
+}
+
+void IoUring::submitAndWait(int timeout_ms) {
+  const unsigned pending = sq_local_tail_ - submitted_tail_;
+  if (timeout_ms == 0) {
+    // DEFER_TASKRUN only runs completions on GETEVENTS, so always ask.
+    enter(pending, 0, 0);
+    return;
+  }
+  enter(pending, 1, timeout_ms);
+}
+
+void IoUring::enter(unsigned to_submit, unsigned min_complete, int timeout_ms) {
+  // Publish the new tail before the kernel reads it.
+  __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+
+  __kernel_timespec ts{};
+  io_uring_getevents_arg arg{};
+  arg.sigmask_sz = _NSIG / 8;
+  if (timeout_ms > 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = static_cast<long long>(timeout_ms % 1000) * 1000000;
+    arg.ts = reinterpret_cast<std::uint64_t>(&ts);
+  }
+  const unsigned flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+  const int rv = sysEnter(fd_, to_submit, min_complete, flags, &arg, sizeof(arg));
+  if (rv < 0 && errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+    throw std::runtime_error("io_uring_enter() failed");
+  }
+  if (rv > 0) submitted_tail_ += static_cast<unsigned>(rv);
+}
+
+void IoUring::recycleBuffer(std::uint16_t id) {
+  // Index the entries by hand: in C++ the header's flexible-array wrapper
+  // gives the empty placeholder a size and shifts 'bufs' by 8 bytes.
+  io_uring_buf& b = reinterpret_cast<io_uring_buf*>(buf_ring_)[buf_tail_ & buf_mask_];
+  b.addr = reinterpret_cast<std::uint64_t>(buffers_ + id * buffer_size_);
+  b.len = static_cast<std::uint32_t>(buffer_size_);
+  b.bid = id;
+  ++buf_tail_;
+  __atomic_store_n(&buf_ring_->tail, buf_tail_, __ATOMIC_RELEASE);
+}
+
+}  // namespace async
+
+#endif  // ASYNC_HAVE_IO_URING
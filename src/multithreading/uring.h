@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define ASYNC_HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#endif
+
+namespace async {
+
+#ifdef ASYNC_HAVE_IO_URING
+
+// Minimal io_uring wrapper over the raw syscalls: one submission and one
+// completion ring, plus a ring of provided receive buffers. Not thread-safe;
+// each event loop owns its ring.
+class IoUring {
+ public:
+  // Throws std::runtime_error if the kernel does not support io_uring or
+  // the features the event loop relies on.
+  IoUring(unsigned entries, unsigned nbuffers, std::size_t buffer_size);
+  ~IoUring();
+  IoUring(const IoUring&) = delete;
+  IoUring& operator=(const IoUring&) = delete;
+
+  // Returns a zeroed submission entry. Flushes the ring to the kernel first
+  // if it is full.
+  io_uring_sqe* sqe();
+
+  // Submits queued entries and waits up to timeout_ms (-1 = forever, 0 =
+  // don't wait) for at least one completion.
+  void submitAndWait(int timeout_ms);
+
+  // Calls fn(const io_uring_cqe&) for every available completion.
+  template <typename Fn>
+  void drainCompletions(Fn&& fn) {
+    unsigned head = *cq_head_;
+    const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+      fn(cqes_[head & cq_mask_]);
+      ++head;
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+
+  // Provided buffers for IOSQE_BUFFER_SELECT receives use this group id.
+  static constexpr std::uint16_t kBufferGroup = 0;
+  std::size_t bufferSize() const { return buffer_size_; }
+  const std::uint8_t* buffer(std::uint16_t id) const { return buffers_ + id * buffer_size_; }
+  // Hands a buffer reported in a completion back to the kernel.
+  void recycleBuffer(std::uint16_t id);
+
+ private:
+  void enter(unsigned to_submit, unsigned min_complete, int timeout_ms);
+  void release();
+
+  int fd_ = -1;
+  // Submission ring
+  void* sq_ring_ = nullptr;
+  std::size_t sq_ring_size_ = 0;
+  unsigned* sq_tail_ = nullptr;
+  unsigned* sq_head_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  unsigned* sq_array_ = nullptr;
+  io_uring_sqe* sqes_ = nullptr;
+  std::size_t sqes_size_ = 0;
+  unsigned sq_local_tail_ = 0;
+  unsigned submitted_tail_ = 0;
+  // Completion ring (shares the sq mapping with IORING_FEAT_SINGLE_MMAP)
+  void* cq_ring_ = nullptr;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe* cqes_ = nullptr;
+  // Provided buffer ring
+  io_uring_buf_ring* buf_ring_ = nullptr;
+  std::size_t buf_ring_size_ = 0;
+  unsigned buf_mask_ = 0;
+  std::uint16_t buf_tail_ = 0;
+  std::uint8_t* buffers_ = nullptr;
+  std::size_t buffer_size_ = 0;
+  unsigned nbuffers_ = 0;
+};
+
+#endif  // ASYNC_HAVE_IO_URING
+
+}  // namespace async
@@ -0,0 +1,439 @@
+#include "aof.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fileutil.h"
+#include "../commands/registry.h"
+#include "../multithreading/asyncio.h"
+#include "../utils/utils.h"
+
+namespace async {
+
+namespace {
+// Write buffers larger than this are released after use, not kept.
+constexpr std::size_t kMaxKeptBuffer = 4u << 20;
+// Rewrite: dump bytes collected per write(), and how small the change
+// backlog must get before the final step, which briefly stops flushes.
+constexpr std::size_t kRewriteChunk = 1u << 20;
+constexpr std::size_t kRewriteFinalDiff = 64u << 10;
+// After a failed automatic rewrite, wait this long before the next one.
+constexpr std::uint64_t kRewriteRetryMs = 60000;
+// EverySec: how long a write may wait for a running fsync.
+constexpr std::uint64_t kMaxPostponeMs = 2000;
+// Replay: bytes read per read(), and commands run per sink connection
+// (whose replies are discarded).
+constexpr std::size_t kReadChunk = 1u << 20;
+constexpr std::size_t kCommandsPerSink = 4096;
+
+std::uint64_t monotonicMs() { return monotonic_ns() / 1000000; }
+
+void appendU32(std::string& out, std::uint32_t v) {
+  out.append(reinterpret_cast<const char*>(&v), 4);
+}
+
+std::runtime_error corrupt(const std::string& path, std::uint64_t offset, const char* what) {
+  return std::runtime_error("AOF " + path + " is corrupt at offset " + std::to_string(offset) +
+                            ": " + what);
+}
+
+// Runs every command in the file through its handler, as if a client sent
+// them. A truncated last frame is cut off; returns the commands run.
+std::size_t replay(int fd, const std::string& path, KVStore& store) {
+  CommandRegistry& registry = CommandRegistry::instance();
+  LoopContext loop(0);
+  std::unique_ptr<Connection> sink;
+  std::vector<std::string_view> args;
+  std::vector<std::uint8_t> buf(kReadChunk);
+  std::size_t begin = 0;
+  std::size_t end = 0;
+  std::uint64_t offset = 0;  // file offset of buf[begin]
+  std::size_t replayed = 0;
+  for (;;) {
+    while (end - begin >= 4) {
+      std::uint32_t len = 0;
+      std::memcpy(&len, buf.data() + begin, 4);
+      if (end - begin - 4 < len) break;
+      if (!Connection::parseRequest(buf.data() + begin + 4, len, args) || args.empty()) {
+        throw corrupt(path, offset, "malformed frame");
+      }
+      const Command* command = registry.find(args[0]);
+      if (!command || !command->arityOk(args.size())) {
+        throw corrupt(path, offset, "unknown command or wrong arity");
+      }
+      if (replayed % kCommandsPerSink == 0) sink = std::make_unique<Connection>(-1, loop);
+      CommandContext ctx{store, args, *sink};
+      command->spec.handler(ctx);
+      ++replayed;
+      begin += 4u + len;
+      offset += 4u + len;
+    }
+
+    // Keep the partial frame and read more behind it, making room for all
+    // of it if it is larger than a chunk.
+    std::memmove(buf.data(), buf.data() + begin, end - begin);
+    end -= begin;
+    begin = 0;
+    std::size_t want = end + kReadChunk;
+    if (end >= 4) {
+      std::uint32_t len = 0;
+      std::memcpy(&len, buf.data(), 4);
+      want = std::max<std::size_t>(want, 4u + len);
+    }
+    if (buf.size() < want) buf.resize(want);
+    const ssize_t rv = ::read(fd, buf.data() + end, buf.size() - end);
+    if (rv < 0 && errno == EINTR) continue;
+    if (rv < 0) throw std::runtime_error(errnoText("cannot read " + path));
+    if (rv == 0) break;
+    end += static_cast<std::size_t>(rv);
+  }
+
+  if (end != 0) {
+    std::fprintf(stderr, "AOF %s: truncated last record at offset %llu, %zu bytes dropped\n",
+                 path.c_str(), static_cast<unsigned long long>(offset), end);
+    if (::truncate(path.c_str(), static_cast<off_t>(offset)) != 0) {
+      throw std::runtime_error(errnoText("cannot truncate " + path));
+    }
+  }
+  return replayed;
+}
+}  // namespace
+
+// Request frame: [len: u32][nstr: u32] { [len: u32][bytes...] } * nstr
+void appendFrame(std::string& out, const std::string_view* args, std::size_t argc) {
+  std::size_t len = 4;
+  for (std::size_t i = 0; i < argc; ++i) len += 4 + args[i].size();
+  appendU32(out, static_cast<std::uint32_t>(len));
+  appendU32(out, static_cast<std::uint32_t>(argc));
+  for (std::size_t i = 0; i < argc; ++i) {
+    appendU32(out, static_cast<std::uint32_t>(args[i].size()));
+    out.append(args[i]);
+  }
+}
+
+void rewriteKey(std::string_view key, std::string_view value, const Object* object,
+                std::int64_t expire_at,
+                const std::function<void(const std::string_view* args, std::size_t argc)>& emit) {
+  char buf[24];
+  const auto res = std::to_chars(buf, buf + sizeof(buf), expire_at);
+  const std::string_view when(buf, static_cast<std::size_t>(res.ptr - buf));
+  if (object) {
+    // Collections are rebuilt by their own commands, then given the expiry.
+    object->rewrite(key, emit);
+    if (expire_at != KVStore::kNoExpiry) {
+      const std::string_view args[] = {"pexpireat", key, when};
+      emit(args, 3);
+    }
+  } else if (expire_at == KVStore::kNoExpiry) {
+    const std::string_view args[] = {"set", key, value};
+    emit(args, 3);
+  } else {
+    const std::string_view args[] = {"set", key, value, "pxat", when};
+    emit(args, 5);
+  }
+}
+
+bool parseFsyncPolicy(const char* name, FsyncPolicy& out) {
+  static const FsyncPolicy kAll[] = {FsyncPolicy::Always, FsyncPolicy::EverySec, FsyncPolicy::No};
+  for (FsyncPolicy policy : kAll) {
+    if (std::strcmp(name, fsyncPolicyName(policy)) == 0) {
+      out = policy;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char* fsyncPolicyName(FsyncPolicy policy) {
+  switch (policy) {
+    case FsyncPolicy::Always: return "always";
+    case FsyncPolicy::EverySec: return "everysec";
+    case FsyncPolicy::No: return "no";
+  }
+  return "unknown";
+}
+
+// ===================== AppendOnlyFile =====================
+
+AppendOnlyFile& AppendOnlyFile::instance() {
+  static AppendOnlyFile aof;
+  return aof;
+}
+
+AppendOnlyFile::~AppendOnlyFile() {
+  {
+    std::lock_guard<std::mutex> lock(stop_mu_);
+    stop_ = true;
+  }
+  stop_cv_.notify_all();
+  if (fsync_thread_.joinable()) fsync_thread_.join();
+  if (rewrite_thread_.joinable()) rewrite_thread_.join();
+  if (fd_ >= 0) ::close(fd_);
+}
+
+std::size_t AppendOnlyFile::open(const Options& options, KVStore& store) {
+  if (store_) throw std::runtime_error("AOF is already open");
+  options_ = options;
+  const char* path = options_.path.c_str();
+
+  std::size_t replayed = 0;
+  const int rfd = ::open(path, O_RDONLY | O_CLOEXEC);
+  if (rfd >= 0) {
+    store.setLoading(true);
+    try {
+      replayed = replay(rfd, options_.path, store);
+    } catch (...) {
+      store.setLoading(false);
+      ::close(rfd);
+      throw;
+    }
+    store.setLoading(false);
+    ::close(rfd);
+  } else if (errno != ENOENT) {
+    throw std::runtime_error(errnoText("cannot open " + options_.path));
+  }
+
+  fd_ = ::open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd_ < 0) throw std::runtime_error(errnoText("cannot open " + options_.path));
+  struct stat st {};
+  if (::fstat(fd_, &st) != 0) throw std::runtime_error(errnoText("cannot stat " + options_.path));
+  size_.store(static_cast<std::uint64_t>(st.st_size), std::memory_order_relaxed);
+  base_size_.store(static_cast<std::uint64_t>(st.st_size), std::memory_order_relaxed);
+
+  store_ = &store;
+  store.addWriteObserver(this);
+  if (options_.fsync == FsyncPolicy::EverySec) {
+    fsync_thread_ = std::thread(&AppendOnlyFile::fsyncLoop, this);
+  }
+  return replayed;
+}
+
+void AppendOnlyFile::onWrite(std::size_t shard, const std::string_view* args, std::size_t argc) {
+  std::lock_guard<std::mutex> lock(buf_mu_);
+  appendFrame(buf_, args, argc);
+  buffered_.store(buf_.size(), std::memory_order_relaxed);
+  // Changes to shards not dumped yet will be part of the dump.
+  if (diff_active_ && dumped_[shard]) appendFrame(rewrite_diff_, args, argc);
+}
+
+void AppendOnlyFile::flush() {
+  if (!pending()) return;
+  const FsyncPolicy policy = options_.fsync;
+  std::unique_lock<std::mutex> lock(write_mu_, std::defer_lock);
+  if (policy == FsyncPolicy::Always) {
+    // Replies go out after this returns, so this loop's changes must be on
+    // disk by then even if another thread is writing them.
+    lock.lock();
+  } else if (!lock.try_lock()) {
+    return;  // the writer, or this loop's next iteration, picks them up
+  }
+
+  if (policy == FsyncPolicy::EverySec && fsync_in_progress_.load(std::memory_order_acquire)) {
+    // write() would likely block behind the fsync; keep buffering, but not
+    // for long, so at most a few seconds of writes are at risk.
+    const std::uint64_t now = monotonicMs();
+    if (postponed_since_ms_ == 0) postponed_since_ms_ = now;
+    if (now - postponed_since_ms_ < kMaxPostponeMs) return;
+    delayed_fsyncs_.fetch_add(1, std::memory_order_relaxed);
+  }
+  postponed_since_ms_ = 0;
+
+  {
+    std::lock_guard<std::mutex> buf_lock(buf_mu_);
+    out_.swap(buf_);
+    buffered_.store(0, std::memory_order_relaxed);
+  }
+  if (out_.empty()) return;
+  if (!writeAll(fd_, out_)) {
+    last_write_ok_.store(false, std::memory_order_relaxed);
+    throw std::runtime_error(errnoText("AOF write failed"));
+  }
+  const std::uint64_t size = size_.fetch_add(out_.size(), std::memory_order_relaxed) + out_.size();
+  if (out_.capacity() > kMaxKeptBuffer) {
+    std::string().swap(out_);
+  } else {
+    out_.clear();
+  }
+  if (policy == FsyncPolicy::Always) {
+    if (::fdatasync(fd_) != 0) {
+      last_write_ok_.store(false, std::memory_order_relaxed);
+      throw std::runtime_error(errnoText("AOF fsync failed"));
+    }
+  } else if (policy == FsyncPolicy::EverySec) {
+    unsynced_.store(true, std::memory_order_relaxed);
+  }
+  last_write_ok_.store(true, std::memory_order_relaxed);
+  lock.unlock();
+
+  const unsigned pct = options_.auto_rewrite_percentage;
+  const std::uint64_t base = base_size_.load(std::memory_order_relaxed);
+  if (pct != 0 && size >= options_.auto_rewrite_min_size && size >= base + base * pct / 100 &&
+      !rewriting_.load(std::memory_order_relaxed) &&
+      (last_rewrite_ok_.load(std::memory_order_relaxed) ||
+       monotonicMs() - last_rewrite_end_ms_.load(std::memory_order_relaxed) >= kRewriteRetryMs)) {
+    rewrite();
+  }
+}
+
+void AppendOnlyFile::fsyncLoop() {
+  std::unique_lock<std::mutex> lock(stop_mu_);
+  while (!stop_) {
+    stop_cv_.wait_for(lock, std::chrono::seconds(1));
+    if (stop_) break;
+    if (!unsynced_.exchange(false, std::memory_order_relaxed)) continue;
+    lock.unlock();
+    fsync_in_progress_.store(true, std::memory_order_release);
+    {
+      std::lock_guard<std::mutex> fsync_lock(fsync_mu_);
+      if (::fdatasync(fd_) != 0) std::perror("AOF fsync failed");
+    }
+    fsync_in_progress_.store(false, std::memory_order_release);
+    lock.lock();
+  }
+}
+
+bool AppendOnlyFile::rewrite() {
+  std::lock_guard<std::mutex> lock(rewrite_mu_);
+  if (!store_ || rewriting_.load(std::memory_order_relaxed)) return false;
+  if (rewrite_thread_.joinable()) rewrite_thread_.join();
+  {
+    std::lock_guard<std::mutex> buf_lock(buf_mu_);
+    dumped_.assign(store_->shardCount(), 0);
+    rewrite_diff_.clear();
+    diff_active_ = true;
+  }
+  rewriting_.store(true, std::memory_order_relaxed);
+  rewrite_thread_ = std::thread(&AppendOnlyFile::runRewrite, this);
+  return true;
+}
+
+void AppendOnlyFile::takeRewriteDiff(std::string& out) {
+  std::lock_guard<std::mutex> lock(buf_mu_);
+  out.append(rewrite_diff_);
+  rewrite_diff_.clear();
+}
+
+void AppendOnlyFile::runRewrite() {
+  const std::string tmp = options_.path + ".rewrite";
+  const int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    std::perror("AOF rewrite: cannot create temporary file");
+    abortRewrite(-1, tmp);
+    return;
+  }
+
+  std::string chunk;
+  std::uint64_t written = 0;
+  const std::function<void(const std::string_view*, std::size_t)> emit =
+      [&chunk](const std::string_view* args, std::size_t argc) { appendFrame(chunk, args, argc); };
+  const auto dumpKey = [&emit](std::string_view key, std::string_view value, const Object* object,
+                               std::int64_t expire_at) {
+    rewriteKey(key, value, object, expire_at, emit);
+  };
+  const auto writeChunk = [&]() {
+    const bool ok = writeAll(fd, chunk);
+    written += chunk.size();
+    chunk.clear();
+    return ok;
+  };
+
+  bool ok = true;
+  for (std::size_t i = 0; i < store_->shardCount() && ok; ++i) {
+    store_->exportShard(i, dumpKey, [this, i] { dumped_[i] = 1; });
+    if (chunk.size() >= kRewriteChunk) ok = writeChunk();
+  }
+  // Catch up with the changes made meanwhile until few are left, then
+  // put the file on disk while the server keeps running.
+  ok = ok && writeChunk();
+  while (ok) {
+    takeRewriteDiff(chunk);
+    if (chunk.size() < kRewriteFinalDiff) break;
+    ok = writeChunk();
+  }
+  ok = ok && ::fdatasync(fd) == 0;
+  if (!ok) {
+    std::perror("AOF rewrite failed");
+    abortRewrite(fd, tmp);
+    return;
+  }
+
+  // Final step: no flush runs until the new file has replaced the old one.
+  // Everything buffered for the old file so far is in the new one, either
+  // in the dump or in the diff, and is dropped once the switch is made.
+  std::unique_lock<std::mutex> write_lock(write_mu_);
+  std::size_t covered = 0;
+  {
+    std::lock_guard<std::mutex> buf_lock(buf_mu_);
+    chunk.append(rewrite_diff_);
+    std::string().swap(rewrite_diff_);
+    diff_active_ = false;
+    covered = buf_.size();
+  }
+  ok = writeChunk() && ::fdatasync(fd) == 0 &&
+       ::rename(tmp.c_str(), options_.path.c_str()) == 0;
+  if (!ok) {
+    std::perror("AOF rewrite failed");
+    write_lock.unlock();
+    abortRewrite(fd, tmp);
+    return;
+  }
+  if (!syncParentDir(options_.path)) std::perror("AOF rewrite: cannot sync directory");
+  {
+    std::lock_guard<std::mutex> fsync_lock(fsync_mu_);
+    ::close(fd_);
+    fd_ = fd;
+  }
+  {
+    std::lock_guard<std::mutex> buf_lock(buf_mu_);
+    buf_.erase(0, covered);
+    buffered_.store(buf_.size(), std::memory_order_relaxed);
+  }
+  size_.store(written, std::memory_order_relaxed);
+  base_size_.store(written, std::memory_order_relaxed);
+  write_lock.unlock();
+
+  rewrites_.fetch_add(1, std::memory_order_relaxed);
+  last_rewrite_ok_.store(true, std::memory_order_relaxed);
+  last_rewrite_end_ms_.store(monotonicMs(), std::memory_order_relaxed);
+  rewriting_.store(false, std::memory_order_release);
+}
+
+void AppendOnlyFile::abortRewrite(int fd, const std::string& tmp_path) {
+  if (fd >= 0) ::close(fd);
+  ::unlink(tmp_path.c_str());
+  {
+    std::lock_guard<std::mutex> lock(buf_mu_);
+    std::string().swap(rewrite_diff_);
+    diff_active_ = false;
+  }
+  last_rewrite_ok_.store(false, std::memory_order_relaxed);
+  last_rewrite_end_ms_.store(monotonicMs(), std::memory_order_relaxed);
+  rewriting_.store(false, std::memory_order_release);
+}
+
+AppendOnlyFile::Status AppendOnlyFile::status() const {
+  Status s;
+  s.enabled = enabled();
+  s.fsync = options_.fsync;
+  s.rewrite_in_progress = rewriting_.load(std::memory_order_relaxed);
+  s.last_rewrite_ok = last_rewrite_ok_.load(std::memory_order_relaxed);
+  s.last_write_ok = last_write_ok_.load(std::memory_order_relaxed);
+  s.current_size = size_.load(std::memory_order_relaxed);
+  s.base_size = base_size_.load(std::memory_order_relaxed);
+  s.buffered = buffered_.load(std::memory_order_relaxed);
+  s.rewrites = rewrites_.load(std::memory_order_relaxed);
+  s.delayed_fsyncs = delayed_fsyncs_.load(std::memory_order_relaxed);
+  return s;
+}
+
+}  // namespace async
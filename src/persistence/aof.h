@@ -0,0 +1,168 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "../storage/kvstore.h"
+
+namespace async {
+
+// When the append-only file is fsynced.
+enum class FsyncPolicy {
+  Always,    // before replies to the writes are sent
+  EverySec,  // once a second, on a background thread
+  No,        // whenever the kernel writes the pages back
+};
+
+// Parse "always" / "everysec" / "no".
+bool parseFsyncPolicy(const char* name, FsyncPolicy& out);
+const char* fsyncPolicyName(FsyncPolicy policy);
+
+// Appends the request frame of args[0..argc) to 'out': the client wire
+// format, in which the AOF and the replication stream carry changes.
+void appendFrame(std::string& out, const std::string_view* args, std::size_t argc);
+
+// Calls emit(args, argc) with the commands that recreate one key, given as
+// KVStore::exportShard() reports it: "set" for strings, the object's own
+// rewrite() commands then "pexpireat" for objects. Used by the AOF rewrite
+// and by cluster slot migration.
+void rewriteKey(std::string_view key, std::string_view value, const Object* object,
+                std::int64_t expire_at,
+                const std::function<void(const std::string_view* args, std::size_t argc)>& emit);
+
+// Append-only file: every change to the keyspace, written as the request
+// frame of the command that reproduces it (the client wire format), so that
+// replaying the file rebuilds the store.
+//
+// Changes arrive through KVStore's WriteObserver, under the shard lock, and
+// are appended to a buffer in memory. Event loops call flush() once per
+// iteration, which writes whatever all loops buffered with a single write()
+// (group commit). Under FsyncPolicy::Always it also fsyncs, and loops send
+// the iteration's replies only afterwards; under EverySec a background
+// thread fsyncs once a second, and writes are postponed (for up to two
+// seconds) while an fsync is still running, so that loops never wait on
+// the disk.
+//
+// rewrite() compacts the file without stopping the server: a background
+// thread writes one "set" per live key into a temporary file, shard by
+// shard, each under that shard's read lock. Changes to shards it has
+// already written are collected in a second buffer and appended after the
+// dump; the temporary file then atomically replaces the log.
+class AppendOnlyFile : public WriteObserver {
+ public:
+  struct Options {
+    std::string path;
+    FsyncPolicy fsync = FsyncPolicy::EverySec;
+    // Rewrite once the file has grown by this percentage since the last
+    // rewrite (or startup) and is at least auto_rewrite_min_size bytes; 0
+    // disables automatic rewrites.
+    unsigned auto_rewrite_percentage = 100;
+    std::size_t auto_rewrite_min_size = 64u << 20;
+  };
+
+  // For INFO and metrics.
+  struct Status {
+    bool enabled = false;
+    FsyncPolicy fsync = FsyncPolicy::EverySec;
+    bool rewrite_in_progress = false;
+    bool last_rewrite_ok = true;
+    bool last_write_ok = true;
+    std::uint64_t current_size = 0;  // bytes in the file
+    std::uint64_t base_size = 0;     // size after the last rewrite
+    std::uint64_t buffered = 0;      // bytes not written yet
+    std::uint64_t rewrites = 0;
+    std::uint64_t delayed_fsyncs = 0;  // writes that waited for an fsync
+  };
+
+  static AppendOnlyFile& instance();
+
+  ~AppendOnlyFile() override;
+  AppendOnlyFile(const AppendOnlyFile&) = delete;
+  AppendOnlyFile& operator=(const AppendOnlyFile&) = delete;
+
+  // Replays the file at options.path into 'store' if it exists, then logs
+  // every later change of 'store' to it. A truncated last record (a crash
+  // in the middle of a write) is cut off with a warning; any other damage
+  // throws std::runtime_error, as do I/O errors. Call once, before event
+  // loops start. Returns the number of commands replayed.
+  std::size_t open(const Options& options, KVStore& store);
+
+  bool enabled() const { return store_ != nullptr; }
+  FsyncPolicy fsyncPolicy() const { return options_.fsync; }
+
+  void onWrite(std::size_t shard, const std::string_view* args, std::size_t argc) override;
+
+  // Writes out what is buffered, subject to the fsync policy. Safe from any
+  // thread; a call that finds another thread writing leaves the data to it
+  // (or, under Always, waits for it). Throws std::runtime_error if the file
+  // cannot be written.
+  void flush();
+
+  // True while data is buffered, e.g. because a write was postponed; event
+  // loops then keep polling so that it is flushed soon.
+  bool pending() const { return buffered_.load(std::memory_order_relaxed) != 0; }
+
+  // Starts a background rewrite. Returns false if AOF is off or a rewrite
+  // is already running.
+  bool rewrite();
+
+  Status status() const;
+
+ private:
+  AppendOnlyFile() = default;
+
+  void fsyncLoop();
+  void runRewrite();
+  // Ends a rewrite that could not complete; the current file stays.
+  void abortRewrite(int fd, const std::string& tmp_path);
+  // Moves the changes collected during a rewrite into 'out'.
+  void takeRewriteDiff(std::string& out);
+
+  Options options_;
+  KVStore* store_ = nullptr;
+
+  // Lock order: write_mu_, rewrite_mu_, buf_mu_, fsync_mu_.
+  std::mutex buf_mu_;
+  std::string buf_;           // guarded by buf_mu_
+  std::string rewrite_diff_;  // guarded by buf_mu_
+  bool diff_active_ = false;  // guarded by buf_mu_
+  // Shards the rewrite has dumped. Element i is written under shard i's
+  // read lock and read in onWrite(), under its write lock.
+  std::vector<char> dumped_;
+  std::atomic<std::uint64_t> buffered_{0};
+
+  // Held while writing to fd_ and while it is replaced.
+  std::mutex write_mu_;
+  int fd_ = -1;
+  std::string out_;  // batch being written; guarded by write_mu_
+  std::uint64_t postponed_since_ms_ = 0;
+  std::atomic<std::uint64_t> size_{0};
+  std::atomic<std::uint64_t> base_size_{0};
+  std::atomic<bool> last_write_ok_{true};
+
+  std::mutex fsync_mu_;  // held during a background fsync of fd_
+  std::atomic<bool> unsynced_{false};
+  std::atomic<bool> fsync_in_progress_{false};
+  std::atomic<std::uint64_t> delayed_fsyncs_{0};
+  std::mutex stop_mu_;
+  std::condition_variable stop_cv_;
+  bool stop_ = false;  // guarded by stop_mu_
+  std::thread fsync_thread_;
+
+  std::mutex rewrite_mu_;
+  std::atomic<bool> rewriting_{false};
+  std::atomic<bool> last_rewrite_ok_{true};
+  std::atomic<std::uint64_t> rewrites_{0};
+  std::atomic<std::uint64_t> last_rewrite_end_ms_{0};  // monotonic
+  std::thread rewrite_thread_;
+};
+
+}  // namespace async
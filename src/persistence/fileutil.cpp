@@ -0,0 +1,38 @@
+#include "fileutil.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace async {
+
+bool writeAll(int fd, const char* data, std::size_t n) {
+  while (n > 0) {
+    const ssize_t rv = ::write(fd, data, n);
+    if (rv < 0 && errno == EINTR) continue;
+    if (rv < 0) return false;
+    if (rv == 0) {
+      errno = EIO;
+      return false;
+    }
+    data += rv;
+    n -= static_cast<std::size_t>(rv);
+  }
+  return true;
+}
+
+bool syncParentDir(const std::string& path) {
+  const std::size_t slash = path.rfind('/');
+  const std::string dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+  const int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) return false;
+  const bool ok = ::fsync(fd) == 0;
+  ::close(fd);
+  return ok;
+}
+
+std::string errnoText(const std::string& what) { return what + ": " + std::strerror(errno); }
+
+}  // namespace async
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace async {
+
+// Helpers shared by the persistence code.
+
+// write()s all 'n' bytes, retrying on EINTR. Returns false with errno set.
+bool writeAll(int fd, const char* data, std::size_t n);
+inline bool writeAll(int fd, const std::string& data) { return writeAll(fd, data.data(), data.size()); }
+
+// Makes a rename in the file's directory durable.
+bool syncParentDir(const std::string& path);
+
+// "what: <strerror(errno)>".
+std::string errnoText(const std::string& what);
+
+}  // namespace async
@@ -0,0 +1,593 @@
+#include "snapshot.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "fileutil.h"
+#include "../utils/lz4.h"
+#include "../utils/utils.h"
+
+namespace async {
+
+namespace {
+constexpr char kMagic[8] = {'K', 'V', 'S', 'N', 'A', 'P', 'S', 'H'};
+constexpr std::uint32_t kVersion = 1;
+constexpr std::uint32_t kFlagLz4 = 1;
+constexpr std::size_t kHeaderBytes = 40;
+constexpr std::size_t kSectionHeaderBytes = 16;
+constexpr std::size_t kBlockHeaderBytes = 12;
+// Record types are 2 * ValueType, plus this bit when an expiry follows.
+constexpr std::uint8_t kTypeExpiryBit = 1;
+constexpr std::uint8_t kMaxValueType = static_cast<std::uint8_t>(ValueType::List);
+// Records per block are cut at about this many raw bytes; output is
+// written in chunks of kIoChunk.
+constexpr std::size_t kBlockBytes = 64u << 10;
+constexpr std::size_t kIoChunk = 1u << 20;
+// LZ4 never expands data by more than this factor.
+constexpr std::uint64_t kMaxLz4Ratio = 256;
+
+// CRC-32 as in zlib (reflected, polynomial 0xEDB88320).
+std::uint32_t crc32(const char* data, std::size_t n) {
+  static const std::array<std::uint32_t, 256> table = [] {
+    std::array<std::uint32_t, 256> t{};
+    for (std::uint32_t i = 0; i < 256; ++i) {
+      std::uint32_t c = i;
+      for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      t[i] = c;
+    }
+    return t;
+  }();
+  std::uint32_t c = 0xFFFFFFFFu;
+  for (std::size_t i = 0; i < n; ++i) {
+    c = table[(c ^ static_cast<std::uint8_t>(data[i])) & 0xFF] ^ (c >> 8);
+  }
+  return c ^ 0xFFFFFFFFu;
+}
+
+template <typename T>
+void putInt(std::string& out, T v) {
+  out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+template <typename T>
+T getInt(const char* p) {
+  T v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+void putVarint(std::string& out, std::uint64_t v) {
+  for (; v >= 0x80; v >>= 7) out.push_back(static_cast<char>(v | 0x80));
+  out.push_back(static_cast<char>(v));
+}
+
+std::runtime_error corrupt(const std::string& path, std::uint64_t offset, const char* what) {
+  return std::runtime_error("snapshot " + path + " is corrupt at offset " + std::to_string(offset) +
+                            ": " + what);
+}
+
+// Streams records into the file layout described in snapshot.h. Section
+// and file headers are written in place with pwrite() once known.
+class Writer {
+ public:
+  Writer(int fd, const std::string& path, bool compress)
+    : fd_(fd), path_(path), compress_(compress) {
+    out_.assign(kHeaderBytes, '\0');
+    offset_ = kHeaderBytes;
+  }
+
+  void beginSection() {
+    section_offset_ = offset_;
+    section_keys_ = 0;
+    out_.append(kSectionHeaderBytes, '\0');
+    offset_ += kSectionHeaderBytes;
+  }
+
+  // 'object' is the value if set, else 'value' is.
+  void add(std::string_view key, std::string_view value, const Object* object,
+           std::int64_t expire_at) {
+    const bool volatile_key = expire_at != KVStore::kNoExpiry;
+    const ValueType type = object ? object->type() : ValueType::String;
+    block_.push_back(static_cast<char>(static_cast<std::uint8_t>(type) * 2 +
+                                       (volatile_key ? kTypeExpiryBit : 0)));
+    putVarint(block_, key.size());
+    block_.append(key);
+    if (object) {
+      encoded_.clear();
+      object->encode(encoded_);
+      value = encoded_;
+    }
+    putVarint(block_, value.size());
+    block_.append(value);
+    if (volatile_key) putInt<std::int64_t>(block_, expire_at);
+    ++section_keys_;
+    ++keys_;
+    if (block_.size() >= kBlockBytes) flushBlock();
+  }
+
+  void endSection() {
+    flushBlock();
+    writeOut();
+    std::string header;
+    putInt<std::uint64_t>(header, section_keys_);
+    putInt<std::uint64_t>(header, offset_ - section_offset_ - kSectionHeaderBytes);
+    writeAt(header, section_offset_);
+  }
+
+  void finish(std::uint32_t sections, std::int64_t time_ms) {
+    writeOut();
+    std::string header(kMagic, sizeof(kMagic));
+    putInt<std::uint32_t>(header, kVersion);
+    putInt<std::uint32_t>(header, compress_ ? kFlagLz4 : 0);
+    putInt<std::uint32_t>(header, sections);
+    putInt<std::uint32_t>(header, 0);
+    putInt<std::uint64_t>(header, keys_);
+    putInt<std::int64_t>(header, time_ms);
+    writeAt(header, 0);
+  }
+
+  std::uint64_t keys() const { return keys_; }
+  std::uint64_t bytes() const { return offset_; }
+
+ private:
+  void flushBlock() {
+    if (block_.empty()) return;
+    const char* data = block_.data();
+    std::size_t stored = block_.size();
+    if (compress_) {
+      compressed_.resize(lz4CompressBound(block_.size()));
+      const std::size_t n = lz4Compress(block_.data(), block_.size(), &compressed_[0]);
+      // Incompressible blocks are stored as they are.
+      if (n < block_.size()) {
+        data = compressed_.data();
+        stored = n;
+      }
+    }
+    putInt<std::uint32_t>(out_, static_cast<std::uint32_t>(block_.size()));
+    putInt<std::uint32_t>(out_, static_cast<std::uint32_t>(stored));
+    putInt<std::uint32_t>(out_, crc32(data, stored));
+    out_.append(data, stored);
+    offset_ += kBlockHeaderBytes + stored;
+    block_.clear();
+    if (out_.size() >= kIoChunk) writeOut();
+  }
+
+  void writeOut() {
+    if (!writeAll(fd_, out_)) throw std::runtime_error(errnoText("cannot write " + path_));
+    out_.clear();
+  }
+
+  void writeAt(const std::string& data, std::uint64_t offset) {
+    if (::pwrite(fd_, data.data(), data.size(), static_cast<off_t>(offset)) !=
+        static_cast<ssize_t>(data.size())) {
+      throw std::runtime_error(errnoText("cannot write " + path_));
+    }
+  }
+
+  int fd_;
+  const std::string& path_;
+  const bool compress_;
+  std::string block_;       // raw records of the current block
+  std::string compressed_;  // its LZ4 form
+  std::string encoded_;     // value of the object being added
+  std::string out_;         // bytes not written yet
+  std::uint64_t offset_ = 0;  // file size including out_
+  std::uint64_t section_offset_ = 0;
+  std::uint64_t section_keys_ = 0;
+  std::uint64_t keys_ = 0;
+};
+
+// Parses the records of one block into 'items', leaving out those whose
+// expiry has passed. Returns the number of records.
+std::uint64_t parseRecords(const char* p, std::size_t n, std::int64_t now_ms,
+                           std::vector<KVStore::LoadItem>& items, const std::string& path,
+                           std::uint64_t offset) {
+  const char* const end = p + n;
+  const auto getVarint = [&](std::uint64_t& v) {
+    v = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+      if (p == end) return false;
+      const std::uint8_t b = static_cast<std::uint8_t>(*p++);
+      v |= static_cast<std::uint64_t>(b & 0x7F) << shift;
+      if (!(b & 0x80)) return true;
+    }
+    return false;
+  };
+  const auto getBytes = [&](std::string_view& out) {
+    std::uint64_t len = 0;
+    if (!getVarint(len) || len > static_cast<std::uint64_t>(end - p)) return false;
+    out = std::string_view(p, static_cast<std::size_t>(len));
+    p += len;
+    return true;
+  };
+
+  std::uint64_t records = 0;
+  while (p < end) {
+    const std::uint8_t type = static_cast<std::uint8_t>(*p++);
+    if (type / 2 > kMaxValueType) throw corrupt(path, offset, "unknown record type");
+    KVStore::LoadItem item{{}, {}, KVStore::kNoExpiry, nullptr};
+    if (!getBytes(item.key) || !getBytes(item.value)) {
+      throw corrupt(path, offset, "truncated record");
+    }
+    if (type & kTypeExpiryBit) {
+      if (end - p < 8) throw corrupt(path, offset, "truncated record");
+      item.expire_at_ms = getInt<std::int64_t>(p);
+      p += 8;
+    }
+    ++records;
+    if (item.expire_at_ms <= now_ms) continue;
+    const ValueType value_type = static_cast<ValueType>(type / 2);
+    if (value_type != ValueType::String) {
+      item.object = decodeObject(value_type, item.value);
+      if (!item.object) throw corrupt(path, offset, "malformed value");
+    }
+    items.push_back(std::move(item));
+  }
+  return records;
+}
+
+// Where a section's blocks are in the mapped file.
+struct Section {
+  std::uint64_t offset;
+  std::uint64_t bytes;
+  std::uint64_t keys;
+};
+
+// Per-thread state of a load.
+struct LoadBuffers {
+  ValueArena arena;
+  std::string raw;  // decompressed block
+  std::vector<KVStore::LoadItem> items;
+};
+
+// Checks and loads the blocks of one section. Returns the number of keys
+// loaded.
+std::size_t loadSection(const char* file, const Section& section, std::int64_t now_ms,
+                        KVStore& store, LoadBuffers& buffers, const std::string& path) {
+  const std::uint64_t end = section.offset + section.bytes;
+  std::uint64_t offset = section.offset;
+  std::uint64_t records = 0;
+  std::size_t loaded = 0;
+  while (offset < end) {
+    if (end - offset < kBlockHeaderBytes) throw corrupt(path, offset, "block overruns its section");
+    const char* block = file + offset;
+    const std::uint32_t raw_len = getInt<std::uint32_t>(block);
+    const std::uint32_t stored_len = getInt<std::uint32_t>(block + 4);
+    if (stored_len > end - offset - kBlockHeaderBytes) {
+      throw corrupt(path, offset, "block overruns its section");
+    }
+    if (raw_len < stored_len || raw_len > stored_len * kMaxLz4Ratio) {
+      throw corrupt(path, offset, "bad block length");
+    }
+    const char* data = block + kBlockHeaderBytes;
+    if (crc32(data, stored_len) != getInt<std::uint32_t>(block + 8)) {
+      throw corrupt(path, offset, "checksum mismatch");
+    }
+    if (stored_len != raw_len) {
+      buffers.raw.resize(raw_len);
+      if (!lz4Decompress(data, stored_len, &buffers.raw[0], raw_len)) {
+        throw corrupt(path, offset, "bad compressed block");
+      }
+      data = buffers.raw.data();
+    }
+    buffers.items.clear();
+    records += parseRecords(data, raw_len, now_ms, buffers.items, path, offset);
+    store.loadBatch(buffers.items.data(), buffers.items.size(), buffers.arena);
+    loaded += buffers.items.size();
+    offset += kBlockHeaderBytes + stored_len;
+  }
+  if (records != section.keys) throw corrupt(path, end, "section key count mismatch");
+  return loaded;
+}
+
+// Maps the file, locates its sections from their headers and loads them
+// on up to 'threads' threads (0: one per CPU), each taking the next
+// section not started yet. Sections are the shards of the saving store,
+// so loaders rarely touch the same shard at once.
+std::size_t loadFile(int fd, const std::string& path, KVStore& store, unsigned threads) {
+  struct stat st;
+  if (::fstat(fd, &st) != 0) throw std::runtime_error(errnoText("cannot stat " + path));
+  const std::uint64_t size = static_cast<std::uint64_t>(st.st_size);
+  if (size < kHeaderBytes) throw corrupt(path, size, "unexpected end of file");
+  void* map = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) throw std::runtime_error(errnoText("cannot map " + path));
+  struct Unmap {
+    void* map;
+    std::size_t size;
+    ~Unmap() { ::munmap(map, size); }
+  } unmap{map, static_cast<std::size_t>(size)};
+  ::madvise(map, size, MADV_SEQUENTIAL);
+  const char* file = static_cast<const char*>(map);
+
+  if (std::memcmp(file, kMagic, sizeof(kMagic)) != 0) {
+    throw corrupt(path, 0, "not a snapshot file");
+  }
+  if (getInt<std::uint32_t>(file + 8) != kVersion) throw corrupt(path, 8, "unsupported version");
+  const std::uint32_t sections = getInt<std::uint32_t>(file + 16);
+  const std::uint64_t keys = getInt<std::uint64_t>(file + 24);
+
+  std::vector<Section> index;
+  std::uint64_t offset = kHeaderBytes;
+  std::uint64_t section_keys = 0;
+  for (std::uint32_t s = 0; s < sections; ++s) {
+    if (size - offset < kSectionHeaderBytes) throw corrupt(path, size, "unexpected end of file");
+    Section section;
+    section.keys = getInt<std::uint64_t>(file + offset);
+    section.bytes = getInt<std::uint64_t>(file + offset + 8);
+    section.offset = offset + kSectionHeaderBytes;
+    if (section.bytes > size - section.offset) throw corrupt(path, size, "unexpected end of file");
+    index.push_back(section);
+    section_keys += section.keys;
+    offset = section.offset + section.bytes;
+  }
+  if (offset != size) throw corrupt(path, offset, "data after the last section");
+  // A record takes at least three bytes before compression.
+  if (section_keys != keys || keys > size / 3 * kMaxLz4Ratio) {
+    throw corrupt(path, offset, "key count mismatch");
+  }
+
+  store.reserve(static_cast<std::size_t>(keys));
+  const std::int64_t now = unix_time_ms();
+  if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+  const std::size_t nthreads = std::max<std::size_t>(1, std::min<std::size_t>(threads, sections));
+
+  std::atomic<std::size_t> next{0};
+  std::atomic<std::size_t> loaded{0};
+  std::atomic<bool> failed{false};
+  std::mutex error_mu;
+  std::exception_ptr error;
+  const auto work = [&] {
+    LoadBuffers buffers;
+    std::size_t count = 0;
+    try {
+      for (std::size_t i; !failed.load(std::memory_order_relaxed) &&
+                          (i = next.fetch_add(1, std::memory_order_relaxed)) < index.size();) {
+        count += loadSection(file, index[i], now, store, buffers, path);
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(error_mu);
+      if (!error) error = std::current_exception();
+      failed.store(true, std::memory_order_relaxed);
+    }
+    loaded.fetch_add(count, std::memory_order_relaxed);
+  };
+  std::vector<std::thread> pool;
+  for (std::size_t i = 1; i < nthreads; ++i) {
+    try {
+      pool.emplace_back(work);
+    } catch (const std::system_error&) {
+      break;  // fewer threads then
+    }
+  }
+  work();
+  for (std::thread& t : pool) t.join();
+  if (error) std::rethrow_exception(error);
+  return loaded.load(std::memory_order_relaxed);
+}
+
+// Sum of a "Name:   N kB" field over /proc/self/smaps_rollup (or smaps on
+// kernels without it), in bytes.
+std::uint64_t procSmapsBytes(const char* field) {
+  std::string text;
+  for (const char* file : {"/proc/self/smaps_rollup", "/proc/self/smaps"}) {
+    const int fd = ::open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) continue;
+    char buf[4096];
+    ssize_t rv;
+    while ((rv = ::read(fd, buf, sizeof(buf))) > 0) text.append(buf, static_cast<std::size_t>(rv));
+    ::close(fd);
+    break;
+  }
+  const std::size_t field_len = std::strlen(field);
+  std::uint64_t kb = 0;
+  for (std::size_t pos = 0; pos < text.size();) {
+    std::size_t eol = text.find('\n', pos);
+    if (eol == std::string::npos) eol = text.size();
+    if (text.compare(pos, field_len, field) == 0) {
+      kb += std::strtoull(text.c_str() + pos + field_len, nullptr, 10);
+    }
+    pos = eol + 1;
+  }
+  return kb * 1024;
+}
+}  // namespace
+
+std::uint64_t writeSnapshot(const KVStore& store, int fd, const std::string& path, bool compress,
+                            std::int64_t time_ms, std::uint64_t& bytes) {
+  Writer out(fd, path, compress);
+  for (std::size_t i = 0; i < store.shardCount(); ++i) {
+    out.beginSection();
+    store.exportShard(
+        i,
+        [&out](std::string_view key, std::string_view value, const Object* object,
+               std::int64_t expire_at) { out.add(key, value, object, expire_at); },
+        [] {});
+    out.endSection();
+  }
+  out.finish(static_cast<std::uint32_t>(store.shardCount()), time_ms);
+  bytes = out.bytes();
+  return out.keys();
+}
+
+std::size_t loadSnapshot(int fd, const std::string& path, KVStore& store, unsigned threads) {
+  return loadFile(fd, path, store, threads);
+}
+
+// ===================== SnapshotFile =====================
+
+SnapshotFile& SnapshotFile::instance() {
+  static SnapshotFile snapshot;
+  return snapshot;
+}
+
+SnapshotFile::~SnapshotFile() {
+  if (waiter_.joinable()) waiter_.join();
+}
+
+void SnapshotFile::configure(const Options& options, KVStore& store) {
+  options_ = options;
+  store_ = &store;
+  std::lock_guard<std::mutex> lock(mu_);
+  status_.enabled = true;
+}
+
+std::size_t SnapshotFile::load() {
+  if (!store_) return 0;
+  const int fd = ::open(options_.path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno == ENOENT) return 0;
+    throw std::runtime_error(errnoText("cannot open " + options_.path));
+  }
+  std::size_t loaded = 0;
+  try {
+    loaded = loadFile(fd, options_.path, *store_, options_.load_threads);
+  } catch (...) {
+    ::close(fd);
+    throw;
+  }
+  ::close(fd);
+  return loaded;
+}
+
+bool SnapshotFile::save() {
+  pid_t pid;
+  int result_fd;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (!store_ || in_progress_) return false;
+    pid = startChild(result_fd);
+    if (pid < 0) return false;
+    in_progress_ = true;
+  }
+  return finishChild(pid, result_fd);
+}
+
+bool SnapshotFile::bgsave() {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (!store_ || in_progress_) return false;
+  if (waiter_.joinable()) waiter_.join();
+  int result_fd;
+  const pid_t pid = startChild(result_fd);
+  if (pid < 0) return false;
+  in_progress_ = true;
+  waiter_ = std::thread([this, pid, result_fd] { finishChild(pid, result_fd); });
+  return true;
+}
+
+pid_t SnapshotFile::startChild(int& result_fd) {
+  int fds[2];
+  if (::pipe2(fds, O_CLOEXEC) != 0) {
+    std::perror("Snapshot: pipe() failed");
+    status_.last_ok = false;
+    return -1;
+  }
+  started_ms_ = unix_time_ms();
+  started_ns_ = monotonic_ns();
+  const pid_t pid = store_->forkSnapshot();
+  if (pid == 0) {
+    ::close(fds[0]);
+    runChild(fds[1]);
+  }
+  const std::uint64_t fork_ns = monotonic_ns() - started_ns_;
+  ::close(fds[1]);
+  if (pid < 0) {
+    std::perror("Snapshot: fork() failed");
+    ::close(fds[0]);
+    status_.last_ok = false;
+    return -1;
+  }
+  status_.last_fork_us = fork_ns / 1000;
+  result_fd = fds[0];
+  return pid;
+}
+
+void SnapshotFile::runChild(int result_fd) {
+  // Only this thread exists here, so nothing below may wait for a lock
+  // another thread of the parent held at the fork; the store is frozen.
+  ChildResult result;
+  const std::string tmp = options_.path + ".tmp-" + std::to_string(::getpid());
+  try {
+    const int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) throw std::runtime_error(errnoText("cannot create " + tmp));
+    result.keys = writeSnapshot(*store_, fd, tmp, options_.compress, started_ms_, result.bytes);
+    if (::fdatasync(fd) != 0) throw std::runtime_error(errnoText("cannot sync " + tmp));
+    ::close(fd);
+    if (::rename(tmp.c_str(), options_.path.c_str()) != 0) {
+      throw std::runtime_error(errnoText("cannot rename " + tmp));
+    }
+    if (!syncParentDir(options_.path)) {
+      throw std::runtime_error(errnoText("cannot sync the directory of " + options_.path));
+    }
+    result.ok = 1;
+  } catch (const std::exception& e) {
+    ::unlink(tmp.c_str());
+    std::snprintf(result.error, sizeof(result.error), "%s", e.what());
+  }
+  // Pages the parent has written since the fork now belong to this
+  // process alone: that is the copy-on-write cost of the snapshot.
+  result.cow_bytes = procSmapsBytes("Private_Dirty:");
+  writeAll(result_fd, reinterpret_cast<const char*>(&result), sizeof(result));
+  ::_exit(result.ok ? 0 : 1);
+}
+
+bool SnapshotFile::finishChild(pid_t pid, int result_fd) {
+  ChildResult result;
+  std::size_t got = 0;
+  while (got < sizeof(result)) {
+    const ssize_t rv = ::read(result_fd, reinterpret_cast<char*>(&result) + got, sizeof(result) - got);
+    if (rv < 0 && errno == EINTR) continue;
+    if (rv <= 0) break;
+    got += static_cast<std::size_t>(rv);
+  }
+  ::close(result_fd);
+  int wstatus = 0;
+  while (::waitpid(pid, &wstatus, 0) < 0 && errno == EINTR) {
+  }
+  store_->resumeRehash();
+
+  const bool reported = got == sizeof(result);
+  const bool ok = reported && result.ok && WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0;
+  if (!ok) {
+    std::fprintf(stderr, "Snapshot %s failed: %s\n", options_.path.c_str(),
+                 reported ? result.error : "the child exited without a result");
+  }
+
+  std::lock_guard<std::mutex> lock(mu_);
+  status_.last_ok = ok;
+  status_.last_duration_ms = (monotonic_ns() - started_ns_) / 1000000;
+  status_.last_cow_bytes = reported ? result.cow_bytes : 0;
+  if (ok) {
+    ++status_.saves;
+    status_.last_save_time_ms = started_ms_;
+    status_.last_keys = result.keys;
+    status_.last_bytes = result.bytes;
+  }
+  in_progress_ = false;
+  return ok;
+}
+
+SnapshotFile::Status SnapshotFile::status() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  Status s = status_;
+  s.in_progress = in_progress_;
+  return s;
+}
+
+}  // namespace async
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <sys/types.h>
+
+#include "../storage/kvstore.h"
+
+namespace async {
+
+// Point-in-time snapshot of the keyspace in a compact binary file.
+//
+// A snapshot is written by a fork()ed child (KVStore::forkSnapshot()), so
+// the server keeps serving while it runs and the child sees the store as
+// of the fork; copy-on-write keeps memory shared until the parent changes
+// it, and the parent pauses incremental rehashing meanwhile to copy fewer
+// pages. The child writes a temporary file and renames it over the old
+// snapshot once it is on disk, then reports its result (and the bytes it
+// ended up owning privately, i.e. copied on write) through a pipe.
+//
+// File layout, little-endian:
+//   header:  "KVSNAPSH", u32 version, u32 flags (bit 0: LZ4), u32 sections,
+//            u32 reserved, u64 keys, i64 time of the snapshot (Unix ms)
+//   sections, one per shard of the saving store:
+//            u64 keys, u64 bytes of the blocks that follow
+//   blocks:  u32 raw length, u32 stored length, u32 CRC-32 of the stored
+//            bytes, then the bytes: LZ4-compressed unless both lengths match
+//   records, packed into blocks and never split between them:
+//            u8 type (2 * ValueType, + 1 with expiry), varint key length,
+//            key, varint value length, value, [i64 expiry (Unix ms)]; the
+//            value of an object is its Object::encode() form
+class SnapshotFile {
+ public:
+  struct Options {
+    std::string path;
+    bool compress = true;  // LZ4 blocks
+    // Threads that load the file at startup; 0: one per CPU.
+    unsigned load_threads = 0;
+  };
+
+  // For INFO and metrics.
+  struct Status {
+    bool enabled = false;
+    bool in_progress = false;
+    bool last_ok = true;
+    std::uint64_t saves = 0;  // completed snapshots
+    std::int64_t last_save_time_ms = 0;  // when the last good one was taken
+    std::uint64_t last_duration_ms = 0;
+    std::uint64_t last_keys = 0;
+    std::uint64_t last_bytes = 0;  // file size
+    std::uint64_t last_cow_bytes = 0;  // memory the child copied on write
+    std::uint64_t last_fork_us = 0;  // time the fork itself took
+  };
+
+  static SnapshotFile& instance();
+
+  ~SnapshotFile();
+  SnapshotFile(const SnapshotFile&) = delete;
+  SnapshotFile& operator=(const SnapshotFile&) = delete;
+
+  // Enables snapshots of 'store' to options.path. Call once, before event
+  // loops start.
+  void configure(const Options& options, KVStore& store);
+  bool enabled() const { return store_ != nullptr; }
+
+  // Loads the file into the store if it exists, skipping keys whose expiry
+  // has passed: the file is mapped and its sections loaded in parallel into
+  // tables sized for them up front. Returns the number of keys loaded. Throws
+  // std::runtime_error if the file cannot be read or is damaged.
+  std::size_t load();
+
+  // Writes a snapshot and waits for it. Returns false if snapshots are off,
+  // one is already being written, or it failed.
+  bool save();
+  // Starts writing a snapshot in the background; false as for save(),
+  // except that failures of the child are only seen in status().
+  bool bgsave();
+
+  Status status() const;
+
+ private:
+  // What the child reports through the pipe.
+  struct ChildResult {
+    std::uint32_t ok = 0;
+    std::uint64_t keys = 0;
+    std::uint64_t bytes = 0;
+    std::uint64_t cow_bytes = 0;
+    char error[256] = {};
+  };
+
+  SnapshotFile() = default;
+
+  // Forks the writer; returns its pid (or -1) and the pipe's read end.
+  pid_t startChild(int& result_fd);
+  [[noreturn]] void runChild(int result_fd);
+  // Waits for the child and records the outcome; returns true on success.
+  bool finishChild(pid_t pid, int result_fd);
+
+  Options options_;
+  KVStore* store_ = nullptr;
+
+  mutable std::mutex mu_;
+  bool in_progress_ = false;  // guarded by mu_
+  Status status_;  // guarded by mu_
+  // When the running snapshot was forked: Unix ms and monotonic ns.
+  std::int64_t started_ms_ = 0;
+  std::uint64_t started_ns_ = 0;
+  std::thread waiter_;  // runs finishChild() for bgsave()
+};
+
+// Writes a snapshot of 'store', dated 'time_ms', to the empty file 'fd';
+// 'path' names it in errors. Meant for the child of forkSnapshot() (or a
+// store nothing else changes meanwhile). Returns the keys written and sets
+// 'bytes' to the file size; throws std::runtime_error on I/O errors.
+std::uint64_t writeSnapshot(const KVStore& store, int fd, const std::string& path, bool compress,
+                            std::int64_t time_ms, std::uint64_t& bytes);
+
+// Loads the snapshot file open at 'fd' into 'store' as SnapshotFile::load()
+// does, on up to 'threads' threads (0: one per CPU). Returns the keys
+// loaded; throws std::runtime_error if the file is damaged.
+std::size_t loadSnapshot(int fd, const std::string& path, KVStore& store, unsigned threads);
+
+}  // namespace async
@@ -0,0 +1,836 @@
+#include "replication.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <random>
+#include <system_error>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../commands/commands.h"
+#include "../multithreading/asyncio.h"
+#include "../persistence/aof.h"
+#include "../persistence/fileutil.h"
+#include "../persistence/snapshot.h"
+#include "../utils/utils.h"
+
+namespace async {
+
+namespace {
+// Threads blocked on a socket wake up this often to check for a stop.
+constexpr int kPollMs = 100;
+// A link that moves no bytes for this long is considered dead.
+constexpr std::uint64_t kTimeoutMs = 60000;
+constexpr std::uint64_t kConnectTimeoutMs = 5000;
+constexpr std::uint64_t kRetryMs = 1000;
+// An idle primary pings this often; replicas acknowledge this often.
+constexpr std::uint64_t kPingIntervalMs = 1000;
+constexpr std::uint64_t kAckIntervalMs = 1000;
+// Stream bytes sent per send(), and received before they are applied.
+constexpr std::size_t kSendChunk = 1u << 20;
+constexpr std::size_t kApplyChunk = 4u << 20;
+// Acknowledgements are tiny; anything bigger is not one.
+constexpr std::size_t kMaxAckFrame = 4096;
+// Commands run per sink connection (whose replies are discarded).
+constexpr std::size_t kCommandsPerSink = 4096;
+constexpr const char* kSnapshotName = "replication snapshot";
+
+std::uint64_t monotonicMs() { return monotonic_ns() / 1000000; }
+
+// 40 random hex digits, like a Redis replication id.
+std::string newReplid() {
+  std::random_device rd;
+  std::mt19937_64 rng((static_cast<std::uint64_t>(rd()) << 32) ^ rd() ^ monotonic_ns());
+  static const char kHex[] = "0123456789abcdef";
+  std::string id(40, '0');
+  for (char& c : id) c = kHex[rng() & 15];
+  return id;
+}
+
+std::string decimal(std::uint64_t v) {
+  char buf[24];
+  const auto res = std::to_chars(buf, buf + sizeof(buf), v);
+  return std::string(buf, res.ptr);
+}
+
+bool parseU64(std::string_view text, std::uint64_t& out) {
+  const auto res = std::from_chars(text.data(), text.data() + text.size(), out);
+  return res.ec == std::errc() && res.ptr == text.data() + text.size();
+}
+
+// Response frame with status 0: [len: u32][status: u32][text]
+std::string responseFrame(std::string_view text) {
+  const std::uint32_t header[2] = {4u + static_cast<std::uint32_t>(text.size()), 0};
+  std::string out(reinterpret_cast<const char*>(header), sizeof(header));
+  out.append(text);
+  return out;
+}
+
+std::vector<std::string_view> splitWords(std::string_view text) {
+  std::vector<std::string_view> words;
+  while (!text.empty()) {
+    const std::size_t end = std::min(text.find(' '), text.size());
+    if (end > 0) words.push_back(text.substr(0, end));
+    text.remove_prefix(std::min(end + 1, text.size()));
+  }
+  return words;
+}
+
+void waitFor(int fd, short events) {
+  pollfd pfd{fd, events, 0};
+  ::poll(&pfd, 1, kPollMs);
+}
+
+// Sends all 'n' bytes on the non-blocking socket 'fd'. Fails on errors,
+// once 'stop' is set, or when the peer takes nothing for kTimeoutMs.
+bool sendAll(int fd, const char* data, std::size_t n, const std::atomic<bool>& stop) {
+  std::uint64_t progress_ms = monotonicMs();
+  while (n > 0) {
+    if (stop.load(std::memory_order_relaxed)) return false;
+    const ssize_t rv = ::send(fd, data, n, MSG_NOSIGNAL);
+    if (rv > 0) {
+      data += rv;
+      n -= static_cast<std::size_t>(rv);
+      progress_ms = monotonicMs();
+    } else if (rv < 0 && errno == EINTR) {
+      continue;
+    } else if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (monotonicMs() - progress_ms >= kTimeoutMs) return false;
+      waitFor(fd, POLLOUT);
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool sendAll(int fd, const std::string& data, const std::atomic<bool>& stop) {
+  return sendAll(fd, data.data(), data.size(), stop);
+}
+
+// Same for the first 'size' bytes of the file 'file', without copying them.
+bool sendFile(int fd, int file, std::uint64_t size, const std::atomic<bool>& stop) {
+  off_t offset = 0;
+  std::uint64_t progress_ms = monotonicMs();
+  while (static_cast<std::uint64_t>(offset) < size) {
+    if (stop.load(std::memory_order_relaxed)) return false;
+    const std::size_t want =
+        static_cast<std::size_t>(std::min<std::uint64_t>(size - offset, kSendChunk));
+    const ssize_t rv = ::sendfile(fd, file, &offset, want);
+    if (rv > 0) {
+      progress_ms = monotonicMs();
+    } else if (rv < 0 && errno == EINTR) {
+      continue;
+    } else if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (monotonicMs() - progress_ms >= kTimeoutMs) return false;
+      waitFor(fd, POLLOUT);
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Appends what the non-blocking socket has (up to about 'limit' bytes in
+// 'in'). Returns the bytes read, 0 if none are there, -1 once the peer
+// closed or the socket failed.
+long receive(int fd, std::string& in, std::size_t limit = kApplyChunk) {
+  char buf[64 * 1024];
+  long total = 0;
+  while (in.size() < limit) {
+    const ssize_t rv = ::recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (rv > 0) {
+      in.append(buf, static_cast<std::size_t>(rv));
+      total += rv;
+      continue;
+    }
+    if (rv < 0 && errno == EINTR) continue;
+    if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    return -1;
+  }
+  return total;
+}
+
+// Receives until 'in' holds at least 'want' bytes. Fails as sendAll() does;
+// 'last_io_ms' is the monotonic time bytes last arrived.
+bool receiveUntil(int fd, std::string& in, std::size_t want, const std::atomic<bool>& stop,
+                  std::atomic<std::uint64_t>& last_io_ms) {
+  while (in.size() < want) {
+    if (stop.load(std::memory_order_relaxed)) return false;
+    const long rv = receive(fd, in, std::max(want, kApplyChunk));
+    if (rv < 0) return false;
+    if (rv > 0) {
+      last_io_ms.store(monotonicMs(), std::memory_order_relaxed);
+      continue;
+    }
+    if (monotonicMs() - last_io_ms.load(std::memory_order_relaxed) >= kTimeoutMs) return false;
+    waitFor(fd, POLLIN);
+  }
+  return true;
+}
+
+void setSocketOptions(int fd) {
+  const int one = 1;
+  ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  ::setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+}
+
+// Connects to host:port with a non-blocking socket; -1 on failure.
+int connectTo(const std::string& host, int port, const std::atomic<bool>& stop) {
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* res = nullptr;
+  if (::getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res) != 0 || !res) {
+    return -1;
+  }
+  const int fd = ::socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  bool connected = false;
+  if (fd >= 0) {
+    connected = ::connect(fd, res->ai_addr, res->ai_addrlen) == 0;
+    if (!connected && errno == EINPROGRESS) {
+      for (std::uint64_t waited = 0; waited < kConnectTimeoutMs && !stop.load(); waited += kPollMs) {
+        pollfd pfd{fd, POLLOUT, 0};
+        if (::poll(&pfd, 1, kPollMs) <= 0) continue;
+        int error = 0;
+        socklen_t len = sizeof(error);
+        connected = ::getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0;
+        break;
+      }
+    }
+  }
+  ::freeaddrinfo(res);
+  if (!connected) {
+    if (fd >= 0) ::close(fd);
+    return -1;
+  }
+  setSocketOptions(fd);
+  return fd;
+}
+
+// Runs stream frames through their command handlers, as an AOF replay does.
+class StreamApplier {
+ public:
+  explicit StreamApplier(KVStore& store) : store_(store), loop_(0) {}
+
+  // Applies the complete frames at the start of 'in' and sets 'used' to the
+  // bytes they take up. Returns false at a frame that cannot be applied.
+  bool apply(const std::string& in, std::size_t& used) {
+    used = 0;
+    while (in.size() - used >= 4) {
+      std::uint32_t len = 0;
+      std::memcpy(&len, in.data() + used, 4);
+      if (len > k_max_msg_limit) return false;
+      if (in.size() - used - 4 < len) break;
+      const auto* frame = reinterpret_cast<const std::uint8_t*>(in.data()) + used + 4;
+      if (!Connection::parseRequest(frame, len, args_) || args_.empty()) return false;
+      const Command* command = registry_.find(args_[0]);
+      if (!command || !command->arityOk(args_.size())) return false;
+      if (applied_ % kCommandsPerSink == 0) sink_ = std::make_unique<Connection>(-1, loop_);
+      CommandContext ctx{store_, args_, *sink_};
+      command->spec.handler(ctx);
+      ++applied_;
+      used += 4u + len;
+    }
+    return true;
+  }
+
+ private:
+  KVStore& store_;
+  CommandRegistry& registry_ = CommandRegistry::instance();
+  LoopContext loop_;
+  std::unique_ptr<Connection> sink_;
+  std::vector<std::string_view> args_;
+  std::size_t applied_ = 0;
+};
+}  // namespace
+
+// ===================== Replication =====================
+
+struct Replication::Sender {
+  int fd = -1;
+  std::string ip;
+  int port = 0;
+  // What the replica asked for.
+  std::string replid;
+  std::uint64_t offset = 0;
+  std::atomic<bool> online{false};
+  std::atomic<std::uint64_t> ack_offset{0};
+  std::atomic<std::uint64_t> ack_ms{0};  // monotonic
+  std::atomic<bool> stop{false};
+  std::atomic<bool> done{false};
+  std::thread thread;
+};
+
+struct Replication::Link {
+  std::string host;
+  int port = 0;
+  std::atomic<bool> stop{false};
+  std::atomic<bool> up{false};
+  std::atomic<bool> syncing{false};
+  std::atomic<std::uint64_t> last_io_ms{0};  // monotonic; 0: nothing yet
+  std::thread thread;
+};
+
+Replication& Replication::instance() {
+  static Replication replication;
+  return replication;
+}
+
+Replication::Replication() : replid_(newReplid()) {}
+
+Replication::~Replication() {
+  std::unique_ptr<Link> link;
+  {
+    std::lock_guard<std::mutex> lock(link_mu_);
+    link.swap(link_);
+  }
+  if (link) {
+    link->stop.store(true);
+    link->thread.join();
+  }
+  dropReplicas();
+  std::lock_guard<std::mutex> lock(senders_mu_);
+  for (const std::unique_ptr<Sender>& sender : senders_) sender->thread.join();
+}
+
+void Replication::configure(const Options& options, KVStore& store) {
+  options_ = options;
+  store_ = &store;
+  store.addWriteObserver(this);
+}
+
+void Replication::onWrite(std::size_t, const std::string_view* args, std::size_t argc) {
+  if (!streaming_.load(std::memory_order_relaxed)) return;
+  std::lock_guard<std::mutex> lock(mu_);
+  // Checked again: a replicaof may have come in between.
+  if (!streaming_.load(std::memory_order_relaxed)) return;
+  frame_.clear();
+  appendFrame(frame_, args, argc);
+  appendBacklog(frame_.data(), frame_.size());
+}
+
+void Replication::flush() {
+  const std::uint64_t end = end_.load(std::memory_order_relaxed);
+  if (end == notified_.load(std::memory_order_relaxed)) return;
+  notified_.store(end, std::memory_order_relaxed);
+  // offset_ changes under mu_, which the senders check it with, so no
+  // wake-up is lost without taking the lock here.
+  grown_.notify_all();
+}
+
+void Replication::startBacklog() {
+  backlog_.assign(std::max<std::size_t>(options_.backlog_bytes, 1), '\0');
+  first_offset_ = offset_;
+  last_append_ms_ = monotonicMs();
+  if (!replica_.load(std::memory_order_relaxed)) streaming_.store(true);
+}
+
+void Replication::appendBacklog(const char* data, std::size_t n) {
+  const std::size_t cap = backlog_.size();
+  // Only the last 'cap' bytes can stay.
+  const std::size_t keep = std::min(n, cap);
+  const std::size_t pos = static_cast<std::size_t>((offset_ + (n - keep)) % cap);
+  const std::size_t first = std::min(keep, cap - pos);
+  std::memcpy(backlog_.data() + pos, data + (n - keep), first);
+  std::memcpy(backlog_.data(), data + (n - keep) + first, keep - first);
+  offset_ += n;
+  first_offset_ = std::max(first_offset_, offset_ > cap ? offset_ - cap : 0);
+  last_append_ms_ = monotonicMs();
+  end_.store(offset_, std::memory_order_relaxed);
+}
+
+bool Replication::canContinue(std::string_view replid, std::uint64_t offset) const {
+  if (backlog_.empty() || offset < first_offset_ || offset > offset_) return false;
+  return replid == replid_ || (!replid2_.empty() && replid == replid2_ && offset <= second_offset_);
+}
+
+// ===================== Primary side =====================
+
+void Replication::addReplica(int fd, std::string_view replid, std::uint64_t offset, int port) {
+  auto sender = std::make_unique<Sender>();
+  sender->fd = fd;
+  sender->port = port;
+  sender->replid.assign(replid);
+  sender->offset = offset;
+  sender->ack_ms.store(monotonicMs());
+  sockaddr_storage ss{};
+  socklen_t len = sizeof(ss);
+  char ip[INET6_ADDRSTRLEN] = "?";
+  if (::getpeername(fd, reinterpret_cast<sockaddr*>(&ss), &len) == 0) {
+    if (ss.ss_family == AF_INET) {
+      ::inet_ntop(AF_INET, &reinterpret_cast<sockaddr_in*>(&ss)->sin_addr, ip, sizeof(ip));
+    } else if (ss.ss_family == AF_INET6) {
+      ::inet_ntop(AF_INET6, &reinterpret_cast<sockaddr_in6*>(&ss)->sin6_addr, ip, sizeof(ip));
+    }
+  }
+  sender->ip = ip;
+  setSocketOptions(fd);
+
+  std::lock_guard<std::mutex> lock(senders_mu_);
+  for (auto it = senders_.begin(); it != senders_.end();) {
+    if ((*it)->done.load()) {
+      (*it)->thread.join();
+      it = senders_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  try {
+    sender->thread = std::thread(&Replication::runSender, this, std::ref(*sender));
+  } catch (const std::system_error& e) {
+    std::fprintf(stderr, "Replication: cannot serve replica %s: %s\n", ip, e.what());
+    ::close(fd);
+    return;
+  }
+  senders_.push_back(std::move(sender));
+}
+
+void Replication::dropReplicas() {
+  std::lock_guard<std::mutex> lock(senders_mu_);
+  for (const std::unique_ptr<Sender>& sender : senders_) sender->stop.store(true);
+}
+
+void Replication::runSender(Sender& sender) {
+  bool partial = false;
+  bool known = false;
+  std::string reply;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (backlog_.empty()) startBacklog();
+    partial = canContinue(sender.replid, sender.offset);
+    known = sender.replid == replid_ || (!replid2_.empty() && sender.replid == replid2_);
+    if (partial) reply = "continue " + replid_;
+  }
+  std::uint64_t next = sender.offset;
+  bool ok = false;
+  if (partial) {
+    partial_syncs_.fetch_add(1, std::memory_order_relaxed);
+    ok = sendAll(sender.fd, responseFrame(reply), sender.stop);
+    if (ok) {
+      std::fprintf(stderr, "Replication: replica %s:%d continues from offset %llu\n",
+                   sender.ip.c_str(), sender.port, static_cast<unsigned long long>(next));
+    }
+  } else {
+    if (known) partial_sync_errors_.fetch_add(1, std::memory_order_relaxed);
+    ok = fullSync(sender, next);
+  }
+  if (ok) {
+    sender.online.store(true);
+    stream(sender, next);
+  }
+  ::close(sender.fd);
+  sender.done.store(true);
+}
+
+bool Replication::fullSync(Sender& sender, std::uint64_t& next) {
+  full_syncs_.fetch_add(1, std::memory_order_relaxed);
+  std::unique_lock<std::mutex> sync(sync_mu_);
+  const int file = ::memfd_create("kv-replication", MFD_CLOEXEC);
+  if (file < 0) {
+    std::perror("Replication: memfd_create() failed");
+    return false;
+  }
+  const std::int64_t time_ms = unix_time_ms();
+  std::string replid;
+  std::uint64_t offset = 0;
+  pid_t pid;
+  {
+    // A replica adds frames to its backlog after applying them; holding
+    // that off makes the snapshot and the offset agree.
+    std::lock_guard<std::mutex> apply(apply_mu_);
+    pid = store_->forkSnapshot([&] {
+      std::lock_guard<std::mutex> lock(mu_);
+      replid = replid_;
+      offset = offset_;
+    });
+  }
+  if (pid == 0) {
+    // Only this thread exists here and the store is frozen, as for
+    // SnapshotFile's child.
+    int code = 0;
+    try {
+      std::uint64_t bytes = 0;
+      writeSnapshot(*store_, file, kSnapshotName, true, time_ms, bytes);
+    } catch (const std::exception& e) {
+      std::fprintf(stderr, "Replication: %s\n", e.what());
+      code = 1;
+    }
+    ::_exit(code);
+  }
+  if (pid < 0) {
+    std::perror("Replication: fork() failed");
+    ::close(file);
+    return false;
+  }
+  int wstatus = 0;
+  while (::waitpid(pid, &wstatus, 0) < 0 && errno == EINTR) {
+  }
+  store_->resumeRehash();
+  sync.unlock();
+
+  struct stat st {};
+  bool ok = false;
+  if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0 || ::fstat(file, &st) != 0) {
+    std::fprintf(stderr, "Replication: snapshot for replica %s:%d failed\n", sender.ip.c_str(),
+                 sender.port);
+  } else {
+    const std::uint64_t size = static_cast<std::uint64_t>(st.st_size);
+    const std::string header =
+        responseFrame("fullresync " + replid + " " + decimal(offset) + " " + decimal(size));
+    ok = sendAll(sender.fd, header, sender.stop) && sendFile(sender.fd, file, size, sender.stop);
+    if (ok) {
+      std::fprintf(stderr, "Replication: replica %s:%d resynced in full, %llu bytes at offset %llu\n",
+                   sender.ip.c_str(), sender.port, static_cast<unsigned long long>(size),
+                   static_cast<unsigned long long>(offset));
+    }
+  }
+  ::close(file);
+  next = offset;
+  return ok;
+}
+
+void Replication::stream(Sender& sender, std::uint64_t next) {
+  static const std::string_view kPing[] = {"ping"};
+  std::string out;
+  std::string in;
+  std::vector<std::string_view> args;
+  while (!sender.stop.load(std::memory_order_relaxed)) {
+    {
+      std::unique_lock<std::mutex> lock(mu_);
+      grown_.wait_for(lock, std::chrono::milliseconds(kPollMs), [&] {
+        return offset_ != next || sender.stop.load(std::memory_order_relaxed);
+      });
+      // A replica passes on its primary's pings instead.
+      if (!replica_.load(std::memory_order_relaxed) &&
+          monotonicMs() - last_append_ms_ >= kPingIntervalMs) {
+        frame_.clear();
+        appendFrame(frame_, kPing, 1);
+        appendBacklog(frame_.data(), frame_.size());
+      }
+      if (next < first_offset_ || next > offset_) {
+        std::fprintf(stderr, "Replication: replica %s:%d fell behind the backlog, dropping it\n",
+                     sender.ip.c_str(), sender.port);
+        return;
+      }
+      const std::size_t cap = backlog_.size();
+      const std::size_t n = static_cast<std::size_t>(std::min<std::uint64_t>(offset_ - next, kSendChunk));
+      const std::size_t pos = static_cast<std::size_t>(next % cap);
+      const std::size_t first = std::min(n, cap - pos);
+      out.assign(backlog_.data() + pos, first);
+      out.append(backlog_.data(), n - first);
+    }
+    if (!out.empty()) {
+      if (!sendAll(sender.fd, out, sender.stop)) break;
+      next += out.size();
+    }
+
+    // Acknowledgements: "replconf ack <offset>" request frames.
+    if (receive(sender.fd, in, kMaxAckFrame * 4) < 0) break;
+    std::size_t used = 0;
+    bool garbage = false;
+    while (in.size() - used >= 4) {
+      std::uint32_t len = 0;
+      std::memcpy(&len, in.data() + used, 4);
+      if (len > kMaxAckFrame) {
+        garbage = true;
+        break;
+      }
+      if (in.size() - used - 4 < len) break;
+      const auto* frame = reinterpret_cast<const std::uint8_t*>(in.data()) + used + 4;
+      std::uint64_t acked = 0;
+      if (Connection::parseRequest(frame, len, args) && args.size() == 3 &&
+          equalsIgnoreCase(args[0], "replconf") && equalsIgnoreCase(args[1], "ack") &&
+          parseU64(args[2], acked)) {
+        sender.ack_offset.store(acked, std::memory_order_relaxed);
+        sender.ack_ms.store(monotonicMs(), std::memory_order_relaxed);
+      }
+      used += 4u + len;
+    }
+    if (garbage) break;
+    in.erase(0, used);
+  }
+  if (!sender.stop.load()) {
+    std::fprintf(stderr, "Replication: lost replica %s:%d\n", sender.ip.c_str(), sender.port);
+  }
+}
+
+// ===================== Replica side =====================
+
+void Replication::replicaOf(const std::string& host, int port) {
+  std::lock_guard<std::mutex> control(control_mu_);
+  std::unique_ptr<Link> old;
+  {
+    std::lock_guard<std::mutex> lock(link_mu_);
+    old.swap(link_);
+  }
+  if (old) {
+    old->stop.store(true);
+    old->thread.join();
+  }
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    replica_.store(true);
+    streaming_.store(false);
+  }
+  auto link = std::make_unique<Link>();
+  link->host = host;
+  link->port = port;
+  link->thread = std::thread(&Replication::runLink, this, std::ref(*link));
+  std::fprintf(stderr, "Replication: replicating from %s:%d\n", host.c_str(), port);
+  std::lock_guard<std::mutex> lock(link_mu_);
+  link_ = std::move(link);
+}
+
+void Replication::promote() {
+  std::lock_guard<std::mutex> control(control_mu_);
+  std::unique_ptr<Link> old;
+  {
+    std::lock_guard<std::mutex> lock(link_mu_);
+    old.swap(link_);
+  }
+  if (old) {
+    old->stop.store(true);
+    old->thread.join();
+  }
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (!replica_.load()) return;
+    // Replicas of the old primary may continue up to where this one got.
+    replid2_ = replid_;
+    second_offset_ = offset_;
+    replid_ = newReplid();
+    replica_.store(false);
+    streaming_.store(!backlog_.empty());
+    std::fprintf(stderr, "Replication: promoted to primary at offset %llu\n",
+                 static_cast<unsigned long long>(offset_));
+  }
+  // Our own replicas reconnect to learn the new id; they continue.
+  dropReplicas();
+}
+
+void Replication::runLink(Link& link) {
+  bool reported = false;  // a failed attempt was logged since the last success
+  while (!link.stop.load()) {
+    const int fd = connectTo(link.host, link.port, link.stop);
+    if (fd >= 0) {
+      reported = false;
+      link.last_io_ms.store(monotonicMs());
+      syncFrom(link, fd);
+      ::close(fd);
+      link.up.store(false);
+      link.syncing.store(false);
+    } else if (!reported && !link.stop.load()) {
+      std::fprintf(stderr, "Replication: cannot connect to primary %s:%d, retrying\n",
+                   link.host.c_str(), link.port);
+      reported = true;
+    }
+    for (std::uint64_t waited = 0; waited < kRetryMs && !link.stop.load(); waited += kPollMs) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(kPollMs));
+    }
+  }
+}
+
+void Replication::syncFrom(Link& link, int fd) {
+  std::string replid;
+  std::string offset_text;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    replid = replid_;
+    offset_text = decimal(offset_);
+  }
+  const std::string port_text = std::to_string(options_.listening_port);
+  const std::string_view psync[] = {"psync", replid, offset_text, port_text};
+  std::string out;
+  appendFrame(out, psync, 4);
+  if (!sendAll(fd, out, link.stop)) return;
+
+  // The reply: [len: u32][status: u32][text]
+  std::string in;
+  if (!receiveUntil(fd, in, 4, link.stop, link.last_io_ms)) return;
+  std::uint32_t len = 0;
+  std::memcpy(&len, in.data(), 4);
+  if (len < 4 || len > kMaxAckFrame || !receiveUntil(fd, in, 4u + len, link.stop, link.last_io_ms)) {
+    return;
+  }
+  const std::string text = in.substr(8, len - 4);
+  in.erase(0, 4u + len);
+  const std::vector<std::string_view> words = splitWords(text);
+  std::uint64_t offset = 0;
+  std::uint64_t size = 0;
+  if (words.size() == 4 && words[0] == "fullresync" && parseU64(words[2], offset) &&
+      parseU64(words[3], size)) {
+    link.syncing.store(true);
+    const int file = ::memfd_create("kv-replication", MFD_CLOEXEC);
+    if (file < 0) {
+      std::perror("Replication: memfd_create() failed");
+      return;
+    }
+    std::uint64_t left = size;
+    while (left > 0) {
+      if (in.empty() && !receiveUntil(fd, in, 1, link.stop, link.last_io_ms)) break;
+      const std::size_t take = static_cast<std::size_t>(std::min<std::uint64_t>(left, in.size()));
+      if (!writeAll(file, in.data(), take)) break;
+      in.erase(0, take);
+      left -= take;
+    }
+    if (left != 0) {
+      if (!link.stop.load()) {
+        std::fprintf(stderr, "Replication: snapshot transfer from %s:%d failed\n",
+                     link.host.c_str(), link.port);
+      }
+      ::close(file);
+      return;
+    }
+    // Replicas of this one follow the old stream; it ends here.
+    dropReplicas();
+    std::size_t loaded = 0;
+    {
+      std::lock_guard<std::mutex> apply(apply_mu_);
+      store_->clear();
+      try {
+        loaded = loadSnapshot(file, kSnapshotName, *store_, options_.load_threads);
+      } catch (const std::exception& e) {
+        std::fprintf(stderr, "Replication: %s\n", e.what());
+        ::close(file);
+        return;
+      }
+      std::lock_guard<std::mutex> lock(mu_);
+      replid_.assign(words[1]);
+      replid2_.clear();
+      second_offset_ = 0;
+      offset_ = offset;
+      if (backlog_.empty()) startBacklog();
+      first_offset_ = offset_;
+      end_.store(offset_, std::memory_order_relaxed);
+    }
+    ::close(file);
+    link.syncing.store(false);
+    std::fprintf(stderr, "Replication: full resync from %s:%d, %zu key(s) at offset %llu\n",
+                 link.host.c_str(), link.port, loaded, static_cast<unsigned long long>(offset));
+    // The log has none of the keys just loaded.
+    AppendOnlyFile& aof = AppendOnlyFile::instance();
+    if (aof.enabled() && !aof.rewrite()) {
+      std::fprintf(stderr, "Replication: AOF rewrite after the resync could not start\n");
+    }
+  } else if (words.size() == 2 && words[0] == "continue") {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (words[1] != replid_) {
+      // The primary was promoted from a replica of ours; its old id goes
+      // on being accepted from our replicas.
+      replid2_ = replid_;
+      second_offset_ = offset_;
+      replid_.assign(words[1]);
+    }
+    std::fprintf(stderr, "Replication: continuing from %s:%d at offset %llu\n",
+                 link.host.c_str(), link.port, static_cast<unsigned long long>(offset_));
+  } else {
+    std::fprintf(stderr, "Replication: unexpected reply to psync from %s:%d\n",
+                 link.host.c_str(), link.port);
+    return;
+  }
+
+  link.up.store(true);
+  StreamApplier applier(*store_);
+  std::uint64_t last_ack_ms = 0;
+  for (;;) {
+    if (link.stop.load()) return;
+    const long rv = receive(fd, in);
+    const std::uint64_t now = monotonicMs();
+    if (rv > 0) link.last_io_ms.store(now, std::memory_order_relaxed);
+    if (!in.empty()) {
+      std::size_t used = 0;
+      bool ok;
+      {
+        std::lock_guard<std::mutex> apply(apply_mu_);
+        ok = applier.apply(in, used);
+        std::lock_guard<std::mutex> lock(mu_);
+        appendBacklog(in.data(), used);
+      }
+      in.erase(0, used);
+      flush();
+      if (!ok) {
+        std::fprintf(stderr, "Replication: cannot apply the stream from %s:%d\n",
+                     link.host.c_str(), link.port);
+        return;
+      }
+    }
+    if (rv < 0 || now - link.last_io_ms.load(std::memory_order_relaxed) >= kTimeoutMs) {
+      std::fprintf(stderr, "Replication: lost the link to %s:%d\n", link.host.c_str(), link.port);
+      return;
+    }
+    if (now - last_ack_ms >= kAckIntervalMs) {
+      std::string acked;
+      {
+        std::lock_guard<std::mutex> lock(mu_);
+        acked = decimal(offset_);
+      }
+      const std::string_view ack[] = {"replconf", "ack", acked};
+      out.clear();
+      appendFrame(out, ack, 3);
+      if (!sendAll(fd, out, link.stop)) return;
+      last_ack_ms = now;
+    }
+    if (rv == 0) waitFor(fd, POLLIN);
+  }
+}
+
+Replication::Status Replication::status() const {
+  Status s;
+  s.replica = replica_.load();
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    s.replid = replid_;
+    s.replid2 = replid2_;
+    s.offset = offset_;
+    s.second_offset = second_offset_;
+    s.backlog_active = !backlog_.empty();
+    s.backlog_bytes = backlog_.size();
+    s.backlog_first_offset = first_offset_;
+    s.backlog_histlen = offset_ - first_offset_;
+  }
+  s.full_syncs = full_syncs_.load(std::memory_order_relaxed);
+  s.partial_syncs = partial_syncs_.load(std::memory_order_relaxed);
+  s.partial_sync_errors = partial_sync_errors_.load(std::memory_order_relaxed);
+  const std::uint64_t now = monotonicMs();
+  {
+    std::lock_guard<std::mutex> lock(senders_mu_);
+    for (const std::unique_ptr<Sender>& sender : senders_) {
+      if (sender->done.load()) continue;
+      ReplicaStatus r;
+      r.ip = sender->ip;
+      r.port = sender->port;
+      r.online = sender->online.load();
+      r.ack_offset = sender->ack_offset.load(std::memory_order_relaxed);
+      r.ack_age_ms = now - std::min(now, sender->ack_ms.load(std::memory_order_relaxed));
+      s.replicas.push_back(std::move(r));
+    }
+  }
+  std::lock_guard<std::mutex> lock(link_mu_);
+  if (link_) {
+    s.primary_host = link_->host;
+    s.primary_port = link_->port;
+    s.link_up = link_->up.load();
+    s.sync_in_progress = link_->syncing.load();
+    const std::uint64_t last = link_->last_io_ms.load(std::memory_order_relaxed);
+    s.last_io_age_ms = last == 0 ? -1 : static_cast<std::int64_t>(now - std::min(now, last));
+  }
+  return s;
+}
+
+}  // namespace async
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "../storage/kvstore.h"
+
+namespace async {
+
+// Asynchronous primary -> replica replication, after Redis's PSYNC.
+//
+// Every change a primary makes goes into the replication stream as the
+// request frame the AOF logs for it; the stream's length in bytes is the
+// replication offset, and the latest backlog_bytes of it are kept in a
+// circular backlog. A replica connects and sends
+//   psync <replication id> <offset> <listening port>
+// If the id is the primary's and the offset is still in the backlog, the
+// primary answers "continue <id>" and streams from that offset (a partial
+// resync). Otherwise it answers "fullresync <id> <offset> <bytes>" and
+// sends a snapshot of that many bytes taken at exactly that offset (it is
+// read with every shard locked, see forkSnapshot()), then the stream from
+// there. Both answers are ordinary response frames.
+//
+// The replica's socket is handed to a sender thread that reads straight
+// from the backlog, so the backlog is the only buffer: a replica that
+// falls further behind than its size (also while a full resync is being
+// transferred) is dropped, and resyncs in full. Replicas acknowledge the
+// offset they applied once a second ("replconf ack <offset>"); INFO
+// reports each replica's lag from it. An idle primary sends "ping" once a
+// second, so a replica can tell a quiet link from a dead one.
+//
+// A replica applies the stream on a thread of its own through the command
+// handlers, as an AOF replay does, serves reads, and rejects writes from
+// clients. It keeps the stream it applied in its own backlog under the
+// primary's id and offsets, so other replicas can sync from it, and so
+// that once promoted ("replicaof no one") it can still continue replicas
+// of the old primary: it takes a new id, but accepts the old one up to
+// the offset it had reached.
+class Replication : public WriteObserver {
+ public:
+  struct Options {
+    // Size of the circular backlog, allocated when the first replica
+    // connects. It must also cover the writes made while a full resync is
+    // being transferred.
+    std::size_t backlog_bytes = 16u << 20;
+    // Threads a replica loads the primary's snapshot with; 0: one per CPU.
+    unsigned load_threads = 0;
+    // Port this server listens on, which a replica reports to its primary.
+    int listening_port = 0;
+  };
+
+  struct ReplicaStatus {
+    std::string ip;
+    int port = 0;
+    bool online = false;  // false while the full resync is transferred
+    std::uint64_t ack_offset = 0;
+    std::uint64_t ack_age_ms = 0;  // since the last acknowledgement
+  };
+
+  // For INFO and metrics.
+  struct Status {
+    bool replica = false;
+    std::string replid;
+    std::string replid2;  // the previous primary's, after a promotion
+    std::uint64_t offset = 0;
+    std::uint64_t second_offset = 0;  // how far replid2 is accepted
+    bool backlog_active = false;
+    std::uint64_t backlog_bytes = 0;
+    std::uint64_t backlog_first_offset = 0;
+    std::uint64_t backlog_histlen = 0;
+    std::uint64_t full_syncs = 0;
+    std::uint64_t partial_syncs = 0;
+    std::uint64_t partial_sync_errors = 0;  // psyncs answered with a full resync
+    std::vector<ReplicaStatus> replicas;
+    // As a replica:
+    std::string primary_host;
+    int primary_port = 0;
+    bool link_up = false;
+    bool sync_in_progress = false;
+    std::int64_t last_io_age_ms = -1;  // -1: nothing received yet
+  };
+
+  static Replication& instance();
+
+  ~Replication() override;
+  Replication(const Replication&) = delete;
+  Replication& operator=(const Replication&) = delete;
+
+  // Replicates changes of 'store' from now on. Call once, before event
+  // loops start.
+  void configure(const Options& options, KVStore& store);
+  bool enabled() const { return store_ != nullptr; }
+
+  void onWrite(std::size_t shard, const std::string_view* args, std::size_t argc) override;
+
+  // Wakes the senders if the stream grew since the last call. Event loops
+  // call it once per iteration, so a burst of writes goes out together.
+  void flush();
+
+  // True while this server is a replica; client writes are rejected.
+  bool readOnly() const { return replica_.load(std::memory_order_relaxed); }
+
+  // Serves the replica behind 'fd', which sent psync with these arguments,
+  // on a sender thread that owns (and eventually closes) the descriptor.
+  void addReplica(int fd, std::string_view replid, std::uint64_t offset, int port);
+
+  // Becomes a replica of host:port; the keyspace is replaced after a full
+  // resync. Returns once the link to the previous primary, if any, has
+  // stopped (which may wait for a snapshot being loaded).
+  void replicaOf(const std::string& host, int port);
+  // Stops replicating and accepts writes again, as a primary with a new id.
+  void promote();
+
+  Status status() const;
+
+ private:
+  // A connected replica, and the link of a replica to its primary
+  // (defined in .cpp).
+  struct Sender;
+  struct Link;
+
+  Replication();
+
+  // Primary side, on the sender thread.
+  void runSender(Sender& sender);
+  // Sends a snapshot and returns the offset the stream continues from, or
+  // false if the replica could not be synced.
+  bool fullSync(Sender& sender, std::uint64_t& next);
+  void stream(Sender& sender, std::uint64_t next);
+  // Stops every sender, e.g. because this replica's stream starts over.
+  void dropReplicas();
+
+  // Replica side, on the link thread.
+  void runLink(Link& link);
+  void syncFrom(Link& link, int fd);
+
+  // With mu_ held: the backlog, and whether a replica at (replid, offset)
+  // can continue from it.
+  void startBacklog();
+  void appendBacklog(const char* data, std::size_t n);
+  bool canContinue(std::string_view replid, std::uint64_t offset) const;
+
+  Options options_;
+  KVStore* store_ = nullptr;
+  std::atomic<bool> replica_{false};
+  // The backlog is active and this server is a primary: writes go in.
+  std::atomic<bool> streaming_{false};
+
+  // Lock order: control_mu_, sync_mu_, apply_mu_, shard locks, mu_;
+  // senders_mu_ and link_mu_ are only held alone.
+  std::mutex control_mu_;  // serializes replicaOf() and promote()
+  mutable std::mutex mu_;
+  std::condition_variable grown_;  // the stream grew; waited on with mu_
+  std::string replid_;   // guarded by mu_, as is everything down to frame_
+  std::string replid2_;
+  std::uint64_t second_offset_ = 0;
+  std::vector<char> backlog_;  // empty until active
+  std::uint64_t first_offset_ = 0;  // oldest byte still in backlog_
+  std::uint64_t offset_ = 0;        // end of the stream
+  std::uint64_t last_append_ms_ = 0;  // monotonic, for pings
+  std::string frame_;  // scratch for onWrite()
+  // offset_, readable without the lock, and its value at the last flush().
+  std::atomic<std::uint64_t> end_{0};
+  std::atomic<std::uint64_t> notified_{0};
+
+  std::mutex sync_mu_;   // one full resync is prepared at a time
+  std::mutex apply_mu_;  // held by the link while it applies frames
+  std::atomic<std::uint64_t> full_syncs_{0};
+  std::atomic<std::uint64_t> partial_syncs_{0};
+  std::atomic<std::uint64_t> partial_sync_errors_{0};
+
+  mutable std::mutex senders_mu_;
+  std::vector<std::unique_ptr<Sender>> senders_;  // guarded by senders_mu_
+
+  mutable std::mutex link_mu_;
+  std::unique_ptr<Link> link_;  // guarded by link_mu_
+};
+
+}  // namespace async
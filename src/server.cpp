@@ -1,16 +1,33 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <iostream>
 #include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 
 
 #include <cassert>
 
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#include "commands/commands.h"
 #include "multithreading/asyncio.h"
+#include "persistence/aof.h"
+#include "persistence/snapshot.h"
+#include "replication/replication.h"
+#include "cluster/cluster.h"
 
 namespace {
 
@@ -58,29 +75,363 @@ void bind_and_listen(int fd, uint16_t port, uint32_t ip_host_order, int backlog)
   }
 }
 
+// Create a non-blocking listening socket on 0.0.0.0:port. With reuse_port
+// several sockets may bind the same port and the kernel spreads incoming
+// connections between them.
+int make_listener(uint16_t port, bool reuse_port) {
+  int fd = create_socket(AF_INET, SOCK_STREAM, 0);
+  set_sockopt_int(fd, SOL_SOCKET, SO_REUSEADDR, 1);
+  if (reuse_port) {
+    set_sockopt_int(fd, SOL_SOCKET, SO_REUSEPORT, 1);
+  }
+  // Non-blocking listen socket is a safer default when used with poll().
+  set_nonblock(fd);
+  bind_and_listen(fd, port, /*0.0.0.0*/ 0, SOMAXCONN);
+  return fd;
+}
+
+// Pin the calling thread to one CPU. Failure is not fatal: the loop still
+// works, it just may migrate between cores.
+void pin_current_thread(unsigned cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set) != 0) {
+    std::cerr << "Warning: cannot pin thread to CPU " << cpu << std::endl;
+  }
+}
+
+struct ServerOptions {
+  uint16_t port = 1234;
+  unsigned threads = 1;
+  std::size_t shards = async::KVStore::kDefaultShards;
+  async::Backend backend = async::Backend::Epoll;
+  std::size_t max_request = k_max_msg;
+  std::size_t max_memory = 0;
+  async::EvictionPolicy eviction = async::EvictionPolicy::NoEviction;
+  bool lazy_free = false;
+  uint16_t metrics_port = 0;  // 0 = no metrics endpoint
+  long long slowlog_threshold_us = 10000;  // negative = slow log off
+  std::size_t slowlog_max_len = 128;
+  std::uint64_t stall_budget_us = 0;  // 0 = no stall detection
+  std::uint64_t idle_timeout_s = 0;  // 0 = idle clients are never closed
+  // Output buffer limits: hard, soft, and how long the soft one may be
+  // exceeded; 0 = no limit.
+  std::size_t output_hard_limit = 0;
+  std::size_t output_soft_limit = 0;
+  std::uint64_t output_soft_s = 0;
+  async::AppendOnlyFile::Options aof;  // AOF off while the path is empty
+  async::SnapshotFile::Options snapshot;  // snapshots off while the path is empty
+  async::Replication::Options replication;
+  std::string replicaof_host;  // empty: start as a primary
+  int replicaof_port = 0;
+  bool cluster = false;
+  std::string cluster_announce_ip = "127.0.0.1";  // clients reach this node at ip:port
+};
+
+// Parses a byte count with an optional kb/mb/gb suffix (case-insensitive).
+bool parse_bytes(const char* val, std::size_t& out) {
+  char* end = nullptr;
+  const unsigned long long n = std::strtoull(val, &end, 10);
+  if (end == val) return false;
+  unsigned long long mult = 1;
+  if (strcasecmp(end, "kb") == 0) {
+    mult = 1ull << 10;
+  } else if (strcasecmp(end, "mb") == 0) {
+    mult = 1ull << 20;
+  } else if (strcasecmp(end, "gb") == 0) {
+    mult = 1ull << 30;
+  } else if (*end != '\0') {
+    return false;
+  }
+  out = static_cast<std::size_t>(n * mult);
+  return true;
+}
+
+// Parses "HARD SOFT SECONDS", as in Redis's client-output-buffer-limit.
+bool parse_output_limit(const char* val, ServerOptions& opts) {
+  char hard[32] = {};
+  char soft[32] = {};
+  char extra = 0;
+  unsigned long long seconds = 0;
+  if (std::sscanf(val, "%31s %31s %llu %c", hard, soft, &seconds, &extra) != 3) return false;
+  if (!parse_bytes(hard, opts.output_hard_limit) || !parse_bytes(soft, opts.output_soft_limit)) {
+    return false;
+  }
+  opts.output_soft_s = seconds;
+  return true;
+}
+
+void print_usage(const char* prog) {
+  std::cerr << "Usage: " << prog << " [--port N] [--threads N] [--shards N] [--backend poll|epoll|io_uring]"
+            << " [--max-request-size BYTES[kb|mb|gb]] [--maxmemory BYTES[kb|mb|gb]]"
+            << " [--maxmemory-policy noeviction|allkeys-lru|allkeys-lfu|volatile-ttl]"
+            << " [--lazyfree yes|no]"
+            << " [--metrics-port N] [--slowlog-log-slower-than US] [--slowlog-max-len N]"
+            << " [--stall-budget-us US] [--timeout SECONDS]"
+            << " [--client-output-buffer-limit 'HARD SOFT SECONDS'] [--aof PATH] [--aof-fsync always|everysec|no]"
+            << " [--aof-rewrite-percentage N] [--aof-rewrite-min-size BYTES[kb|mb|gb]]"
+            << " [--snapshot PATH] [--snapshot-compression yes|no] [--snapshot-load-threads N]"
+            << " [--replicaof HOST:PORT] [--repl-backlog-size BYTES[kb|mb|gb]]"
+            << " [--cluster-enabled yes|no] [--cluster-announce-ip IP]" << std::endl;
+}
+
+bool parse_args(int argc, char** argv, ServerOptions& opts) {
+  for (int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    const char* val = i + 1 < argc ? argv[i + 1] : nullptr;
+    if (!val) return false;
+    if (std::strcmp(arg, "--backend") == 0) {
+      if (!async::parseBackend(val, opts.backend)) return false;
+    } else if (std::strcmp(arg, "--threads") == 0) {
+      const long n = std::strtol(val, nullptr, 10);
+      if (n < 1 || n > static_cast<long>(async::CommandRegistry::kMaxStatSlots)) return false;
+      opts.threads = static_cast<unsigned>(n);
+    } else if (std::strcmp(arg, "--shards") == 0) {
+      const long n = std::strtol(val, nullptr, 10);
+      if (n < 1 || n > 65536) return false;
+      opts.shards = static_cast<std::size_t>(n);
+    } else if (std::strcmp(arg, "--port") == 0) {
+      const long n = std::strtol(val, nullptr, 10);
+      if (n < 1 || n > 65535) return false;
+      opts.port = static_cast<uint16_t>(n);
+    } else if (std::strcmp(arg, "--max-request-size") == 0) {
+      if (!parse_bytes(val, opts.max_request)) return false;
+      if (opts.max_request < 1024 || opts.max_request > k_max_msg_limit) return false;
+    } else if (std::strcmp(arg, "--maxmemory") == 0) {
+      if (!parse_bytes(val, opts.max_memory)) return false;
+    } else if (std::strcmp(arg, "--maxmemory-policy") == 0) {
+      if (!async::parseEvictionPolicy(val, opts.eviction)) return false;
+    } else if (std::strcmp(arg, "--lazyfree") == 0) {
+      if (std::strcmp(val, "yes") == 0) {
+        opts.lazy_free = true;
+      } else if (std::strcmp(val, "no") == 0) {
+        opts.lazy_free = false;
+      } else {
+        return false;
+      }
+    } else if (std::strcmp(arg, "--metrics-port") == 0) {
+      const long n = std::strtol(val, nullptr, 10);
+      if (n < 1 || n > 65535) return false;
+      opts.metrics_port = static_cast<uint16_t>(n);
+    } else if (std::strcmp(arg, "--slowlog-log-slower-than") == 0) {
+      char* end = nullptr;
+      opts.slowlog_threshold_us = std::strtoll(val, &end, 10);
+      if (end == val || *end != '\0') return false;
+    } else if (std::strcmp(arg, "--slowlog-max-len") == 0) {
+      const long n = std::strtol(val, nullptr, 10);
+      if (n < 1 || n > 1000000) return false;
+      opts.slowlog_max_len = static_cast<std::size_t>(n);
+    } else if (std::strcmp(arg, "--stall-budget-us") == 0) {
+      char* end = nullptr;
+      const long long n = std::strtoll(val, &end, 10);
+      if (end == val || *end != '\0' || n < 0) return false;
+      opts.stall_budget_us = static_cast<std::uint64_t>(n);
+    } else if (std::strcmp(arg, "--timeout") == 0) {
+      char* end = nullptr;
+      const long long n = std::strtoll(val, &end, 10);
+      if (end == val || *end != '\0' || n < 0) return false;
+      opts.idle_timeout_s = static_cast<std::uint64_t>(n);
+    } else if (std::strcmp(arg, "--client-output-buffer-limit") == 0) {
+      if (!parse_output_limit(val, opts)) return false;
+    } else if (std::strcmp(arg, "--aof") == 0) {
+      if (*val == '\0') return false;
+      opts.aof.path = val;
+    } else if (std::strcmp(arg, "--aof-fsync") == 0) {
+      if (!async::parseFsyncPolicy(val, opts.aof.fsync)) return false;
+    } else if (std::strcmp(arg, "--aof-rewrite-percentage") == 0) {
+      const long n = std::strtol(val, nullptr, 10);
+      if (n < 0 || n > 100000) return false;
+      opts.aof.auto_rewrite_percentage = static_cast<unsigned>(n);
+    } else if (std::strcmp(arg, "--aof-rewrite-min-size") == 0) {
+      if (!parse_bytes(val, opts.aof.auto_rewrite_min_size)) return false;
+    } else if (std::strcmp(arg, "--snapshot") == 0) {
+      if (*val == '\0') return false;
+      opts.snapshot.path = val;
+    } else if (std::strcmp(arg, "--snapshot-compression") == 0) {
+      if (std::strcmp(val, "yes") == 0) {
+        opts.snapshot.compress = true;
+      } else if (std::strcmp(val, "no") == 0) {
+        opts.snapshot.compress = false;
+      } else {
+        return false;
+      }
+    } else if (std::strcmp(arg, "--snapshot-load-threads") == 0) {
+      const long n = std::strtol(val, nullptr, 10);
+      if (n < 0 || n > 1024) return false;
+      opts.snapshot.load_threads = static_cast<unsigned>(n);
+    } else if (std::strcmp(arg, "--replicaof") == 0) {
+      const char* colon = std::strrchr(val, ':');
+      if (!colon || colon == val) return false;
+      const long n = std::strtol(colon + 1, nullptr, 10);
+      if (n < 1 || n > 65535) return false;
+      opts.replicaof_host.assign(val, colon);
+      opts.replicaof_port = static_cast<int>(n);
+    } else if (std::strcmp(arg, "--repl-backlog-size") == 0) {
+      if (!parse_bytes(val, opts.replication.backlog_bytes)) return false;
+      if (opts.replication.backlog_bytes < 16384) return false;
+    } else if (std::strcmp(arg, "--cluster-enabled") == 0) {
+      if (std::strcmp(val, "yes") == 0) {
+        opts.cluster = true;
+      } else if (std::strcmp(val, "no") == 0) {
+        opts.cluster = false;
+      } else {
+        return false;
+      }
+    } else if (std::strcmp(arg, "--cluster-announce-ip") == 0) {
+      if (*val == '\0') return false;
+      opts.cluster_announce_ip = val;
+    } else {
+      return false;
+    }
+    ++i;
+  }
+  return true;
+}
+
+// Answers every HTTP request on listen_fd with the Prometheus metrics, one
+// connection at a time. Runs on its own thread so scrapes never touch the
+// event loops; counters are read, not locked.
+void serve_metrics(int listen_fd, const async::KVStore& store) {
+  for (;;) {
+    pollfd pfd{listen_fd, POLLIN, 0};
+    if (::poll(&pfd, 1, -1) < 0) continue;
+    const int fd = ::accept(listen_fd, nullptr, nullptr);
+    if (fd < 0) continue;
+    // Don't let a client that never sends its request hold the thread.
+    timeval tv{1, 0};
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    // The request itself is ignored: any path returns the metrics.
+    char request[4096];
+    if (::recv(fd, request, sizeof(request), 0) > 0) {
+      const std::string body = async::renderPrometheus(store);
+      const std::string response =
+          "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+          std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+      size_t off = 0;
+      while (off < response.size()) {
+        const ssize_t rv = ::send(fd, response.data() + off, response.size() - off, MSG_NOSIGNAL);
+        if (rv <= 0) break;
+        off += static_cast<size_t>(rv);
+      }
+    }
+    ::close(fd);
+  }
+}
+
 }  // namespace
 
-int main() {
-  constexpr uint16_t kPort = 1234;
+int main(int argc, char** argv) {
+  ServerOptions opts;
+  if (!parse_args(argc, argv, opts)) {
+    print_usage(argv[0]);
+    return 1;
+  }
 
   try {
-    int listen_fd = create_socket(AF_INET, SOCK_STREAM, 0);
-    set_sockopt_int(listen_fd, SOL_SOCKET, SO_REUSEADDR, 1);
-    // Non-blocking listen socket is a safer default when used with poll().
-    set_nonblock(listen_fd);
-    bind_and_listen(listen_fd, kPort, /*0.0.0.0*/ 0, SOMAXCONN);
+    // One listening socket per loop; with more than one loop they share the
+    // port through SO_REUSEPORT so each loop accepts its own connections.
+    const bool reuse_port = opts.threads > 1;
+    std::vector<int> listen_fds;
+    for (unsigned i = 0; i < opts.threads; ++i) {
+      listen_fds.push_back(make_listener(opts.port, reuse_port));
+    }
 
-    std::cout << "Server is ready to accept connections on 0.0.0.0:" << kPort << std::endl;
+    std::cout << "Server is ready to accept connections on 0.0.0.0:" << opts.port
+              << " (" << opts.threads << " thread(s))" << std::endl;
 
-    async::KVStore store;
-    async::EventLoop loop(listen_fd, store);
-    loop.run();
+    async::KVStore store(opts.shards);
+    store.setMaxMemory(opts.max_memory, opts.eviction);
+    store.setLazyFree(opts.lazy_free);
+    async::SlowLog::instance().configure(opts.slowlog_threshold_us, opts.slowlog_max_len);
+    if (!opts.snapshot.path.empty()) {
+      async::SnapshotFile& snapshot = async::SnapshotFile::instance();
+      snapshot.configure(opts.snapshot, store);
+      // With AOF on, the log is the complete history and is loaded instead.
+      if (opts.aof.path.empty()) {
+        const std::uint64_t start_ns = monotonic_ns();
+        const std::size_t loaded = snapshot.load();
+        std::cout << "Snapshot " << opts.snapshot.path << ": " << loaded << " key(s) loaded in "
+                  << (monotonic_ns() - start_ns) / 1000000 << " ms" << std::endl;
+      }
+    }
+    async::AppendOnlyFile* aof = nullptr;
+    if (!opts.aof.path.empty()) {
+      aof = &async::AppendOnlyFile::instance();
+      const std::size_t replayed = aof->open(opts.aof, store);
+      std::cout << "AOF " << opts.aof.path << ": " << replayed << " command(s) replayed, "
+                << store.size() << " key(s), fsync " << async::fsyncPolicyName(opts.aof.fsync)
+                << std::endl;
+    }
+    async::Replication& replication = async::Replication::instance();
+    opts.replication.listening_port = opts.port;
+    opts.replication.load_threads = opts.snapshot.load_threads;
+    replication.configure(opts.replication, store);
+    if (!opts.replicaof_host.empty()) {
+      replication.replicaOf(opts.replicaof_host, opts.replicaof_port);
+    }
+    async::Cluster* cluster = nullptr;
+    if (opts.cluster) {
+      cluster = &async::Cluster::instance();
+      cluster->configure(opts.cluster_announce_ip + ":" + std::to_string(opts.port));
+      std::cout << "Cluster mode on, as " << cluster->self() << std::endl;
+    }
+    if (opts.metrics_port != 0) {
+      const int metrics_fd = make_listener(opts.metrics_port, false);
+      std::thread(serve_metrics, metrics_fd, std::cref(store)).detach();
+      std::cout << "Prometheus metrics on 0.0.0.0:" << opts.metrics_port << "/metrics" << std::endl;
+    }
+    if (opts.threads == 1) {
+      async::LoopConfig config;
+      config.backend = opts.backend;
+      config.max_request_bytes = opts.max_request;
+      config.stall_budget_us = opts.stall_budget_us;
+      config.idle_timeout_ms = opts.idle_timeout_s * 1000;
+      config.output_hard_limit = opts.output_hard_limit;
+      config.output_soft_limit = opts.output_soft_limit;
+      config.output_soft_ms = opts.output_soft_s * 1000;
+      config.aof = aof;
+      config.replication = &replication;
+      config.cluster = cluster;
+      async::EventLoop loop(listen_fds[0], store, config);
+      loop.run();
+    } else {
+      const unsigned ncpu = std::max(1u, std::thread::hardware_concurrency());
+      std::vector<std::thread> workers;
+      for (unsigned i = 0; i < opts.threads; ++i) {
+        workers.emplace_back([&, i] {
+          try {
+            pin_current_thread(i % ncpu);
+            async::LoopConfig config;
+            config.backend = opts.backend;
+            config.max_request_bytes = opts.max_request;
+            config.stall_budget_us = opts.stall_budget_us;
+            config.idle_timeout_ms = opts.idle_timeout_s * 1000;
+            config.output_hard_limit = opts.output_hard_limit;
+            config.output_soft_limit = opts.output_soft_limit;
+            config.output_soft_ms = opts.output_soft_s * 1000;
+            config.aof = aof;
+            config.replication = &replication;
+            config.cluster = cluster;
+            config.index = i;
+            config.count = opts.threads;
+            async::EventLoop loop(listen_fds[i], store, config);
+            loop.run();
+          } catch (const std::exception& e) {
+            std::cerr << "Fatal (loop " << i << "): " << e.what() << std::endl;
+            std::exit(1);
+          }
+        });
+      }
+      for (std::thread& t : workers) t.join();
+    }
 
     // Normally unreachable; loop.run() is an infinite loop.
-    ::close(listen_fd);
+    for (int fd : listen_fds) ::close(fd);
     return 0;
   } catch (const std::exception& e) {
     std::cerr << "Fatal: " << e.what() << std::endl;
     return 1;
   }
-}
\ No newline at end of file
+}
@@ -0,0 +1,195 @@
+#include "hash.h"
+
+#include <cstring>
+
+#include "keyhash.h"
+#include "varint.h"
+
+namespace async {
+
+namespace {
+// Fields per command when an AOF rewrite rebuilds a large hash.
+constexpr std::size_t kRewriteBatch = 64;
+
+uint64_t hashField(std::string_view field) { return hashKey(field); }
+
+// Reads the [field][value] pair at p; nullptr if truncated.
+const char* getPair(const char* p, const char* end, std::string_view& field,
+                    std::string_view& value) {
+  p = getString(p, end, field);
+  return p ? getString(p, end, value) : nullptr;
+}
+}  // namespace
+
+void Hash::Field::assign(std::string_view field, std::string_view value) {
+  char* data = new char[field.size() + value.size()];
+  std::memcpy(data, field.data(), field.size());
+  std::memcpy(data + field.size(), value.data(), value.size());
+  delete[] data_;
+  data_ = data;
+  flen_ = static_cast<uint32_t>(field.size());
+  vlen_ = static_cast<uint32_t>(value.size());
+}
+
+std::size_t Hash::memoryBytes() const {
+  if (packed()) return sizeof(*this) + packed_.capacity();
+  return sizeof(*this) + table_.memoryUsage() + field_bytes_;
+}
+
+std::size_t Hash::packedFind(std::string_view field) const {
+  const char* const begin = packed_.data();
+  const char* const end = begin + packed_.size();
+  std::string_view f;
+  std::string_view v;
+  for (const char* p = begin; p < end;) {
+    const char* pair = p;
+    p = getPair(p, end, f, v);
+    if (f == field) return static_cast<std::size_t>(pair - begin);
+  }
+  return std::string::npos;
+}
+
+bool Hash::set(std::string_view field, std::string_view value) {
+  if (packed()) {
+    const bool fits = field.size() <= kMaxPackedBytes && value.size() <= kMaxPackedBytes;
+    const std::size_t at = packedFind(field);
+    if (at != std::string::npos && fits) {
+      // Rewrite the pair in place, keeping the field's position.
+      const char* const begin = packed_.data();
+      std::string_view f;
+      std::string_view v;
+      const char* next = getPair(begin + at, begin + packed_.size(), f, v);
+      std::string pair;
+      putString(pair, field);
+      putString(pair, value);
+      packed_.replace(at, static_cast<std::size_t>(next - begin) - at, pair);
+      return false;
+    }
+    if (at == std::string::npos && fits && packed_count_ < kMaxPackedEntries) {
+      putString(packed_, field);
+      putString(packed_, value);
+      ++packed_count_;
+      return true;
+    }
+    convert();
+  }
+  auto [slot, inserted] = table_.findOrInsert(field, hashField(field));
+  field_bytes_ -= slot->heapBytes();
+  slot->assign(field, value);
+  field_bytes_ += slot->heapBytes();
+  return inserted;
+}
+
+bool Hash::get(std::string_view field, std::string_view& value) const {
+  if (packed()) {
+    const std::size_t at = packedFind(field);
+    if (at == std::string::npos) return false;
+    std::string_view f;
+    getPair(packed_.data() + at, packed_.data() + packed_.size(), f, value);
+    return true;
+  }
+  const Field* slot = table_.find(field, hashField(field));
+  if (!slot) return false;
+  value = slot->value();
+  return true;
+}
+
+bool Hash::remove(std::string_view field) {
+  if (packed()) {
+    const std::size_t at = packedFind(field);
+    if (at == std::string::npos) return false;
+    const char* const begin = packed_.data();
+    std::string_view f;
+    std::string_view v;
+    const char* next = getPair(begin + at, begin + packed_.size(), f, v);
+    packed_.erase(at, static_cast<std::size_t>(next - begin) - at);
+    --packed_count_;
+    return true;
+  }
+  return table_.erase(field, hashField(field),
+                      [this](Field& slot) { field_bytes_ -= slot.heapBytes(); });
+}
+
+void Hash::forEachImpl(Visitor visit, void* ctx) const {
+  if (packed()) {
+    const char* p = packed_.data();
+    const char* const end = p + packed_.size();
+    std::string_view f;
+    std::string_view v;
+    while (p < end) {
+      p = getPair(p, end, f, v);
+      visit(ctx, f, v);
+    }
+    return;
+  }
+  table_.forEach(
+      [&](std::string_view, const Field& slot) { visit(ctx, slot.key(), slot.value()); });
+}
+
+void Hash::convert() {
+  table_.reserve(packed_count_ + 1);
+  const char* p = packed_.data();
+  const char* const end = p + packed_.size();
+  std::string_view f;
+  std::string_view v;
+  while (p < end) {
+    p = getPair(p, end, f, v);
+    Field* slot = table_.findOrInsert(f, hashField(f)).first;
+    slot->assign(f, v);
+    field_bytes_ += slot->heapBytes();
+  }
+  std::string().swap(packed_);
+  packed_count_ = 0;
+  converted_ = true;
+}
+
+// [count: varint] then the pairs as in the packed encoding.
+void Hash::encode(std::string& out) const {
+  putVarint(out, size());
+  if (packed()) {
+    out.append(packed_);
+    return;
+  }
+  forEach([&out](std::string_view field, std::string_view value) {
+    putString(out, field);
+    putString(out, value);
+  });
+}
+
+std::unique_ptr<Hash> Hash::decode(std::string_view bytes) {
+  const char* p = bytes.data();
+  const char* const end = p + bytes.size();
+  uint64_t count = 0;
+  p = getVarint(p, end, count);
+  // Every pair takes at least 2 bytes; an empty hash is never stored.
+  if (!p || count == 0 || count > static_cast<uint64_t>(end - p) / 2) return nullptr;
+  auto hash = std::make_unique<Hash>();
+  std::string_view field;
+  std::string_view value;
+  for (uint64_t i = 0; i < count; ++i) {
+    p = getPair(p, end, field, value);
+    if (!p) return nullptr;
+    hash->set(field, value);
+  }
+  if (p != end) return nullptr;
+  return hash;
+}
+
+void Hash::rewrite(std::string_view key,
+                   const std::function<void(const std::string_view*, std::size_t)>& emit) const {
+  std::string_view args[2 + 2 * kRewriteBatch];
+  args[0] = "hset";
+  args[1] = key;
+  std::size_t n = 0;
+  forEach([&](std::string_view field, std::string_view value) {
+    args[2 + 2 * n] = field;
+    args[3 + 2 * n] = value;
+    if (++n == kRewriteBatch) {
+      emit(args, 2 + 2 * n);
+      n = 0;
+    }
+  });
+  if (n > 0) emit(args, 2 + 2 * n);
+}
+
+}  // namespace async
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "hashtable.h"
+#include "object.h"
+
+namespace async {
+
+// Hash: a map of fields to values under one key, so that an object with a
+// handful of attributes costs one key instead of one per attribute.
+//
+// A small hash is a single packed buffer of [field][value] pairs, each a
+// varint length and its bytes, in insertion order and scanned linearly.
+// Once it has more than kMaxPackedEntries fields, or a field or value
+// longer than kMaxPackedBytes, it is converted for good to a HashTable of
+// fields, each field and its value sharing one allocation.
+class Hash final : public Object {
+ public:
+  static constexpr ValueType kType = ValueType::Hash;
+  static constexpr std::size_t kMaxPackedEntries = 128;
+  static constexpr std::size_t kMaxPackedBytes = 64;
+
+  Hash() = default;
+  Hash(const Hash&) = delete;
+  Hash& operator=(const Hash&) = delete;
+
+  ValueType type() const override { return kType; }
+  std::size_t size() const override { return packed() ? packed_count_ : table_.size(); }
+  std::size_t memoryBytes() const override;
+  std::size_t freeEffort() const override { return packed() ? 1 : table_.size(); }
+  void encode(std::string& out) const override;
+  void rewrite(std::string_view key,
+               const std::function<void(const std::string_view*, std::size_t)>& emit)
+      const override;
+
+  // Reads encode() output; nullptr if malformed.
+  static std::unique_ptr<Hash> decode(std::string_view bytes);
+
+  // Sets field to value; returns true if the field is new.
+  bool set(std::string_view field, std::string_view value);
+  // Fills a view of the value, valid until the hash is next modified.
+  bool get(std::string_view field, std::string_view& value) const;
+  // Returns true if the field existed.
+  bool remove(std::string_view field);
+
+  // Calls fn(std::string_view field, std::string_view value) for every
+  // field: in insertion order while packed, in table order after that.
+  template <typename Fn>
+  void forEach(Fn&& fn) const {
+    auto* ctx = &fn;
+    forEachImpl(
+        [](void* p, std::string_view field, std::string_view value) {
+          (*static_cast<decltype(ctx)>(p))(field, value);
+        },
+        const_cast<void*>(static_cast<const void*>(ctx)));
+  }
+
+  bool packed() const { return !converted_; }
+
+ private:
+  using Visitor = void (*)(void* ctx, std::string_view field, std::string_view value);
+
+  // Table slot: field and value bytes back to back in one allocation.
+  class Field {
+   public:
+    Field() = default;
+    Field(Field&& other) noexcept
+      : data_(other.data_), flen_(other.flen_), vlen_(other.vlen_) {
+      other.data_ = nullptr;
+    }
+    Field& operator=(Field&&) = delete;
+    ~Field() { delete[] data_; }
+
+    std::string_view key() const { return std::string_view(data_, flen_); }
+    std::string_view value() const { return std::string_view(data_ + flen_, vlen_); }
+    void assign(std::string_view field, std::string_view value);
+    std::size_t heapBytes() const { return data_ ? flen_ + vlen_ + 16 : 0; }
+
+   private:
+    char* data_ = nullptr;
+    uint32_t flen_ = 0;
+    uint32_t vlen_ = 0;
+  };
+
+  void forEachImpl(Visitor visit, void* ctx) const;
+  // Offset of field's pair in packed_, or npos.
+  std::size_t packedFind(std::string_view field) const;
+  void convert();
+
+  bool converted_ = false;
+  std::size_t packed_count_ = 0;
+  std::string packed_;
+  HashTable<Field> table_;
+  std::size_t field_bytes_ = 0;  // heap bytes of the table's fields
+};
+
+}  // namespace async
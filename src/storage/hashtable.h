@@ -0,0 +1,514 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <string_view>
+#include <utility>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "keyhash.h"
+
+namespace async {
+
+// Open-addressing hash table, Swiss-table style, whose values carry their
+// own key: V must have std::string_view key() const, so the key can share
+// the value's storage. Slots are grouped by 16, and each group has 16
+// control bytes holding 7 bits of the hash (or an empty/deleted marker)
+// that are probed with one SIMD compare. Every slot caches the full 64-bit
+// hash so that resizing never rehashes keys and mismatches are rejected
+// before touching key bytes.
+//
+// The caller supplies the hash, so one hash per request can serve shard
+// selection and probing. Growing (and shrinking) is incremental, like Redis
+// dictRehash: a second table is allocated and every mutating call moves a
+// bounded number of groups into it, so no single insert pays for a full
+// rehash. rehashStep() lets an idle owner finish the move in the background.
+// While a forked child shares the table's pages, pauseRehash() stops those
+// moves (and shrinking) so that pages are only copied for real writes.
+//
+// A value inserted by findOrInsert() is default-constructed, with an empty
+// key; the caller must store the key in it before the table is used again.
+//
+// Not thread-safe; KVStore serializes access per shard.
+template <typename V>
+class HashTable {
+ public:
+  HashTable() = default;
+  ~HashTable() {
+    destroyTable(tables_[0]);
+    destroyTable(tables_[1]);
+  }
+  HashTable(const HashTable&) = delete;
+  HashTable& operator=(const HashTable&) = delete;
+
+  // Returns the value for key, or nullptr.
+  V* find(std::string_view key, uint64_t hash) {
+    if (V* v = findIn(tables_[0], key, hash)) return v;
+    return rehashing() ? findIn(tables_[1], key, hash) : nullptr;
+  }
+  const V* find(std::string_view key, uint64_t hash) const {
+    return const_cast<HashTable*>(this)->find(key, hash);
+  }
+
+  // Returns the value for key, inserting a default-constructed value if the
+  // key is absent (see above). 'second' is true when the key was inserted.
+  std::pair<V*, bool> findOrInsert(std::string_view key, uint64_t hash) {
+    if (!paused_) rehashStep(kStepGroups);
+    if (V* v = find(key, hash)) return {v, false};
+    if (!rehashing() && needsGrow(tables_[0])) {
+      startRehash(groupsFor(tables_[0].size + 1));
+    } else if (rehashing() && needsGrow(tables_[1])) {
+      // Only reachable if the old table outlived its budget; finish it now.
+      rehashStep(tables_[0].ngroups);
+      startRehash(groupsFor(tables_[0].size + 1));
+    }
+    Table& t = rehashing() ? tables_[1] : tables_[0];
+    Slot* slot = insertNew(t, hash);
+    new (slot) Slot{hash, V()};
+    return {&slot->value, true};
+  }
+
+  // Sizes an empty table for 'n' entries up front, so that inserting them
+  // never rehashes. Does nothing unless the table is empty.
+  void reserve(std::size_t n) {
+    if (size() != 0 || rehashing()) return;
+    const std::size_t groups = groupsFor(n);
+    if (groups <= tables_[0].ngroups) return;
+    destroyTable(tables_[0]);
+    tables_[0] = allocTable(groups);
+  }
+
+  // Destroys every entry and frees the table's memory, ending any rehash.
+  void clear() {
+    destroyTable(tables_[0]);
+    destroyTable(tables_[1]);
+    rehash_idx_ = 0;
+    released_bytes_ = 0;
+  }
+
+  // Prefetches the control bytes a find() of 'hash' probes first, so that
+  // a batch of lookups can overlap their cache misses.
+  void prefetch(uint64_t hash) const {
+    for (const Table& t : tables_) {
+      if (t.ngroups == 0) continue;
+      __builtin_prefetch(t.ctrl + (h1Of(hash) & (t.ngroups - 1)) * kGroupSize);
+    }
+  }
+
+  // Removes key; returns true if it existed. dispose(V&) is called on the
+  // value just before it is destroyed.
+  template <typename Fn>
+  bool erase(std::string_view key, uint64_t hash, Fn&& dispose) {
+    if (!paused_) rehashStep(kStepGroups);
+    bool erased = eraseIn(tables_[0], key, hash, dispose);
+    if (!erased && rehashing()) erased = eraseIn(tables_[1], key, hash, dispose);
+    if (erased && !paused_ && !rehashing() && needsShrink(tables_[0])) {
+      startRehash(groupsFor(tables_[0].size));
+    }
+    return erased;
+  }
+
+  // Moves up to 'groups' groups of the old table into the new one. Returns
+  // true while a rehash is still in progress afterwards.
+  bool rehashStep(std::size_t groups) {
+    if (!rehashing()) return false;
+    Table& from = tables_[0];
+    // Bound the number of empty groups visited as well, like dictRehash.
+    std::size_t empty_visits = groups * 10;
+    while (groups > 0 && rehash_idx_ < from.ngroups) {
+      uint8_t* ctrl = from.ctrl + rehash_idx_ * kGroupSize;
+      uint32_t full = Group(ctrl).matchFull();
+      if (full == 0) {
+        ++rehash_idx_;
+        if (--empty_visits == 0) break;
+        continue;
+      }
+      while (full) {
+        const unsigned i = static_cast<unsigned>(__builtin_ctz(full));
+        full &= full - 1;
+        Slot* src = from.slots + rehash_idx_ * kGroupSize + i;
+        Slot* dst = insertNew(tables_[1], src->hash);
+        new (dst) Slot(std::move(*src));
+        src->~Slot();
+        ctrl[i] = kDeleted;
+        --from.size;
+      }
+      ++rehash_idx_;
+      --groups;
+    }
+    if (rehash_idx_ < from.ngroups) {
+      releaseMigrated();
+      return true;
+    }
+
+    destroyTable(tables_[0]);
+    tables_[0] = tables_[1];
+    tables_[1] = Table();
+    rehash_idx_ = 0;
+    return false;
+  }
+
+  bool rehashing() const { return tables_[1].ngroups != 0; }
+
+  // While paused, inserts and erases move no entries and the table never
+  // shrinks. It still grows when full: new entries then go to the new
+  // table, and the old one is only migrated once resumed (or by explicit
+  // rehashStep() calls), like Redis with dict resizing disabled.
+  void pauseRehash(bool paused) { paused_ = paused; }
+
+  // Calls fn(std::string_view key, V& value) for every entry. The table must
+  // not be modified during the walk.
+  template <typename Fn>
+  void forEach(Fn&& fn) {
+    for (Table& t : tables_) {
+      for (std::size_t g = 0; g < t.ngroups; ++g) {
+        uint32_t full = Group(t.ctrl + g * kGroupSize).matchFull();
+        while (full) {
+          const unsigned i = static_cast<unsigned>(__builtin_ctz(full));
+          full &= full - 1;
+          Slot& slot = t.slots[g * kGroupSize + i];
+          fn(slot.value.key(), slot.value);
+        }
+      }
+    }
+  }
+
+  template <typename Fn>
+  void forEach(Fn&& fn) const {
+    const_cast<HashTable*>(this)->forEach(
+        [&fn](std::string_view key, V& value) { fn(key, static_cast<const V&>(value)); });
+  }
+
+  // Cursor walk for SCAN, like Redis dictScan. A bucket is every entry
+  // whose home group (the first one it probes) has a given index; this
+  // calls fn(std::string_view key, const V& value) for the bucket at
+  // 'cursor' and returns the cursor of the next one, 0 after the last.
+  // Cursors count with their bits reversed, so a bucket of a table twice
+  // the size covers exactly two buckets of the smaller one and vice versa:
+  // every entry present for a whole walk (0, scan(0), ... 0) is visited at
+  // least once, however the table grows or shrinks between calls, and an
+  // entry is only visited again when the table shrank. While rehashing,
+  // the bucket is taken from the smaller table plus all of its expansions
+  // in the larger one.
+  template <typename Fn>
+  uint64_t scan(uint64_t cursor, Fn&& fn) const {
+    if (tables_[0].ngroups == 0) return 0;
+    if (!rehashing()) {
+      const uint64_t mask = tables_[0].ngroups - 1;
+      scanBucket(tables_[0], cursor & mask, fn);
+      return nextCursor(cursor, mask);
+    }
+    const bool grows = tables_[1].ngroups > tables_[0].ngroups;
+    const Table& small = tables_[grows ? 0 : 1];
+    const Table& large = tables_[grows ? 1 : 0];
+    const uint64_t small_mask = small.ngroups - 1;
+    const uint64_t large_mask = large.ngroups - 1;
+    scanBucket(small, cursor & small_mask, fn);
+    // The large table's buckets that share the small bucket's low bits.
+    do {
+      scanBucket(large, cursor & large_mask, fn);
+      cursor = nextCursor(cursor, large_mask);
+    } while (cursor & (small_mask ^ large_mask));
+    return cursor;
+  }
+
+  std::size_t size() const { return tables_[0].size + tables_[1].size; }
+
+  // Total slots allocated across both tables.
+  std::size_t capacity() const {
+    return (tables_[0].ngroups + tables_[1].ngroups) * kGroupSize;
+  }
+
+  // Bytes allocated for control bytes and slots (not for key/value heap data).
+  std::size_t memoryUsage() const { return capacity() * (sizeof(Slot) + 1); }
+
+  // Calls fn(std::string_view key, V& value) for up to 'n' entries found
+  // from a random group picked with 'rnd'; used for sampled eviction.
+  // Returns the number of entries visited.
+  template <typename Fn>
+  std::size_t sample(uint64_t rnd, std::size_t n, Fn&& fn) {
+    Table* t = &tables_[0];
+    // While rehashing, pick a table in proportion to how full it is.
+    if (rehashing() && (rnd >> 32) % size() >= tables_[0].size) t = &tables_[1];
+    if (t->size == 0) return 0;
+    const std::size_t mask = t->ngroups - 1;
+    std::size_t g = static_cast<std::size_t>(rnd) & mask;
+    std::size_t found = 0;
+    for (std::size_t visited = 0; visited < t->ngroups && visited < kMaxSampleGroups && found < n;
+         ++visited, g = (g + 1) & mask) {
+      uint32_t full = Group(t->ctrl + g * kGroupSize).matchFull();
+      while (full && found < n) {
+        const unsigned i = static_cast<unsigned>(__builtin_ctz(full));
+        full &= full - 1;
+        Slot& slot = t->slots[g * kGroupSize + i];
+        fn(slot.value.key(), slot.value);
+        ++found;
+      }
+    }
+    return found;
+  }
+
+ private:
+  static constexpr std::size_t kGroupSize = 16;
+  // Groups moved per mutating call while a rehash is in progress.
+  static constexpr std::size_t kStepGroups = 1;
+  // Groups scanned by sample() before giving up on a sparse table.
+  static constexpr std::size_t kMaxSampleGroups = 64;
+
+  // Control byte values. Full slots hold 0x80 | low 7 hash bits, so only
+  // full slots have the sign bit set. Empty is zero so that large control
+  // arrays come straight from zeroed pages without a memset.
+  static constexpr uint8_t kEmpty = 0x00;
+  static constexpr uint8_t kDeleted = 0x01;
+  static constexpr uint8_t kFullBit = 0x80;
+  // Old tables at least this large return migrated pages to the OS while
+  // the rehash runs, so freeing them at the end does not stall.
+  static constexpr std::size_t kReleaseThresholdBytes = 1u << 20;
+
+  struct Slot {
+    uint64_t hash;
+    V value;
+  };
+
+  struct Table {
+    uint8_t* ctrl = nullptr;
+    Slot* slots = nullptr;
+    std::size_t ngroups = 0;  // power of two, or 0 when unallocated
+    std::size_t size = 0;
+    std::size_t tombstones = 0;
+  };
+
+  // 16 control bytes; each match returns a bitmask of matching positions.
+  struct Group {
+    explicit Group(const uint8_t* p) : ctrl(p) {}
+#if defined(__SSE2__)
+    uint32_t match(uint8_t h2) const {
+      return cmp(_mm_set1_epi8(static_cast<char>(h2)));
+    }
+    uint32_t matchEmpty() const { return cmp(_mm_setzero_si128()); }
+    // Full slots are the only control bytes with the sign bit set.
+    uint32_t matchFull() const { return static_cast<uint32_t>(_mm_movemask_epi8(load())); }
+    uint32_t matchEmptyOrDeleted() const { return ~matchFull() & 0xFFFFu; }
+
+   private:
+    __m128i load() const { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl)); }
+    uint32_t cmp(__m128i needle) const {
+      return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(needle, load())));
+    }
+#else
+    uint32_t match(uint8_t h2) const {
+      uint32_t m = 0;
+      for (unsigned i = 0; i < kGroupSize; ++i) m |= static_cast<uint32_t>(ctrl[i] == h2) << i;
+      return m;
+    }
+    uint32_t matchEmpty() const { return match(kEmpty); }
+    uint32_t matchFull() const {
+      uint32_t m = 0;
+      for (unsigned i = 0; i < kGroupSize; ++i) m |= static_cast<uint32_t>(ctrl[i] >> 7) << i;
+      return m;
+    }
+    uint32_t matchEmptyOrDeleted() const { return ~matchFull() & 0xFFFFu; }
+
+   private:
+#endif
+    const uint8_t* ctrl;
+  };
+
+  static uint8_t h2Of(uint64_t hash) { return static_cast<uint8_t>(kFullBit | (hash & 0x7F)); }
+  static std::size_t h1Of(uint64_t hash) { return static_cast<std::size_t>(hash >> 7); }
+
+  // Max load factor 7/8, counting tombstones since they lengthen probes.
+  static bool needsGrow(const Table& t) {
+    return (t.size + t.tombstones + 1) * 8 > t.ngroups * kGroupSize * 7;
+  }
+  static bool needsShrink(const Table& t) {
+    return t.ngroups > 1 && t.size * 16 < t.ngroups * kGroupSize;
+  }
+
+  // Smallest power-of-two group count that keeps 'n' entries under half load.
+  static std::size_t groupsFor(std::size_t n) {
+    std::size_t groups = 1;
+    while (groups * kGroupSize < n * 2) groups <<= 1;
+    return groups;
+  }
+
+  static Table allocTable(std::size_t ngroups) {
+    Table t;
+    t.ngroups = ngroups;
+    t.ctrl = static_cast<uint8_t*>(std::calloc(ngroups, kGroupSize));
+    if (!t.ctrl) throw std::bad_alloc();
+    t.slots = static_cast<Slot*>(::operator new(ngroups * kGroupSize * sizeof(Slot),
+                                                std::align_val_t(alignof(Slot))));
+    return t;
+  }
+
+  static void destroyTable(Table& t) {
+    if (t.ngroups == 0) return;
+    for (std::size_t g = 0; g < t.ngroups && t.size > 0; ++g) {
+      uint32_t full = Group(t.ctrl + g * kGroupSize).matchFull();
+      while (full) {
+        const unsigned i = static_cast<unsigned>(__builtin_ctz(full));
+        full &= full - 1;
+        t.slots[g * kGroupSize + i].~Slot();
+        --t.size;
+      }
+    }
+    std::free(t.ctrl);
+    ::operator delete(t.slots, std::align_val_t(alignof(Slot)));
+    t = Table();
+  }
+
+  void startRehash(std::size_t ngroups) {
+    if (tables_[0].ngroups == 0) {
+      tables_[0] = allocTable(ngroups);
+      return;
+    }
+    tables_[1] = allocTable(ngroups);
+    rehash_idx_ = 0;
+    released_bytes_ = 0;
+  }
+
+  // Hands fully migrated pages of the old slot array back to the OS.
+  void releaseMigrated() {
+#ifdef __linux__
+    const Table& from = tables_[0];
+    const std::size_t total = from.ngroups * kGroupSize * sizeof(Slot);
+    if (total < kReleaseThresholdBytes) return;
+    static const std::size_t page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    const uintptr_t base = reinterpret_cast<uintptr_t>(from.slots);
+    const uintptr_t begin = (base + released_bytes_ + page - 1) & ~(page - 1);
+    const uintptr_t end = (base + rehash_idx_ * kGroupSize * sizeof(Slot)) & ~(page - 1);
+    // Batch madvise calls; 64 pages at a time is plenty.
+    if (end <= begin || end - begin < page * 64) return;
+    ::madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED);
+    released_bytes_ = end - base;
+#endif
+  }
+
+  static V* findIn(Table& t, std::string_view key, uint64_t hash) {
+    if (t.ngroups == 0) return nullptr;
+    const std::size_t mask = t.ngroups - 1;
+    std::size_t g = h1Of(hash) & mask;
+    for (std::size_t probes = 0; probes < t.ngroups; ++probes) {
+      const Group group(t.ctrl + g * kGroupSize);
+      uint32_t m = group.match(h2Of(hash));
+      while (m) {
+        const unsigned i = static_cast<unsigned>(__builtin_ctz(m));
+        m &= m - 1;
+        Slot& slot = t.slots[g * kGroupSize + i];
+        if (slot.hash == hash && keyEquals(slot.value.key(), key)) return &slot.value;
+      }
+      // Probing stops at the first group that was never full.
+      if (group.matchEmpty()) return nullptr;
+      g = (g + 1) & mask;
+    }
+    return nullptr;
+  }
+
+  // Visits the entries whose home group is 'bucket': they all sit between
+  // it and the first group that was never full, where findIn() stops.
+  template <typename Fn>
+  static void scanBucket(const Table& t, std::size_t bucket, Fn& fn) {
+    const std::size_t mask = t.ngroups - 1;
+    std::size_t g = bucket;
+    for (std::size_t probes = 0; probes < t.ngroups; ++probes) {
+      const Group group(t.ctrl + g * kGroupSize);
+      uint32_t full = group.matchFull();
+      while (full) {
+        const unsigned i = static_cast<unsigned>(__builtin_ctz(full));
+        full &= full - 1;
+        const Slot& slot = t.slots[g * kGroupSize + i];
+        if ((h1Of(slot.hash) & mask) == bucket) fn(slot.value.key(), slot.value);
+      }
+      if (group.matchEmpty()) return;
+      g = (g + 1) & mask;
+    }
+  }
+
+  // Adds one to the bits of 'cursor' under 'mask', counting from the top.
+  static uint64_t nextCursor(uint64_t cursor, uint64_t mask) {
+    cursor |= ~mask;
+    cursor = reverseBits(cursor);
+    ++cursor;
+    return reverseBits(cursor);
+  }
+
+  static uint64_t reverseBits(uint64_t v) {
+    v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+    v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((v & 0x0F0F0F0F0F0F0F0Full) << 4);
+    return __builtin_bswap64(v);
+  }
+
+  // Claims a slot for a key known to be absent from 't'. Caller constructs it.
+  static Slot* insertNew(Table& t, uint64_t hash) {
+    const std::size_t mask = t.ngroups - 1;
+    std::size_t g = h1Of(hash) & mask;
+    for (;;) {
+      uint8_t* ctrl = t.ctrl + g * kGroupSize;
+      const uint32_t m = Group(ctrl).matchEmptyOrDeleted();
+      if (m) {
+        const unsigned i = static_cast<unsigned>(__builtin_ctz(m));
+        if (ctrl[i] == kDeleted) --t.tombstones;
+        ctrl[i] = h2Of(hash);
+        ++t.size;
+        return t.slots + g * kGroupSize + i;
+      }
+      g = (g + 1) & mask;
+    }
+  }
+
+  template <typename Fn>
+  static bool eraseIn(Table& t, std::string_view key, uint64_t hash, Fn& dispose) {
+    if (t.ngroups == 0) return false;
+    const std::size_t mask = t.ngroups - 1;
+    std::size_t g = h1Of(hash) & mask;
+    for (std::size_t probes = 0; probes < t.ngroups; ++probes) {
+      uint8_t* ctrl = t.ctrl + g * kGroupSize;
+      const Group group(ctrl);
+      uint32_t m = group.match(h2Of(hash));
+      while (m) {
+        const unsigned i = static_cast<unsigned>(__builtin_ctz(m));
+        m &= m - 1;
+        Slot& slot = t.slots[g * kGroupSize + i];
+        if (slot.hash != hash || !keyEquals(slot.value.key(), key)) continue;
+        dispose(slot.value);
+        slot.~Slot();
+        --t.size;
+        // A group that still has an empty slot never ended a probe sequence,
+        // so the slot can go back to empty instead of becoming a tombstone.
+        if (group.matchEmpty()) {
+          ctrl[i] = kEmpty;
+        } else {
+          ctrl[i] = kDeleted;
+          ++t.tombstones;
+        }
+        return true;
+      }
+      if (group.matchEmpty()) return false;
+      g = (g + 1) & mask;
+    }
+    return false;
+  }
+
+  // tables_[0] is the live table; tables_[1] is only allocated while a
+  // rehash is moving entries into it, with rehash_idx_ the next group of
+  // tables_[0] to move.
+  Table tables_[2];
+  std::size_t rehash_idx_ = 0;
+  // Prefix of tables_[0].slots (in bytes) already returned to the OS.
+  std::size_t released_bytes_ = 0;
+  bool paused_ = false;
+};
+
+}  // namespace async
@@ -0,0 +1,18 @@
+#include "keyhash.h"
+
+#include <random>
+
+namespace async {
+
+namespace {
+std::uint64_t randomSeed() {
+  std::random_device rd;
+  return static_cast<std::uint64_t>(rd()) << 32 ^ rd();
+}
+}  // namespace
+
+namespace keyhash {
+const std::uint64_t seed = randomSeed();
+}  // namespace keyhash
+
+}  // namespace async
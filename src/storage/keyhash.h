@@ -0,0 +1,139 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace async {
+
+// Hashing and comparison of keys (and of hash fields and set members) for
+// the store's tables. Every lookup hashes its key once with hashKey(); the
+// same 64-bit value picks the shard (top bits), the home group and the
+// control byte (see HashTable), so one hash serves the whole request.
+//
+// The hash is wyhash (final version 4), which reads 8 or 16 bytes per step
+// and runs near memory speed on long keys, keyed by a per-process random
+// seed: without it, clients able to choose keys could make them all collide
+// and turn every probe into a scan. Anything hash-ordered (SCAN cursors,
+// table layout) is therefore only meaningful within one process; snapshots
+// and the AOF hold keys, not hashes.
+
+namespace keyhash {
+// Random per process, from std::random_device, set before main().
+extern const std::uint64_t seed;
+
+inline std::uint64_t read8(const unsigned char* p) {
+  std::uint64_t v;
+  std::memcpy(&v, p, 8);
+  return v;
+}
+inline std::uint64_t read4(const unsigned char* p) {
+  std::uint32_t v;
+  std::memcpy(&v, p, 4);
+  return v;
+}
+inline void multiply(std::uint64_t& a, std::uint64_t& b) {
+  const unsigned __int128 r = static_cast<unsigned __int128>(a) * b;
+  a = static_cast<std::uint64_t>(r);
+  b = static_cast<std::uint64_t>(r >> 64);
+}
+inline std::uint64_t mix(std::uint64_t a, std::uint64_t b) {
+  multiply(a, b);
+  return a ^ b;
+}
+
+inline constexpr std::uint64_t kSecret[4] = {0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+                                             0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull};
+
+inline std::uint64_t wyhash(const void* data, std::size_t len, std::uint64_t seed) {
+  const unsigned char* p = static_cast<const unsigned char*>(data);
+  seed ^= mix(seed ^ kSecret[0], kSecret[1]);
+  std::uint64_t a = 0;
+  std::uint64_t b = 0;
+  if (len <= 16) {
+    if (len >= 4) {
+      const std::size_t mid = (len >> 3) << 2;
+      a = (read4(p) << 32) | read4(p + mid);
+      b = (read4(p + len - 4) << 32) | read4(p + len - 4 - mid);
+    } else if (len > 0) {
+      a = static_cast<std::uint64_t>(p[0]) << 16 | static_cast<std::uint64_t>(p[len >> 1]) << 8 |
+          p[len - 1];
+    }
+  } else {
+    std::size_t i = len;
+    if (i > 48) {
+      std::uint64_t see1 = seed;
+      std::uint64_t see2 = seed;
+      do {
+        seed = mix(read8(p) ^ kSecret[1], read8(p + 8) ^ seed);
+        see1 = mix(read8(p + 16) ^ kSecret[2], read8(p + 24) ^ see1);
+        see2 = mix(read8(p + 32) ^ kSecret[3], read8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) {
+      seed = mix(read8(p) ^ kSecret[1], read8(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    a = read8(p + i - 16);
+    b = read8(p + i - 8);
+  }
+  a ^= kSecret[1];
+  b ^= seed;
+  multiply(a, b);
+  return mix(a ^ kSecret[0] ^ len, b ^ kSecret[1]);
+}
+}  // namespace keyhash
+
+inline std::uint64_t hashKey(std::string_view key) {
+  return keyhash::wyhash(key.data(), key.size(), keyhash::seed);
+}
+
+// Key equality, lengths first. Table probes only get here once the cached
+// 64-bit hashes match, so the bytes nearly always are equal and are all
+// compared: 16 at a time, the last block overlapping the one before it so
+// that nothing past either key is read; short keys with two overlapping
+// loads of 8 or 4 bytes.
+inline bool keyEquals(std::string_view a, std::string_view b) {
+  const std::size_t n = a.size();
+  if (n != b.size()) return false;
+  const unsigned char* x = reinterpret_cast<const unsigned char*>(a.data());
+  const unsigned char* y = reinterpret_cast<const unsigned char*>(b.data());
+#if defined(__SSE2__)
+  if (n >= 16) {
+    auto block = [x, y](std::size_t i) {
+      const __m128i u = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i));
+      const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(y + i));
+      return _mm_movemask_epi8(_mm_cmpeq_epi8(u, v)) == 0xFFFF;
+    };
+    for (std::size_t i = 0; i + 16 < n; i += 16) {
+      if (!block(i)) return false;
+    }
+    return block(n - 16);
+  }
+#else
+  if (n >= 16) return std::memcmp(x, y, n) == 0;
+#endif
+  if (n >= 8) {
+    return ((keyhash::read8(x) ^ keyhash::read8(y)) |
+            (keyhash::read8(x + n - 8) ^ keyhash::read8(y + n - 8))) == 0;
+  }
+  if (n >= 4) {
+    return ((keyhash::read4(x) ^ keyhash::read4(y)) |
+            (keyhash::read4(x + n - 4) ^ keyhash::read4(y + n - 4))) == 0;
+  }
+  for (std::size_t i = 0; i < n; ++i) {
+    if (x[i] != y[i]) return false;
+  }
+  return true;
+}
+
+}  // namespace async
@@ -0,0 +1,1136 @@
+#include "kvstore.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+#include "hashtable.h"
+#include "keyhash.h"
+#include "lazyfree.h"
+#include "slab.h"
+#include "../utils/utils.h"
+
+namespace async {
+
+namespace {
+// Shards are padded to this size so neighbouring locks never share a line.
+constexpr std::size_t kCacheLine = 64;
+
+std::size_t roundUpPow2(std::size_t n) {
+  std::size_t p = 1;
+  while (p < n) p <<= 1;
+  return p;
+}
+
+unsigned log2Pow2(std::size_t n) {
+  unsigned bits = 0;
+  while ((std::size_t{1} << bits) < n) ++bits;
+  return bits;
+}
+
+// xorshift64*, one per thread, for eviction sampling and LFU increments.
+uint64_t nextRandom() {
+  thread_local uint64_t s = 0x9E3779B97F4A7C15ull ^ reinterpret_cast<uintptr_t>(&s);
+  s ^= s >> 12;
+  s ^= s << 25;
+  s ^= s >> 27;
+  return s * 0x2545F4914F6CDD1Dull;
+}
+
+// Decimal text of v in 'buf', for WriteObserver arguments.
+std::string_view formatInt(char (&buf)[24], int64_t v) {
+  const auto res = std::to_chars(buf, buf + sizeof(buf), v);
+  return std::string_view(buf, static_cast<std::size_t>(res.ptr - buf));
+}
+}  // namespace
+
+// ===================== Access metadata =====================
+
+namespace {
+// 24 bits per entry, as in Redis's robj: either an LRU clock in seconds, or
+// for LFU the last decrement time in minutes (16 bits) plus an 8-bit
+// logarithmic access counter.
+constexpr uint32_t kAccessMask = (1u << 24) - 1;
+constexpr uint32_t kLfuInitCounter = 5;
+constexpr unsigned kLfuLogFactor = 10;
+constexpr uint32_t kLfuDecayMinutes = 1;
+// Keys sampled per eviction, as Redis's maxmemory-samples default.
+constexpr std::size_t kEvictionSamples = 5;
+// Upper bound on evictions performed by one ensureMemory() call.
+constexpr std::size_t kMaxEvictionsPerCall = 128;
+
+uint32_t lruIdle(uint32_t now_s, uint32_t access) {
+  const uint32_t now = now_s & kAccessMask;
+  return now >= access ? now - access : kAccessMask - access + now;
+}
+
+uint32_t lfuCounter(uint32_t now_s, uint32_t access) {
+  const uint32_t now_min = (now_s / 60) & 0xFFFF;
+  const uint32_t last = access >> 8;
+  const uint32_t elapsed = now_min >= last ? now_min - last : 0xFFFF - last + now_min;
+  const uint32_t periods = elapsed / kLfuDecayMinutes;
+  const uint32_t counter = access & 0xFF;
+  return periods > counter ? 0 : counter - periods;
+}
+
+uint32_t lfuPack(uint32_t now_s, uint32_t counter) {
+  return (((now_s / 60) & 0xFFFF) << 8) | counter;
+}
+
+// Probability of an increment falls as 1 / ((counter - init) * factor + 1).
+uint32_t lfuIncrement(uint32_t counter) {
+  if (counter == 255) return counter;
+  const double base = counter > kLfuInitCounter ? counter - kLfuInitCounter : 0;
+  const double r = static_cast<double>(nextRandom() >> 11) * (1.0 / 9007199254740992.0);
+  return r < 1.0 / (base * kLfuLogFactor + 1) ? counter + 1 : counter;
+}
+}  // namespace
+
+// ===================== Shard =====================
+
+namespace {
+// Key, value and metadata of one key, 48 bytes in the table slot. Key and
+// value are stored back to back: in the entry itself when together they
+// fit in kInlineBytes, else in one chunk from the shard's SlabAllocator.
+// Values of kSharedValueBytes and up, and bulk-loaded ones that exceed the
+// slab's largest chunk (loadBatch()), are a SharedValue instead, with only
+// the key in a chunk. An Object value is owned through a pointer next to
+// the key's chunk pointer.
+//
+// Chunks and objects are not freed by the destructor, which has no
+// allocator to give them back to (and runs for the moved-from slots of a
+// rehash): release() must be called first.
+class Entry {
+ public:
+  static constexpr std::size_t kInlineBytes = 24;
+
+  Entry() = default;
+  Entry(Entry&& other) noexcept
+    : expire_at(other.expire_at), klen_(other.klen_), vlen_(other.vlen_),
+      access(other.access), kind_(other.kind_) {
+    if (kind_ == Kind::Shared) {
+      setChunk(other.chunk());
+      new (sharedSlot()) SharedValue(std::move(*other.sharedSlot()));
+    } else {
+      std::memcpy(storage_, other.storage_, sizeof(storage_));
+    }
+  }
+  Entry& operator=(Entry&&) = delete;
+  ~Entry() {
+    if (kind_ == Kind::Shared) sharedSlot()->~SharedValue();
+  }
+
+  std::string_view key() const {
+    return std::string_view(kind_ == Kind::Inline ? storage_ : chunk(), klen_);
+  }
+  // String value; empty for an object.
+  std::string_view bytes() const {
+    switch (kind_) {
+      case Kind::Inline: return std::string_view(storage_ + klen_, vlen_);
+      case Kind::Packed: return std::string_view(chunk() + klen_, vlen_);
+      case Kind::Shared: return **sharedSlot();
+      case Kind::Object: break;
+    }
+    return std::string_view();
+  }
+  const SharedValue* shared() const { return kind_ == Kind::Shared ? sharedSlot() : nullptr; }
+  Object* object() const { return kind_ == Kind::Object ? objectPtr() : nullptr; }
+  ValueType type() const { return kind_ == Kind::Object ? objectPtr()->type() : ValueType::String; }
+
+  // Replace the entry's key and value (a new entry has neither). Return the
+  // change in heapBytes(). With 'lazy', an old value that is costly to
+  // free goes to it instead of being freed here, as in release().
+  int64_t store(SlabAllocator& slab, std::string_view key, std::string_view value,
+                LazyFree* lazy = nullptr);
+  int64_t storeShared(SlabAllocator& slab, std::string_view key, SharedValue&& value,
+                      LazyFree* lazy = nullptr);
+  int64_t storeObject(SlabAllocator& slab, std::string_view key, std::unique_ptr<Object> value);
+  // Frees the key and value, leaving both empty; the value is handed to
+  // 'lazy' instead if it takes it.
+  void release(SlabAllocator& slab, LazyFree* lazy = nullptr);
+
+  // Bytes held outside the entry.
+  int64_t heapBytes() const {
+    switch (kind_) {
+      case Kind::Inline: return 0;
+      case Kind::Packed: return static_cast<int64_t>(SlabAllocator::chunkBytes(klen_ + vlen_));
+      case Kind::Object:
+        return static_cast<int64_t>(SlabAllocator::chunkBytes(klen_) + objectPtr()->memoryBytes());
+      case Kind::Shared: break;
+    }
+    // The shared value with its view and control block, or its share of an
+    // arena page.
+    return static_cast<int64_t>(SlabAllocator::chunkBytes(klen_) + (*sharedSlot())->size() +
+                                sizeof(std::string_view) + 16);
+  }
+
+  bool hasExpiry() const { return expire_at != KVStore::kNoExpiry; }
+  bool expiredAt(int64_t now_ms) const { return hasExpiry() && expire_at <= now_ms; }
+
+  uint32_t loadAccess() const { return __atomic_load_n(&access, __ATOMIC_RELAXED); }
+  void storeAccess(uint32_t v) const { __atomic_store_n(&access, v, __ATOMIC_RELAXED); }
+
+  int64_t expire_at = KVStore::kNoExpiry;
+
+ private:
+  enum class Kind : uint8_t {
+    Inline,  // key and value in storage_
+    Packed,  // storage_ holds a chunk pointer; chunk holds key and value
+    Shared,  // storage_ holds a chunk pointer (the key) and a SharedValue
+    Object,  // storage_ holds a chunk pointer (the key) and an owned Object*
+  };
+
+  char* chunk() const {
+    char* p;
+    std::memcpy(&p, storage_, sizeof(p));
+    return p;
+  }
+  void setChunk(char* p) { std::memcpy(storage_, &p, sizeof(p)); }
+  SharedValue* sharedSlot() const {
+    return std::launder(reinterpret_cast<SharedValue*>(const_cast<char*>(storage_) + 8));
+  }
+  Object* objectPtr() const {
+    Object* p;
+    std::memcpy(&p, storage_ + 8, sizeof(p));
+    return p;
+  }
+
+  alignas(8) char storage_[kInlineBytes];
+  uint32_t klen_ = 0;
+  uint32_t vlen_ = 0;
+
+ public:
+  // LRU/LFU metadata. Readers update it under the shared lock with relaxed
+  // atomics; a lost update only makes the approximation slightly coarser.
+  // (Declared here to pack with the lengths.)
+  mutable uint32_t access = 0;
+
+ private:
+  Kind kind_ = Kind::Inline;
+};
+
+static_assert(sizeof(char*) + sizeof(SharedValue) <= Entry::kInlineBytes,
+              "a shared entry keeps a chunk pointer and a SharedValue inline");
+static_assert(sizeof(Entry) == 48, "entries are meant to stay compact");
+
+int64_t Entry::store(SlabAllocator& slab, std::string_view key, std::string_view value,
+                     LazyFree* lazy) {
+  const int64_t before = heapBytes();
+  const std::size_t total = key.size() + value.size();
+  char* dst;
+  if (total <= kInlineBytes) {
+    release(slab, lazy);
+    dst = storage_;
+  } else if (kind_ == Kind::Packed &&
+             SlabAllocator::chunkBytes(total) == SlabAllocator::chunkBytes(klen_ + vlen_)) {
+    // Same size class: overwrite in place. Writers hold the shard lock
+    // exclusively, so no reader sees the bytes change.
+    dst = chunk();
+  } else {
+    dst = slab.allocate(total);
+    release(slab, lazy);
+    setChunk(dst);
+    kind_ = Kind::Packed;
+  }
+  std::memcpy(dst, key.data(), key.size());
+  std::memcpy(dst + key.size(), value.data(), value.size());
+  klen_ = static_cast<uint32_t>(key.size());
+  vlen_ = static_cast<uint32_t>(value.size());
+  return heapBytes() - before;
+}
+
+int64_t Entry::storeShared(SlabAllocator& slab, std::string_view key, SharedValue&& value,
+                           LazyFree* lazy) {
+  const int64_t before = heapBytes();
+  if (kind_ == Kind::Shared) {
+    // Never modified in place: readers may still be sending the old buffer.
+    if (lazy) lazy->take(*sharedSlot());
+    *sharedSlot() = std::move(value);
+  } else {
+    char* dst = slab.allocate(key.size());
+    std::memcpy(dst, key.data(), key.size());
+    release(slab, lazy);
+    setChunk(dst);
+    new (sharedSlot()) SharedValue(std::move(value));
+    kind_ = Kind::Shared;
+    klen_ = static_cast<uint32_t>(key.size());
+  }
+  vlen_ = static_cast<uint32_t>((*sharedSlot())->size());
+  return heapBytes() - before;
+}
+
+int64_t Entry::storeObject(SlabAllocator& slab, std::string_view key,
+                           std::unique_ptr<Object> value) {
+  const int64_t before = heapBytes();
+  char* dst = slab.allocate(key.size());
+  std::memcpy(dst, key.data(), key.size());
+  release(slab);
+  setChunk(dst);
+  Object* object = value.release();
+  std::memcpy(storage_ + 8, &object, sizeof(object));
+  kind_ = Kind::Object;
+  klen_ = static_cast<uint32_t>(key.size());
+  return heapBytes() - before;
+}
+
+void Entry::release(SlabAllocator& slab, LazyFree* lazy) {
+  if (kind_ == Kind::Packed) {
+    slab.deallocate(chunk(), klen_ + vlen_);
+  } else if (kind_ == Kind::Shared) {
+    slab.deallocate(chunk(), klen_);
+    if (lazy) lazy->take(*sharedSlot());
+    sharedSlot()->~SharedValue();
+  } else if (kind_ == Kind::Object) {
+    slab.deallocate(chunk(), klen_);
+    std::unique_ptr<Object> object(objectPtr());
+    if (lazy) lazy->take(object);
+  }
+  kind_ = Kind::Inline;
+  klen_ = 0;
+  vlen_ = 0;
+}
+
+struct ExpiryItem {
+  int64_t when;
+  std::string key;
+};
+
+struct ExpiresLater {
+  bool operator()(const ExpiryItem& a, const ExpiryItem& b) const { return a.when > b.when; }
+};
+
+// Stale heap items popped per active-expire run, per key actually deleted.
+constexpr std::size_t kStalePopsPerKey = 4;
+// Per-shard memory deltas are folded into the global counter in batches of
+// about this size, so the counter's cache line is not written on every set.
+constexpr int64_t kMemoryFlushBytes = 4 * 1024;
+
+// Updates an entry's LRU/LFU metadata on access.
+void touchEntry(const Entry& entry, EvictionPolicy policy, uint32_t now_s) {
+  if (policy == EvictionPolicy::AllKeysLfu) {
+    entry.storeAccess(lfuPack(now_s, lfuIncrement(lfuCounter(now_s, entry.loadAccess()))));
+  } else {
+    entry.storeAccess(now_s & kAccessMask);
+  }
+}
+}  // namespace
+
+struct alignas(kCacheLine) KVStore::Shard {
+  // Readers (get) share the lock; writers (set/del) take it exclusively.
+  mutable std::shared_mutex mu;
+  // Holds the entries' key/value chunks; declared first so that it
+  // outlives the table.
+  SlabAllocator slab;
+  HashTable<Entry> data;
+  // Min-heap of (deadline, key). Items go stale when a key's expiry changes
+  // or the key is deleted; they are skipped when popped, and the heap is
+  // rebuilt when stale items outnumber live ones.
+  std::vector<ExpiryItem> expiry_heap;
+  std::size_t volatile_keys = 0;
+  // Copy of the heap top, readable without the lock.
+  std::atomic<int64_t> next_expiry{kNoExpiry};
+  // Structure bytes (table, expiry heap) last folded into the accounting,
+  // and the entry/structure delta not yet added to KVStore::used_memory_.
+  int64_t overhead_bytes = 0;
+  int64_t pending_memory = 0;
+
+  void publishNextExpiry() {
+    next_expiry.store(expiry_heap.empty() ? kNoExpiry : expiry_heap.front().when,
+                      std::memory_order_relaxed);
+  }
+
+  ~Shard() {
+    data.forEach([this](std::string_view, Entry& e) { e.release(slab); });
+  }
+
+  // Erases an entry, handing its value to 'lazy' if costly to free;
+  // returns the entry bytes released.
+  int64_t removeEntry(std::string_view key, uint64_t hash, const Entry& entry,
+                      LazyFree* lazy) {
+    if (entry.hasExpiry()) --volatile_keys;
+    const int64_t freed = entry.heapBytes();
+    data.erase(key, hash, [this, lazy](Entry& e) { e.release(slab, lazy); });
+    return freed;
+  }
+
+  // Change in structure bytes since the last call.
+  int64_t overheadDelta() {
+    const int64_t now =
+        static_cast<int64_t>(data.memoryUsage() + expiry_heap.capacity() * sizeof(ExpiryItem));
+    const int64_t delta = now - overhead_bytes;
+    overhead_bytes = now;
+    return delta;
+  }
+};
+
+// ===================== SharedValue =====================
+
+SharedValue makeSharedValue(std::string&& bytes) {
+  struct Owned {
+    std::string bytes;
+    std::string_view view;
+  };
+  auto owned = std::make_shared<Owned>();
+  owned->bytes = std::move(bytes);
+  owned->view = owned->bytes;
+  return SharedValue(owned, &owned->view);
+}
+
+SharedValue ValueArena::copy(std::string_view bytes) {
+  if (bytes.size() > kMaxValueBytes) return makeSharedValue(std::string(bytes));
+  // Each value is its view followed by the bytes, at view alignment.
+  constexpr std::size_t kAlign = alignof(std::string_view);
+  const std::size_t need = sizeof(std::string_view) + bytes.size();
+  if (kPageBytes - used_ < need) {
+    page_ = std::shared_ptr<char[]>(new char[kPageBytes]);
+    used_ = 0;
+  }
+  char* at = page_.get() + used_;
+  std::memcpy(at + sizeof(std::string_view), bytes.data(), bytes.size());
+  const std::string_view* view =
+      new (at) std::string_view(at + sizeof(std::string_view), bytes.size());
+  used_ += (need + kAlign - 1) & ~(kAlign - 1);
+  return SharedValue(page_, view);
+}
+
+// ===================== KVStore =====================
+
+bool parseEvictionPolicy(const char* name, EvictionPolicy& out) {
+  static const EvictionPolicy kAll[] = {EvictionPolicy::NoEviction, EvictionPolicy::AllKeysLru,
+                                        EvictionPolicy::AllKeysLfu, EvictionPolicy::VolatileTtl};
+  for (EvictionPolicy policy : kAll) {
+    if (std::strcmp(name, evictionPolicyName(policy)) == 0) {
+      out = policy;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char* evictionPolicyName(EvictionPolicy policy) {
+  switch (policy) {
+    case EvictionPolicy::NoEviction: return "noeviction";
+    case EvictionPolicy::AllKeysLru: return "allkeys-lru";
+    case EvictionPolicy::AllKeysLfu: return "allkeys-lfu";
+    case EvictionPolicy::VolatileTtl: return "volatile-ttl";
+  }
+  return "unknown";
+}
+
+KVStore::KVStore(std::size_t nshards)
+  : nshards_(roundUpPow2(nshards == 0 ? 1 : nshards)),
+    shard_shift_(64 - log2Pow2(nshards_)),
+    shards_(new Shard[nshards_]),
+    lazy_free_(new LazyFree()) {
+  updateClock();
+}
+
+KVStore::~KVStore() = default;
+
+KVStore::Shard& KVStore::shardFor(uint64_t hash) const {
+  if (nshards_ == 1) return shards_[0];
+  // Top bits pick the shard; the low bits remain free for the table itself.
+  return shards_[static_cast<std::size_t>(hash >> shard_shift_)];
+}
+
+void KVStore::noteRehash(bool was_rehashing, bool is_rehashing) {
+  if (was_rehashing == is_rehashing) return;
+  if (is_rehashing) {
+    rehashing_shards_.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    rehashing_shards_.fetch_sub(1, std::memory_order_relaxed);
+  }
+}
+
+void KVStore::finishWrite(Shard& shard, bool was_rehashing, int64_t entry_delta, bool flush) {
+  noteRehash(was_rehashing, shard.data.rehashing());
+  shard.pending_memory += entry_delta + shard.overheadDelta();
+  if (flush || shard.pending_memory >= kMemoryFlushBytes ||
+      shard.pending_memory <= -kMemoryFlushBytes) {
+    used_memory_.fetch_add(shard.pending_memory, std::memory_order_relaxed);
+    shard.pending_memory = 0;
+  }
+}
+
+int64_t KVStore::writeClockMs() const {
+  return loading_ ? INT64_MIN : unix_time_ms();
+}
+
+void KVStore::notify(const Shard& shard, std::initializer_list<std::string_view> args) const {
+  notify(shard, args.begin(), args.size());
+}
+
+void KVStore::notify(const Shard& shard, const std::string_view* args, std::size_t argc) const {
+  const std::size_t index = static_cast<std::size_t>(&shard - shards_.get());
+  for (WriteObserver* observer : observers_) observer->onWrite(index, args, argc);
+}
+
+bool KVStore::get(std::string_view key, std::string& out) const {
+  return view(key, [&out](std::string_view value) { out.assign(value); });
+}
+
+KVStore::KeyResult KVStore::viewImpl(std::string_view key, ValueVisitor visit, void* ctx) const {
+  const uint64_t hash = hashKey(key);
+  Shard& shard = shardFor(hash);
+  std::shared_lock<std::shared_mutex> lock(shard.mu);
+  const Entry* entry = shard.data.find(key, hash);
+  if (!entry) return KeyResult::Missing;
+  // Lazy expiry: readers only hide the key; the next writer removes it.
+  if (entry->hasExpiry() && entry->expiredAt(unix_time_ms())) return KeyResult::Missing;
+  if (entry->object()) return KeyResult::WrongType;
+  touchEntry(*entry, policy_, clock_s_.load(std::memory_order_relaxed));
+  visit(ctx, entry->bytes(), entry->shared());
+  return KeyResult::Ok;
+}
+
+void KVStore::set(std::string_view key, std::string_view value, int64_t expire_at_ms) {
+  setImpl(key, value, nullptr, expire_at_ms);
+}
+
+void KVStore::setOwned(std::string_view key, std::string&& value, int64_t expire_at_ms) {
+  setImpl(key, value, &value, expire_at_ms);
+}
+
+void KVStore::setImpl(std::string_view key, std::string_view value, std::string* owned,
+                      int64_t expire_at_ms) {
+  const uint64_t hash = hashKey(key);
+  Shard& shard = shardFor(hash);
+  std::unique_lock<std::shared_mutex> lock(shard.mu);
+  setLocked(shard, key, hash, value, owned, expire_at_ms);
+}
+
+void KVStore::setLocked(Shard& shard, std::string_view key, uint64_t hash,
+                        std::string_view value, std::string* owned, int64_t expire_at_ms) {
+  // Reported first: 'owned' is moved from below.
+  if (!observers_.empty()) {
+    char buf[24];
+    if (expire_at_ms == kNoExpiry) {
+      notify(shard, {"set", key, value});
+    } else {
+      notify(shard, {"set", key, value, "pxat", formatInt(buf, expire_at_ms)});
+    }
+  }
+  const bool was_rehashing = shard.data.rehashing();
+  auto [entry, inserted] = shard.data.findOrInsert(key, hash);
+  const uint32_t now_s = clock_s_.load(std::memory_order_relaxed);
+  if (inserted) {
+    entry->access = policy_ == EvictionPolicy::AllKeysLfu ? lfuPack(now_s, kLfuInitCounter)
+                                                          : (now_s & kAccessMask);
+  } else {
+    touchEntry(*entry, policy_, now_s);
+  }
+  const int64_t delta =
+      value.size() >= kSharedValueBytes
+          ? entry->storeShared(shard.slab, key,
+                               makeSharedValue(owned ? std::move(*owned) : std::string(value)),
+                               deleteLazyFree())
+          : entry->store(shard.slab, key, value, deleteLazyFree());
+  if (entry->hasExpiry()) --shard.volatile_keys;
+  entry->expire_at = expire_at_ms;
+  if (entry->hasExpiry()) scheduleExpiry(shard, key, expire_at_ms);
+  finishWrite(shard, was_rehashing, delta);
+}
+
+bool KVStore::del(std::string_view key) {
+  const uint64_t hash = hashKey(key);
+  Shard& shard = shardFor(hash);
+  std::unique_lock<std::shared_mutex> lock(shard.mu);
+  return delLocked(shard, key, hash, deleteLazyFree());
+}
+
+bool KVStore::delLocked(Shard& shard, std::string_view key, uint64_t hash, LazyFree* lazy) {
+  const Entry* entry = shard.data.find(key, hash);
+  if (!entry) return false;
+  const bool was_rehashing = shard.data.rehashing();
+  const bool expired = entry->expiredAt(writeClockMs());
+  if (!expired) notify(shard, {"del", key});
+  const int64_t freed = shard.removeEntry(key, hash, *entry, lazy);
+  finishWrite(shard, was_rehashing, -freed);
+  if (expired) expired_keys_.fetch_add(1, std::memory_order_relaxed);
+  return !expired;
+}
+
+// ===================== Objects =====================
+
+bool KVStore::type(std::string_view key, ValueType& out) const {
+  const uint64_t hash = hashKey(key);
+  Shard& shard = shardFor(hash);
+  std::shared_lock<std::shared_mutex> lock(shard.mu);
+  const Entry* entry = shard.data.find(key, hash);
+  if (!entry || entry->expiredAt(unix_time_ms())) return false;
+  out = entry->type();
+  return true;
+}
+
+KVStore::KeyResult KVStore::readObjectImpl(std::string_view key, ValueType type,
+                                           ObjectReader read, void* ctx) const {
+  const uint64_t hash = hashKey(key);
+  Shard& shard = shardFor(hash);
+  std::shared_lock<std::shared_mutex> lock(shard.mu);
+  const Entry* entry = shard.data.find(key, hash);
+  if (!entry || entry->expiredAt(unix_time_ms())) return KeyResult::Missing;
+  if (entry->type() != type) return KeyResult::WrongType;
+  touchEntry(*entry, policy_, clock_s_.load(std::memory_order_relaxed));
+  read(ctx, *entry->object());
+  return KeyResult::Ok;
+}
+
+KVStore::KeyResult KVStore::writeObjectImpl(std::string_view key, ValueType type,
+                                            ObjectFactory create, ObjectWriter write, void* ctx,
+                                            const std::string_view* args, std::size_t argc) {
+  const uint64_t hash = hashKey(key);
+  Shard& shard = shardFor(hash);
+  std::unique_lock<std::shared_mutex> lock(shard.mu);
+  expireIfDue(shard, key, hash, writeClockMs());
+  Entry* entry = shard.data.find(key, hash);
+  if (entry && entry->type() != type) return KeyResult::WrongType;
+  if (!entry && !create) return KeyResult::Missing;
+
+  const bool was_rehashing = shard.data.rehashing();
+  const uint32_t now_s = clock_s_.load(std::memory_order_relaxed);
+  const int64_t before = entry ? entry->heapBytes() : 0;
+  if (entry) {
+    touchEntry(*entry, policy_, now_s);
+  } else {
+    entry = shard.data.findOrInsert(key, hash).first;
+    entry->access = policy_ == EvictionPolicy::AllKeysLfu ? lfuPack(now_s, kLfuInitCounter)
+                                                          : (now_s & kAccessMask);
+    entry->storeObject(shard.slab, key, create());
+  }
+  if (write(ctx, *entry->object())) notify(shard, args, argc);
+  int64_t after = 0;
+  if (entry->object()->size() == 0) {
+    // Left empty, or created and never filled: the key goes away.
+    shard.removeEntry(key, hash, *entry, nullptr);
+  } else {
+    after = entry->heapBytes();
+  }
+  const int64_t delta = after - before;
+  finishWrite(shard, was_rehashing, delta);
+  return KeyResult::Ok;
+}
+
+// ===================== Batches =====================
+
+namespace {
+// Keys a batch looks up ahead of the current one.
+constexpr std::size_t kPrefetchDistance = 8;
+
+// Hashes and shards of the batch being run; per thread, so that batch
+// commands do not allocate once warmed up.
+struct BatchScratch {
+  std::vector<uint64_t> hashes;
+  std::vector<std::size_t> shards;
+  std::vector<uint64_t> shard_bits;  // one bit per shard, all clear between batches
+};
+
+BatchScratch& batchScratch() {
+  thread_local BatchScratch scratch;
+  return scratch;
+}
+}  // namespace
+
+// Locks the distinct shards of a batch in index order, and unlocks them
+// when destroyed. Fills the batch's hashes; 'stride' steps over values.
+class KVStore::BatchLocks {
+ public:
+  BatchLocks(const KVStore& store, const std::string_view* keys, std::size_t n,
+             std::size_t stride, bool exclusive)
+    : store_(store), scratch_(batchScratch()), exclusive_(exclusive) {
+    scratch_.hashes.clear();
+    scratch_.shards.clear();
+    std::vector<uint64_t>& bits = scratch_.shard_bits;
+    if (bits.size() < (store.nshards_ + 63) / 64) bits.resize((store.nshards_ + 63) / 64);
+    for (std::size_t i = 0; i < n; ++i) {
+      const uint64_t hash = hashKey(keys[i * stride]);
+      scratch_.hashes.push_back(hash);
+      const std::size_t s = static_cast<std::size_t>(&store.shardFor(hash) - store.shards_.get());
+      bits[s / 64] |= uint64_t{1} << (s % 64);
+    }
+    // Shards in index order, clearing the bits for the next batch.
+    for (std::size_t w = 0; w < bits.size(); ++w) {
+      for (uint64_t word = bits[w]; word != 0; word &= word - 1) {
+        scratch_.shards.push_back(w * 64 + static_cast<std::size_t>(__builtin_ctzll(word)));
+      }
+      bits[w] = 0;
+    }
+    for (std::size_t s : scratch_.shards) {
+      if (exclusive_) {
+        store_.shards_[s].mu.lock();
+      } else {
+        store_.shards_[s].mu.lock_shared();
+      }
+    }
+  }
+  ~BatchLocks() {
+    for (std::size_t s : scratch_.shards) {
+      if (exclusive_) {
+        store_.shards_[s].mu.unlock();
+      } else {
+        store_.shards_[s].mu.unlock_shared();
+      }
+    }
+  }
+  BatchLocks(const BatchLocks&) = delete;
+  BatchLocks& operator=(const BatchLocks&) = delete;
+
+  uint64_t hash(std::size_t i) const { return scratch_.hashes[i]; }
+
+  // Prefetches the probe of key i, if there is one.
+  void prefetch(std::size_t i) const {
+    if (i < scratch_.hashes.size()) {
+      const uint64_t hash = scratch_.hashes[i];
+      store_.shardFor(hash).data.prefetch(hash);
+    }
+  }
+
+ private:
+  const KVStore& store_;
+  BatchScratch& scratch_;
+  bool exclusive_;
+};
+
+void KVStore::viewManyImpl(const std::string_view* keys, std::size_t n, BatchVisitor visit,
+                           void* ctx) const {
+  BatchLocks locks(*this, keys, n, 1, /*exclusive=*/false);
+  const int64_t now = unix_time_ms();
+  const uint32_t now_s = clock_s_.load(std::memory_order_relaxed);
+  for (std::size_t i = 0; i < kPrefetchDistance; ++i) locks.prefetch(i);
+  for (std::size_t i = 0; i < n; ++i) {
+    locks.prefetch(i + kPrefetchDistance);
+    const uint64_t hash = locks.hash(i);
+    const Entry* entry = shardFor(hash).data.find(keys[i], hash);
+    if (!entry || entry->expiredAt(now) || entry->object()) {
+      visit(ctx, i, nullptr, nullptr);
+      continue;
+    }
+    touchEntry(*entry, policy_, now_s);
+    const std::string_view value = entry->bytes();
+    visit(ctx, i, &value, entry->shared());
+  }
+}
+
+void KVStore::setMany(const std::string_view* pairs, std::size_t n) {
+  BatchLocks locks(*this, pairs, n, 2, /*exclusive=*/true);
+  for (std::size_t i = 0; i < kPrefetchDistance; ++i) locks.prefetch(i);
+  for (std::size_t i = 0; i < n; ++i) {
+    locks.prefetch(i + kPrefetchDistance);
+    const uint64_t hash = locks.hash(i);
+    setLocked(shardFor(hash), pairs[2 * i], hash, pairs[2 * i + 1], nullptr, kNoExpiry);
+  }
+}
+
+std::size_t KVStore::delMany(const std::string_view* keys, std::size_t n) {
+  return removeMany(keys, n, deleteLazyFree());
+}
+
+std::size_t KVStore::unlinkMany(const std::string_view* keys, std::size_t n) {
+  return removeMany(keys, n, lazy_free_.get());
+}
+
+std::size_t KVStore::removeMany(const std::string_view* keys, std::size_t n, LazyFree* lazy) {
+  BatchLocks locks(*this, keys, n, 1, /*exclusive=*/true);
+  for (std::size_t i = 0; i < kPrefetchDistance; ++i) locks.prefetch(i);
+  std::size_t deleted = 0;
+  for (std::size_t i = 0; i < n; ++i) {
+    locks.prefetch(i + kPrefetchDistance);
+    const uint64_t hash = locks.hash(i);
+    if (delLocked(shardFor(hash), keys[i], hash, lazy)) ++deleted;
+  }
+  return deleted;
+}
+
+bool KVStore::expireAt(std::string_view key, int64_t expire_at_ms) {
+  const uint64_t hash = hashKey(key);
+  Shard& shard = shardFor(hash);
+  std::unique_lock<std::shared_mutex> lock(shard.mu);
+  const int64_t now = writeClockMs();
+  if (expireIfDue(shard, key, hash, now)) return false;
+  Entry* entry = shard.data.find(key, hash);
+  if (!entry) return false;
+  const bool was_rehashing = shard.data.rehashing();
+  if (expire_at_ms <= now) {
+    notify(shard, {"del", key});
+    const int64_t freed = shard.removeEntry(key, hash, *entry, deleteLazyFree());
+    finishWrite(shard, was_rehashing, -freed);
+    return true;
+  }
+  if (!observers_.empty()) {
+    char buf[24];
+    notify(shard, {"pexpireat", key, formatInt(buf, expire_at_ms)});
+  }
+  if (entry->hasExpiry()) --shard.volatile_keys;
+  entry->expire_at = expire_at_ms;
+  scheduleExpiry(shard, key, expire_at_ms);
+  finishWrite(shard, was_rehashing, 0);
+  return true;
+}
+
+bool KVStore::persist(std::string_view key) {
+  const uint64_t hash = hashKey(key);
+  Shard& shard = shardFor(hash);
+  std::unique_lock<std::shared_mutex> lock(shard.mu);
+  if (expireIfDue(shard, key, hash, writeClockMs())) return false;
+  Entry* entry = shard.data.find(key, hash);
+  if (!entry) return false;
+  if (entry->hasExpiry()) {
+    notify(shard, {"persist", key});
+    // The heap item goes stale and is dropped when popped.
+    --shard.volatile_keys;
+    entry->expire_at = kNoExpiry;
+  }
+  return true;
+}
+
+bool KVStore::ttl(std::string_view key, int64_t& remaining_ms) const {
+  const uint64_t hash = hashKey(key);
+  Shard& shard = shardFor(hash);
+  std::shared_lock<std::shared_mutex> lock(shard.mu);
+  const Entry* entry = shard.data.find(key, hash);
+  if (!entry) return false;
+  if (!entry->hasExpiry()) {
+    remaining_ms = -1;
+    return true;
+  }
+  const int64_t now = unix_time_ms();
+  if (entry->expiredAt(now)) return false;
+  remaining_ms = entry->expire_at - now;
+  return true;
+}
+
+void KVStore::scheduleExpiry(Shard& shard, std::string_view key, int64_t expire_at_ms) {
+  ++shard.volatile_keys;
+  std::vector<ExpiryItem>& heap = shard.expiry_heap;
+  if (heap.size() > 2 * shard.volatile_keys + 64) {
+    // Mostly stale: rebuild from the live deadlines (this one included).
+    heap.clear();
+    shard.data.forEach([&heap](std::string_view k, Entry& e) {
+      if (e.hasExpiry()) heap.push_back(ExpiryItem{e.expire_at, std::string(k)});
+    });
+    std::make_heap(heap.begin(), heap.end(), ExpiresLater());
+  } else {
+    heap.push_back(ExpiryItem{expire_at_ms, std::string(key)});
+    std::push_heap(heap.begin(), heap.end(), ExpiresLater());
+  }
+  shard.publishNextExpiry();
+}
+
+bool KVStore::expireIfDue(Shard& shard, std::string_view key, uint64_t hash, int64_t now_ms) {
+  const Entry* entry = shard.data.find(key, hash);
+  if (!entry || !entry->expiredAt(now_ms)) return false;
+  const bool was_rehashing = shard.data.rehashing();
+  const int64_t freed = shard.removeEntry(key, hash, *entry, deleteLazyFree());
+  finishWrite(shard, was_rehashing, -freed);
+  expired_keys_.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+void KVStore::incrementalRehash(unsigned worker, unsigned nworkers, std::size_t groups) {
+  if (rehash_paused_.load(std::memory_order_relaxed)) return;
+  for (std::size_t i = worker; i < nshards_; i += nworkers) {
+    Shard& shard = shards_[i];
+    std::unique_lock<std::shared_mutex> lock(shard.mu);
+    if (!shard.data.rehashing()) continue;
+    shard.data.rehashStep(groups);
+    finishWrite(shard, true, 0);
+  }
+}
+
+std::size_t KVStore::activeExpire(unsigned worker, unsigned nworkers, std::size_t max_keys) {
+  const int64_t now = unix_time_ms();
+  std::size_t expired = 0;
+  std::size_t stale_budget = max_keys * kStalePopsPerKey;
+  for (std::size_t i = worker; i < nshards_ && expired < max_keys && stale_budget > 0;
+       i += nworkers) {
+    Shard& shard = shards_[i];
+    if (shard.next_expiry.load(std::memory_order_relaxed) > now) continue;
+
+    std::unique_lock<std::shared_mutex> lock(shard.mu);
+    std::vector<ExpiryItem>& heap = shard.expiry_heap;
+    const bool was_rehashing = shard.data.rehashing();
+    int64_t freed = 0;
+    while (!heap.empty() && heap.front().when <= now && expired < max_keys && stale_budget > 0) {
+      std::pop_heap(heap.begin(), heap.end(), ExpiresLater());
+      ExpiryItem item = std::move(heap.back());
+      heap.pop_back();
+      const uint64_t hash = hashKey(item.key);
+      const Entry* entry = shard.data.find(item.key, hash);
+      if (!entry || entry->expire_at != item.when) {
+        --stale_budget;
+        continue;
+      }
+      freed += shard.removeEntry(item.key, hash, *entry, deleteLazyFree());
+      ++expired;
+    }
+    finishWrite(shard, was_rehashing, -freed);
+    shard.publishNextExpiry();
+  }
+  if (expired) expired_keys_.fetch_add(expired, std::memory_order_relaxed);
+  return expired;
+}
+
+int64_t KVStore::nextExpiry(unsigned worker, unsigned nworkers) const {
+  int64_t next = kNoExpiry;
+  for (std::size_t i = worker; i < nshards_; i += nworkers) {
+    next = std::min(next, shards_[i].next_expiry.load(std::memory_order_relaxed));
+  }
+  return next;
+}
+
+void KVStore::setMaxMemory(std::size_t bytes, EvictionPolicy policy) {
+  max_memory_ = bytes;
+  policy_ = policy;
+}
+
+std::size_t KVStore::usedMemory() const {
+  const int64_t used = used_memory_.load(std::memory_order_relaxed);
+  return used > 0 ? static_cast<std::size_t>(used) : 0;
+}
+
+void KVStore::updateClock() {
+  const uint32_t now_s = static_cast<uint32_t>(unix_time_ms() / 1000);
+  // Only write when the second changes, so readers' cache lines stay shared.
+  if (clock_s_.load(std::memory_order_relaxed) != now_s) {
+    clock_s_.store(now_s, std::memory_order_relaxed);
+  }
+}
+
+bool KVStore::ensureMemory() {
+  if (max_memory_ == 0 || usedMemory() <= max_memory_) return true;
+  if (policy_ == EvictionPolicy::NoEviction) return false;
+  // Bounded so one command never stalls its loop; as long as keys are being
+  // evicted the command proceeds and later ones continue the work.
+  std::size_t evicted = 0;
+  while (evicted < kMaxEvictionsPerCall && usedMemory() > max_memory_) {
+    if (!evictOne()) break;
+    ++evicted;
+  }
+  return evicted > 0 || usedMemory() <= max_memory_;
+}
+
+bool KVStore::evictOne() {
+  const uint32_t now_s = clock_s_.load(std::memory_order_relaxed);
+  // Shards are visited round-robin so evictions spread over the keyspace.
+  const std::size_t start = evict_cursor_.fetch_add(1, std::memory_order_relaxed);
+  for (std::size_t attempt = 0; attempt < nshards_; ++attempt) {
+    Shard& shard = shards_[(start + attempt) & (nshards_ - 1)];
+    std::unique_lock<std::shared_mutex> lock(shard.mu);
+    if (shard.data.size() == 0) continue;
+
+    // Copy the victim's key: erasing may move slots while it is compared.
+    std::string victim;
+    bool found = false;
+    if (policy_ == EvictionPolicy::VolatileTtl) {
+      // The expiry heap already orders volatile keys by deadline.
+      std::vector<ExpiryItem>& heap = shard.expiry_heap;
+      while (!heap.empty() && !found) {
+        const ExpiryItem& top = heap.front();
+        const Entry* entry = shard.data.find(top.key, hashKey(top.key));
+        if (entry && entry->expire_at == top.when) {
+          victim = top.key;
+          found = true;
+        }
+        std::pop_heap(heap.begin(), heap.end(), ExpiresLater());
+        heap.pop_back();
+      }
+      shard.publishNextExpiry();
+    } else {
+      const bool lfu = policy_ == EvictionPolicy::AllKeysLfu;
+      uint32_t best = 0;
+      shard.data.sample(nextRandom(), kEvictionSamples, [&](std::string_view key, Entry& e) {
+        // Higher score = better victim: idle seconds, or inverted frequency.
+        const uint32_t score =
+            lfu ? 255 - lfuCounter(now_s, e.access) : lruIdle(now_s, e.access);
+        if (!found || score > best) {
+          best = score;
+          victim.assign(key);
+          found = true;
+        }
+      });
+    }
+    if (!found) continue;
+
+    const uint64_t hash = hashKey(victim);
+    const Entry* entry = shard.data.find(victim, hash);
+    const bool was_rehashing = shard.data.rehashing();
+    notify(shard, {"del", victim});
+    const int64_t freed = shard.removeEntry(victim, hash, *entry, deleteLazyFree());
+    // Flush right away so ensureMemory() sees the memory come back.
+    finishWrite(shard, was_rehashing, -freed, /*flush=*/true);
+    evicted_keys_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+  return false;
+}
+
+void KVStore::exportShard(std::size_t index, const ExportFn& fn,
+                          const std::function<void()>& done) const {
+  Shard& shard = shards_[index];
+  std::shared_lock<std::shared_mutex> lock(shard.mu, std::defer_lock);
+  if (!frozen_) lock.lock();
+  const int64_t now = unix_time_ms();
+  shard.data.forEach([&](std::string_view key, Entry& e) {
+    if (!e.expiredAt(now)) fn(key, e.bytes(), e.object(), e.expire_at);
+  });
+  done();
+}
+
+std::size_t KVStore::handOff(const std::string_view* keys, std::size_t n, const ExportFn& fn,
+                             const std::function<bool()>& commit) {
+  BatchLocks locks(*this, keys, n, 1, /*exclusive=*/true);
+  const int64_t now = unix_time_ms();
+  std::size_t live = 0;
+  for (std::size_t i = 0; i < n; ++i) {
+    const uint64_t hash = locks.hash(i);
+    const Entry* entry = shardFor(hash).data.find(keys[i], hash);
+    if (!entry || entry->expiredAt(now)) continue;
+    fn(keys[i], entry->bytes(), entry->object(), entry->expire_at);
+    ++live;
+  }
+  if (live == 0 || !commit()) return 0;
+  std::size_t deleted = 0;
+  for (std::size_t i = 0; i < n; ++i) {
+    const uint64_t hash = locks.hash(i);
+    if (delLocked(shardFor(hash), keys[i], hash, lazy_free_.get())) ++deleted;
+  }
+  return deleted;
+}
+
+void KVStore::clear() {
+  for (std::size_t i = 0; i < nshards_; ++i) {
+    Shard& shard = shards_[i];
+    std::unique_lock<std::shared_mutex> lock(shard.mu);
+    const bool was_rehashing = shard.data.rehashing();
+    int64_t freed = 0;
+    shard.data.forEach([&](std::string_view, Entry& e) {
+      freed += e.heapBytes();
+      e.release(shard.slab, lazy_free_.get());
+    });
+    shard.data.clear();
+    std::vector<ExpiryItem>().swap(shard.expiry_heap);
+    shard.volatile_keys = 0;
+    shard.publishNextExpiry();
+    finishWrite(shard, was_rehashing, -freed, true);
+  }
+}
+
+void KVStore::reserve(std::size_t keys) {
+  // Some slack for shards that get more than their share.
+  const std::size_t per_shard = keys / nshards_ + keys / nshards_ / 8 + 16;
+  for (std::size_t i = 0; i < nshards_; ++i) {
+    Shard& shard = shards_[i];
+    std::unique_lock<std::shared_mutex> lock(shard.mu);
+    shard.data.reserve(per_shard);
+    finishWrite(shard, shard.data.rehashing(), 0);
+  }
+}
+
+void KVStore::loadBatch(LoadItem* items, std::size_t n, ValueArena& arena) {
+  const uint32_t now_s = clock_s_.load(std::memory_order_relaxed);
+  const uint32_t access = policy_ == EvictionPolicy::AllKeysLfu ? lfuPack(now_s, kLfuInitCounter)
+                                                                : (now_s & kAccessMask);
+  std::unique_lock<std::shared_mutex> lock;
+  const Shard* locked = nullptr;
+  for (std::size_t i = 0; i < n; ++i) {
+    LoadItem& item = items[i];
+    const uint64_t hash = hashKey(item.key);
+    Shard& shard = shardFor(hash);
+    if (&shard != locked) {
+      // Never hold two shard locks: another loader may go the other way.
+      if (lock) lock.unlock();
+      lock = std::unique_lock<std::shared_mutex>(shard.mu);
+      locked = &shard;
+    }
+    const bool was_rehashing = shard.data.rehashing();
+    Entry* entry = shard.data.findOrInsert(item.key, hash).first;
+    entry->access = access;
+    int64_t delta;
+    if (item.object) {
+      delta = entry->storeObject(shard.slab, item.key, std::move(item.object));
+    } else if (item.key.size() + item.value.size() <= SlabAllocator::kMaxChunkBytes) {
+      delta = entry->store(shard.slab, item.key, item.value);
+    } else {
+      delta = entry->storeShared(shard.slab, item.key, arena.copy(item.value));
+    }
+    if (entry->hasExpiry()) --shard.volatile_keys;
+    entry->expire_at = item.expire_at_ms;
+    if (entry->hasExpiry()) scheduleExpiry(shard, item.key, item.expire_at_ms);
+    finishWrite(shard, was_rehashing, delta);
+  }
+}
+
+pid_t KVStore::forkSnapshot(const std::function<void()>& locked) {
+  // Always in index order; no other path holds two shard locks at once.
+  for (std::size_t i = 0; i < nshards_; ++i) shards_[i].mu.lock();
+  if (locked) locked();
+  const pid_t pid = ::fork();
+  if (pid == 0) {
+    frozen_ = true;
+    return 0;
+  }
+  if (pid > 0) {
+    rehash_paused_.store(true, std::memory_order_relaxed);
+    for (std::size_t i = 0; i < nshards_; ++i) shards_[i].data.pauseRehash(true);
+  }
+  for (std::size_t i = 0; i < nshards_; ++i) shards_[i].mu.unlock();
+  return pid;
+}
+
+void KVStore::resumeRehash() {
+  for (std::size_t i = 0; i < nshards_; ++i) {
+    std::unique_lock<std::shared_mutex> lock(shards_[i].mu);
+    shards_[i].data.pauseRehash(false);
+  }
+  rehash_paused_.store(false, std::memory_order_relaxed);
+}
+
+std::size_t KVStore::size() const {
+  std::size_t total = 0;
+  for (std::size_t i = 0; i < nshards_; ++i) {
+    std::shared_lock<std::shared_mutex> lock(shards_[i].mu);
+    total += shards_[i].data.size();
+  }
+  return total;
+}
+
+uint64_t KVStore::scanImpl(uint64_t cursor, std::size_t count, KeyVisitor visit,
+                           void* ctx) const {
+  // Shards are walked in index order, each with a table cursor of its own
+  // below the shard bits, as in shardFor().
+  const uint64_t table_mask = nshards_ == 1 ? ~uint64_t{0} : (uint64_t{1} << shard_shift_) - 1;
+  std::size_t index = nshards_ == 1 ? 0 : static_cast<std::size_t>(cursor >> shard_shift_);
+  uint64_t table_cursor = cursor & table_mask;
+  if (count == 0) count = 1;
+  std::size_t seen = 0;
+  std::size_t buckets_left = count > SIZE_MAX / 10 ? SIZE_MAX : count * 10;
+  const int64_t now = unix_time_ms();
+  while (index < nshards_ && seen < count && buckets_left > 0) {
+    const Shard& shard = shards_[index];
+    {
+      std::shared_lock<std::shared_mutex> lock(shard.mu);
+      do {
+        table_cursor = shard.data.scan(table_cursor, [&](std::string_view key, const Entry& e) {
+          if (e.expiredAt(now)) return;
+          visit(ctx, key);
+          ++seen;
+        });
+        --buckets_left;
+      } while (table_cursor != 0 && seen < count && buckets_left > 0);
+    }
+    if (table_cursor == 0) ++index;
+  }
+  if (index == nshards_) return 0;
+  return (nshards_ == 1 ? 0 : static_cast<uint64_t>(index) << shard_shift_) | table_cursor;
+}
+
+}  // namespace async
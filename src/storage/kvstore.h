@@ -0,0 +1,439 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "object.h"
+
+namespace async {
+
+// Immutable, reference-counted value bytes. Large values are stored this
+// way so that readers can keep sending them after the shard lock is gone.
+// The view points into memory owned by whatever the pointer shares: a
+// string of its own (makeSharedValue()) or a ValueArena page.
+using SharedValue = std::shared_ptr<const std::string_view>;
+
+// Takes over 'bytes' as a SharedValue.
+SharedValue makeSharedValue(std::string&& bytes);
+
+// Packs value bytes back to back into large pages for bulk loads: each
+// value becomes a SharedValue that keeps its page alive, so loading costs
+// one allocation per page rather than one per value. A page is freed once
+// every value in it has been overwritten or deleted. Not thread-safe.
+class ValueArena {
+ public:
+  static constexpr std::size_t kPageBytes = 1u << 20;
+  // Values larger than this get an allocation of their own.
+  static constexpr std::size_t kMaxValueBytes = kPageBytes / 8;
+
+  SharedValue copy(std::string_view bytes);
+
+ private:
+  std::shared_ptr<char[]> page_;
+  std::size_t used_ = kPageBytes;
+};
+
+// What KVStore does when maxmemory is exceeded.
+enum class EvictionPolicy {
+  NoEviction,  // reject writes that may grow memory
+  AllKeysLru,  // evict the least recently used of a few sampled keys
+  AllKeysLfu,  // evict the least frequently used of a few sampled keys
+  VolatileTtl, // evict the key with the nearest expiry
+};
+
+// Parse "noeviction" / "allkeys-lru" / "allkeys-lfu" / "volatile-ttl".
+bool parseEvictionPolicy(const char* name, EvictionPolicy& out);
+const char* evictionPolicyName(EvictionPolicy policy);
+
+// Receives every change to the keyspace as the command that reproduces it:
+// "set" key value ["pxat" ms], "del" key, "pexpireat" key ms, "persist"
+// key, or for objects the command that changed them (see writeObject()).
+// Calls are made under the lock of the shard the key lives in, so for
+// any key they come in the order the changes took effect. Keys removed
+// because their deadline passed are not reported; the deadline was.
+class WriteObserver {
+ public:
+  virtual ~WriteObserver() = default;
+  virtual void onWrite(std::size_t shard, const std::string_view* args, std::size_t argc) = 0;
+};
+
+class LazyFree;
+
+// In-memory key-value store split into power-of-two shards picked by key
+// hash. Every shard has its own reader/writer lock, so operations on
+// different shards never contend. All methods are thread-safe.
+//
+// Each shard is an open-addressing HashTable that grows incrementally;
+// writes move a little of a pending rehash, and event loops finish the
+// rest through incrementalRehash() when traffic is light. A key and its
+// value share one allocation from the shard's SlabAllocator, or none at
+// all when they are short enough to live in the table slot.
+//
+// A value is either a string or an Object (sorted set, hash, list). String
+// operations see keys holding objects as absent, except that set() and
+// del() replace and remove keys of any type; readObject() and
+// writeObject() give commands typed access to objects under the lock.
+//
+// Keys may carry an absolute expiry time (Unix ms). Expired keys are never
+// returned (lazy expiry) and are removed by writers that touch them or by
+// activeExpire(), which walks a per-shard min-heap of deadlines so that its
+// cost is proportional to the number of keys actually expiring.
+//
+// Memory used by keys, values and table overhead is tracked approximately
+// (per-shard deltas are folded into a global counter in batches). With a
+// maxmemory limit, ensureMemory() evicts keys according to the policy.
+// Every entry packs its access metadata into 24 bits, as Redis does: a
+// seconds clock for LRU, or a decay time plus logarithmic counter for LFU.
+class KVStore {
+ public:
+  static constexpr std::size_t kDefaultShards = 64;
+  // "No expiry" for expiry times and nextExpiry().
+  static constexpr std::int64_t kNoExpiry = INT64_MAX;
+  // Values of at least this size are kept in a SharedValue.
+  static constexpr std::size_t kSharedValueBytes = 16 * 1024;
+
+  // 'nshards' is rounded up to a power of two (minimum 1).
+  explicit KVStore(std::size_t nshards = kDefaultShards);
+  ~KVStore();
+  // Non-copyable
+  KVStore(const KVStore&) = delete;
+  KVStore& operator=(const KVStore&) = delete;
+
+  // Outcome of a typed access: the key holds the requested type, does not
+  // exist, or holds a value of another type.
+  enum class KeyResult { Ok, Missing, WrongType };
+
+  // Returns true and fills 'out' if key exists; false otherwise.
+  bool get(std::string_view key, std::string& out) const;
+
+  // Calls fn(std::string_view value) under the shard's read lock if key
+  // exists, without copying the value; the view is only valid during the
+  // call. Returns false if key is absent.
+  template <typename Fn>
+  bool view(std::string_view key, Fn&& fn) const {
+    auto* ctx = &fn;
+    return viewImpl(
+        key,
+        [](void* p, std::string_view v, const SharedValue*) { (*static_cast<decltype(ctx)>(p))(v); },
+        const_cast<void*>(static_cast<const void*>(ctx))) == KeyResult::Ok;
+  }
+
+  // Like view(), but calls fn(std::string_view value, const SharedValue*
+  // shared); 'shared' is non-null for values stored as a SharedValue and may
+  // be copied to keep the bytes past the call. Tells absent keys from keys
+  // holding an object.
+  template <typename Fn>
+  KeyResult viewShared(std::string_view key, Fn&& fn) const {
+    auto* ctx = &fn;
+    return viewImpl(
+        key,
+        [](void* p, std::string_view v, const SharedValue* shared) {
+          (*static_cast<decltype(ctx)>(p))(v, shared);
+        },
+        const_cast<void*>(static_cast<const void*>(ctx)));
+  }
+
+  // Sets key to value. The store keeps its own copy of both. Any previous
+  // expiry is replaced by 'expire_at_ms' (kNoExpiry for none).
+  void set(std::string_view key, std::string_view value, std::int64_t expire_at_ms = kNoExpiry);
+  // Same, but takes over 'value' instead of copying it when it becomes a
+  // SharedValue; smaller values are copied into the shard's slabs anyway.
+  void setOwned(std::string_view key, std::string&& value, std::int64_t expire_at_ms = kNoExpiry);
+
+  // Deletes key; returns true if existed.
+  bool del(std::string_view key);
+
+  // Fills the type of key's value; false if key does not exist.
+  bool type(std::string_view key, ValueType& out) const;
+
+  // Calls fn(const T&) under the shard's read lock if key holds a T (a
+  // class derived from Object, with a static kType).
+  template <typename T, typename Fn>
+  KeyResult readObject(std::string_view key, Fn&& fn) const {
+    auto* ctx = &fn;
+    return readObjectImpl(
+        key, T::kType,
+        [](void* p, const Object& object) {
+          (*static_cast<decltype(ctx)>(p))(static_cast<const T&>(object));
+        },
+        const_cast<void*>(static_cast<const void*>(ctx)));
+  }
+
+  // Calls fn(T&) under the shard's write lock if key holds a T; an absent
+  // key first gets an empty T if 'create' is set (else Missing). fn returns
+  // whether it changed the value. A change is reported to the WriteObserver
+  // as args[0..argc), which must be a command that makes the same change
+  // when replayed, normally the caller's own; a value left empty deletes
+  // the key.
+  template <typename T, typename Fn>
+  KeyResult writeObject(std::string_view key, bool create, const std::string_view* args,
+                        std::size_t argc, Fn&& fn) {
+    auto* ctx = &fn;
+    return writeObjectImpl(
+        key, T::kType,
+        create ? static_cast<ObjectFactory>([] { return std::unique_ptr<Object>(new T()); })
+               : nullptr,
+        [](void* p, Object& object) -> bool {
+          return (*static_cast<decltype(ctx)>(p))(static_cast<T&>(object));
+        },
+        const_cast<void*>(static_cast<const void*>(ctx)), args, argc);
+  }
+
+  // Batch operations. Each locks every shard its keys fall in once, all at
+  // the same time (in index order, so batches never deadlock), so a batch
+  // sees and makes its changes at a single point in time. Hashes are
+  // computed for the whole batch up front, and table probes are prefetched
+  // a few keys ahead of the lookups.
+  //
+  // viewMany() calls fn(std::size_t i, const std::string_view* value,
+  // const SharedValue* shared) for every keys[i], in order, under the read
+  // locks; 'value' is null if the key is absent or not a string, and
+  // 'shared' is as for viewShared().
+  template <typename Fn>
+  void viewMany(const std::string_view* keys, std::size_t n, Fn&& fn) const {
+    auto* ctx = &fn;
+    viewManyImpl(
+        keys, n,
+        [](void* p, std::size_t i, const std::string_view* v, const SharedValue* shared) {
+          (*static_cast<decltype(ctx)>(p))(i, v, shared);
+        },
+        const_cast<void*>(static_cast<const void*>(ctx)));
+  }
+  // Sets pairs[2i] to pairs[2i + 1] for i < n, without expiry.
+  void setMany(const std::string_view* pairs, std::size_t n);
+  // Deletes keys[0..n); returns how many existed.
+  std::size_t delMany(const std::string_view* keys, std::size_t n);
+  // Like delMany(), but values that are costly to free are left to the
+  // LazyFree thread: the keys are gone on return, their memory soon after.
+  std::size_t unlinkMany(const std::string_view* keys, std::size_t n);
+
+  // Sets the absolute expiry of an existing key; a time in the past deletes
+  // it. Returns false if the key does not exist.
+  bool expireAt(std::string_view key, std::int64_t expire_at_ms);
+
+  // Removes the expiry of an existing key. Returns false if it does not exist.
+  bool persist(std::string_view key);
+
+  // Fills the remaining time to live in ms, or -1 if the key has no expiry.
+  // Returns false if key does not exist.
+  bool ttl(std::string_view key, std::int64_t& remaining_ms) const;
+
+  // Number of keys across all shards (takes every shard lock in turn).
+  std::size_t size() const;
+
+  // One step of a keyspace walk for SCAN: calls fn(std::string_view key)
+  // for the live keys of the table buckets from 'cursor' on (0 to start)
+  // until 'count' keys were seen or 10 * count buckets visited, and returns
+  // the cursor for the next call, 0 once the walk is complete. Only one
+  // shard's read lock is held at a time, and no longer than that bound.
+  // Every key present for the whole walk is reported at least once, even
+  // if tables resize between calls (see HashTable::scan()); some may be
+  // reported twice. The cursor keeps the shard index in its top bits.
+  template <typename Fn>
+  uint64_t scan(uint64_t cursor, std::size_t count, Fn&& fn) const {
+    auto* ctx = &fn;
+    return scanImpl(
+        cursor, count,
+        [](void* p, std::string_view key) { (*static_cast<decltype(ctx)>(p))(key); },
+        const_cast<void*>(static_cast<const void*>(ctx)));
+  }
+
+  std::size_t shardCount() const { return nshards_; }
+
+  // True while any shard has a rehash in progress that incrementalRehash()
+  // would advance (not while rehashing is paused by forkSnapshot()).
+  bool rehashPending() const {
+    return rehashing_shards_.load(std::memory_order_relaxed) > 0 &&
+           !rehash_paused_.load(std::memory_order_relaxed);
+  }
+
+  // Moves up to 'groups' hash groups per shard for the shards owned by
+  // 'worker' out of 'nworkers' (shard index % nworkers == worker), so that
+  // several event loops can share the background work without contending.
+  void incrementalRehash(unsigned worker, unsigned nworkers, std::size_t groups);
+
+  // Deletes up to 'max_keys' expired keys from the shards owned by 'worker'
+  // (same split as incrementalRehash). Returns the number deleted; a result
+  // equal to max_keys means more keys may be due.
+  std::size_t activeExpire(unsigned worker, unsigned nworkers, std::size_t max_keys);
+
+  // Earliest expiry deadline (Unix ms) among the shards owned by 'worker',
+  // or kNoExpiry. May be early (a deadline that was since cleared), never late.
+  std::int64_t nextExpiry(unsigned worker, unsigned nworkers) const;
+
+  // Total keys removed because their time to live elapsed.
+  std::uint64_t expiredKeys() const { return expired_keys_.load(std::memory_order_relaxed); }
+
+  // Sets the memory limit in bytes (0 = unlimited) and eviction policy.
+  // Call before the store is shared between threads.
+  void setMaxMemory(std::size_t bytes, EvictionPolicy policy);
+  std::size_t maxMemory() const { return max_memory_; }
+  EvictionPolicy evictionPolicy() const { return policy_; }
+
+  // Evicts keys until memory is under the limit, at most a bounded number
+  // per call. Returns false if over the limit and nothing could be evicted
+  // (noeviction, or no candidate keys); callers then reject commands that
+  // may allocate.
+  bool ensureMemory();
+
+  // Approximate bytes used by keys, values and table overhead. Values
+  // waiting for the LazyFree thread no longer count.
+  std::size_t usedMemory() const;
+
+  // With 'lazy' set, every delete, overwrite, expiry and eviction frees
+  // costly values the way unlinkMany() does. Call before the store is
+  // shared between threads.
+  void setLazyFree(bool lazy) { lazy_free_all_ = lazy; }
+  bool lazyFreeEnabled() const { return lazy_free_all_; }
+  // The background freer, for its statistics.
+  const LazyFree& lazyFree() const { return *lazy_free_; }
+
+  // Total keys removed by eviction.
+  std::uint64_t evictedKeys() const { return evicted_keys_.load(std::memory_order_relaxed); }
+
+  // Removes every key, shard by shard, handing costly values to the lazy
+  // free thread whatever setLazyFree() says; for replacing the keyspace
+  // with another (a replica's full resync). Not reported to the
+  // WriteObserver.
+  void clear();
+
+  // Sizes empty shards for 'keys' keys in total ahead of a bulk load, so
+  // that filling them does not rehash.
+  void reserve(std::size_t keys);
+
+  // One key of a bulk load; see loadBatch(). 'object', when set, is the
+  // value instead of 'value'.
+  struct LoadItem {
+    std::string_view key;
+    std::string_view value;
+    std::int64_t expire_at_ms;
+    std::unique_ptr<Object> object;
+  };
+
+  // Sets every item as set() would, for loading snapshots: each shard lock
+  // is taken once per run of consecutive items in that shard, and values
+  // too large for a slab chunk are copied into 'arena' instead of
+  // allocated one by one. Objects are moved from the items. Changes are not
+  // reported to the WriteObserver.
+  void loadBatch(LoadItem* items, std::size_t n, ValueArena& arena);
+
+  // Reports every later change to 'observer' as well, after the observers
+  // added before it. Call before the store is shared between threads.
+  void addWriteObserver(WriteObserver* observer) { observers_.push_back(observer); }
+
+  // While set, writes treat no key as expired, so that replaying a log of
+  // changes made over time gives the results they had when made (e.g. a
+  // PERSIST of a key whose old deadline has passed since). Expired keys
+  // are still hidden from reads and removed by activeExpire() later.
+  void setLoading(bool loading) { loading_ = loading; }
+
+  // Calls fn(key, value, object, expire_at_ms) for every live key of shard
+  // 'index' (< shardCount()) and then done(), all under the shard's read
+  // lock, so WriteObserver calls for the shard come entirely before or
+  // after; 'object' is null for strings, and 'value' empty for objects. In
+  // the child of forkSnapshot() no lock is taken.
+  using ExportFn =
+      std::function<void(std::string_view, std::string_view, const Object*, std::int64_t)>;
+  void exportShard(std::size_t index, const ExportFn& fn, const std::function<void()>& done) const;
+
+  // Moves keys elsewhere (cluster slot migration): calls fn() as
+  // exportShard() does for each of the n keys that is live, then commit(),
+  // and if that returns true deletes them, all under the locks of their
+  // shards, so no write to them can slip in between. Returns the number of
+  // keys deleted; 0 if none was live or commit() failed.
+  std::size_t handOff(const std::string_view* keys, std::size_t n, const ExportFn& fn,
+                      const std::function<bool()>& commit);
+
+  // fork()s with every shard locked, so the child gets the whole keyspace
+  // as of one instant, and returns fork()'s result. In the child (0) the
+  // store is frozen: the only thread is the caller's, shard locks stay
+  // taken, and it may only be read with exportShard(). In the parent,
+  // rehashing is paused until resumeRehash(), so that the pages the child
+  // still shares are not copied just to move entries between tables.
+  // 'locked', if set, runs in the parent right before the fork, with every
+  // shard locked: e.g. to note how far a log of the changes has got.
+  pid_t forkSnapshot(const std::function<void()>& locked = nullptr);
+  void resumeRehash();
+
+  // Refreshes the coarse clock used for LRU/LFU metadata. Event loops call
+  // it once per iteration so that key accesses never read the clock.
+  void updateClock();
+
+ private:
+  // Pimpl-friendly: we keep implementation details in the .cpp
+  struct Shard;
+  using ValueVisitor = void (*)(void* ctx, std::string_view value, const SharedValue* shared);
+  using BatchVisitor = void (*)(void* ctx, std::size_t i, const std::string_view* value,
+                                const SharedValue* shared);
+  using KeyVisitor = void (*)(void* ctx, std::string_view key);
+  using ObjectReader = void (*)(void* ctx, const Object& object);
+  using ObjectWriter = bool (*)(void* ctx, Object& object);
+  using ObjectFactory = std::unique_ptr<Object> (*)();
+  class BatchLocks;
+
+  Shard& shardFor(uint64_t hash) const;
+  KeyResult viewImpl(std::string_view key, ValueVisitor visit, void* ctx) const;
+  KeyResult readObjectImpl(std::string_view key, ValueType type, ObjectReader read,
+                           void* ctx) const;
+  KeyResult writeObjectImpl(std::string_view key, ValueType type, ObjectFactory create,
+                            ObjectWriter write, void* ctx, const std::string_view* args,
+                            std::size_t argc);
+  void viewManyImpl(const std::string_view* keys, std::size_t n, BatchVisitor visit,
+                    void* ctx) const;
+  uint64_t scanImpl(uint64_t cursor, std::size_t count, KeyVisitor visit, void* ctx) const;
+  void noteRehash(bool was_rehashing, bool is_rehashing);
+  // Shared body of set() and setOwned(); moves from 'owned' when non-null.
+  void setImpl(std::string_view key, std::string_view value, std::string* owned,
+               std::int64_t expire_at_ms);
+  // Bodies of set and del for a shard the caller has locked exclusively.
+  void setLocked(Shard& shard, std::string_view key, uint64_t hash, std::string_view value,
+                 std::string* owned, std::int64_t expire_at_ms);
+  bool delLocked(Shard& shard, std::string_view key, uint64_t hash, LazyFree* lazy);
+  // Body of delMany() and unlinkMany().
+  std::size_t removeMany(const std::string_view* keys, std::size_t n, LazyFree* lazy);
+  // Where deletes other than unlinks send costly values; null unless
+  // setLazyFree(true).
+  LazyFree* deleteLazyFree() const { return lazy_free_all_ ? lazy_free_.get() : nullptr; }
+  void scheduleExpiry(Shard& shard, std::string_view key, std::int64_t expire_at_ms);
+  bool expireIfDue(Shard& shard, std::string_view key, uint64_t hash, std::int64_t now_ms);
+  // Common tail of every write: tracks rehash state and folds the entry
+  // byte delta plus any table growth into the memory accounting.
+  void finishWrite(Shard& shard, bool was_rehashing, std::int64_t entry_delta, bool flush = false);
+  bool evictOne();
+  // Current time for expiry checks on the write path; see setLoading().
+  std::int64_t writeClockMs() const;
+  // Reports a change to the observers, if any; call with the shard locked.
+  void notify(const Shard& shard, std::initializer_list<std::string_view> args) const;
+  void notify(const Shard& shard, const std::string_view* args, std::size_t argc) const;
+
+  std::size_t nshards_ = 1;
+  unsigned shard_shift_ = 64;
+  std::unique_ptr<Shard[]> shards_;
+  std::atomic<std::size_t> rehashing_shards_{0};
+  std::atomic<std::uint64_t> expired_keys_{0};
+
+  std::size_t max_memory_ = 0;
+  EvictionPolicy policy_ = EvictionPolicy::NoEviction;
+  std::atomic<std::int64_t> used_memory_{0};
+  std::atomic<std::uint64_t> evicted_keys_{0};
+  std::atomic<std::size_t> evict_cursor_{0};
+  // Coarse clock in seconds; see updateClock().
+  std::atomic<std::uint32_t> clock_s_{0};
+  std::vector<WriteObserver*> observers_;
+  std::unique_ptr<LazyFree> lazy_free_;
+  bool lazy_free_all_ = false;
+  bool loading_ = false;
+  std::atomic<bool> rehash_paused_{false};
+  bool frozen_ = false;  // see forkSnapshot()
+};
+
+}  // namespace async
@@ -0,0 +1,81 @@
+#include "lazyfree.h"
+
+#include <utility>
+
+namespace async {
+
+LazyFree::~LazyFree() {
+  if (!thread_.joinable()) return;
+  {
+    std::lock_guard<std::mutex> lock(wake_mu_);
+    stop_ = true;
+  }
+  wake_cv_.notify_one();
+  thread_.join();
+}
+
+bool LazyFree::take(std::unique_ptr<Object>& object) {
+  if (!object || object->freeEffort() < kMinObjectEffort) return false;
+  Job* job = new Job;
+  job->bytes = object->memoryBytes();
+  job->object = std::move(object);
+  push(job);
+  return true;
+}
+
+bool LazyFree::take(SharedValue& value) {
+  if (!value || value.use_count() > 1 || value->size() < kMinValueBytes) return false;
+  Job* job = new Job;
+  job->bytes = value->size();
+  job->value = std::move(value);
+  push(job);
+  return true;
+}
+
+void LazyFree::push(Job* job) {
+  pending_bytes_.fetch_add(job->bytes, std::memory_order_relaxed);
+  pending_values_.fetch_add(1, std::memory_order_relaxed);
+  std::call_once(started_, [this] { thread_ = std::thread(&LazyFree::run, this); });
+  Job* head = head_.load(std::memory_order_relaxed);
+  do {
+    job->next = head;
+  } while (!head_.compare_exchange_weak(head, job, std::memory_order_release,
+                                        std::memory_order_relaxed));
+  if (head == nullptr) {
+    // The thread may be asleep; taking the mutex orders this push against
+    // its check of the stack.
+    { std::lock_guard<std::mutex> lock(wake_mu_); }
+    wake_cv_.notify_one();
+  }
+}
+
+void LazyFree::run() {
+  for (;;) {
+    Job* jobs = head_.exchange(nullptr, std::memory_order_acquire);
+    if (!jobs) {
+      std::unique_lock<std::mutex> lock(wake_mu_);
+      wake_cv_.wait(lock, [this] { return stop_ || head_.load(std::memory_order_relaxed); });
+      if (stop_ && !head_.load(std::memory_order_relaxed)) return;
+      continue;
+    }
+    // The stack is newest first; free in the order values were handed over.
+    Job* oldest = nullptr;
+    while (jobs) {
+      Job* next = jobs->next;
+      jobs->next = oldest;
+      oldest = jobs;
+      jobs = next;
+    }
+    while (oldest) {
+      Job* next = oldest->next;
+      const std::size_t bytes = oldest->bytes;
+      delete oldest;
+      pending_bytes_.fetch_sub(bytes, std::memory_order_relaxed);
+      pending_values_.fetch_sub(1, std::memory_order_relaxed);
+      freed_values_.fetch_add(1, std::memory_order_relaxed);
+      oldest = next;
+    }
+  }
+}
+
+}  // namespace async
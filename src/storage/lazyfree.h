@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "kvstore.h"
+#include "object.h"
+
+namespace async {
+
+// Frees values on a background thread, like Redis's lazyfree, so that
+// deleting a large sorted set or a value of hundreds of MB does not stall
+// the event loop that removed its key: the key leaves the table at once
+// and only the value's memory is reclaimed later.
+//
+// Producers push onto a lock-free stack (one compare-and-swap); the
+// thread takes the whole stack with one exchange and frees it oldest
+// first. A mutex is only taken to wake the thread when the stack was
+// empty. The thread starts with the first value handed over and drains
+// the stack before the destructor returns.
+class LazyFree {
+ public:
+  // Below these a value is cheaper to free in place than to hand over:
+  // Redis's LAZYFREE_THRESHOLD for objects, and enough pages that
+  // unmapping them takes a while for strings.
+  static constexpr std::size_t kMinObjectEffort = 64;
+  static constexpr std::size_t kMinValueBytes = 1u << 20;
+
+  LazyFree() = default;
+  ~LazyFree();
+  LazyFree(const LazyFree&) = delete;
+  LazyFree& operator=(const LazyFree&) = delete;
+
+  // Takes over 'object' or 'value' if worth it and returns true; else
+  // leaves it to the caller. A value still shared with a reader is never
+  // taken, since dropping this reference frees nothing.
+  bool take(std::unique_ptr<Object>& object);
+  bool take(SharedValue& value);
+
+  // Bytes and values handed over but not freed yet, and values freed.
+  std::size_t pendingBytes() const { return pending_bytes_.load(std::memory_order_relaxed); }
+  std::size_t pendingValues() const { return pending_values_.load(std::memory_order_relaxed); }
+  std::uint64_t freedValues() const { return freed_values_.load(std::memory_order_relaxed); }
+
+ private:
+  struct Job {
+    Job* next = nullptr;
+    std::unique_ptr<Object> object;
+    SharedValue value;
+    std::size_t bytes = 0;
+  };
+
+  void push(Job* job);
+  void run();
+
+  std::atomic<Job*> head_{nullptr};
+  std::atomic<std::size_t> pending_bytes_{0};
+  std::atomic<std::size_t> pending_values_{0};
+  std::atomic<std::uint64_t> freed_values_{0};
+
+  std::once_flag started_;
+  std::mutex wake_mu_;
+  std::condition_variable wake_cv_;
+  bool stop_ = false;  // guarded by wake_mu_
+  std::thread thread_;
+};
+
+}  // namespace async
@@ -0,0 +1,167 @@
+#include "list.h"
+
+#include "varint.h"
+
+namespace async {
+
+namespace {
+// Elements per command when an AOF rewrite rebuilds a large list.
+constexpr std::size_t kRewriteBatch = 64;
+// What a std::deque spends besides its elements, roughly: the map and
+// the partly used blocks at both ends.
+constexpr std::size_t kDequeOverhead = 1024;
+}  // namespace
+
+std::size_t List::memoryBytes() const {
+  if (packed()) return sizeof(*this) + packed_.bytes.capacity();
+  return sizeof(*this) + kDequeOverhead + chunks_->size() * sizeof(Chunk) + chunk_bytes_;
+}
+
+List::Chunk& List::chunkFor(bool front, std::size_t value_bytes) {
+  Chunk& end = packed() ? packed_ : (front ? chunks_->front() : chunks_->back());
+  // An element larger than a chunk still gets a chunk of its own.
+  if (end.count == 0 ||
+      (end.count < kChunkEntries && end.bytes.size() + value_bytes <= kChunkBytes)) {
+    return end;
+  }
+  if (packed()) {
+    chunks_ = std::make_unique<std::deque<Chunk>>();
+    chunks_->push_back(std::move(packed_));
+    packed_ = Chunk();
+  }
+  if (front) {
+    chunks_->emplace_front();
+    return chunks_->front();
+  }
+  chunks_->emplace_back();
+  return chunks_->back();
+}
+
+void List::pushFront(std::string_view value) {
+  Chunk& chunk = chunkFor(true, value.size() + 1);
+  std::string entry;
+  putString(entry, value);
+  chunk_bytes_ -= chunk.bytes.capacity();
+  chunk.bytes.insert(0, entry);
+  chunk_bytes_ += chunk.bytes.capacity();
+  ++chunk.count;
+  ++size_;
+}
+
+void List::pushBack(std::string_view value) {
+  Chunk& chunk = chunkFor(false, value.size() + 1);
+  chunk_bytes_ -= chunk.bytes.capacity();
+  putString(chunk.bytes, value);
+  chunk_bytes_ += chunk.bytes.capacity();
+  ++chunk.count;
+  ++size_;
+}
+
+bool List::popFront(std::string& out) { return pop(true, out); }
+
+bool List::popBack(std::string& out) { return pop(false, out); }
+
+bool List::pop(bool front, std::string& out) {
+  if (size_ == 0) return false;
+  Chunk& chunk = packed() ? packed_ : (front ? chunks_->front() : chunks_->back());
+  const char* const begin = chunk.bytes.data();
+  const char* const end = begin + chunk.bytes.size();
+  std::string_view value;
+  if (front) {
+    const char* next = getString(begin, end, value);
+    out.assign(value);
+    chunk.bytes.erase(0, static_cast<std::size_t>(next - begin));
+  } else {
+    // Chunks are only walked forwards: find the last element's start.
+    const char* last = begin;
+    for (std::size_t i = 0; i + 1 < chunk.count; ++i) last = getString(last, end, value);
+    getString(last, end, value);
+    out.assign(value);
+    chunk.bytes.resize(static_cast<std::size_t>(last - begin));
+  }
+  --chunk.count;
+  --size_;
+  if (chunk.count == 0 && !packed() && chunks_->size() > 1) {
+    chunk_bytes_ -= chunk.bytes.capacity();
+    if (front) {
+      chunks_->pop_front();
+    } else {
+      chunks_->pop_back();
+    }
+  }
+  return true;
+}
+
+void List::rangeImpl(std::size_t start, Visitor visit, void* ctx) const {
+  if (start >= size_) return;
+  const auto walk = [&](const Chunk& chunk) {
+    const char* p = chunk.bytes.data();
+    const char* const end = p + chunk.bytes.size();
+    std::string_view value;
+    for (std::size_t i = 0; i < chunk.count; ++i) {
+      p = getString(p, end, value);
+      if (i < start) continue;
+      if (!visit(ctx, value)) return false;
+    }
+    start = 0;
+    return true;
+  };
+  if (packed()) {
+    walk(packed_);
+    return;
+  }
+  for (const Chunk& chunk : *chunks_) {
+    if (start >= chunk.count) {
+      start -= chunk.count;
+      continue;
+    }
+    if (!walk(chunk)) return;
+  }
+}
+
+// [count: varint] then the elements in order, as in the chunks.
+void List::encode(std::string& out) const {
+  putVarint(out, size_);
+  if (packed()) {
+    out.append(packed_.bytes);
+    return;
+  }
+  for (const Chunk& chunk : *chunks_) out.append(chunk.bytes);
+}
+
+std::unique_ptr<List> List::decode(std::string_view bytes) {
+  const char* p = bytes.data();
+  const char* const end = p + bytes.size();
+  uint64_t count = 0;
+  p = getVarint(p, end, count);
+  // Every element takes at least a byte; an empty list is never stored.
+  if (!p || count == 0 || count > static_cast<uint64_t>(end - p)) return nullptr;
+  auto list = std::make_unique<List>();
+  std::string_view value;
+  for (uint64_t i = 0; i < count; ++i) {
+    p = getString(p, end, value);
+    if (!p) return nullptr;
+    list->pushBack(value);
+  }
+  if (p != end) return nullptr;
+  return list;
+}
+
+void List::rewrite(std::string_view key,
+                   const std::function<void(const std::string_view*, std::size_t)>& emit) const {
+  std::string_view args[2 + kRewriteBatch];
+  args[0] = "rpush";
+  args[1] = key;
+  std::size_t n = 0;
+  range(0, [&](std::string_view value) {
+    args[2 + n] = value;
+    if (++n == kRewriteBatch) {
+      emit(args, 2 + n);
+      n = 0;
+    }
+    return true;
+  });
+  if (n > 0) emit(args, 2 + n);
+}
+
+}  // namespace async
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "object.h"
+
+namespace async {
+
+// List: a sequence of strings with pushes and pops at both ends and range
+// reads by index, as a chunked deque like Redis's quicklist.
+//
+// Elements are packed back to back as [length: varint][bytes] in chunks of
+// up to kChunkEntries elements and about kChunkBytes bytes, so there is no
+// per-element allocation or pointer. A small list is a single chunk held
+// inline; once it needs a second one, the chunks move to a std::deque,
+// where pushes fill the end chunk or start a new one and pops drop chunks
+// that become empty. Range reads skip whole chunks by their counts.
+class List final : public Object {
+ public:
+  static constexpr ValueType kType = ValueType::List;
+  static constexpr std::size_t kChunkEntries = 128;
+  static constexpr std::size_t kChunkBytes = 4096;
+
+  List() = default;
+  List(const List&) = delete;
+  List& operator=(const List&) = delete;
+
+  ValueType type() const override { return kType; }
+  std::size_t size() const override { return size_; }
+  std::size_t memoryBytes() const override;
+  std::size_t freeEffort() const override { return packed() ? 1 : chunks_->size(); }
+  void encode(std::string& out) const override;
+  void rewrite(std::string_view key,
+               const std::function<void(const std::string_view*, std::size_t)>& emit)
+      const override;
+
+  // Reads encode() output; nullptr if malformed.
+  static std::unique_ptr<List> decode(std::string_view bytes);
+
+  void pushFront(std::string_view value);
+  void pushBack(std::string_view value);
+  // Moves the first (last) element to 'out'; false if the list is empty.
+  bool popFront(std::string& out);
+  bool popBack(std::string& out);
+
+  // Calls fn(std::string_view value) for the elements from index 'start'
+  // on, in order, until fn returns false or the list ends.
+  template <typename Fn>
+  void range(std::size_t start, Fn&& fn) const {
+    auto* ctx = &fn;
+    rangeImpl(
+        start,
+        [](void* p, std::string_view value) -> bool {
+          return (*static_cast<decltype(ctx)>(p))(value);
+        },
+        const_cast<void*>(static_cast<const void*>(ctx)));
+  }
+
+  bool packed() const { return chunks_ == nullptr; }
+
+ private:
+  using Visitor = bool (*)(void* ctx, std::string_view value);
+
+  struct Chunk {
+    std::string bytes;
+    std::size_t count = 0;
+  };
+
+  void rangeImpl(std::size_t start, Visitor visit, void* ctx) const;
+  // The chunk at the front (back) end that 'value' can go in, adding one
+  // if the end chunk is full.
+  Chunk& chunkFor(bool front, std::size_t value_bytes);
+  bool pop(bool front, std::string& out);
+
+  std::size_t size_ = 0;
+  // Capacity of every chunk's buffer, for memoryBytes().
+  std::size_t chunk_bytes_ = 0;
+  Chunk packed_;
+  std::unique_ptr<std::deque<Chunk>> chunks_;
+};
+
+}  // namespace async
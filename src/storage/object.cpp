@@ -0,0 +1,29 @@
+#include "object.h"
+
+#include "hash.h"
+#include "list.h"
+#include "zset.h"
+
+namespace async {
+
+const char* valueTypeName(ValueType type) {
+  switch (type) {
+    case ValueType::String: return "string";
+    case ValueType::SortedSet: return "zset";
+    case ValueType::Hash: return "hash";
+    case ValueType::List: return "list";
+  }
+  return "unknown";
+}
+
+std::unique_ptr<Object> decodeObject(ValueType type, std::string_view bytes) {
+  switch (type) {
+    case ValueType::SortedSet: return SortedSet::decode(bytes);
+    case ValueType::Hash: return Hash::decode(bytes);
+    case ValueType::List: return List::decode(bytes);
+    case ValueType::String: break;
+  }
+  return nullptr;
+}
+
+}  // namespace async
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace async {
+
+// Type of the value stored under a key. The numbers are part of the
+// snapshot format.
+enum class ValueType : std::uint8_t {
+  String = 0,
+  SortedSet = 1,
+  Hash = 2,
+  List = 3,
+};
+
+// "string", "zset", "hash" or "list", as the TYPE command reports them.
+const char* valueTypeName(ValueType type);
+
+// A value other than a plain string: a collection owned by its store
+// entry and only touched under that entry's shard lock. Types derive from
+// it and name themselves with a static kType, which KVStore::readObject()
+// and writeObject() check before handing the value to a command.
+class Object {
+ public:
+  virtual ~Object() = default;
+
+  virtual ValueType type() const = 0;
+  // Elements; an object left empty by a write is deleted with its key.
+  virtual std::size_t size() const = 0;
+  // Heap bytes held, the object itself included, for memory accounting.
+  virtual std::size_t memoryBytes() const = 0;
+  // Roughly how many allocations deleting the object frees; objects for
+  // which that is large are deleted off the event loop (see LazyFree).
+  virtual std::size_t freeEffort() const = 0;
+
+  // Appends the compact form decodeObject() reads back (snapshots).
+  virtual void encode(std::string& out) const = 0;
+  // Calls emit(args, argc) with commands that rebuild the value under
+  // 'key' when replayed, a batch of elements per command (AOF rewrite).
+  virtual void rewrite(
+      std::string_view key,
+      const std::function<void(const std::string_view* args, std::size_t argc)>& emit) const = 0;
+};
+
+// Rebuilds an object from encode() output; nullptr if 'bytes' is malformed
+// or 'type' is not an object type.
+std::unique_ptr<Object> decodeObject(ValueType type, std::string_view bytes);
+
+}  // namespace async
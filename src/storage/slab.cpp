@@ -0,0 +1,68 @@
+#include "slab.h"
+
+#include <new>
+
+namespace async {
+
+SlabAllocator::~SlabAllocator() {
+  for (char* page : pages_) ::operator delete(page);
+}
+
+// Classes 0..7 are 16..128 in steps of 16; after that each power of two
+// (128, 256] .. (1024, 2048] is split into four equal steps.
+std::size_t SlabAllocator::classOf(std::size_t n) {
+  if (n <= 128) return (n + 15) / 16 - 1;
+  const std::size_t m = n - 1;
+  const unsigned log2 = 63 - static_cast<unsigned>(__builtin_clzll(m));
+  return 8 + (log2 - 7) * 4 + (m >> (log2 - 2)) - 4;
+}
+
+std::size_t SlabAllocator::classBytes(std::size_t c) {
+  if (c < 8) return (c + 1) * 16;
+  const std::size_t j = c - 8;
+  const std::size_t base = std::size_t{128} << (j / 4);
+  return base + (j % 4 + 1) * (base / 4);
+}
+
+std::size_t SlabAllocator::chunkBytes(std::size_t n) {
+  if (n == 0) return 0;
+  // Large chunks: the request plus malloc's own header, roughly.
+  if (n > kMaxChunkBytes) return n + 16;
+  return classBytes(classOf(n));
+}
+
+char* SlabAllocator::allocate(std::size_t n) {
+  if (n == 0) return nullptr;
+  if (n > kMaxChunkBytes) return static_cast<char*>(::operator new(n));
+  SizeClass& sc = classes_[classOf(n)];
+  if (sc.free) {
+    FreeChunk* chunk = sc.free;
+    sc.free = chunk->next;
+    return reinterpret_cast<char*>(chunk);
+  }
+  const std::size_t size = classBytes(classOf(n));
+  if (static_cast<std::size_t>(sc.end - sc.next) < size) {
+    pages_.reserve(pages_.size() + 1);
+    char* page = static_cast<char*>(::operator new(kPageBytes));
+    pages_.push_back(page);
+    sc.next = page;
+    sc.end = page + kPageBytes / size * size;
+  }
+  char* p = sc.next;
+  sc.next += size;
+  return p;
+}
+
+void SlabAllocator::deallocate(char* p, std::size_t n) {
+  if (!p) return;
+  if (n > kMaxChunkBytes) {
+    ::operator delete(p);
+    return;
+  }
+  SizeClass& sc = classes_[classOf(n)];
+  FreeChunk* chunk = reinterpret_cast<FreeChunk*>(p);
+  chunk->next = sc.free;
+  sc.free = chunk;
+}
+
+}  // namespace async
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace async {
+
+// Size-class allocator for the key/value bytes of one shard. Requests are
+// rounded up to one of kClasses chunk sizes (multiples of 16 up to 128,
+// then four classes per power of two up to kMaxChunkBytes) and carved from
+// kPageBytes pages owned by the allocator; freed chunks go on a free list
+// per class and are reused first. Pages are only returned when the
+// allocator is destroyed, as a shard's key sizes rarely change much.
+// Larger requests go straight to operator new.
+//
+// Not thread-safe: each shard's allocator is used under that shard's
+// exclusive lock, so there is no allocator lock to contend on.
+class SlabAllocator {
+ public:
+  static constexpr std::size_t kMaxChunkBytes = 2048;
+  static constexpr std::size_t kPageBytes = 64 * 1024;
+
+  SlabAllocator() = default;
+  ~SlabAllocator();
+  SlabAllocator(const SlabAllocator&) = delete;
+  SlabAllocator& operator=(const SlabAllocator&) = delete;
+
+  // Returns at least n bytes (nullptr for n == 0). Throws std::bad_alloc.
+  char* allocate(std::size_t n);
+  // Frees a chunk from allocate(n), with the same n.
+  void deallocate(char* p, std::size_t n);
+
+  // Bytes actually reserved for a request of n bytes, for accounting.
+  static std::size_t chunkBytes(std::size_t n);
+
+  // Bytes of pages held, used or not.
+  std::size_t pageBytes() const { return pages_.size() * kPageBytes; }
+
+ private:
+  static constexpr std::size_t kClasses = 24;
+
+  struct FreeChunk {
+    FreeChunk* next;
+  };
+  struct SizeClass {
+    FreeChunk* free = nullptr;
+    // Not yet handed out part of the newest page.
+    char* next = nullptr;
+    char* end = nullptr;
+  };
+
+  static std::size_t classOf(std::size_t n);
+  static std::size_t classBytes(std::size_t c);
+
+  SizeClass classes_[kClasses];
+  std::vector<char*> pages_;
+};
+
+}  // namespace async
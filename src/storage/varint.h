@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace async {
+
+// LEB128 varints and length-prefixed strings, the building blocks of the
+// packed object encodings (and of their snapshot form).
+
+inline void putVarint(std::string& out, uint64_t v) {
+  for (; v >= 0x80; v >>= 7) out.push_back(static_cast<char>(v | 0x80));
+  out.push_back(static_cast<char>(v));
+}
+
+// Reads a varint at p (bounded by end); nullptr if truncated.
+inline const char* getVarint(const char* p, const char* end, uint64_t& v) {
+  v = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7) {
+    if (p == end) return nullptr;
+    const uint8_t b = static_cast<uint8_t>(*p++);
+    v |= static_cast<uint64_t>(b & 0x7F) << shift;
+    if (!(b & 0x80)) return p;
+  }
+  return nullptr;
+}
+
+// [length: varint][bytes]
+inline void putString(std::string& out, std::string_view s) {
+  putVarint(out, s.size());
+  out.append(s);
+}
+
+// Reads a putString() string; nullptr if truncated.
+inline const char* getString(const char* p, const char* end, std::string_view& s) {
+  uint64_t len = 0;
+  p = getVarint(p, end, len);
+  if (!p || len > static_cast<uint64_t>(end - p)) return nullptr;
+  s = std::string_view(p, static_cast<std::size_t>(len));
+  return p + len;
+}
+
+}  // namespace async
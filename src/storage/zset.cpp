@@ -0,0 +1,462 @@
+#include "zset.h"
+
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <new>
+
+#include "keyhash.h"
+#include "varint.h"
+
+namespace async {
+
+namespace {
+// Levels of the skiplist head; with p = 1/4 that covers 2^64 members.
+constexpr unsigned kMaxLevel = 32;
+// Members per command when an AOF rewrite rebuilds a large set.
+constexpr std::size_t kRewriteBatch = 64;
+
+uint64_t hashMember(std::string_view member) { return hashKey(member); }
+
+// (score, member) order, members compared bytewise on equal scores.
+bool before(double a_score, std::string_view a, double b_score, std::string_view b) {
+  return a_score < b_score || (a_score == b_score && a < b);
+}
+
+unsigned randomLevel() {
+  thread_local uint64_t state = 0x9E3779B97F4A7C15ull ^ reinterpret_cast<uintptr_t>(&state);
+  unsigned level = 1;
+  while (level < kMaxLevel) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    if ((state & 3) != 0) break;
+    ++level;
+  }
+  return level;
+}
+
+void putEntry(std::string& out, std::string_view member, double score) {
+  out.append(reinterpret_cast<const char*>(&score), sizeof(score));
+  putString(out, member);
+}
+
+// Reads one [score][length][member] entry; nullptr if truncated or NaN.
+const char* getEntry(const char* p, const char* end, std::string_view& member, double& score) {
+  if (end - p < static_cast<std::ptrdiff_t>(sizeof(score))) return nullptr;
+  std::memcpy(&score, p, sizeof(score));
+  if (std::isnan(score)) return nullptr;
+  return getString(p + sizeof(score), end, member);
+}
+}  // namespace
+
+std::string_view formatScore(double score, char (&buf)[32]) {
+  if (std::isinf(score)) return score > 0 ? "inf" : "-inf";
+  const auto res = std::to_chars(buf, buf + sizeof(buf), score);
+  return std::string_view(buf, static_cast<std::size_t>(res.ptr - buf));
+}
+
+// ===================== Skiplist node =====================
+
+// A node is one allocation: this header, 'height' levels, then the member
+// bytes.
+struct SortedSet::Node {
+  struct Level {
+    Node* forward;
+    // Members skipped by following 'forward' (1 on level 0), for ranks.
+    std::size_t span;
+  };
+
+  double score;
+  Node* backward;
+  uint32_t len;
+  uint32_t height;
+
+  Level* levels() { return reinterpret_cast<Level*>(this + 1); }
+  const Level* levels() const { return reinterpret_cast<const Level*>(this + 1); }
+  std::string_view member() const {
+    return std::string_view(reinterpret_cast<const char*>(levels() + height), len);
+  }
+
+  static std::size_t bytesFor(unsigned height, std::size_t len) {
+    return sizeof(Node) + height * sizeof(Level) + len;
+  }
+
+  static Node* create(unsigned height, std::string_view member, double score) {
+    void* mem = ::operator new(bytesFor(height, member.size()));
+    Node* node = new (mem) Node{score, nullptr, static_cast<uint32_t>(member.size()), height};
+    for (unsigned i = 0; i < height; ++i) node->levels()[i] = Level{nullptr, 0};
+    std::memcpy(node->levels() + height, member.data(), member.size());
+    return node;
+  }
+
+  static void destroy(Node* node) { ::operator delete(node); }
+};
+
+std::string_view SortedSet::Ref::key() const {
+  return node ? node->member() : std::string_view();
+}
+
+// ===================== SortedSet =====================
+
+SortedSet::SortedSet() = default;
+
+SortedSet::~SortedSet() { freeNodes(); }
+
+void SortedSet::freeNodes() {
+  Node* node = head_;
+  while (node) {
+    Node* next = node->levels()[0].forward;
+    Node::destroy(node);
+    node = next;
+  }
+  head_ = nullptr;
+}
+
+std::size_t SortedSet::memoryBytes() const {
+  if (packed()) return sizeof(*this) + packed_.capacity();
+  return sizeof(*this) + node_bytes_ + index_.memoryUsage();
+}
+
+bool SortedSet::add(std::string_view member, double score) {
+  if (packed()) {
+    std::size_t offset = 0;
+    double old = 0;
+    if (packedFind(member, offset, old)) {
+      if (old == score) return false;
+      packedErase(offset);
+      packedInsert(member, score);
+      return false;
+    }
+    if (size_ < kMaxPackedEntries && member.size() <= kMaxPackedMember) {
+      packedInsert(member, score);
+      ++size_;
+      return true;
+    }
+    convert();
+  }
+
+  const uint64_t hash = hashMember(member);
+  if (Ref* ref = index_.find(member, hash)) {
+    Node* node = ref->node;
+    if (node->score == score) return false;
+    // Keep the node if it stays between its neighbours.
+    const Node* prev = node->backward;
+    const Node* next = node->levels()[0].forward;
+    if ((!prev || before(prev->score, prev->member(), score, member)) &&
+        (!next || before(score, member, next->score, next->member()))) {
+      node->score = score;
+      return false;
+    }
+    // listInsert() takes size_ as the length without the member.
+    listErase(node);
+    --size_;
+    ref->node = listInsert(member, score);
+    ++size_;
+    return false;
+  }
+  Node* node = listInsert(member, score);
+  index_.findOrInsert(member, hash).first->node = node;
+  ++size_;
+  return true;
+}
+
+bool SortedSet::remove(std::string_view member) {
+  if (packed()) {
+    std::size_t offset = 0;
+    double score = 0;
+    if (!packedFind(member, offset, score)) return false;
+    packedErase(offset);
+    --size_;
+    return true;
+  }
+  Node* node = nullptr;
+  if (!index_.erase(member, hashMember(member), [&](Ref& ref) { node = ref.node; })) {
+    return false;
+  }
+  listErase(node);
+  --size_;
+  return true;
+}
+
+bool SortedSet::score(std::string_view member, double& out) const {
+  if (packed()) {
+    std::size_t offset = 0;
+    return packedFind(member, offset, out);
+  }
+  const Ref* ref = index_.find(member, hashMember(member));
+  if (!ref) return false;
+  out = ref->node->score;
+  return true;
+}
+
+bool SortedSet::rank(std::string_view member, std::size_t& out) const {
+  if (packed()) {
+    const char* p = packed_.data();
+    const char* const end = p + packed_.size();
+    std::string_view m;
+    double s = 0;
+    for (std::size_t i = 0; p < end; ++i) {
+      p = getEntry(p, end, m, s);
+      if (m == member) {
+        out = i;
+        return true;
+      }
+    }
+    return false;
+  }
+  const Ref* ref = index_.find(member, hashMember(member));
+  if (!ref) return false;
+  out = listRank(ref->node);
+  return true;
+}
+
+std::size_t SortedSet::firstInRange(const ScoreRange& range) const {
+  if (packed()) {
+    const char* p = packed_.data();
+    const char* const end = p + packed_.size();
+    std::string_view m;
+    double s = 0;
+    std::size_t i = 0;
+    for (; p < end; ++i) {
+      p = getEntry(p, end, m, s);
+      if (range.aboveMin(s)) break;
+    }
+    return i;
+  }
+  // Count the members below the range on the way down.
+  const Node* x = head_;
+  std::size_t rank = 0;
+  for (unsigned i = level_; i-- > 0;) {
+    while (x->levels()[i].forward && !range.aboveMin(x->levels()[i].forward->score)) {
+      rank += x->levels()[i].span;
+      x = x->levels()[i].forward;
+    }
+  }
+  return rank;
+}
+
+void SortedSet::rangeImpl(std::size_t start, Visitor visit, void* ctx) const {
+  if (start >= size_) return;
+  if (packed()) {
+    const char* p = packed_.data();
+    const char* const end = p + packed_.size();
+    std::string_view m;
+    double s = 0;
+    for (std::size_t i = 0; p < end; ++i) {
+      p = getEntry(p, end, m, s);
+      if (i >= start && !visit(ctx, m, s)) return;
+    }
+    return;
+  }
+  // Find the node of rank 'start' through the spans, then walk level 0.
+  const Node* x = head_;
+  std::size_t traversed = 0;
+  const std::size_t target = start + 1;
+  for (unsigned i = level_; i-- > 0;) {
+    while (x->levels()[i].forward && traversed + x->levels()[i].span <= target) {
+      traversed += x->levels()[i].span;
+      x = x->levels()[i].forward;
+    }
+    if (traversed == target) break;
+  }
+  for (; x; x = x->levels()[0].forward) {
+    if (!visit(ctx, x->member(), x->score)) return;
+  }
+}
+
+// ===================== Packed encoding =====================
+
+bool SortedSet::packedFind(std::string_view member, std::size_t& offset, double& score) const {
+  const char* const begin = packed_.data();
+  const char* const end = begin + packed_.size();
+  std::string_view m;
+  for (const char* p = begin; p < end;) {
+    const char* entry = p;
+    p = getEntry(p, end, m, score);
+    if (m == member) {
+      offset = static_cast<std::size_t>(entry - begin);
+      return true;
+    }
+  }
+  return false;
+}
+
+void SortedSet::packedInsert(std::string_view member, double score) {
+  const char* const begin = packed_.data();
+  const char* const end = begin + packed_.size();
+  const char* p = begin;
+  std::string_view m;
+  double s = 0;
+  while (p < end) {
+    const char* next = getEntry(p, end, m, s);
+    if (before(score, member, s, m)) break;
+    p = next;
+  }
+  std::string entry;
+  putEntry(entry, member, score);
+  packed_.insert(static_cast<std::size_t>(p - begin), entry);
+}
+
+void SortedSet::packedErase(std::size_t offset) {
+  const char* const begin = packed_.data();
+  std::string_view m;
+  double s = 0;
+  const char* next = getEntry(begin + offset, begin + packed_.size(), m, s);
+  packed_.erase(offset, static_cast<std::size_t>(next - begin) - offset);
+}
+
+void SortedSet::convert() {
+  head_ = Node::create(kMaxLevel, {}, 0);
+  level_ = 1;
+  node_bytes_ = Node::bytesFor(kMaxLevel, 0);
+  index_.reserve(size_ + 1);
+  size_ = 0;
+  const char* p = packed_.data();
+  const char* const end = p + packed_.size();
+  std::string_view m;
+  double s = 0;
+  while (p < end) {
+    p = getEntry(p, end, m, s);
+    Node* node = listInsert(m, s);
+    index_.findOrInsert(node->member(), hashMember(node->member())).first->node = node;
+    ++size_;
+  }
+  std::string().swap(packed_);
+}
+
+// ===================== Skiplist encoding =====================
+
+// Inserts a member known to be absent; size_ is still the old size.
+SortedSet::Node* SortedSet::listInsert(std::string_view member, double score) {
+  Node* update[kMaxLevel];
+  std::size_t rank[kMaxLevel];
+  Node* x = head_;
+  for (unsigned i = level_; i-- > 0;) {
+    rank[i] = i == level_ - 1 ? 0 : rank[i + 1];
+    while (Node* next = x->levels()[i].forward) {
+      if (!before(next->score, next->member(), score, member)) break;
+      rank[i] += x->levels()[i].span;
+      x = next;
+    }
+    update[i] = x;
+  }
+  const unsigned height = randomLevel();
+  if (height > level_) {
+    for (unsigned i = level_; i < height; ++i) {
+      rank[i] = 0;
+      update[i] = head_;
+      head_->levels()[i].span = size_;
+    }
+    level_ = height;
+  }
+  Node* node = Node::create(height, member, score);
+  node_bytes_ += Node::bytesFor(height, member.size());
+  for (unsigned i = 0; i < height; ++i) {
+    Node::Level& prev = update[i]->levels()[i];
+    node->levels()[i].forward = prev.forward;
+    prev.forward = node;
+    node->levels()[i].span = prev.span - (rank[0] - rank[i]);
+    prev.span = rank[0] - rank[i] + 1;
+  }
+  for (unsigned i = height; i < level_; ++i) ++update[i]->levels()[i].span;
+  node->backward = update[0] == head_ ? nullptr : update[0];
+  if (Node* next = node->levels()[0].forward) next->backward = node;
+  return node;
+}
+
+void SortedSet::listErase(Node* node) {
+  Node* update[kMaxLevel];
+  Node* x = head_;
+  const std::string_view member = node->member();
+  for (unsigned i = level_; i-- > 0;) {
+    while (Node* next = x->levels()[i].forward) {
+      if (!before(next->score, next->member(), node->score, member)) break;
+      x = next;
+    }
+    update[i] = x;
+  }
+  for (unsigned i = 0; i < level_; ++i) {
+    Node::Level& prev = update[i]->levels()[i];
+    if (prev.forward == node) {
+      prev.span += node->levels()[i].span - 1;
+      prev.forward = node->levels()[i].forward;
+    } else {
+      --prev.span;
+    }
+  }
+  if (Node* next = node->levels()[0].forward) next->backward = node->backward;
+  while (level_ > 1 && !head_->levels()[level_ - 1].forward) --level_;
+  node_bytes_ -= Node::bytesFor(node->height, node->len);
+  Node::destroy(node);
+}
+
+std::size_t SortedSet::listRank(const Node* node) const {
+  const Node* x = head_;
+  std::size_t rank = 0;
+  const std::string_view member = node->member();
+  for (unsigned i = level_; i-- > 0;) {
+    while (const Node* next = x->levels()[i].forward) {
+      if (before(node->score, member, next->score, next->member())) break;
+      rank += x->levels()[i].span;
+      x = next;
+    }
+    if (x == node) break;
+  }
+  return rank - 1;
+}
+
+// ===================== Serialization =====================
+
+// [count: varint] then the members in order as packed entries.
+void SortedSet::encode(std::string& out) const {
+  putVarint(out, size_);
+  if (packed()) {
+    out.append(packed_);
+    return;
+  }
+  for (const Node* x = head_->levels()[0].forward; x; x = x->levels()[0].forward) {
+    putEntry(out, x->member(), x->score);
+  }
+}
+
+std::unique_ptr<SortedSet> SortedSet::decode(std::string_view bytes) {
+  const char* p = bytes.data();
+  const char* const end = p + bytes.size();
+  uint64_t count = 0;
+  p = getVarint(p, end, count);
+  // Every entry takes at least 9 bytes; an empty set is never stored.
+  if (!p || count == 0 || count > static_cast<uint64_t>(end - p) / 9) return nullptr;
+  auto set = std::make_unique<SortedSet>();
+  std::string_view member;
+  double score = 0;
+  for (uint64_t i = 0; i < count; ++i) {
+    p = getEntry(p, end, member, score);
+    if (!p) return nullptr;
+    set->add(member, score);
+  }
+  if (p != end) return nullptr;
+  return set;
+}
+
+void SortedSet::rewrite(
+    std::string_view key,
+    const std::function<void(const std::string_view*, std::size_t)>& emit) const {
+  std::string_view args[2 + 2 * kRewriteBatch];
+  char scores[kRewriteBatch][32];
+  args[0] = "zadd";
+  args[1] = key;
+  std::size_t n = 0;
+  range(0, [&](std::string_view member, double score) {
+    args[2 + 2 * n] = formatScore(score, scores[n]);
+    args[3 + 2 * n] = member;
+    if (++n == kRewriteBatch) {
+      emit(args, 2 + 2 * n);
+      n = 0;
+    }
+    return true;
+  });
+  if (n > 0) emit(args, 2 + 2 * n);
+}
+
+}  // namespace async
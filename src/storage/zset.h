@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <string_view>
+
+#include "hashtable.h"
+#include "object.h"
+
+namespace async {
+
+// Score interval of a range query; an exclusive bound leaves its own
+// score out.
+struct ScoreRange {
+  double min = -std::numeric_limits<double>::infinity();
+  double max = std::numeric_limits<double>::infinity();
+  bool min_exclusive = false;
+  bool max_exclusive = false;
+
+  bool aboveMin(double score) const { return min_exclusive ? score > min : score >= min; }
+  bool belowMax(double score) const { return max_exclusive ? score < max : score <= max; }
+};
+
+// Shortest decimal text that parses back to 'score' ("inf" and "-inf" for
+// the infinities); returns a view of 'buf'.
+std::string_view formatScore(double score, char (&buf)[32]);
+
+// Sorted set: unique members ordered by (score, member bytes), with rank
+// and score-range queries. Scores are never NaN.
+//
+// A small set is a single packed buffer of [score: f64][length: varint]
+// [member] entries in order, scanned linearly: one allocation and no
+// per-member pointers, which is most of the memory for small members. Once
+// the set grows past kMaxPackedEntries members, or gets a member longer
+// than kMaxPackedMember, it is converted for good to a skiplist with spans
+// (like Redis's zskiplist, for O(log n) rank and range lookups) plus a
+// member -> node hash table for O(1) score lookups.
+class SortedSet final : public Object {
+ public:
+  static constexpr ValueType kType = ValueType::SortedSet;
+  static constexpr std::size_t kMaxPackedEntries = 128;
+  static constexpr std::size_t kMaxPackedMember = 64;
+
+  SortedSet();
+  ~SortedSet() override;
+  SortedSet(const SortedSet&) = delete;
+  SortedSet& operator=(const SortedSet&) = delete;
+
+  ValueType type() const override { return kType; }
+  std::size_t size() const override { return size_; }
+  std::size_t memoryBytes() const override;
+  std::size_t freeEffort() const override { return packed() ? 1 : size_; }
+  void encode(std::string& out) const override;
+  void rewrite(std::string_view key,
+               const std::function<void(const std::string_view*, std::size_t)>& emit)
+      const override;
+
+  // Reads encode() output; nullptr if malformed.
+  static std::unique_ptr<SortedSet> decode(std::string_view bytes);
+
+  // Sets member's score; returns true if the member is new.
+  bool add(std::string_view member, double score);
+  // Returns true if the member existed.
+  bool remove(std::string_view member);
+  bool score(std::string_view member, double& out) const;
+  // Position in ascending order, from 0.
+  bool rank(std::string_view member, std::size_t& out) const;
+  // Rank of the first member whose score is in 'range' (not checking the
+  // upper bound); size() if there is none.
+  std::size_t firstInRange(const ScoreRange& range) const;
+
+  // Calls fn(std::string_view member, double score) for the members from
+  // rank 'start' on, in order, until fn returns false or the set ends.
+  template <typename Fn>
+  void range(std::size_t start, Fn&& fn) const {
+    auto* ctx = &fn;
+    rangeImpl(
+        start,
+        [](void* p, std::string_view member, double score) -> bool {
+          return (*static_cast<decltype(ctx)>(p))(member, score);
+        },
+        const_cast<void*>(static_cast<const void*>(ctx)));
+  }
+
+  bool packed() const { return head_ == nullptr; }
+
+ private:
+  using Visitor = bool (*)(void* ctx, std::string_view member, double score);
+
+  struct Node;
+  // Index slot: the member bytes live in the node.
+  struct Ref {
+    Node* node = nullptr;
+    std::string_view key() const;
+  };
+
+  void rangeImpl(std::size_t start, Visitor visit, void* ctx) const;
+
+  // Packed encoding.
+  bool packedFind(std::string_view member, std::size_t& offset, double& score) const;
+  void packedInsert(std::string_view member, double score);
+  void packedErase(std::size_t offset);
+  void convert();
+
+  // Skiplist encoding.
+  Node* listInsert(std::string_view member, double score);
+  void listErase(Node* node);
+  std::size_t listRank(const Node* node) const;
+  void freeNodes();
+
+  std::size_t size_ = 0;
+  std::string packed_;
+  Node* head_ = nullptr;
+  unsigned level_ = 1;
+  std::size_t node_bytes_ = 0;
+  HashTable<Ref> index_;
+};
+
+}  // namespace async
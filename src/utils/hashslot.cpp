@@ -0,0 +1,43 @@
+#include "hashslot.h"
+
+#include <array>
+
+namespace async {
+
+namespace {
+constexpr std::array<std::uint16_t, 256> makeCrc16Table() {
+  std::array<std::uint16_t, 256> t{};
+  for (unsigned i = 0; i < 256; ++i) {
+    std::uint16_t c = static_cast<std::uint16_t>(i << 8);
+    for (int k = 0; k < 8; ++k) {
+      c = static_cast<std::uint16_t>((c & 0x8000) ? (c << 1) ^ 0x1021 : c << 1);
+    }
+    t[i] = c;
+  }
+  return t;
+}
+
+constexpr std::array<std::uint16_t, 256> kCrc16Table = makeCrc16Table();
+}  // namespace
+
+std::uint16_t crc16(const char* data, std::size_t n) {
+  std::uint16_t c = 0;
+  for (std::size_t i = 0; i < n; ++i) {
+    c = static_cast<std::uint16_t>(
+        (c << 8) ^ kCrc16Table[((c >> 8) ^ static_cast<std::uint8_t>(data[i])) & 0xFF]);
+  }
+  return c;
+}
+
+std::uint16_t keyHashSlot(std::string_view key) {
+  const std::size_t open = key.find('{');
+  if (open != std::string_view::npos) {
+    const std::size_t close = key.find('}', open + 1);
+    if (close != std::string_view::npos && close != open + 1) {
+      key = key.substr(open + 1, close - open - 1);
+    }
+  }
+  return static_cast<std::uint16_t>(crc16(key.data(), key.size()) & (kClusterSlots - 1));
+}
+
+}  // namespace async
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace async {
+
+// Keys map to one of kClusterSlots hash slots as in Redis Cluster, so that
+// the server and the client library agree on where a key lives.
+inline constexpr std::size_t kClusterSlots = 16384;
+
+// CRC-16/XMODEM (polynomial 0x1021, no reflection, initial value 0).
+std::uint16_t crc16(const char* data, std::size_t n);
+
+// Slot of 'key': CRC16 of its hash tag modulo kClusterSlots. The tag is
+// what lies between the first '{' and the next '}' if that is non-empty,
+// else the whole key, so "{user1}.name" and "{user1}.mail" share a slot.
+std::uint16_t keyHashSlot(std::string_view key);
+
+}  // namespace async
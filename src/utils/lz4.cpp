@@ -0,0 +1,149 @@
+#include "lz4.h"
+
+#include <cstdint>
+#include <cstring>
+
+namespace async {
+
+namespace {
+constexpr std::size_t kMinMatch = 4;
+// The last 5 bytes are always literals, and the last match starts at least
+// 12 bytes before the end of the block.
+constexpr std::size_t kLastLiterals = 5;
+constexpr std::size_t kMatchLimit = 12;
+constexpr std::size_t kMaxOffset = 65535;
+constexpr unsigned kHashBits = 12;
+// After 2^kSkipTrigger misses in a row the search step grows, so that
+// incompressible input is skipped over quickly.
+constexpr unsigned kSkipTrigger = 6;
+
+std::uint32_t read32(const std::uint8_t* p) {
+  std::uint32_t v;
+  std::memcpy(&v, p, 4);
+  return v;
+}
+
+std::uint32_t hash4(std::uint32_t v) { return (v * 2654435761u) >> (32 - kHashBits); }
+
+std::uint8_t* putLength(std::uint8_t* op, std::size_t len) {
+  for (; len >= 255; len -= 255) *op++ = 255;
+  *op++ = static_cast<std::uint8_t>(len);
+  return op;
+}
+
+// Token, literal run and (unless it is the last sequence) match.
+std::uint8_t* putSequence(std::uint8_t* op, const std::uint8_t* literals, std::size_t nlit) {
+  std::uint8_t* token = op++;
+  *token = static_cast<std::uint8_t>((nlit >= 15 ? 15 : nlit) << 4);
+  if (nlit >= 15) op = putLength(op, nlit - 15);
+  std::memcpy(op, literals, nlit);
+  return op + nlit;
+}
+
+// Reads a length extension after a nibble of 15.
+bool getLength(const std::uint8_t*& ip, const std::uint8_t* iend, std::size_t& len) {
+  std::uint8_t b;
+  do {
+    if (ip >= iend) return false;
+    b = *ip++;
+    len += b;
+  } while (b == 255);
+  return true;
+}
+}  // namespace
+
+std::size_t lz4Compress(const char* src_chars, std::size_t n, char* dst_chars) {
+  const std::uint8_t* src = reinterpret_cast<const std::uint8_t*>(src_chars);
+  std::uint8_t* const dst = reinterpret_cast<std::uint8_t*>(dst_chars);
+  const std::uint8_t* const end = src + n;
+  const std::uint8_t* anchor = src;
+  std::uint8_t* op = dst;
+
+  if (n > kMatchLimit) {
+    const std::uint8_t* const match_limit = end - kMatchLimit;
+    const std::uint8_t* const match_end = end - kLastLiterals;
+    // Positions relative to src; zero-initialized entries just fail the
+    // byte comparison below.
+    std::uint32_t table[1u << kHashBits] = {};
+    const std::uint8_t* ip = src + 1;
+    unsigned misses = 0;
+    while (ip < match_limit) {
+      const std::uint32_t seq = read32(ip);
+      const std::uint32_t h = hash4(seq);
+      const std::uint8_t* ref = src + table[h];
+      table[h] = static_cast<std::uint32_t>(ip - src);
+      if (ref >= ip || static_cast<std::size_t>(ip - ref) > kMaxOffset || read32(ref) != seq) {
+        ip += 1 + (misses++ >> kSkipTrigger);
+        continue;
+      }
+      misses = 0;
+      while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+        --ip;
+        --ref;
+      }
+      const std::uint8_t* mp = ip + kMinMatch;
+      const std::uint8_t* rp = ref + kMinMatch;
+      while (mp < match_end && *mp == *rp) {
+        ++mp;
+        ++rp;
+      }
+
+      std::uint8_t* token = op;
+      op = putSequence(op, anchor, static_cast<std::size_t>(ip - anchor));
+      const std::size_t offset = static_cast<std::size_t>(ip - ref);
+      *op++ = static_cast<std::uint8_t>(offset);
+      *op++ = static_cast<std::uint8_t>(offset >> 8);
+      const std::size_t mlen = static_cast<std::size_t>(mp - ip) - kMinMatch;
+      *token |= static_cast<std::uint8_t>(mlen >= 15 ? 15 : mlen);
+      if (mlen >= 15) op = putLength(op, mlen - 15);
+
+      ip = mp;
+      anchor = ip;
+      // Index a position inside the match too, for the next search.
+      table[hash4(read32(ip - 2))] = static_cast<std::uint32_t>(ip - 2 - src);
+    }
+  }
+  op = putSequence(op, anchor, static_cast<std::size_t>(end - anchor));
+  return static_cast<std::size_t>(op - dst);
+}
+
+bool lz4Decompress(const char* src_chars, std::size_t n, char* dst_chars, std::size_t out_n) {
+  const std::uint8_t* ip = reinterpret_cast<const std::uint8_t*>(src_chars);
+  const std::uint8_t* const iend = ip + n;
+  std::uint8_t* const dst = reinterpret_cast<std::uint8_t*>(dst_chars);
+  std::uint8_t* op = dst;
+  std::uint8_t* const oend = dst + out_n;
+
+  for (;;) {
+    if (ip >= iend) return false;
+    const std::uint8_t token = *ip++;
+    std::size_t nlit = token >> 4;
+    if (nlit == 15 && !getLength(ip, iend, nlit)) return false;
+    if (nlit > static_cast<std::size_t>(iend - ip) || nlit > static_cast<std::size_t>(oend - op)) {
+      return false;
+    }
+    std::memcpy(op, ip, nlit);
+    ip += nlit;
+    op += nlit;
+    if (ip == iend) return op == oend;  // the last sequence has no match
+
+    if (iend - ip < 2) return false;
+    const std::size_t offset = static_cast<std::size_t>(ip[0]) | static_cast<std::size_t>(ip[1]) << 8;
+    ip += 2;
+    if (offset == 0 || offset > static_cast<std::size_t>(op - dst)) return false;
+    std::size_t mlen = token & 15;
+    if (mlen == 15 && !getLength(ip, iend, mlen)) return false;
+    mlen += kMinMatch;
+    if (mlen > static_cast<std::size_t>(oend - op)) return false;
+    const std::uint8_t* ref = op - offset;
+    if (offset >= mlen) {
+      std::memcpy(op, ref, mlen);
+      op += mlen;
+    } else {
+      // Overlapping copy repeats the last 'offset' bytes.
+      for (std::size_t i = 0; i < mlen; ++i) *op++ = *ref++;
+    }
+  }
+}
+
+}  // namespace async
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+
+namespace async {
+
+// LZ4 block format (https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md),
+// compatible with LZ4_compress_default() / LZ4_decompress_safe(): a greedy
+// compressor with a 4K-entry hash table, fast enough to run at disk speed,
+// and a decompressor that checks every length against both buffers.
+
+// Largest possible compressed size of 'n' input bytes.
+inline constexpr std::size_t lz4CompressBound(std::size_t n) { return n + n / 255 + 16; }
+
+// Compresses src[0, n) into dst, which must hold lz4CompressBound(n) bytes.
+// Returns the compressed size.
+std::size_t lz4Compress(const char* src, std::size_t n, char* dst);
+
+// Decompresses a block into exactly 'out_n' bytes at dst. Returns false if
+// the block is malformed or does not decompress to exactly out_n bytes.
+bool lz4Decompress(const char* src, std::size_t n, char* dst, std::size_t out_n);
+
+}  // namespace async
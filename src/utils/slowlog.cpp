@@ -0,0 +1,138 @@
+#include "slowlog.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "utils.h"
+
+namespace async {
+
+namespace {
+// Appends at most 'room' bytes of 's' to the slot text; returns false once
+// the text is full.
+bool put(char* text, std::uint32_t& len, std::string_view s) {
+  const std::size_t room = SlowLog::kTextBytes - len;
+  const std::size_t n = std::min(room, s.size());
+  std::memcpy(text + len, s.data(), n);
+  len += static_cast<std::uint32_t>(n);
+  return n == s.size();
+}
+
+// One argument, quoted, with non-printable bytes escaped and long values
+// cut to kMaxArgChars.
+bool putArg(char* text, std::uint32_t& len, std::string_view arg, bool taken) {
+  char buf[64];
+  if (taken) {
+    std::snprintf(buf, sizeof(buf), "(%zu bytes)", arg.size());
+    return put(text, len, buf);
+  }
+  if (!put(text, len, "\"")) return false;
+  const std::size_t shown = std::min(arg.size(), SlowLog::kMaxArgChars);
+  for (std::size_t i = 0; i < shown; ++i) {
+    const unsigned char c = static_cast<unsigned char>(arg[i]);
+    if (c == '"' || c == '\\') {
+      const char esc[2] = {'\\', static_cast<char>(c)};
+      if (!put(text, len, std::string_view(esc, 2))) return false;
+    } else if (c < 0x20 || c >= 0x7f) {
+      std::snprintf(buf, sizeof(buf), "\\x%02x", c);
+      if (!put(text, len, buf)) return false;
+    } else {
+      const char ch = static_cast<char>(c);
+      if (!put(text, len, std::string_view(&ch, 1))) return false;
+    }
+  }
+  if (!put(text, len, "\"")) return false;
+  if (shown < arg.size()) {
+    std::snprintf(buf, sizeof(buf), "... (%zu more bytes)", arg.size() - shown);
+    return put(text, len, buf);
+  }
+  return true;
+}
+}  // namespace
+
+SlowLog& SlowLog::instance() {
+  static SlowLog log;
+  return log;
+}
+
+void SlowLog::configure(std::int64_t threshold_us, std::size_t max_len) {
+  threshold_ns_ = threshold_us < 0 ? UINT64_MAX : static_cast<std::uint64_t>(threshold_us) * 1000;
+  capacity_ = std::max<std::size_t>(max_len, 1);
+  slots_ = std::make_unique<Slot[]>(capacity_);
+  next_id_.store(0, std::memory_order_relaxed);
+  reset_id_.store(0, std::memory_order_relaxed);
+}
+
+void SlowLog::record(const std::vector<std::string_view>& args, const std::vector<bool>* taken,
+                     std::uint64_t duration_ns) {
+  if (!slots_) return;
+  const std::uint64_t id = next_id_.fetch_add(1, std::memory_order_relaxed);
+  Slot& slot = slots_[id % capacity_];
+  // Claim the slot. Losing the race means another writer lapped the ring
+  // onto the same slot; dropping this entry is fine.
+  std::uint32_t seq = slot.seq.load(std::memory_order_relaxed);
+  if ((seq & 1) || !slot.seq.compare_exchange_strong(seq, seq + 1, std::memory_order_acquire)) {
+    return;
+  }
+
+  slot.id = id;
+  slot.time_ms = unix_time_ms();
+  slot.duration_ns = duration_ns;
+  slot.argc = static_cast<std::uint32_t>(args.size());
+  slot.request_bytes = 0;
+  for (std::string_view a : args) slot.request_bytes += a.size();
+  slot.text_len = 0;
+  const std::size_t shown = std::min(args.size(), kMaxArgs);
+  bool room = true;
+  for (std::size_t i = 0; i < shown && room; ++i) {
+    if (i > 0) room = put(slot.text, slot.text_len, " ");
+    room = room && putArg(slot.text, slot.text_len, args[i], taken && (*taken)[i]);
+  }
+  if (room && shown < args.size()) {
+    char buf[48];
+    std::snprintf(buf, sizeof(buf), " ... (%zu more arguments)", args.size() - shown);
+    put(slot.text, slot.text_len, buf);
+  }
+  slot.seq.store(seq + 2, std::memory_order_release);
+}
+
+std::uint64_t SlowLog::firstVisible(std::uint64_t next) const {
+  const std::uint64_t oldest = next > capacity_ ? next - capacity_ : 0;
+  return std::max(oldest, reset_id_.load(std::memory_order_relaxed));
+}
+
+std::vector<SlowLog::Entry> SlowLog::get(std::size_t n) const {
+  std::vector<Entry> out;
+  if (!slots_) return out;
+  const std::uint64_t next = next_id_.load(std::memory_order_acquire);
+  const std::uint64_t first = firstVisible(next);
+  for (std::uint64_t id = next; id > first && out.size() < n; --id) {
+    const Slot& slot = slots_[(id - 1) % capacity_];
+    const std::uint32_t before = slot.seq.load(std::memory_order_acquire);
+    if (before & 1) continue;  // being written
+    Entry e;
+    e.id = slot.id;
+    e.time_ms = slot.time_ms;
+    e.duration_ns = slot.duration_ns;
+    e.argc = slot.argc;
+    e.request_bytes = slot.request_bytes;
+    e.args.assign(slot.text, std::min<std::size_t>(slot.text_len, kTextBytes));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    // Changed while copying, or not yet (re)written for this id: skip.
+    if (slot.seq.load(std::memory_order_relaxed) != before || e.id != id - 1) continue;
+    out.push_back(std::move(e));
+  }
+  return out;
+}
+
+std::size_t SlowLog::len() const {
+  const std::uint64_t next = next_id_.load(std::memory_order_acquire);
+  return static_cast<std::size_t>(next - std::min(next, firstVisible(next)));
+}
+
+void SlowLog::reset() {
+  reset_id_.store(next_id_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+}  // namespace async
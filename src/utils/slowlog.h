@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace async {
+
+// Process-wide log of commands that ran longer than a threshold, kept in a
+// fixed-size ring that overwrites the oldest entries. Recording is
+// lock-free: a writer claims an id with one fetch_add and fills the slot
+// under a per-slot sequence number, and readers copy slots optimistically,
+// skipping any that change under them. Slow commands are rare, so the only
+// hot-path cost is comparing the duration the dispatcher measures anyway
+// against the threshold.
+class SlowLog {
+ public:
+  // Arguments recorded per entry, and bytes kept of each; longer ones are
+  // abbreviated with their remaining length, as Redis does.
+  static constexpr std::size_t kMaxArgs = 16;
+  static constexpr std::size_t kMaxArgChars = 64;
+  // Formatted argument text kept per entry.
+  static constexpr std::size_t kTextBytes = 1024;
+
+  struct Entry {
+    std::uint64_t id = 0;
+    std::int64_t time_ms = 0;  // Unix time the command finished
+    std::uint64_t duration_ns = 0;
+    std::uint32_t argc = 0;
+    std::uint64_t request_bytes = 0;  // sum of argument sizes
+    std::string args;                 // quoted, space-separated
+  };
+
+  static SlowLog& instance();
+
+  // Commands taking at least 'threshold_us' are logged; a negative value
+  // disables the log. Keeps the last 'max_len' entries (minimum 1). Call
+  // before event loops start.
+  void configure(std::int64_t threshold_us, std::size_t max_len);
+
+  // Threshold in ns; UINT64_MAX when disabled.
+  std::uint64_t thresholdNs() const { return threshold_ns_; }
+
+  // Records one command. 'taken' marks arguments the handler moved from
+  // (their bytes are gone); only their size is logged.
+  void record(const std::vector<std::string_view>& args, const std::vector<bool>* taken,
+              std::uint64_t duration_ns);
+
+  // Up to 'n' entries, newest first.
+  std::vector<Entry> get(std::size_t n) const;
+  // Entries currently in the log.
+  std::size_t len() const;
+  // Empties the log.
+  void reset();
+  // Commands logged since startup, including ones since overwritten.
+  std::uint64_t totalRecorded() const { return next_id_.load(std::memory_order_relaxed); }
+
+ private:
+  SlowLog() = default;
+
+  struct Slot {
+    // Even: stable; odd: being written.
+    std::atomic<std::uint32_t> seq{0};
+    std::uint64_t id = 0;
+    std::int64_t time_ms = 0;
+    std::uint64_t duration_ns = 0;
+    std::uint32_t argc = 0;
+    std::uint64_t request_bytes = 0;
+    std::uint32_t text_len = 0;
+    char text[kTextBytes];
+  };
+
+  // Oldest id still visible.
+  std::uint64_t firstVisible(std::uint64_t next) const;
+
+  std::uint64_t threshold_ns_ = UINT64_MAX;
+  std::size_t capacity_ = 0;
+  std::unique_ptr<Slot[]> slots_;
+  std::atomic<std::uint64_t> next_id_{0};
+  // Ids below this were cleared by reset().
+  std::atomic<std::uint64_t> reset_id_{0};
+};
+
+}  // namespace async
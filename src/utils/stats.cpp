@@ -0,0 +1,56 @@
+#include "stats.h"
+
+#include "utils.h"
+
+namespace async {
+
+namespace {
+LoopStats g_loop_stats[kMaxStatSlots];
+const std::int64_t g_start_ms = unix_time_ms();
+}  // namespace
+
+void LatencyTotals::add(const LatencyBuckets& b, std::uint64_t n, std::uint64_t ns) {
+  count += n;
+  sum_ns += ns;
+  for (std::size_t i = 0; i < LatencyBuckets::kCount; ++i) {
+    buckets[i] += b.counts[i].load(std::memory_order_relaxed);
+  }
+}
+
+std::uint64_t LatencyTotals::percentileNs(double q) const {
+  std::uint64_t total = 0;
+  for (std::uint64_t c : buckets) total += c;
+  if (total == 0) return 0;
+  const std::uint64_t rank = static_cast<std::uint64_t>(q * static_cast<double>(total - 1)) + 1;
+  std::uint64_t seen = 0;
+  for (std::size_t i = 0; i < LatencyBuckets::kCount; ++i) {
+    seen += buckets[i];
+    if (seen >= rank && LatencyBuckets::boundNs(i) != 0) return LatencyBuckets::boundNs(i);
+  }
+  return count ? sum_ns / count : 0;
+}
+
+LoopStats& loopStats(std::size_t slot) { return g_loop_stats[slot]; }
+
+LoopTotals LoopTotals::collect() {
+  LoopTotals t;
+  for (const LoopStats& s : g_loop_stats) {
+    const std::uint64_t iterations = s.iterations.load(std::memory_order_relaxed);
+    t.loops += s.running.load(std::memory_order_relaxed);
+    t.connections_accepted += s.connections_accepted.load(std::memory_order_relaxed);
+    t.connections_closed += s.connections_closed.load(std::memory_order_relaxed);
+    t.idle_disconnects += s.idle_disconnects.load(std::memory_order_relaxed);
+    t.output_limit_disconnects += s.output_limit_disconnects.load(std::memory_order_relaxed);
+    t.bytes_in += s.bytes_in.load(std::memory_order_relaxed);
+    t.bytes_out += s.bytes_out.load(std::memory_order_relaxed);
+    t.rejected_commands += s.rejected_commands.load(std::memory_order_relaxed);
+    t.buffer_bytes += s.buffer_bytes.load(std::memory_order_relaxed);
+    t.stalls += s.stalls.load(std::memory_order_relaxed);
+    t.iteration_time.add(s.iteration_time, iterations, s.busy_ns.load(std::memory_order_relaxed));
+  }
+  return t;
+}
+
+std::int64_t processStartMs() { return g_start_ms; }
+
+}  // namespace async
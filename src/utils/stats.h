@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace async {
+
+// Statistics are kept per event loop ("slot") and only summed when read:
+// each slot has a single writer, so counters are bumped with relaxed
+// load/store pairs and no cache line is written by two threads.
+inline constexpr std::size_t kMaxStatSlots = 256;
+
+// Single-writer increment; see above.
+inline void bump(std::atomic<std::uint64_t>& counter, std::uint64_t n = 1) {
+  counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// Duration histogram with power-of-two buckets: bucket i counts durations
+// below 2^(i+8) ns (256 ns .. 134 ms); the last bucket counts the rest.
+struct LatencyBuckets {
+  static constexpr std::size_t kCount = 21;
+
+  static std::size_t bucketOf(std::uint64_t ns) {
+    if (ns < 256) return 0;
+    const std::size_t log2 = 63 - static_cast<std::size_t>(__builtin_clzll(ns));
+    return log2 - 7 < kCount ? log2 - 7 : kCount - 1;
+  }
+  // Exclusive upper bound of bucket i in ns; 0 for the last (unbounded) one.
+  static std::uint64_t boundNs(std::size_t i) { return i + 1 < kCount ? 256ull << i : 0; }
+
+  void record(std::uint64_t ns) { bump(counts[bucketOf(ns)]); }
+
+  std::atomic<std::uint64_t> counts[kCount] = {};
+};
+
+// Sum of latency statistics over slots, as plain numbers for reporting.
+struct LatencyTotals {
+  std::uint64_t count = 0;
+  std::uint64_t sum_ns = 0;
+  std::uint64_t buckets[LatencyBuckets::kCount] = {};
+
+  void add(const LatencyBuckets& b, std::uint64_t n, std::uint64_t ns);
+  // Upper bound of the bucket holding the q-quantile (0..1), in ns; for
+  // the unbounded bucket, the mean of what was recorded.
+  std::uint64_t percentileNs(double q) const;
+};
+
+// Counters of one event loop and its connections.
+struct alignas(64) LoopStats {
+  // Gauge: 1 while an event loop owns the slot.
+  std::atomic<std::uint64_t> running{0};
+  std::atomic<std::uint64_t> connections_accepted{0};
+  std::atomic<std::uint64_t> connections_closed{0};
+  // Connections closed for idling past the timeout, or for output over
+  // the buffer limits.
+  std::atomic<std::uint64_t> idle_disconnects{0};
+  std::atomic<std::uint64_t> output_limit_disconnects{0};
+  std::atomic<std::uint64_t> bytes_in{0};
+  std::atomic<std::uint64_t> bytes_out{0};
+  // Requests answered with an error before running (unknown command, bad
+  // arity, over maxmemory).
+  std::atomic<std::uint64_t> rejected_commands{0};
+  // Gauge: bytes of I/O buffers held by the loop's buffer pool.
+  std::atomic<std::uint64_t> buffer_bytes{0};
+  // Loop iterations and the time spent in them, excluding the wait.
+  std::atomic<std::uint64_t> iterations{0};
+  std::atomic<std::uint64_t> busy_ns{0};
+  LatencyBuckets iteration_time;
+  // Iterations over the stall budget.
+  std::atomic<std::uint64_t> stalls{0};
+};
+
+// Process-wide stats of loop 'slot' (< kMaxStatSlots).
+LoopStats& loopStats(std::size_t slot);
+
+// Sum of LoopStats over all slots.
+struct LoopTotals {
+  std::uint64_t connections_accepted = 0;
+  std::uint64_t connections_closed = 0;
+  std::uint64_t idle_disconnects = 0;
+  std::uint64_t output_limit_disconnects = 0;
+  std::uint64_t bytes_in = 0;
+  std::uint64_t bytes_out = 0;
+  std::uint64_t rejected_commands = 0;
+  std::uint64_t buffer_bytes = 0;
+  std::uint64_t stalls = 0;
+  // Event loops currently running.
+  std::uint64_t loops = 0;
+  LatencyTotals iteration_time;
+
+  static LoopTotals collect();
+};
+
+// Wall-clock time (Unix ms) when the process started.
+std::int64_t processStartMs();
+
+}  // namespace async
@@ -2,17 +2,42 @@
 
 #include <cstddef>   // std::size_t
 #include <cstdint>   // std::uint32_t, std::int32_t
+#include <ctime>     // clock_gettime
 
-// Maximum allowed message size for framed protocol payloads.
-inline constexpr std::size_t k_max_msg = 4096;
+// Default maximum size of a framed request payload; the server's
+// --max-request-size overrides it.
+inline constexpr std::size_t k_max_msg = 64u << 20;
+// Upper bound accepted for --max-request-size.
+inline constexpr std::size_t k_max_msg_limit = 512u << 20;
 
 namespace ResponseStatus {
 // Key not found
 inline constexpr std::uint32_t RES_NX = 1;
+// Cluster redirections; data is "<slot> <host>:<port>". MOVED: the slot is
+// served by that node, from now on. ASK: send this one command there,
+// preceded by "asking" (the slot is being migrated to it).
+inline constexpr std::uint32_t RES_MOVED = 2;
+inline constexpr std::uint32_t RES_ASK = 3;
 // Generic error (kept as uint32_t for wire-compat; value is all-ones)
 inline constexpr std::uint32_t RES_ERR = static_cast<std::uint32_t>(-1);
 }  // namespace ResponseStatus
 
+// Monotonic clock in nanoseconds, for latency measurements.
+inline std::uint64_t monotonic_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<std::uint64_t>(ts.tv_sec) * 1000000000ull +
+         static_cast<std::uint64_t>(ts.tv_nsec);
+}
+
+// Wall-clock time in milliseconds since the Unix epoch. Key expiry uses
+// absolute times on this clock so they survive persistence.
+inline std::int64_t unix_time_ms() {
+  timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return static_cast<std::int64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
 // Read exactly n bytes into buf from fd (or throw on error).
 std::int32_t read_full(const int& fd, char* buf, std::size_t n);
 